@@ -0,0 +1,245 @@
+/*******************************************************************\
+| Section: Analysis                                                 |
+| Critical path and expected cycle time of a Process_Model, using   |
+| the mean of the `duration` of every event. Edges that close a     |
+| cycle are left out, so the rest of the graph is a DAG and every   |
+| pass below is linear in the number of nodes and edges.            |
+\*******************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+
+#define ANALYSIS_WHITE 0
+#define ANALYSIS_GRAY  1
+#define ANALYSIS_BLACK 2
+
+typedef struct {
+    size_t nodes_cnt;
+
+    double *duration;  // mean duration of each node
+    double *head;      // longest time from a starter to the start of the node
+    double *tail;      // longest time from the start of the node to an end
+    double *expected;  // expected time from the start of the node to an end
+    uint32_t *next;    // successor on the longest path to an end
+    uint32_t *origin;  // starter of the longest path reaching the node
+    uint32_t *order;   // topological order, ignoring the back edges
+    uint8_t *back;     // bit i is set when targets[i] closes a cycle
+    bool *critical;    // node is on the critical path of some starter
+
+    size_t back_cnt;
+} Analysis;
+
+// Iterative DFS from every starter, then from whatever they do not reach.
+// The reverse postorder is a topological order once back edges, the ones
+// pointing to a node still on the stack, are removed.
+void analysis_sort(const Process_Model *model, Analysis *a) {
+    size_t n = model->nodes_cnt;
+    uint8_t *color = calloc(n, sizeof(uint8_t));
+    uint32_t *stack = malloc(sizeof(uint32_t) * n);
+    uint8_t *edge = malloc(sizeof(uint8_t) * n);
+    assert(color != NULL && stack != NULL && edge != NULL && "Cannot allocate analysis");
+
+    size_t post = n;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t root = 0; root < n; root++) {
+            if (color[root] != ANALYSIS_WHITE) continue;
+            if (pass == 0 && model->nodes[root].kind != NODE_STARTER) continue;
+
+            size_t top = 0;
+            stack[top] = root;
+            edge[top++] = 0;
+            color[root] = ANALYSIS_GRAY;
+
+            while (top > 0) {
+                uint32_t node = stack[top - 1];
+                const Model_Node *m = &model->nodes[node];
+
+                if (edge[top - 1] == model_successors(m)) {
+                    color[node] = ANALYSIS_BLACK;
+                    a->order[--post] = node;
+                    top--;
+                    continue;
+                }
+
+                uint8_t i = edge[top - 1]++;
+                uint32_t target = m->targets[i];
+                if (color[target] == ANALYSIS_GRAY) {
+                    a->back[node] |= 1 << i;
+                    a->back_cnt++;
+                } else if (color[target] == ANALYSIS_WHITE) {
+                    color[target] = ANALYSIS_GRAY;
+                    stack[top] = target;
+                    edge[top++] = 0;
+                }
+            }
+        }
+    }
+
+    free(color);
+    free(stack);
+    free(edge);
+}
+
+void analyze(const Process_Model *model, Analysis *a) {
+    size_t n = model->nodes_cnt;
+    memset(a, 0, sizeof(*a));
+    a->nodes_cnt = n;
+
+    a->duration = malloc(sizeof(double) * n);
+    a->head = malloc(sizeof(double) * n);
+    a->tail = malloc(sizeof(double) * n);
+    a->expected = malloc(sizeof(double) * n);
+    a->next = malloc(sizeof(uint32_t) * n);
+    a->origin = malloc(sizeof(uint32_t) * n);
+    a->order = malloc(sizeof(uint32_t) * n);
+    a->back = calloc(n, sizeof(uint8_t));
+    a->critical = calloc(n, sizeof(bool));
+    assert(a->duration != NULL && a->head != NULL && a->tail != NULL && a->expected != NULL
+           && a->next != NULL && a->origin != NULL && a->order != NULL && a->back != NULL
+           && a->critical != NULL && "Cannot allocate analysis");
+
+    for (size_t i = 0; i < n; i++) {
+        const Model_Node *node = &model->nodes[i];
+        a->duration[i] = node->kind == NODE_STARTER ? 0 : distribution_mean(node->duration);
+        a->head[i] = 0;
+        a->origin[i] = node->kind == NODE_STARTER ? i : ENGINE_INVALID_ID;
+    }
+
+    analysis_sort(model, a);
+
+    // backwards: longest and expected time to an end. Gateways follow the
+    // weights of the targets that do not close a cycle
+    for (size_t k = n; k-- > 0;) {
+        uint32_t v = a->order[k];
+        const Model_Node *node = &model->nodes[v];
+
+        double longest = 0, expected = 0, weight = 0, slowest = 0;
+        a->next[v] = ENGINE_INVALID_ID;
+
+        for (uint32_t i = 0; i < model_successors(node); i++) {
+            if (a->back[v] & (1 << i)) continue;
+
+            uint32_t t = node->targets[i];
+            if (a->next[v] == ENGINE_INVALID_ID || a->tail[t] > longest) {
+                longest = a->tail[t];
+                a->next[v] = t;
+            }
+
+            // parallel branches take as long as the slowest one, taking the
+            // slowest expected time is a lower bound of that
+            if (node->kind == NODE_GATEWAY && node->gateway != GATEWAY_XOR) {
+                if (a->expected[t] > slowest) slowest = a->expected[t];
+                continue;
+            }
+
+            double w = node->kind == NODE_GATEWAY ? node->weights[i] : 1;
+            expected += w * a->expected[t];
+            weight += w;
+        }
+
+        a->tail[v] = a->duration[v] + longest;
+        a->expected[v] = a->duration[v] + (weight > 0 ? expected / weight : slowest);
+    }
+
+    // forwards: longest time from a starter, remembering which one
+    for (size_t k = 0; k < n; k++) {
+        uint32_t v = a->order[k];
+        const Model_Node *node = &model->nodes[v];
+        if (a->origin[v] == ENGINE_INVALID_ID) continue;
+
+        for (uint32_t i = 0; i < model_successors(node); i++) {
+            if (a->back[v] & (1 << i)) continue;
+
+            uint32_t t = node->targets[i];
+            double start = a->head[v] + a->duration[v];
+            if (a->origin[t] == ENGINE_INVALID_ID || start > a->head[t]) {
+                a->head[t] = start;
+                a->origin[t] = a->origin[v];
+            }
+        }
+    }
+
+    // without durations every path is as long as any other
+    for (size_t i = 0; i < n; i++) {
+        if (model->nodes[i].kind != NODE_STARTER || a->tail[i] <= 0) continue;
+        for (uint32_t v = i; v != ENGINE_INVALID_ID; v = a->next[v]) {
+            a->critical[v] = true;
+        }
+    }
+}
+
+void analysis_free(Analysis *a) {
+    free(a->duration);
+    free(a->head);
+    free(a->tail);
+    free(a->expected);
+    free(a->next);
+    free(a->origin);
+    free(a->order);
+    free(a->back);
+    free(a->critical);
+    memset(a, 0, sizeof(*a));
+}
+
+bool analysis_critical_edge(const Analysis *a, uint32_t from, uint32_t to) {
+    return a->critical[from] && a->next[from] == to;
+}
+
+// how much the node can be delayed without delaying the longest path of
+// the starter that reaches it, negative when no starter reaches it
+double analysis_slack(const Analysis *a, uint32_t node) {
+    uint32_t origin = a->origin[node];
+    if (origin == ENGINE_INVALID_ID) return -1;
+    return fmax(a->tail[origin] - a->head[node] - a->tail[node], 0);
+}
+
+void analysis_print(const Process_Model *model, const Analysis *a) {
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        const Model_Node *node = &model->nodes[i];
+        for (uint32_t j = 0; j < model_successors(node); j++) {
+            if (a->back[i] & (1 << j)) {
+                fprintf(stderr, "warning: `%s` -> `%s` closes a cycle and is ignored by the analysis\n",
+                        node->name, model->nodes[node->targets[j]].name);
+            }
+        }
+    }
+
+    printf("%-40s %14s %14s\n", "Starter", "Critical path", "Expected cycle");
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind != NODE_STARTER) continue;
+        printf("%-40s %14s %14s\n", model->nodes[i].name, FMT_DURATION(a->tail[i]), FMT_DURATION(a->expected[i]));
+    }
+
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind != NODE_STARTER) continue;
+
+        printf("\nCritical path from %s\n", model->nodes[i].name);
+        for (uint32_t v = i; v != ENGINE_INVALID_ID; v = a->next[v]) {
+            printf("    %12s  %s\n", FMT_DURATION(a->head[v] - a->head[i]), model->nodes[v].name);
+        }
+    }
+
+    printf("\n%-40s %14s %14s\n", "End", "Longest path", "From");
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        const Model_Node *node = &model->nodes[i];
+        if (node->kind != NODE_END && model_successors(node) > 0) continue;
+
+        uint32_t origin = a->origin[i];
+        if (origin == ENGINE_INVALID_ID) {
+            printf("%-40s %14s %14s\n", node->name, "-", "unreachable");
+        } else {
+            printf("%-40s %14s %14s\n", node->name, FMT_DURATION(a->head[i] + a->duration[i]), model->nodes[origin].name);
+        }
+    }
+
+    printf("\n%-40s %12s %12s %12s\n", "Task", "Mean time", "Earliest", "Slack");
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind != NODE_TASK) continue;
+
+        double slack = analysis_slack(a, i);
+        printf("%-40s %12s %12s %12s%s\n", model->nodes[i].name, FMT_DURATION(a->duration[i]),
+               slack < 0 ? "-" : FMT_DURATION(a->head[i]),
+               slack < 0 ? "unreachable" : FMT_DURATION(slack),
+               a->critical[i] ? "  *" : "");
+    }
+}
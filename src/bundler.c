@@ -1,22 +1,56 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <string.h>
+
+#define SDEFL_IMPLEMENTATION
+#include "external/sdefl.h"
+#define STB_TRUETYPE_IMPLEMENTATION
+#include "external/stb_truetype.h"
 
 char *RESOURCE_NAMES_AND_PATHS[][2] = {
-    { "FONT", "./resources/font.ttf"         },
     { "FONT_RUBIK", "./resources/font_2.ttf" },
     { "EMAIL", "./resources/email.png"       },
     { "RELOGIO", "./resources/relogio.png"   },
     { "RECTANGLE", "./resources/rect.png"    },
 };
 
+// Rasterized here so the program only has to upload them. A signed distance
+// field keeps, instead of the coverage, how far each texel is from the
+// outline, so the one atlas draws the text sharp at any size and zoom.
+struct {
+    char *name;
+    char *font;
+    int font_size;
+    bool sdf;
+} FONT_ATLASES[] = {
+    { "ATLAS_RUBIK_SDF", "FONT_RUBIK", 32, true },
+};
+
+// The glyphs LoadFontFromMemory loads by default, ASCII from the space on
+#define ATLAS_FIRST_CODEPOINT 32
+#define ATLAS_CODEPOINTS_CNT 95
+// FONT_TTF_DEFAULT_CHARS_PADDING of raylib
+#define ATLAS_PADDING 4
+// The FONT_SDF defaults of LoadFontData: the field reaches SDF_PADDING
+// pixels out of the glyph, the outline is at SDF_ON_EDGE and every pixel
+// away from it moves the value by SDF_PIXEL_DIST_SCALE
+#define SDF_PADDING 4
+#define SDF_ON_EDGE 128
+#define SDF_PIXEL_DIST_SCALE 64.0f
+
 #define BANDLE_FILE_PATH "./src/bundle.c"
+#define BANDLE_ASM_PATH "./src/bundle.S"
+#define BANDLE_BLOB_PATH "./src/bundle.bin"
 
 FILE *OUT;
+FILE *ASM;
+FILE *BLOB;
 
 char *read_file(const char *file_path, size_t *file_size) {
     char *content = NULL;
-    FILE *file = fopen(file_path, "r");
+    FILE *file = fopen(file_path, "rb");
     if (file == NULL) {
         printf("Cannot open file %s\n", file_path);
         goto CLEAN_UP;
@@ -52,28 +86,234 @@ CLEAN_UP:
     return NULL;
 }
 
+// The CRC-32 of zlib, the one raylib's ComputeCRC32 checks at runtime
+uint32_t crc32(const unsigned char *data, size_t size) {
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
 #define FGENERATE(fmt, ...) fprintf(OUT, fmt, __VA_ARGS__)
 #define GENERATE(line) fprintf(OUT, line)
+#define FGENERATE_ASM(fmt, ...) fprintf(ASM, fmt, __VA_ARGS__)
+#define GENERATE_ASM(line) fprintf(ASM, line)
+
+typedef struct {
+    size_t offset;  // in the blob
+    size_t size;    // in the blob
+    size_t raw_size;
+    uint32_t crc;
+    bool packed;
+} Entry;
+
+// The resource is deflated into the blob, or copied when that does not make
+// it smaller, like the PNGs. The assembler pulls its part of the blob in, so
+// neither the bundler nor the compiler go through the bytes as text. The
+// size is checked when assembling, in case the blob changed after bundling.
+bool generate_bytes(char *resource_name, const unsigned char *bytes, size_t size, Entry *entry) {
+    static struct sdefl sdefl;
+    unsigned char *packed = malloc(sdefl_bound(size));
+    if (packed == NULL) {
+        printf("Cannot allocate %s deflated\n", resource_name);
+        return false;
+    }
+
+    int packed_size = sdeflate(&sdefl, packed, bytes, size, SDEFL_LVL_MAX);
+    entry->offset = ftell(BLOB);
+    entry->raw_size = size;
+    entry->crc = crc32(bytes, size);
+    entry->packed = packed_size > 0 && (size_t) packed_size < size;
+    entry->size = entry->packed ? (size_t) packed_size : size;
+
+    bool written = fwrite(entry->packed ? packed : bytes, 1, entry->size, BLOB) == entry->size;
+    free(packed);
+    if (!written) {
+        printf("Cannot write %s\n", BANDLE_BLOB_PATH);
+        return false;
+    }
+
+    FGENERATE_ASM("    .globl SYMBOL(__data_%s)\n", resource_name);
+    GENERATE_ASM("    .balign 16\n");
+    FGENERATE_ASM("SYMBOL(__data_%s):\n", resource_name);
+    FGENERATE_ASM("    .incbin \"%s\", %zu, %zu\n", BANDLE_BLOB_PATH, entry->offset, entry->size);
+    FGENERATE_ASM("    .if . - SYMBOL(__data_%s) != %zu\n", resource_name, entry->size);
+    FGENERATE_ASM("    .error \"%s is shorter than expected, run the bundler again\"\n", BANDLE_BLOB_PATH);
+    GENERATE_ASM("    .endif\n\n");
+
+    FGENERATE("extern const unsigned char __data_%s[];\n", resource_name);
+    printf("%-14s %8zu -> %8zu bytes%s\n", resource_name, size, entry->size, entry->packed ? "" : " (stored)");
+    return true;
+}
 
-void generate_bytes(char *resource_name, char *resource) {
-    FGENERATE("const unsigned char __data_%s[] = {", resource_name);
+bool generate_file(char *resource_name, char *resource, Entry *entry) {
     size_t size = 0;
+    unsigned char *bytes = (unsigned char *) read_file(resource, &size);
+    if (bytes == NULL) return false;
 
-    const char *bytes = read_file(resource, &size);
-    for (size_t i = 0; i < size; i++) {
-        if ((i%20) == 0) {
-            GENERATE("\n    ");
+    bool generated = generate_bytes(resource_name, bytes, size, entry);
+    free(bytes);
+    return generated;
+}
+
+// Written to bundle.c as well, keep both in step
+typedef struct {
+    int32_t font_size;
+    int32_t padding;
+    int32_t glyph_count;
+    int32_t width;
+    int32_t height;
+} Baked_Atlas;
+
+typedef struct {
+    int32_t value, offset_x, offset_y, advance_x;  // as in GlyphInfo
+    int32_t x, y, width, height;                   // its rectangle in the atlas
+} Baked_Glyph;
+
+#define BAKED_TYPES \
+    "typedef struct {\n" \
+    "    int32_t font_size;\n" \
+    "    int32_t padding;\n" \
+    "    int32_t glyph_count;\n" \
+    "    int32_t width;\n" \
+    "    int32_t height;\n" \
+    "} Baked_Atlas;  // followed by its Baked_Glyph and the grayscale atlas\n\n" \
+    "typedef struct {\n" \
+    "    int32_t value, offset_x, offset_y, advance_x;  // as in GlyphInfo\n" \
+    "    int32_t x, y, width, height;                   // its rectangle in the atlas\n" \
+    "} Baked_Glyph;\n\n"
+
+typedef struct {
+    Baked_Glyph baked;
+    unsigned char *bitmap;
+} Glyph;
+
+// Rasterizes the glyphs the way LoadFontData of raylib does with FONT_DEFAULT
+// or FONT_SDF and lays them out like GenImageFontAtlas with its basic
+// packing, so a bitmap atlas is the one LoadFontFromMemory would have made.
+// The resource is a Baked_Atlas, its glyphs and then the atlas in grayscale.
+bool generate_font_atlas(char *resource_name, char *font_path, int font_size, bool sdf, Entry *entry) {
+    size_t ttf_size = 0;
+    unsigned char *ttf = (unsigned char *) read_file(font_path, &ttf_size);
+    if (ttf == NULL) return false;
+
+    stbtt_fontinfo info;
+    if (!stbtt_InitFont(&info, ttf, 0)) {
+        printf("Cannot read the font %s\n", font_path);
+        free(ttf);
+        return false;
+    }
+
+    float scale = stbtt_ScaleForPixelHeight(&info, (float) font_size);
+    int ascent, descent, line_gap;
+    stbtt_GetFontVMetrics(&info, &ascent, &descent, &line_gap);
+
+    Glyph glyphs[ATLAS_CODEPOINTS_CNT] = {0};
+    int total_width = 0, tallest = 0;
+    for (int i = 0; i < ATLAS_CODEPOINTS_CNT; i++) {
+        Glyph *glyph = &glyphs[i];
+        glyph->baked.value = ATLAS_FIRST_CODEPOINT + i;
+        if (stbtt_FindGlyphIndex(&info, glyph->baked.value) == 0) continue;
+
+        int width = 0, height = 0;
+        if (!sdf) {
+            glyph->bitmap = stbtt_GetCodepointBitmap(&info, scale, scale, glyph->baked.value, &width, &height, &glyph->baked.offset_x, &glyph->baked.offset_y);
+        } else if (glyph->baked.value != ' ') {
+            glyph->bitmap = stbtt_GetCodepointSDF(&info, scale, glyph->baked.value, SDF_PADDING, SDF_ON_EDGE, SDF_PIXEL_DIST_SCALE,
+                                                  &width, &height, &glyph->baked.offset_x, &glyph->baked.offset_y);
+        }
+        if (glyph->bitmap != NULL) {
+            stbtt_GetCodepointHMetrics(&info, glyph->baked.value, &glyph->baked.advance_x, NULL);
+            glyph->baked.advance_x = (int) ((float) glyph->baked.advance_x*scale);
+            glyph->baked.width = width;
+            glyph->baked.height = height;
+            glyph->baked.offset_y += (int) ((float) ascent*scale);
         }
-        FGENERATE("0x%02hhX,", bytes[i]);
+
+        // The space has no bitmap but still takes its advance in the atlas
+        if (glyph->baked.value == ' ') {
+            stbtt_GetCodepointHMetrics(&info, glyph->baked.value, &glyph->baked.advance_x, NULL);
+            glyph->baked.advance_x = (int) ((float) glyph->baked.advance_x*scale);
+            free(glyph->bitmap);
+            glyph->bitmap = calloc(glyph->baked.advance_x*font_size, 1);
+            glyph->baked.width = glyph->baked.advance_x;
+            glyph->baked.height = font_size;
+        }
+        total_width += glyph->baked.width + 2*ATLAS_PADDING;
+        if (glyph->baked.height > tallest) tallest = glyph->baked.height;
     }
+    free(ttf);
 
-    GENERATE("\n};\n\n");
-    FGENERATE("const Resource __resource_%s = { .data = __data_%s, .size = %ld };\n\n", resource_name, resource_name, size);
+    // The glyphs of a field are taller than the font by its reach
+    int row_height = (sdf ? font_size + 2*SDF_PADDING : font_size);
+    if (tallest > row_height) row_height = tallest;
+    row_height += 2*ATLAS_PADDING;
 
+    float total_area = total_width*row_height*1.2f;
+    int atlas_size = (int) powf(2, ceilf(logf(sqrtf(total_area))/logf(2)));
+    int atlas_width = atlas_size;
+    int atlas_height = total_area < (atlas_size*atlas_size)/2 ? atlas_size/2 : atlas_size;
+
+    size_t pixels_offset = sizeof(Baked_Atlas) + ATLAS_CODEPOINTS_CNT*sizeof(Baked_Glyph);
+    size_t size = pixels_offset + (size_t) atlas_width*atlas_height;
+    unsigned char *bytes = calloc(size, 1);
+    if (bytes == NULL) {
+        printf("Cannot allocate the atlas %s\n", resource_name);
+        return false;
+    }
+
+    unsigned char *pixels = bytes + pixels_offset;
+    int x = ATLAS_PADDING, y = ATLAS_PADDING;
+    for (int i = 0; i < ATLAS_CODEPOINTS_CNT; i++) {
+        Glyph *glyph = &glyphs[i];
+        if (x >= atlas_width - glyph->baked.width - 2*ATLAS_PADDING) {
+            x = ATLAS_PADDING;
+            y += row_height;
+            if (y > atlas_height - row_height + ATLAS_PADDING) {
+                printf("The atlas %s is too small for its glyphs\n", resource_name);
+                free(bytes);
+                return false;
+            }
+        }
+
+        for (int row = 0; row < glyph->baked.height; row++) {
+            for (int col = 0; col < glyph->baked.width; col++) {
+                pixels[(y + row)*atlas_width + x + col] = glyph->bitmap[row*glyph->baked.width + col];
+            }
+        }
+        free(glyph->bitmap);
+
+        glyph->baked.x = x;
+        glyph->baked.y = y;
+        x += glyph->baked.width + 2*ATLAS_PADDING;
+    }
+
+    // The white corner of SUPPORT_FONT_ATLAS_WHITE_REC, for SetShapesTexture
+    for (int row = atlas_height - 3; !sdf && row < atlas_height; row++) {
+        for (int col = atlas_width - 3; col < atlas_width; col++) pixels[row*atlas_width + col] = 255;
+    }
+
+    Baked_Atlas *atlas = (Baked_Atlas *) bytes;
+    *atlas = (Baked_Atlas) {
+        .font_size = font_size,
+        .padding = ATLAS_PADDING,
+        .glyph_count = ATLAS_CODEPOINTS_CNT,
+        .width = atlas_width,
+        .height = atlas_height,
+    };
+    Baked_Glyph *baked = (Baked_Glyph *) (atlas + 1);
+    for (int i = 0; i < ATLAS_CODEPOINTS_CNT; i++) baked[i] = glyphs[i].baked;
+
+    bool generated = generate_bytes(resource_name, bytes, size, entry);
+    free(bytes);
+    return generated;
 }
 
-void generate_resource(char *resource_name) {
-    FGENERATE("    __resource_%s,\n", resource_name);
+void generate_resource(char *resource_name, const Entry *entry) {
+    FGENERATE("    { .name = \"%s\", .data = __data_%s, .size = %zu, .raw_size = %zu, .crc = 0x%08" PRIX32 ", .packed = %s },\n",
+              resource_name, resource_name, entry->size, entry->raw_size, entry->crc, entry->packed ? "true" : "false");
 }
 
 int main(void) {
@@ -83,24 +323,104 @@ int main(void) {
         return 1;
     }
 
+    ASM = fopen(BANDLE_ASM_PATH, "w+");
+    if (ASM == NULL) {
+        printf("Cannot open/create %s\n", BANDLE_ASM_PATH);
+        return 1;
+    }
+
+    BLOB = fopen(BANDLE_BLOB_PATH, "wb");
+    if (BLOB == NULL) {
+        printf("Cannot open/create %s\n", BANDLE_BLOB_PATH);
+        return 1;
+    }
+
     GENERATE(
+    "// Generated by src/bundler.c, the bytes are in src/bundle.S\n\n"
     "typedef struct {\n"
-    "    const unsigned char *data;\n"
-    "    size_t size;\n"
+    "    const char *name;\n"
+    "    const unsigned char *data;  // as bundled, deflated when `packed`\n"
+    "    size_t size;                // of `data`\n"
+    "    size_t raw_size;            // once inflated\n"
+    "    uint32_t crc;               // CRC-32 of the inflated bytes\n"
+    "    bool packed;\n"
     "} Resource;\n\n"
     );
 
-    size_t total_resources = sizeof(RESOURCE_NAMES_AND_PATHS) / sizeof(RESOURCE_NAMES_AND_PATHS[0]);
-    for (size_t i = 0; i < total_resources; i++) {
-        generate_bytes(RESOURCE_NAMES_AND_PATHS[i][0], RESOURCE_NAMES_AND_PATHS[i][1]);
-        FGENERATE("#define RESOURCE_%s %ld\n", RESOURCE_NAMES_AND_PATHS[i][0], i);
+    GENERATE_ASM(
+    "// Generated by src/bundler.c\n\n"
+    "#if defined(__APPLE__)\n"
+    "#define SYMBOL(name) _##name\n"
+    "    .const\n"
+    "#else\n"
+    "#define SYMBOL(name) name\n"
+    "    .section .rodata\n"
+    "#endif\n\n"
+    );
+
+    size_t total_files = sizeof(RESOURCE_NAMES_AND_PATHS) / sizeof(RESOURCE_NAMES_AND_PATHS[0]);
+    size_t total_atlases = sizeof(FONT_ATLASES) / sizeof(FONT_ATLASES[0]);
+    size_t total_resources = total_files + total_atlases;
+    char *names[sizeof(RESOURCE_NAMES_AND_PATHS) / sizeof(RESOURCE_NAMES_AND_PATHS[0]) + sizeof(FONT_ATLASES) / sizeof(FONT_ATLASES[0])];
+    Entry entries[sizeof(RESOURCE_NAMES_AND_PATHS) / sizeof(RESOURCE_NAMES_AND_PATHS[0]) + sizeof(FONT_ATLASES) / sizeof(FONT_ATLASES[0])];
+    for (size_t i = 0; i < total_files; i++) {
+        names[i] = RESOURCE_NAMES_AND_PATHS[i][0];
+        if (!generate_file(names[i], RESOURCE_NAMES_AND_PATHS[i][1], &entries[i])) return 1;
+        FGENERATE("#define RESOURCE_%s %ld\n\n", names[i], i);
+    }
+
+    GENERATE(BAKED_TYPES);
+    for (size_t i = 0; i < total_atlases; i++) {
+        char *font_path = NULL;
+        for (size_t j = 0; j < total_files; j++) {
+            if (strcmp(RESOURCE_NAMES_AND_PATHS[j][0], FONT_ATLASES[i].font) == 0) font_path = RESOURCE_NAMES_AND_PATHS[j][1];
+        }
+        if (font_path == NULL) {
+            printf("Unknown font %s for %s\n", FONT_ATLASES[i].font, FONT_ATLASES[i].name);
+            return 1;
+        }
+
+        names[total_files + i] = FONT_ATLASES[i].name;
+        if (!generate_font_atlas(FONT_ATLASES[i].name, font_path, FONT_ATLASES[i].font_size, FONT_ATLASES[i].sdf, &entries[total_files + i])) return 1;
+        FGENERATE("#define RESOURCE_%s %ld\n\n", FONT_ATLASES[i].name, total_files + i);
     }
 
-    GENERATE("\nResource resources[] = {\n");
+    FGENERATE("#define RESOURCES_CNT %zu\n\n", total_resources);
+    GENERATE("Resource resources[] = {\n");
     for (size_t i = 0; i < total_resources; i++) {
-        generate_resource(RESOURCE_NAMES_AND_PATHS[i][0]);
+        generate_resource(names[i], &entries[i]);
     }
     GENERATE("};\n\n");
 
+    GENERATE(
+    "typedef struct {\n"
+    "    size_t resource;  // the Baked_Atlas\n"
+    "    size_t font;      // the TTF it was rasterized from\n"
+    "    int font_size;\n"
+    "    bool sdf;         // a signed distance field, see SDF_ON_EDGE\n"
+    "} Font_Atlas;\n\n"
+    );
+    FGENERATE("#define SDF_ON_EDGE %d\n", SDF_ON_EDGE);
+    FGENERATE("#define SDF_PIXEL_DIST_SCALE %.1ff\n\n", SDF_PIXEL_DIST_SCALE);
+    FGENERATE("#define FONT_ATLASES_CNT %zu\n\n", total_atlases);
+    GENERATE("Font_Atlas font_atlases[] = {\n");
+    for (size_t i = 0; i < total_atlases; i++) {
+        FGENERATE("    { .resource = RESOURCE_%s, .font = RESOURCE_%s, .font_size = %d, .sdf = %s },\n",
+                  FONT_ATLASES[i].name, FONT_ATLASES[i].font, FONT_ATLASES[i].font_size, FONT_ATLASES[i].sdf ? "true" : "false");
+    }
+    GENERATE("};\n");
+
+    GENERATE_ASM(
+    "#if defined(__ELF__)\n"
+    "    .section .note.GNU-stack, \"\", %%progbits\n"
+    "#endif\n"
+    );
+
+    fclose(OUT);
+    fclose(ASM);
+    if (fclose(BLOB) != 0) {
+        printf("Cannot write %s\n", BANDLE_BLOB_PATH);
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,1075 @@
+/*******************************************************************\
+| Section: Conformance                                              |
+| Replays the cases of an event log (CSV with a case id and an      |
+| activity on every line) on the compiled program of the model, as  |
+| tokens on its edges. An activity that finds no token on its way   |
+| gets a missing one, and tokens left when the case is over are     |
+| remaining ones, which give the fitness of the case:               |
+|                                                                   |
+|   fitness = (1 - missing / consumed) / 2 + (1 - remaining / produced) / 2
+|                                                                   |
+| Activities are the tasks. Starters, gateways, waits, mail events  |
+| and ends are not in the log, so they fire on their own when an    |
+| activity needs a token from behind them. The log is mapped and    |
+| read once, cases are sharded by the hash of their id between      |
+| threads, and a case is dropped once none of its tokens can get to |
+| an activity anymore and CONFORM_LINGER more cases of its shard    |
+| have been over since, so late events still count against it.      |
+| Memory grows with the cases that are open at the same time, not   |
+| with the log.                                                     |
+\*******************************************************************/
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONFORM_BATCH 4096      // events handed to a shard at once
+#define CONFORM_QUEUE 8         // batches a shard can have waiting
+#define CONFORM_DEVIATIONS 4    // kept for the report of each case
+#define CONFORM_LINGER 1024     // over cases a shard keeps for their late events
+#define CONFORM_OUTPUT (1 << 16)
+
+/*
+ * The net: places are the edges of the program, plus one that gives every
+ * case its first token and that the starters take it from.
+ */
+
+typedef struct {
+    const char *name;
+    size_t len;
+    uint32_t node;
+} Conform_Activity;
+
+typedef struct {
+    const Process_Model *model;
+    Program program;
+    uint32_t places_cnt;
+    uint32_t start;          // the place of the first token
+
+    uint32_t *sources;       // per place, the node it leaves, ENGINE_INVALID_ID for start
+    uint32_t *targets;       // per place, the node it reaches, ENGINE_INVALID_ID for start
+    uint32_t *in_offsets;    // places coming into node i are in_places[in_offsets[i]..in_offsets[i + 1])
+    uint32_t *in_places;
+    bool *silent;            // per node, fires on its own
+    bool *continues;         // per place, an activity can still take its token
+    bool *ends;              // per place, its token gets to an end on its own
+
+    Conform_Activity *activities;  // open addressing on the hash of the name
+    size_t activities_mask;
+} Conform_Net;
+
+void conform_add_activity(Conform_Net *net, const char *name, uint32_t node) {
+    size_t len = strlen(name);
+    if (len == 0) return;
+
+    for (size_t i = hash_bytes(name, len) & net->activities_mask;; i = (i + 1) & net->activities_mask) {
+        Conform_Activity *a = &net->activities[i];
+        if (a->name == NULL) {
+            *a = (Conform_Activity) { .name = name, .len = len, .node = node };
+            return;
+        }
+        // the first node that takes a name keeps it
+        if (a->len == len && memcmp(a->name, name, len) == 0) return;
+    }
+}
+
+uint32_t conform_find_activity(const Conform_Net *net, const char *name, size_t len) {
+    for (size_t i = hash_bytes(name, len) & net->activities_mask;; i = (i + 1) & net->activities_mask) {
+        const Conform_Activity *a = &net->activities[i];
+        if (a->name == NULL) return ENGINE_INVALID_ID;
+        if (a->len == len && memcmp(a->name, name, len) == 0) return a->node;
+    }
+}
+
+// Sets the places of the nodes `base` picks, then walks back through
+// the silent nodes, which pass the flag of any of their outputs on to
+// all of their places
+void conform_propagate(Conform_Net *net, bool *flags, bool (*base)(const Conform_Net *, uint32_t)) {
+    uint32_t *queue = malloc(sizeof(uint32_t) * net->places_cnt);
+    assert(queue != NULL && "Cannot allocate the net");
+    memset(flags, 0, net->places_cnt);
+
+    size_t head = 0, len = 0;
+    for (uint32_t v = 0; v < net->program.nodes_cnt; v++) {
+        if (!base(net, v)) continue;
+        for (uint32_t i = net->in_offsets[v]; i < net->in_offsets[v + 1]; i++) {
+            uint32_t p = net->in_places[i];
+            if (!flags[p]) flags[queue[len++] = p] = true;
+        }
+    }
+
+    while (head < len) {
+        uint32_t g = net->sources[queue[head++]];
+        if (g == ENGINE_INVALID_ID || !net->silent[g]) continue;
+
+        for (uint32_t i = net->in_offsets[g]; i < net->in_offsets[g + 1]; i++) {
+            uint32_t p = net->in_places[i];
+            if (!flags[p]) flags[queue[len++] = p] = true;
+        }
+    }
+
+    free(queue);
+}
+
+bool conform_is_activity(const Conform_Net *net, uint32_t node) {
+    return !net->silent[node];
+}
+
+bool conform_is_end(const Conform_Net *net, uint32_t node) {
+    return net->program.ops[node] == OP_END;
+}
+
+// Activities are the names of the tasks, waits and mails, with or without
+// their subprocess, and their titles, which may be NULL
+void conform_init(Conform_Net *net, const Process_Model *model, const char **titles) {
+    memset(net, 0, sizeof(*net));
+    net->model = model;
+    program_compile(model, &net->program);
+
+    const Program *program = &net->program;
+    size_t n = program->nodes_cnt;
+    net->start = program->edges_cnt;
+    net->places_cnt = program->edges_cnt + 1;
+
+    net->sources = malloc(sizeof(uint32_t) * net->places_cnt);
+    net->targets = malloc(sizeof(uint32_t) * net->places_cnt);
+    net->in_offsets = calloc(n + 1, sizeof(uint32_t));
+    net->in_places = malloc(sizeof(uint32_t) * (net->places_cnt + n));
+    net->silent = malloc(n + 1);
+    net->continues = malloc(net->places_cnt);
+    net->ends = malloc(net->places_cnt);
+    assert(net->sources != NULL && net->targets != NULL && net->in_offsets != NULL && net->in_places != NULL
+           && net->silent != NULL && net->continues != NULL && net->ends != NULL && "Cannot allocate the net");
+
+    net->sources[net->start] = net->targets[net->start] = ENGINE_INVALID_ID;
+    for (uint32_t v = 0; v < n; v++) {
+        for (uint32_t e = program->offsets[v]; e < program->offsets[v + 1]; e++) {
+            net->sources[e] = v;
+            net->targets[e] = program->edges[e];
+        }
+    }
+
+    // counting sort of the places by their target, starters take the start place
+    uint32_t *count = calloc(n + 1, sizeof(uint32_t));
+    assert(count != NULL && "Cannot allocate the net");
+    for (uint32_t q = 0; q < net->start; q++) count[net->targets[q]]++;
+    for (uint32_t v = 0; v < n; v++) {
+        if (model->nodes[v].kind == NODE_STARTER) count[v]++;
+    }
+    for (uint32_t v = 0; v < n; v++) net->in_offsets[v + 1] = net->in_offsets[v] + count[v];
+    memset(count, 0, sizeof(uint32_t) * (n + 1));
+    for (uint32_t q = 0; q < net->start; q++) {
+        uint32_t v = net->targets[q];
+        net->in_places[net->in_offsets[v] + count[v]++] = q;
+    }
+    for (uint32_t v = 0; v < n; v++) {
+        if (model->nodes[v].kind == NODE_STARTER) net->in_places[net->in_offsets[v] + count[v]++] = net->start;
+    }
+    free(count);
+
+    for (uint32_t v = 0; v < n; v++) {
+        net->silent[v] = model->nodes[v].kind != NODE_TASK;
+    }
+
+    conform_propagate(net, net->continues, conform_is_activity);
+    conform_propagate(net, net->ends, conform_is_end);
+
+    size_t cap = 16;
+    while (cap < 6 * n) cap *= 2;
+    net->activities = calloc(cap, sizeof(Conform_Activity));
+    assert(net->activities != NULL && "Cannot allocate the activities");
+    net->activities_mask = cap - 1;
+
+    for (uint32_t v = 0; v < n; v++) {
+        if (net->silent[v]) continue;
+        conform_add_activity(net, model->nodes[v].name, v);
+        if (titles != NULL && titles[v] != NULL) conform_add_activity(net, titles[v], v);
+    }
+
+    // then without the subprocess, unless another activity already has it
+    for (uint32_t v = 0; v < n; v++) {
+        const char *dot = strrchr(model->nodes[v].name, '.');
+        if (!net->silent[v] && dot != NULL) conform_add_activity(net, dot + 1, v);
+    }
+}
+
+void conform_free(Conform_Net *net) {
+    program_free(&net->program);
+    free(net->sources);
+    free(net->targets);
+    free(net->in_offsets);
+    free(net->in_places);
+    free(net->silent);
+    free(net->continues);
+    free(net->ends);
+    free(net->activities);
+    memset(net, 0, sizeof(*net));
+}
+
+/*
+ * Cases
+ */
+
+typedef enum {
+    DEVIATION_MISSING = 0,  // the activity found no token
+    DEVIATION_REMAINING,    // a token was left on the way to the node
+    DEVIATION_UNKNOWN       // the activity is not in the model
+} Deviation_Kind;
+
+typedef struct {
+    Deviation_Kind kind;
+    uint32_t node;
+    const char *activity;  // DEVIATION_UNKNOWN, in the log
+    uint32_t activity_len;
+} Conform_Deviation;
+
+typedef struct {
+    uint32_t place;
+    uint32_t tokens;
+    uint32_t optional;  // from OR splits, only count once an activity takes them
+} Conform_Mark;
+
+typedef struct {
+    const char *id;  // in the log
+    uint32_t id_len;
+    uint64_t hash;
+
+    uint32_t events;
+    uint32_t unknown;
+    uint32_t missing, consumed, remaining, produced;
+    uint64_t over;  // its latest entry in the ring of over cases, 0 while open
+
+    Conform_Mark *marks;
+    uint32_t marks_cnt, marks_cap;
+
+    Conform_Deviation deviations[CONFORM_DEVIATIONS];
+    uint32_t deviations_cnt;
+} Conform_Case;
+
+void conform_deviate(Conform_Case *c, Conform_Deviation deviation) {
+    if (c->deviations_cnt < CONFORM_DEVIATIONS) c->deviations[c->deviations_cnt] = deviation;
+    c->deviations_cnt++;
+}
+
+Conform_Mark *conform_mark(Conform_Case *c, uint32_t place) {
+    for (uint32_t i = 0; i < c->marks_cnt; i++) {
+        if (c->marks[i].place == place) return &c->marks[i];
+    }
+    return NULL;
+}
+
+bool conform_marked(Conform_Case *c, uint32_t place) {
+    Conform_Mark *m = conform_mark(c, place);
+    return m != NULL && m->tokens + m->optional > 0;
+}
+
+void conform_put(Conform_Case *c, uint32_t place, bool optional) {
+    Conform_Mark *m = conform_mark(c, place);
+    if (m == NULL) {
+        if (c->marks_cnt == c->marks_cap) {
+            c->marks_cap = c->marks_cap == 0 ? 4 : c->marks_cap * 2;
+            c->marks = realloc(c->marks, sizeof(Conform_Mark) * c->marks_cap);
+            assert(c->marks != NULL && "Cannot grow the marking");
+        }
+        m = &c->marks[c->marks_cnt++];
+        *m = (Conform_Mark) { .place = place };
+    }
+
+    if (optional) {
+        m->optional++;
+    } else {
+        m->tokens++;
+        c->produced++;
+    }
+}
+
+// Takes a token from `place`, a real one first. Returns false when there
+// is none.
+bool conform_take(Conform_Case *c, uint32_t place) {
+    Conform_Mark *m = conform_mark(c, place);
+    if (m == NULL || m->tokens + m->optional == 0) return false;
+
+    if (m->tokens > 0) {
+        m->tokens--;
+    } else {
+        m->optional--;
+        c->produced++;
+    }
+
+    c->consumed++;
+    if (m->tokens + m->optional == 0) *m = c->marks[--c->marks_cnt];
+    return true;
+}
+
+// Fires the silent node `node`, taking the token on `in` and giving one
+// to `out`, the way to the activity that needs it. AND joins, with no
+// `in`, take one from each of their places.
+void conform_fire(const Conform_Net *net, Conform_Case *c, uint32_t node, uint32_t in, uint32_t out) {
+    const Program *program = &net->program;
+    Opcode op = program->ops[node];
+
+    if (in != ENGINE_INVALID_ID) conform_take(c, in);
+
+    if (op == OP_JOIN) {
+        uint32_t slot = program->joins[node];
+        for (uint32_t i = net->in_offsets[node]; i < net->in_offsets[node + 1]; i++) {
+            uint32_t place = net->in_places[i];
+            // OR joins also take the tokens of the other branches that were taken
+            if (program->arity[slot] > 0) {
+                conform_take(c, place);
+                continue;
+            }
+
+            for (Conform_Mark *m = conform_mark(c, place); m != NULL && m->tokens > 0; m = conform_mark(c, place)) {
+                conform_take(c, place);
+            }
+        }
+        op = program->then[slot];
+    }
+
+    for (uint32_t e = program->offsets[node]; e < program->offsets[node + 1]; e++) {
+        if (e == out || op == OP_FORK) conform_put(c, e, false);
+        else if (op == OP_SELECT) conform_put(c, e, true);
+    }
+}
+
+typedef struct {
+    uint32_t *seen;    // per place, the search that last got to it
+    uint32_t *toward;  // per place, where its token goes on the way to the activity
+    uint32_t *queue;
+    uint32_t search;
+} Conform_Scratch;
+
+// Breadth-first from the places of the activity back through the silent
+// nodes, to the closest token. AND joins are only gone through when all
+// of their tokens are there, and then fire first.
+void conform_replay(const Conform_Net *net, Conform_Scratch *s, Conform_Case *c, uint32_t node) {
+    const Program *program = &net->program;
+    uint32_t search = ++s->search;
+    uint32_t found = ENGINE_INVALID_ID, join = ENGINE_INVALID_ID;
+    size_t head = 0, len = 0;
+
+    for (uint32_t i = net->in_offsets[node]; i < net->in_offsets[node + 1]; i++) {
+        uint32_t q = net->in_places[i];
+        s->seen[q] = search;
+        s->toward[q] = ENGINE_INVALID_ID;
+        s->queue[len++] = q;
+    }
+
+    while (head < len && found == ENGINE_INVALID_ID) {
+        uint32_t q = s->queue[head++];
+        if (conform_marked(c, q)) {
+            found = q;
+            break;
+        }
+
+        uint32_t g = net->sources[q];
+        if (g == ENGINE_INVALID_ID || !net->silent[g]) continue;
+
+        if (program->ops[g] == OP_JOIN && program->arity[program->joins[g]] > 0) {
+            bool ready = true;
+            for (uint32_t i = net->in_offsets[g]; i < net->in_offsets[g + 1] && ready; i++) {
+                ready = conform_marked(c, net->in_places[i]);
+            }
+            if (ready) {
+                found = q;
+                join = g;
+            }
+            continue;
+        }
+
+        for (uint32_t i = net->in_offsets[g]; i < net->in_offsets[g + 1]; i++) {
+            uint32_t p = net->in_places[i];
+            if (s->seen[p] == search) continue;
+
+            s->seen[p] = search;
+            s->toward[p] = q;
+            s->queue[len++] = p;
+        }
+    }
+
+    if (found == ENGINE_INVALID_ID) {
+        c->missing++;
+        c->consumed++;
+        conform_deviate(c, (Conform_Deviation) { .kind = DEVIATION_MISSING, .node = node });
+    } else {
+        if (join != ENGINE_INVALID_ID) conform_fire(net, c, join, ENGINE_INVALID_ID, found);
+
+        uint32_t q = found;
+        for (; s->toward[q] != ENGINE_INVALID_ID; q = s->toward[q]) {
+            conform_fire(net, c, net->sources[s->toward[q]], q, s->toward[q]);
+        }
+        conform_take(c, q);
+    }
+
+    if (program->offsets[node + 1] > program->offsets[node]) conform_put(c, program->offsets[node], false);
+}
+
+// The case is over: tokens that get to an end on their own are taken
+// there, the others remain
+void conform_finish(const Conform_Net *net, Conform_Case *c) {
+    for (uint32_t i = 0; i < c->marks_cnt; i++) {
+        const Conform_Mark *m = &c->marks[i];
+        if (m->tokens == 0) continue;
+
+        if (net->ends[m->place]) {
+            c->consumed += m->tokens;
+        } else {
+            c->remaining += m->tokens;
+            conform_deviate(c, (Conform_Deviation) { .kind = DEVIATION_REMAINING, .node = net->targets[m->place] });
+        }
+    }
+    c->marks_cnt = 0;
+}
+
+// Over when no token can get to an activity anymore
+bool conform_over(const Conform_Net *net, const Conform_Case *c) {
+    for (uint32_t i = 0; i < c->marks_cnt; i++) {
+        if (c->marks[i].tokens > 0 && net->continues[c->marks[i].place]) return false;
+    }
+    return true;
+}
+
+double conform_fitness(const Conform_Case *c) {
+    double taken = c->consumed > 0 ? 1 - (double) c->missing / c->consumed : 1;
+    double left = c->produced > 0 ? 1 - (double) c->remaining / c->produced : 1;
+    return taken / 2 + left / 2;
+}
+
+/*
+ * Shards: the reader hands each one batches of the events of its cases
+ * through a ring of CONFORM_QUEUE batches, and waits when it is full.
+ */
+
+typedef struct {
+    const char *id;  // in the log, as written there
+    const char *activity;
+    uint32_t id_len;
+    uint32_t activity_len;
+    uint32_t node;  // ENGINE_INVALID_ID when the activity is unknown
+    uint64_t hash;  // of the id
+} Conform_Event;
+
+typedef struct {
+    uint64_t cases, fitting, events, unknown;
+    uint64_t missing, consumed, remaining, produced;
+    double fitness;  // sum of the cases
+    uint64_t *missing_at;    // per node
+    uint64_t *remaining_at;  // per node
+} Conform_Stats;
+
+// A case that was over, kept open for late events until CONFORM_LINGER
+// more are over. `seq` tells whether the case is still the same over one.
+typedef struct {
+    const char *id;
+    uint32_t id_len;
+    uint64_t hash;
+    uint64_t seq;
+} Conform_Over;
+
+typedef struct {
+    Conform_Event (*batches)[CONFORM_BATCH];
+    uint32_t lens[CONFORM_QUEUE];
+    _Alignas(64) _Atomic size_t head;  // worker
+    _Alignas(64) _Atomic size_t tail;  // reader
+    _Atomic bool done;
+    size_t filling;  // reader only, events in the batch at tail
+
+    // worker only
+    const Conform_Net *net;
+    Conform_Case *cases;  // open addressing on the hash of the id
+    size_t cases_mask;
+    size_t cases_cnt;
+    Conform_Over *over;  // ring of CONFORM_LINGER
+    size_t over_head, over_len;
+    uint64_t over_seq;
+    Conform_Scratch scratch;
+    Conform_Stats stats;
+    char *out;
+    size_t out_len;
+    pthread_t thread;
+} Conform_Shard;
+
+void conform_flush(Conform_Shard *shard) {
+    fwrite(shard->out, 1, shard->out_len, stdout);
+    shard->out_len = 0;
+}
+
+void conform_write(Conform_Shard *shard, const char *data, size_t len) {
+    if (shard->out_len + len > CONFORM_OUTPUT) conform_flush(shard);
+    if (len > CONFORM_OUTPUT) {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+
+    memcpy(shard->out + shard->out_len, data, len);
+    shard->out_len += len;
+}
+
+// Writes the CSV line of the case, quoting the deviations
+void conform_report(Conform_Shard *shard, const Conform_Case *c) {
+    static const char *KINDS[] = { "missing", "remaining", "unknown" };
+    char buf[128];
+
+    // ids that needed quotes in the log need them here too
+    bool quoted = memchr(c->id, ',', c->id_len) != NULL || memchr(c->id, '"', c->id_len) != NULL;
+    if (quoted) conform_write(shard, "\"", 1);
+    conform_write(shard, c->id, c->id_len);
+    if (quoted) conform_write(shard, "\"", 1);
+    int n = snprintf(buf, sizeof(buf), ",%u,%.4f,\"", c->events, conform_fitness(c));
+    conform_write(shard, buf, n);
+
+    uint32_t kept = c->deviations_cnt < CONFORM_DEVIATIONS ? c->deviations_cnt : CONFORM_DEVIATIONS;
+    for (uint32_t i = 0; i < kept; i++) {
+        const Conform_Deviation *d = &c->deviations[i];
+        const char *name = d->activity;
+        size_t len = d->activity_len;
+        if (d->kind != DEVIATION_UNKNOWN) {
+            name = d->node == ENGINE_INVALID_ID ? "start" : shard->net->model->nodes[d->node].name;
+            len = strlen(name);
+        }
+
+        if (i > 0) conform_write(shard, "; ", 2);
+        conform_write(shard, KINDS[d->kind], strlen(KINDS[d->kind]));
+        conform_write(shard, " ", 1);
+        if (d->kind == DEVIATION_UNKNOWN) {
+            // as written in the log, where its quotes are already doubled
+            conform_write(shard, name, len);
+            continue;
+        }
+        for (size_t k = 0; k < len; k++) {
+            conform_write(shard, &name[k], 1);
+            if (name[k] == '"') conform_write(shard, "\"", 1);
+        }
+    }
+
+    if (c->deviations_cnt > kept) {
+        n = snprintf(buf, sizeof(buf), "; %u more", c->deviations_cnt - kept);
+        conform_write(shard, buf, n);
+    }
+    conform_write(shard, "\"\n", 2);
+}
+
+void conform_count(Conform_Shard *shard, const Conform_Case *c) {
+    Conform_Stats *stats = &shard->stats;
+    double fitness = conform_fitness(c);
+
+    stats->cases++;
+    stats->fitting += fitness >= 1;
+    stats->fitness += fitness;
+    stats->events += c->events;
+    stats->unknown += c->unknown;
+    stats->missing += c->missing;
+    stats->consumed += c->consumed;
+    stats->remaining += c->remaining;
+    stats->produced += c->produced;
+
+    uint32_t kept = c->deviations_cnt < CONFORM_DEVIATIONS ? c->deviations_cnt : CONFORM_DEVIATIONS;
+    for (uint32_t i = 0; i < kept; i++) {
+        const Conform_Deviation *d = &c->deviations[i];
+        if (d->node == ENGINE_INVALID_ID || d->kind == DEVIATION_UNKNOWN) continue;
+        if (d->kind == DEVIATION_MISSING) stats->missing_at[d->node]++;
+        else stats->remaining_at[d->node]++;
+    }
+}
+
+void conform_grow(Conform_Shard *shard) {
+    size_t cap = shard->cases_mask + 1;
+    Conform_Case *old = shard->cases;
+
+    shard->cases = calloc(cap * 2, sizeof(Conform_Case));
+    assert(shard->cases != NULL && "Cannot grow the open cases");
+    shard->cases_mask = cap * 2 - 1;
+
+    for (size_t i = 0; i < cap; i++) {
+        if (old[i].id == NULL) continue;
+
+        size_t j = old[i].hash & shard->cases_mask;
+        while (shard->cases[j].id != NULL) j = (j + 1) & shard->cases_mask;
+        shard->cases[j] = old[i];
+    }
+    free(old);
+}
+
+// The slot of the case, or the empty one where it would go
+Conform_Case *conform_find(Conform_Shard *shard, const char *id, uint32_t id_len, uint64_t hash) {
+    for (size_t i = hash & shard->cases_mask;; i = (i + 1) & shard->cases_mask) {
+        Conform_Case *c = &shard->cases[i];
+        if (c->id == NULL) return c;
+        if (c->hash == hash && c->id_len == id_len && memcmp(c->id, id, id_len) == 0) return c;
+    }
+}
+
+Conform_Case *conform_open(Conform_Shard *shard, const Conform_Event *ev) {
+    Conform_Case *c = conform_find(shard, ev->id, ev->id_len, ev->hash);
+    if (c->id != NULL) return c;
+
+    if (2 * (shard->cases_cnt + 1) > shard->cases_mask + 1) {
+        conform_grow(shard);
+        c = conform_find(shard, ev->id, ev->id_len, ev->hash);
+    }
+
+    *c = (Conform_Case) { .id = ev->id, .id_len = ev->id_len, .hash = ev->hash };
+    conform_put(c, shard->net->start, false);
+    shard->cases_cnt++;
+    return c;
+}
+
+// Finishes, reports and drops the case, shifting back the ones after it
+// so no tombstones are needed
+void conform_close(Conform_Shard *shard, Conform_Case *c) {
+    conform_finish(shard->net, c);
+    conform_report(shard, c);
+    conform_count(shard, c);
+    free(c->marks);
+
+    size_t mask = shard->cases_mask;
+    size_t i = c - shard->cases;
+    for (size_t j = (i + 1) & mask; shard->cases[j].id != NULL; j = (j + 1) & mask) {
+        size_t home = shard->cases[j].hash & mask;
+        // j may move to i when its home is not between i and j
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            shard->cases[i] = shard->cases[j];
+            i = j;
+        }
+    }
+
+    memset(&shard->cases[i], 0, sizeof(Conform_Case));
+    shard->cases_cnt--;
+}
+
+// Closes the case of the oldest entry in the ring of over cases, unless
+// a late event opened it again since
+void conform_expire(Conform_Shard *shard) {
+    Conform_Over o = shard->over[shard->over_head];
+    shard->over_head = (shard->over_head + 1) % CONFORM_LINGER;
+    shard->over_len--;
+
+    Conform_Case *c = conform_find(shard, o.id, o.id_len, o.hash);
+    if (c->id != NULL && c->over == o.seq) conform_close(shard, c);
+}
+
+// The case of `ev` is over: it waits in the ring for late events, which
+// make the oldest one there leave when it is full. Closing moves cases
+// around, so the one of `ev` is looked up again after.
+void conform_linger(Conform_Shard *shard, const Conform_Event *ev) {
+    if (shard->over_len == CONFORM_LINGER) conform_expire(shard);
+
+    uint64_t seq = ++shard->over_seq;
+    shard->over[(shard->over_head + shard->over_len++) % CONFORM_LINGER] = (Conform_Over) {
+        .id = ev->id,
+        .id_len = ev->id_len,
+        .hash = ev->hash,
+        .seq = seq
+    };
+    conform_find(shard, ev->id, ev->id_len, ev->hash)->over = seq;
+}
+
+void conform_event(Conform_Shard *shard, const Conform_Event *ev) {
+    Conform_Case *c = conform_open(shard, ev);
+    c->events++;
+
+    if (ev->node == ENGINE_INVALID_ID) {
+        c->unknown++;
+        conform_deviate(c, (Conform_Deviation) {
+            .kind = DEVIATION_UNKNOWN,
+            .node = ENGINE_INVALID_ID,
+            .activity = ev->activity,
+            .activity_len = ev->activity_len
+        });
+        return;
+    }
+
+    // an over case finds no token for a late activity, so it is missing there
+    conform_replay(shard->net, &shard->scratch, c, ev->node);
+    if (conform_over(shard->net, c)) conform_linger(shard, ev);
+    else c->over = 0;
+}
+
+void *conform_worker(void *arg) {
+    Conform_Shard *shard = arg;
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&shard->head, memory_order_relaxed);
+        if (head == atomic_load_explicit(&shard->tail, memory_order_acquire)) {
+            // done is set after the last batch, so the tail is read again
+            if (atomic_load_explicit(&shard->done, memory_order_acquire)
+                && head == atomic_load_explicit(&shard->tail, memory_order_acquire)) break;
+            sched_yield();
+            continue;
+        }
+
+        size_t slot = head % CONFORM_QUEUE;
+        for (uint32_t i = 0; i < shard->lens[slot]; i++) {
+            conform_event(shard, &shard->batches[slot][i]);
+        }
+        atomic_store_explicit(&shard->head, head + 1, memory_order_release);
+    }
+
+    // over cases in the order they were over, then the ones still open at
+    // the end of the log
+    while (shard->over_len > 0) conform_expire(shard);
+    for (size_t i = 0; i <= shard->cases_mask; i++) {
+        while (shard->cases[i].id != NULL) conform_close(shard, &shard->cases[i]);
+    }
+
+    conform_flush(shard);
+    return NULL;
+}
+
+void conform_publish(Conform_Shard *shard) {
+    size_t tail = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+    shard->lens[tail % CONFORM_QUEUE] = shard->filling;
+    shard->filling = 0;
+    atomic_store_explicit(&shard->tail, tail + 1, memory_order_release);
+}
+
+void conform_push(Conform_Shard *shard, Conform_Event ev) {
+    size_t tail = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+    if (shard->filling == 0) {
+        while (tail - atomic_load_explicit(&shard->head, memory_order_acquire) == CONFORM_QUEUE) sched_yield();
+    }
+
+    shard->batches[tail % CONFORM_QUEUE][shard->filling++] = ev;
+    if (shard->filling == CONFORM_BATCH) conform_publish(shard);
+}
+
+/*
+ * Reading the log
+ */
+
+// Scans the field at `p`, without the quotes when it has them. Returns
+// where it ends: at the separator, the end of the line or of the log.
+const char *conform_field(const char *p, const char *end, char sep, const char **field, size_t *len, bool *escaped) {
+    *escaped = false;
+    if (p < end && *p == '"') {
+        const char *q = ++p;
+        for (;;) {
+            q = memchr(q, '"', end - q);
+            if (q == NULL) q = end;
+            if (q + 1 < end && q[1] == '"') {
+                *escaped = true;
+                q += 2;
+                continue;
+            }
+            break;
+        }
+
+        *field = p;
+        *len = q - p;
+        p = q < end ? q + 1 : end;
+        while (p < end && *p != sep && *p != '\n') p++;
+        return p;
+    }
+
+    const char *q = p;
+    while (q < end && *q != sep && *q != '\n') q++;
+    *field = p;
+    *len = q - p;
+    if (*len > 0 && q[-1] == '\r') (*len)--;
+    return q;
+}
+
+// Undoes the doubled quotes of a quoted field into `buf`
+size_t conform_unquote(const char *field, size_t len, char *buf, size_t cap) {
+    size_t n = 0;
+    for (size_t i = 0; i < len && n < cap; i++) {
+        buf[n++] = field[i];
+        if (field[i] == '"' && i + 1 < len && field[i + 1] == '"') i++;
+    }
+    return n;
+}
+
+bool conform_column(const char *field, size_t len, const char **names) {
+    for (; *names != NULL; names++) {
+        if (strlen(*names) == len && strncasecmp(field, *names, len) == 0) return true;
+    }
+    return false;
+}
+
+typedef struct {
+    char sep;
+    size_t case_col, activity_col;
+    size_t resource_col;  // SIZE_MAX when there is none
+    const char *data;     // first line of events
+} Conform_Format;
+
+// Picks the separator that the first line uses the most, and the columns
+// by their header. Without one the case id is the first column and the
+// activity the second.
+Conform_Format conform_format(const char *log, const char *end) {
+    static const char *CASE_NAMES[] = { "case", "case_id", "caseid", "case id", "case:concept:name", NULL };
+    static const char *ACTIVITY_NAMES[] = { "activity", "activity_id", "activity id", "concept:name", "event", "task", NULL };
+    static const char *RESOURCE_NAMES[] = { "resource", "org:resource", "org:role", "role", "lane", "department", "group", NULL };
+
+    const char *eol = memchr(log, '\n', end - log);
+    if (eol == NULL) eol = end;
+
+    Conform_Format format = { .sep = ',', .case_col = 0, .activity_col = 1, .resource_col = SIZE_MAX, .data = log };
+    size_t best = 0;
+    for (const char *sep = ",;\t|"; *sep; sep++) {
+        size_t count = 0;
+        for (const char *p = log; p < eol; p++) count += *p == *sep;
+        if (count > best) {
+            best = count;
+            format.sep = *sep;
+        }
+    }
+
+    bool has_case = false, has_activity = false;
+    const char *p = log, *field;
+    size_t len;
+    bool escaped;
+    for (size_t col = 0;; col++) {
+        p = conform_field(p, end, format.sep, &field, &len, &escaped);
+        if (!has_case && conform_column(field, len, CASE_NAMES)) {
+            format.case_col = col;
+            has_case = true;
+        } else if (!has_activity && conform_column(field, len, ACTIVITY_NAMES)) {
+            format.activity_col = col;
+            has_activity = true;
+        } else if (format.resource_col == SIZE_MAX && conform_column(field, len, RESOURCE_NAMES)) {
+            format.resource_col = col;
+        }
+        if (p >= end || *p == '\n') break;
+        p++;
+    }
+
+    if (has_case || has_activity) format.data = p < end ? p + 1 : end;
+    else format.resource_col = SIZE_MAX;
+    return format;
+}
+
+typedef struct {
+    const char *id, *activity, *resource;  // NULL when the line has no such column
+    size_t id_len, activity_len, resource_len;
+    bool activity_escaped, resource_escaped;  // with doubled quotes
+} Conform_Line;
+
+// Splits the line at `p` into the columns of `format`. Returns where the
+// next one starts.
+const char *conform_line(const Conform_Format *format, const char *p, const char *end, Conform_Line *line) {
+    memset(line, 0, sizeof(*line));
+    for (size_t col = 0;; col++) {
+        const char *field;
+        size_t len;
+        bool escaped;
+        p = conform_field(p, end, format->sep, &field, &len, &escaped);
+        if (col == format->case_col) {
+            line->id = field;
+            line->id_len = len;
+        } else if (col == format->activity_col) {
+            line->activity = field;
+            line->activity_len = len;
+            line->activity_escaped = escaped;
+        } else if (col == format->resource_col) {
+            line->resource = field;
+            line->resource_len = len;
+            line->resource_escaped = escaped;
+        }
+        if (p >= end || *p++ == '\n') return p;
+    }
+}
+
+// Parses every line and hands it to the shard of its case
+void conform_read(const Conform_Net *net, const char *log, const char *end, Conform_Shard *shards, size_t shards_cnt) {
+    Conform_Format format = conform_format(log, end);
+    char unquoted[1024];
+
+    const char *p = format.data;
+    while (p < end) {
+        Conform_Line line;
+        p = conform_line(&format, p, end, &line);
+        if (line.id == NULL || line.activity == NULL || line.id_len == 0) continue;
+
+        uint32_t node;
+        if (line.activity_escaped) {
+            size_t n = conform_unquote(line.activity, line.activity_len, unquoted, sizeof(unquoted));
+            node = conform_find_activity(net, unquoted, n);
+        } else {
+            node = conform_find_activity(net, line.activity, line.activity_len);
+        }
+
+        uint64_t hash = hash_bytes(line.id, line.id_len);
+        conform_push(&shards[(hash >> 32) % shards_cnt], (Conform_Event) {
+            .id = line.id,
+            .activity = line.activity,
+            .id_len = line.id_len,
+            .activity_len = line.activity_len,
+            .node = node,
+            .hash = hash
+        });
+    }
+
+    for (size_t i = 0; i < shards_cnt; i++) {
+        if (shards[i].filling > 0) conform_publish(&shards[i]);
+        atomic_store_explicit(&shards[i].done, true, memory_order_release);
+    }
+}
+
+/*
+ * Running
+ */
+
+void conform_merge(const Conform_Net *net, Conform_Stats *total, const Conform_Stats *stats) {
+    total->cases += stats->cases;
+    total->fitting += stats->fitting;
+    total->events += stats->events;
+    total->unknown += stats->unknown;
+    total->missing += stats->missing;
+    total->consumed += stats->consumed;
+    total->remaining += stats->remaining;
+    total->produced += stats->produced;
+    total->fitness += stats->fitness;
+    for (size_t i = 0; i < net->program.nodes_cnt; i++) {
+        total->missing_at[i] += stats->missing_at[i];
+        total->remaining_at[i] += stats->remaining_at[i];
+    }
+}
+
+// To stderr, so stdout is only the CSV of the cases
+void conform_print(const Conform_Net *net, const Conform_Stats *total, double elapsed, size_t threads) {
+    const Process_Model *model = net->model;
+    double taken = total->consumed > 0 ? 1 - (double) total->missing / total->consumed : 1;
+    double left = total->produced > 0 ? 1 - (double) total->remaining / total->produced : 1;
+
+    fprintf(stderr, "\nReplayed %lu events of %lu cases in %.2fs (%.1fM events/s) on %zu threads\n",
+            total->events, total->cases, elapsed, elapsed > 0 ? total->events / elapsed / 1e6 : 0, threads);
+    fprintf(stderr, "    fitness         %.4f\n", taken / 2 + left / 2);
+    fprintf(stderr, "    mean per case   %.4f\n", total->cases > 0 ? total->fitness / total->cases : 1);
+    fprintf(stderr, "    fitting cases   %lu (%.1f%%)\n", total->fitting,
+            total->cases > 0 ? 100.0 * total->fitting / total->cases : 100);
+    fprintf(stderr, "    tokens          %lu missing of %lu consumed, %lu remaining of %lu produced\n",
+            total->missing, total->consumed, total->remaining, total->produced);
+    fprintf(stderr, "    unknown events  %lu\n", total->unknown);
+
+    bool any = false;
+    for (size_t i = 0; i < net->program.nodes_cnt && !any; i++) {
+        any = total->missing_at[i] > 0 || total->remaining_at[i] > 0;
+    }
+    if (!any) return;
+
+    fprintf(stderr, "\n%-40s %10s %10s\n", "Event", "Missing", "Remaining");
+    for (size_t i = 0; i < net->program.nodes_cnt; i++) {
+        if (total->missing_at[i] == 0 && total->remaining_at[i] == 0) continue;
+        fprintf(stderr, "%-40s %10lu %10lu\n", model->nodes[i].name, total->missing_at[i], total->remaining_at[i]);
+    }
+}
+
+double conform_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Replays the log at `path` and prints a line per case to stdout and the
+// totals to stderr. `titles` are per node and may be NULL.
+int conform(const Process_Model *model, const char **titles, const char *path, size_t threads) {
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? cores : 1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "error: cannot read the log %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return EXIT_FAILURE;
+    }
+
+    const char *log = "";
+    if (st.st_size > 0) {
+        log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (log == MAP_FAILED) {
+            fprintf(stderr, "error: cannot map the log %s: %s\n", path, strerror(errno));
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        madvise((void *) log, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    static Conform_Net net = {0};
+    conform_init(&net, model, titles);
+    size_t nodes_cnt = net.program.nodes_cnt;
+
+    Conform_Shard *shards = calloc(threads, sizeof(Conform_Shard));
+    assert(shards != NULL && "Cannot allocate the shards");
+    for (size_t i = 0; i < threads; i++) {
+        Conform_Shard *shard = &shards[i];
+        shard->net = &net;
+        shard->batches = malloc(sizeof(*shard->batches) * CONFORM_QUEUE);
+        shard->cases = calloc(1024, sizeof(Conform_Case));
+        shard->cases_mask = 1023;
+        shard->over = malloc(sizeof(Conform_Over) * CONFORM_LINGER);
+        shard->scratch.seen = calloc(net.places_cnt, sizeof(uint32_t));
+        shard->scratch.toward = malloc(sizeof(uint32_t) * net.places_cnt);
+        shard->scratch.queue = malloc(sizeof(uint32_t) * net.places_cnt);
+        shard->stats.missing_at = calloc(nodes_cnt, sizeof(uint64_t));
+        shard->stats.remaining_at = calloc(nodes_cnt, sizeof(uint64_t));
+        shard->out = malloc(CONFORM_OUTPUT);
+        assert(shard->batches != NULL && shard->cases != NULL && shard->over != NULL && shard->scratch.seen != NULL
+               && shard->scratch.toward != NULL && shard->scratch.queue != NULL && shard->stats.missing_at != NULL
+               && shard->stats.remaining_at != NULL && shard->out != NULL && "Cannot allocate the shards");
+    }
+
+    printf("case,events,fitness,deviations\n");
+    fflush(stdout);
+
+    double start = conform_now();
+    for (size_t i = 0; i < threads; i++) {
+        if (pthread_create(&shards[i].thread, NULL, conform_worker, &shards[i]) != 0) {
+            fprintf(stderr, "error: cannot create conformance thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    conform_read(&net, log, log + st.st_size, shards, threads);
+
+    Conform_Stats total = {
+        .missing_at = calloc(nodes_cnt, sizeof(uint64_t)),
+        .remaining_at = calloc(nodes_cnt, sizeof(uint64_t))
+    };
+    assert(total.missing_at != NULL && total.remaining_at != NULL && "Cannot allocate the totals");
+
+    for (size_t i = 0; i < threads; i++) {
+        Conform_Shard *shard = &shards[i];
+        pthread_join(shard->thread, NULL);
+        conform_merge(&net, &total, &shard->stats);
+
+        free(shard->batches);
+        free(shard->cases);
+        free(shard->over);
+        free(shard->scratch.seen);
+        free(shard->scratch.toward);
+        free(shard->scratch.queue);
+        free(shard->stats.missing_at);
+        free(shard->stats.remaining_at);
+        free(shard->out);
+    }
+    double elapsed = conform_now() - start;
+
+    fflush(stdout);
+    conform_print(&net, &total, elapsed, threads);
+
+    free(total.missing_at);
+    free(total.remaining_at);
+    free(shards);
+    conform_free(&net);
+    if (st.st_size > 0) munmap((void *) log, st.st_size);
+    close(fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,994 @@
+/*******************************************************************\
+| Section: Discovery                                                |
+| Builds a process from an event log (CSV, read like --conform):    |
+| counts how often each activity directly follows another in the    |
+| same case, drops the pairs that come both ways about as often     |
+| (they run in parallel) and the ones much rarer than the busiest   |
+| pair of their activity, then prints the graph that is left as a   |
+| .pcs file, with gateways where activities split and join and a    |
+| subprocess per value of the resource column.                      |
+|                                                                   |
+| The log is cut in one part per thread at line boundaries, and     |
+| every thread counts its part in its own tables, which are merged  |
+| in log order at the end: a case that goes on in the next part is  |
+| joined to it there, from the last activity it had in this one.    |
+\*******************************************************************/
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DISCOVER_FILTER 0.05    // default of --filter
+#define DISCOVER_PARALLEL 0.5   // pairs closer than this both ways are parallel
+#define DISCOVER_ID 48          // bytes of the ids written to the .pcs
+#define DISCOVER_NAME 200       // bytes of the names written to the .pcs
+
+// ids of the graph, activities come after them
+#define DISCOVER_START 0
+#define DISCOVER_END 1
+
+/*
+ * Tables: names seen in the log, counts of pairs of ids and cases, all
+ * open addressing and grown at half full.
+ */
+
+typedef struct {
+    const char *name;  // in the log
+    uint32_t len;
+    bool escaped;      // with doubled quotes
+    uint64_t hash;
+} Discover_Key;
+
+typedef struct {
+    Discover_Key *keys;  // by id
+    size_t cnt, cap;
+    uint32_t *slots;     // id + 1, 0 when free
+    size_t mask;
+} Discover_Names;
+
+void discover_names_init(Discover_Names *names) {
+    memset(names, 0, sizeof(*names));
+    names->cap = 64;
+    names->keys = malloc(sizeof(Discover_Key) * names->cap);
+    names->slots = calloc(128, sizeof(uint32_t));
+    names->mask = 127;
+    assert(names->keys != NULL && names->slots != NULL && "Cannot allocate the names");
+}
+
+void discover_names_free(Discover_Names *names) {
+    free(names->keys);
+    free(names->slots);
+    memset(names, 0, sizeof(*names));
+}
+
+void discover_names_grow(Discover_Names *names) {
+    size_t cap = (names->mask + 1) * 2;
+    free(names->slots);
+    names->slots = calloc(cap, sizeof(uint32_t));
+    assert(names->slots != NULL && "Cannot grow the names");
+    names->mask = cap - 1;
+
+    for (size_t id = 0; id < names->cnt; id++) {
+        size_t i = names->keys[id].hash & names->mask;
+        while (names->slots[i] != 0) i = (i + 1) & names->mask;
+        names->slots[i] = id + 1;
+    }
+}
+
+uint32_t discover_intern(Discover_Names *names, Discover_Key key) {
+    for (size_t i = key.hash & names->mask;; i = (i + 1) & names->mask) {
+        uint32_t slot = names->slots[i];
+        if (slot == 0) break;
+
+        const Discover_Key *k = &names->keys[slot - 1];
+        if (k->hash == key.hash && k->len == key.len && memcmp(k->name, key.name, key.len) == 0) return slot - 1;
+    }
+
+    if (names->cnt == names->cap) {
+        names->cap *= 2;
+        names->keys = realloc(names->keys, sizeof(Discover_Key) * names->cap);
+        assert(names->keys != NULL && "Cannot grow the names");
+    }
+
+    uint32_t id = names->cnt++;
+    names->keys[id] = key;
+    if (2 * names->cnt > names->mask + 1) {
+        discover_names_grow(names);
+    } else {
+        size_t i = key.hash & names->mask;
+        while (names->slots[i] != 0) i = (i + 1) & names->mask;
+        names->slots[i] = id + 1;
+    }
+    return id;
+}
+
+typedef struct {
+    uint64_t key;  // first id in the high half, UINT64_MAX when free
+    uint64_t count;
+} Discover_Pair;
+
+typedef struct {
+    Discover_Pair *slots;
+    size_t mask, cnt;
+} Discover_Pairs;
+
+uint64_t discover_mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+}
+
+void discover_pairs_init(Discover_Pairs *pairs, size_t cap) {
+    pairs->slots = malloc(sizeof(Discover_Pair) * cap);
+    assert(pairs->slots != NULL && "Cannot allocate the pairs");
+    memset(pairs->slots, 0xff, sizeof(Discover_Pair) * cap);
+    pairs->mask = cap - 1;
+    pairs->cnt = 0;
+}
+
+void discover_count(Discover_Pairs *pairs, uint32_t a, uint32_t b, uint64_t n) {
+    uint64_t key = (uint64_t) a << 32 | b;
+    for (size_t i = discover_mix(key) & pairs->mask;; i = (i + 1) & pairs->mask) {
+        Discover_Pair *pair = &pairs->slots[i];
+        if (pair->key == key) {
+            pair->count += n;
+            return;
+        }
+        if (pair->key != UINT64_MAX) continue;
+
+        *pair = (Discover_Pair) { .key = key, .count = n };
+        if (2 * ++pairs->cnt > pairs->mask + 1) {
+            Discover_Pairs old = *pairs;
+            discover_pairs_init(pairs, (old.mask + 1) * 2);
+            for (size_t j = 0; j <= old.mask; j++) {
+                Discover_Pair *p = &old.slots[j];
+                if (p->key != UINT64_MAX) discover_count(pairs, p->key >> 32, p->key & UINT32_MAX, p->count);
+            }
+            free(old.slots);
+        }
+        return;
+    }
+}
+
+uint64_t discover_follows(const Discover_Pairs *pairs, uint32_t a, uint32_t b) {
+    uint64_t key = (uint64_t) a << 32 | b;
+    for (size_t i = discover_mix(key) & pairs->mask;; i = (i + 1) & pairs->mask) {
+        const Discover_Pair *pair = &pairs->slots[i];
+        if (pair->key == key) return pair->count;
+        if (pair->key == UINT64_MAX) return 0;
+    }
+}
+
+typedef struct {
+    const char *id;  // in the log, NULL when free
+    uint32_t len;
+    uint32_t first, last;  // activities
+    uint64_t hash;
+} Discover_Case;
+
+typedef struct {
+    Discover_Case *slots;
+    size_t mask, cnt;
+} Discover_Cases;
+
+void discover_cases_init(Discover_Cases *cases, size_t cap) {
+    cases->slots = calloc(cap, sizeof(Discover_Case));
+    assert(cases->slots != NULL && "Cannot allocate the cases");
+    cases->mask = cap - 1;
+    cases->cnt = 0;
+}
+
+// Returns the case, with a NULL id when it is new so the caller fills it
+Discover_Case *discover_case(Discover_Cases *cases, const char *id, uint32_t len, uint64_t hash) {
+    if (2 * (cases->cnt + 1) > cases->mask + 1) {
+        Discover_Cases old = *cases;
+        discover_cases_init(cases, (old.mask + 1) * 2);
+        for (size_t i = 0; i <= old.mask; i++) {
+            if (old.slots[i].id == NULL) continue;
+            size_t j = old.slots[i].hash & cases->mask;
+            while (cases->slots[j].id != NULL) j = (j + 1) & cases->mask;
+            cases->slots[j] = old.slots[i];
+        }
+        cases->cnt = old.cnt;
+        free(old.slots);
+    }
+
+    for (size_t i = hash & cases->mask;; i = (i + 1) & cases->mask) {
+        Discover_Case *c = &cases->slots[i];
+        if (c->id == NULL) {
+            cases->cnt++;
+            c->hash = hash;
+            return c;
+        }
+        if (c->hash == hash && c->len == len && memcmp(c->id, id, len) == 0) return c;
+    }
+}
+
+/*
+ * Counting
+ */
+
+typedef struct {
+    const Conform_Format *format;
+    const char *begin, *end;
+
+    Discover_Names activities;
+    Discover_Names resources;
+    Discover_Pairs follows;    // activity after activity
+    Discover_Pairs performed;  // activity by resource
+    Discover_Cases cases;
+    uint64_t events;
+    pthread_t thread;
+} Discover_Part;
+
+Discover_Key discover_key(const char *name, size_t len, bool escaped) {
+    return (Discover_Key) { .name = name, .len = len, .escaped = escaped, .hash = hash_bytes(name, len) };
+}
+
+void *discover_worker(void *arg) {
+    Discover_Part *part = arg;
+    uint32_t no_resource = discover_intern(&part->resources, discover_key("", 0, false));
+
+    const char *p = part->begin;
+    while (p < part->end) {
+        Conform_Line line;
+        p = conform_line(part->format, p, part->end, &line);
+        if (line.id == NULL || line.activity == NULL || line.id_len == 0 || line.activity_len == 0) continue;
+
+        uint32_t activity = discover_intern(&part->activities, discover_key(line.activity, line.activity_len, line.activity_escaped));
+        uint32_t resource = line.resource != NULL
+            ? discover_intern(&part->resources, discover_key(line.resource, line.resource_len, line.resource_escaped))
+            : no_resource;
+        discover_count(&part->performed, activity, resource, 1);
+        part->events++;
+
+        Discover_Case *c = discover_case(&part->cases, line.id, line.id_len, hash_bytes(line.id, line.id_len));
+        if (c->id == NULL) {
+            c->id = line.id;
+            c->len = line.id_len;
+            c->first = activity;
+        } else {
+            discover_count(&part->follows, c->last, activity, 1);
+        }
+        c->last = activity;
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    Discover_Names activities;  // graph id - 2
+    Discover_Names resources;
+    Discover_Pairs follows;     // graph ids, with the start and the end of the cases
+    Discover_Pairs performed;
+    uint64_t events, cases;
+} Discover_Log;
+
+// Adds the part to the log, with its ids turned into the ones of the log
+void discover_merge(Discover_Log *log, Discover_Part *part, Discover_Cases *cases) {
+    uint32_t *activities = malloc(sizeof(uint32_t) * (part->activities.cnt + 1));
+    uint32_t *resources = malloc(sizeof(uint32_t) * (part->resources.cnt + 1));
+    assert(activities != NULL && resources != NULL && "Cannot allocate the merge");
+
+    for (size_t i = 0; i < part->activities.cnt; i++) {
+        activities[i] = discover_intern(&log->activities, part->activities.keys[i]) + 2;
+    }
+    for (size_t i = 0; i < part->resources.cnt; i++) {
+        resources[i] = discover_intern(&log->resources, part->resources.keys[i]);
+    }
+
+    for (size_t i = 0; i <= part->follows.mask; i++) {
+        const Discover_Pair *pair = &part->follows.slots[i];
+        if (pair->key == UINT64_MAX) continue;
+        discover_count(&log->follows, activities[pair->key >> 32], activities[pair->key & UINT32_MAX], pair->count);
+    }
+
+    for (size_t i = 0; i <= part->performed.mask; i++) {
+        const Discover_Pair *pair = &part->performed.slots[i];
+        if (pair->key == UINT64_MAX) continue;
+        discover_count(&log->performed, activities[pair->key >> 32], resources[pair->key & UINT32_MAX], pair->count);
+    }
+
+    for (size_t i = 0; i <= part->cases.mask; i++) {
+        const Discover_Case *from = &part->cases.slots[i];
+        if (from->id == NULL) continue;
+
+        Discover_Case *c = discover_case(cases, from->id, from->len, from->hash);
+        if (c->id == NULL) {
+            c->id = from->id;
+            c->len = from->len;
+            c->first = activities[from->first];
+        } else {
+            discover_count(&log->follows, c->last, activities[from->first], 1);
+        }
+        c->last = activities[from->last];
+    }
+
+    log->events += part->events;
+    free(activities);
+    free(resources);
+}
+
+/*
+ * The graph
+ */
+
+typedef struct {
+    uint32_t from, to;
+    uint64_t count;
+} Discover_Edge;
+
+typedef struct {
+    Node_Kind kind;
+    Gateway_Kind gateway;
+    uint32_t lane;
+    uint32_t targets[MODEL_MAX_TARGETS];
+    double weights[MODEL_MAX_TARGETS];
+    uint32_t targets_cnt;
+    uint32_t rank;  // columns from the starter
+    uint32_t activity;  // graph id, for the name of tasks
+    char id[DISCOVER_ID];
+} Discover_Node;
+
+typedef struct {
+    const Discover_Log *log;
+    size_t activities_cnt;  // with the start and the end
+    uint64_t *counts;       // per activity, events or cases for the start and the end
+    uint32_t *lanes;        // per activity, the resource that performed it the most
+
+    Discover_Edge *edges;   // kept, sorted by source
+    size_t edges_cnt;
+    uint32_t *out_offsets;  // edges of activity i are edges[out_offsets[i]..out_offsets[i + 1])
+
+    Discover_Node *nodes;
+    size_t nodes_cnt;
+    uint32_t *entries;      // per activity, the node that its sources point to
+    Discover_Names ids;     // of the nodes, so they are unique
+} Discover_Graph;
+
+bool discover_parallel(const Discover_Log *log, uint32_t a, uint32_t b) {
+    if (a < 2 || b < 2 || a == b) return false;
+
+    double ab = discover_follows(&log->follows, a, b);
+    double ba = discover_follows(&log->follows, b, a);
+    if (ab == 0 || ba == 0) return false;
+    return fabs(ab - ba) / (ab + ba + 1) < DISCOVER_PARALLEL;
+}
+
+int discover_compare_edges(const void *a, const void *b) {
+    const Discover_Edge *x = a, *y = b;
+    if (x->from != y->from) return x->from < y->from ? -1 : 1;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return x->to < y->to ? -1 : x->to > y->to;
+}
+
+// Keeps the pairs that are not parallel and come at least `filter` times
+// as often as the busiest pair leaving their source and the one reaching
+// their target. The busiest ones always stay, so nothing gets cut off.
+void discover_filter(Discover_Graph *graph, double filter) {
+    const Discover_Log *log = graph->log;
+    size_t n = graph->activities_cnt;
+
+    Discover_Edge *edges = malloc(sizeof(Discover_Edge) * (log->follows.cnt + 2 * n));
+    uint64_t *max_out = calloc(n, sizeof(uint64_t));
+    uint64_t *max_in = calloc(n, sizeof(uint64_t));
+    bool *has_in = calloc(n, sizeof(bool));
+    bool *has_out = calloc(n, sizeof(bool));
+    assert(edges != NULL && max_out != NULL && max_in != NULL && has_in != NULL && has_out != NULL
+           && "Cannot allocate the edges");
+
+    size_t all = 0;
+    for (size_t i = 0; i <= log->follows.mask; i++) {
+        const Discover_Pair *pair = &log->follows.slots[i];
+        if (pair->key == UINT64_MAX) continue;
+
+        Discover_Edge edge = { .from = pair->key >> 32, .to = pair->key & UINT32_MAX, .count = pair->count };
+        if (discover_parallel(log, edge.from, edge.to)) continue;
+
+        edges[all++] = edge;
+        if (edge.count > max_out[edge.from]) max_out[edge.from] = edge.count;
+        if (edge.count > max_in[edge.to]) max_in[edge.to] = edge.count;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < all; i++) {
+        Discover_Edge edge = edges[i];
+        bool busiest = edge.count == max_out[edge.from] || edge.count == max_in[edge.to];
+        if (!busiest && (edge.count < filter * max_out[edge.from] || edge.count < filter * max_in[edge.to])) continue;
+
+        edges[kept++] = edge;
+        has_out[edge.from] = true;
+        has_in[edge.to] = true;
+    }
+
+    // activities only seen next to the ones they run with
+    for (uint32_t a = 2; a < n; a++) {
+        if (!has_in[a]) edges[kept++] = (Discover_Edge) { .from = DISCOVER_START, .to = a, .count = graph->counts[a] };
+        if (!has_out[a]) edges[kept++] = (Discover_Edge) { .from = a, .to = DISCOVER_END, .count = graph->counts[a] };
+    }
+
+    qsort(edges, kept, sizeof(Discover_Edge), discover_compare_edges);
+    graph->edges = edges;
+    graph->edges_cnt = kept;
+
+    graph->out_offsets = calloc(n + 1, sizeof(uint32_t));
+    assert(graph->out_offsets != NULL && "Cannot allocate the edges");
+    for (size_t i = 0; i < kept; i++) graph->out_offsets[edges[i].from + 1]++;
+    for (size_t a = 0; a < n; a++) graph->out_offsets[a + 1] += graph->out_offsets[a];
+
+    free(max_out);
+    free(max_in);
+    free(has_in);
+    free(has_out);
+}
+
+// Lowercase letters, digits and underscores, unique between the nodes
+void discover_slug(Discover_Names *ids, char *id, const char *name, size_t len, const char *prefix) {
+    size_t n = snprintf(id, DISCOVER_ID, "%s", prefix);
+    bool gap = false;  // the prefix ends in one
+    for (size_t i = 0; i < len && n + 1 < DISCOVER_ID - 4; i++) {
+        unsigned char c = name[i];
+        if (isalnum(c) && c < 128) {
+            if (gap && n > 0) id[n++] = '_';
+            id[n++] = tolower(c);
+            gap = false;
+        } else {
+            gap = true;
+        }
+    }
+    if (n == 0 || isdigit((unsigned char) id[0])) {
+        memmove(id + 2, id, n);
+        id[0] = 'e';
+        id[1] = '_';
+        n += 2;
+    }
+    id[n] = '\0';
+
+    size_t base = n;
+    for (uint32_t copy = 2;; copy++) {
+        size_t before = ids->cnt;
+        discover_intern(ids, discover_key(id, strlen(id), false));
+        if (ids->cnt > before) return;
+        snprintf(id + base, DISCOVER_ID - base, "_%u", copy);
+    }
+}
+
+uint32_t discover_node(Discover_Graph *graph, Node_Kind kind, uint32_t activity, uint32_t lane) {
+    uint32_t node = graph->nodes_cnt++;
+    graph->nodes[node] = (Discover_Node) { .kind = kind, .lane = lane, .activity = activity };
+    return node;
+}
+
+// The kind of gateway between `activities`: AND when all of them run in
+// parallel about as often as each other, XOR when none do and OR
+// otherwise, like a rare activity that shows up anywhere in its cases
+Gateway_Kind discover_gateway(const Discover_Graph *graph, const uint32_t *activities, size_t cnt) {
+    size_t pairs = 0, parallel = 0;
+    uint64_t least = UINT64_MAX, most = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        uint64_t count = graph->counts[activities[i]];
+        if (count < least) least = count;
+        if (count > most) most = count;
+        for (size_t j = i + 1; j < cnt; j++) {
+            pairs++;
+            parallel += discover_parallel(graph->log, activities[i], activities[j]);
+        }
+    }
+
+    if (parallel == 0) return GATEWAY_XOR;
+    return parallel == pairs && least >= (1 - DISCOVER_PARALLEL) * most ? GATEWAY_AND : GATEWAY_OR;
+}
+
+// Points `node` to the targets of the edges, through a gateway when there
+// is more than one, and a chain of them when there are more than it takes
+void discover_split(Discover_Graph *graph, uint32_t node, const Discover_Edge *edges, size_t cnt, uint64_t total) {
+    Discover_Node *from = &graph->nodes[node];
+    if (cnt == 1) {
+        from->targets[from->targets_cnt++] = graph->entries[edges[0].to];
+        return;
+    }
+
+    uint32_t *activities = calloc(cnt, sizeof(uint32_t));
+    assert(activities != NULL && "Cannot allocate the split");
+    uint64_t sum = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        activities[i] = edges[i].to;
+        sum += edges[i].count;
+    }
+    Gateway_Kind kind = discover_gateway(graph, activities, cnt);
+    free(activities);
+
+    // a gateway takes up to MODEL_MAX_TARGETS targets, the last one of
+    // them being the next gateway when there are more
+    uint32_t prev = node;
+    uint64_t remaining = sum, prev_total = sum;
+    size_t at = 0;
+    while (at < cnt) {
+        uint32_t gateway = discover_node(graph, NODE_GATEWAY, graph->nodes[node].activity, graph->nodes[node].lane);
+        Discover_Node *g = &graph->nodes[gateway];
+        g->gateway = kind;
+        discover_slug(&graph->ids, g->id, graph->nodes[node].id, strlen(graph->nodes[node].id), "split_");
+
+        Discover_Node *p = &graph->nodes[prev];
+        p->targets[p->targets_cnt] = gateway;
+        p->weights[p->targets_cnt++] = kind == GATEWAY_OR ? 1 : (double) remaining / prev_total;
+        prev_total = remaining;
+
+        size_t take = cnt - at <= MODEL_MAX_TARGETS ? cnt - at : MODEL_MAX_TARGETS - 1;
+        for (size_t i = 0; i < take; i++, at++) {
+            // OR takes each target on its own, XOR one of them
+            double weight = kind == GATEWAY_OR ? (double) edges[at].count / total : (double) edges[at].count / prev_total;
+            g->targets[g->targets_cnt] = graph->entries[edges[at].to];
+            g->weights[g->targets_cnt++] = weight < 1 ? weight : 1;
+            remaining -= edges[at].count;
+        }
+        prev = gateway;
+    }
+}
+
+void discover_build(Discover_Graph *graph) {
+    const Discover_Log *log = graph->log;
+    size_t n = graph->activities_cnt;
+
+    // sources per activity, for the joins
+    uint32_t *in_counts = calloc(n + 1, sizeof(uint32_t));
+    uint32_t *in_sources = malloc(sizeof(uint32_t) * (graph->edges_cnt + 1));
+    assert(in_counts != NULL && in_sources != NULL && "Cannot allocate the graph");
+    for (size_t i = 0; i < graph->edges_cnt; i++) in_counts[graph->edges[i].to + 1]++;
+    for (size_t a = 0; a < n; a++) in_counts[a + 1] += in_counts[a];
+    uint32_t *filled = calloc(n, sizeof(uint32_t));
+    assert(filled != NULL && "Cannot allocate the graph");
+    for (size_t i = 0; i < graph->edges_cnt; i++) {
+        uint32_t to = graph->edges[i].to;
+        in_sources[in_counts[to] + filled[to]++] = graph->edges[i].from;
+    }
+    free(filled);
+
+    // a node per activity, a join per target and a chain of splits per source
+    size_t cap = 2 * n + 2 * graph->edges_cnt;
+    graph->nodes = calloc(cap, sizeof(Discover_Node));
+    graph->entries = malloc(sizeof(uint32_t) * n);
+    assert(graph->nodes != NULL && graph->entries != NULL && "Cannot allocate the nodes");
+    discover_names_init(&graph->ids);
+
+    for (uint32_t a = 0; a < n; a++) {
+        Node_Kind kind = a == DISCOVER_START ? NODE_STARTER : a == DISCOVER_END ? NODE_END : NODE_TASK;
+        uint32_t node = discover_node(graph, kind, a, graph->lanes[a]);
+        if (a == DISCOVER_START) discover_slug(&graph->ids, graph->nodes[node].id, "start", 5, "");
+        else if (a == DISCOVER_END) discover_slug(&graph->ids, graph->nodes[node].id, "end", 3, "");
+        else {
+            const Discover_Key *key = &log->activities.keys[a - 2];
+            discover_slug(&graph->ids, graph->nodes[node].id, key->name, key->len, "");
+        }
+        graph->entries[a] = node;
+    }
+
+    // XOR joins need no gateway, the sources point to the activity
+    for (uint32_t a = 0; a < n; a++) {
+        uint32_t cnt = in_counts[a + 1] - in_counts[a];
+        if (cnt < 2) continue;
+
+        Gateway_Kind kind = discover_gateway(graph, &in_sources[in_counts[a]], cnt);
+        if (kind == GATEWAY_XOR) continue;
+
+        uint32_t join = discover_node(graph, NODE_GATEWAY, a, graph->lanes[a]);
+        Discover_Node *g = &graph->nodes[join];
+        g->gateway = kind;
+        g->targets[g->targets_cnt++] = a;
+        discover_slug(&graph->ids, g->id, graph->nodes[a].id, strlen(graph->nodes[a].id), "join_");
+        graph->entries[a] = join;
+    }
+
+    for (uint32_t a = 0; a < n; a++) {
+        uint32_t first = graph->out_offsets[a], last = graph->out_offsets[a + 1];
+        if (first < last) discover_split(graph, a, &graph->edges[first], last - first, graph->counts[a]);
+    }
+
+    free(in_counts);
+    free(in_sources);
+}
+
+// Columns by breadth-first order from the starter, then from whatever
+// only loops reach
+void discover_rank(Discover_Graph *graph) {
+    size_t n = graph->nodes_cnt;
+    uint32_t *queue = malloc(sizeof(uint32_t) * n);
+    bool *seen = calloc(n, sizeof(bool));
+    assert(queue != NULL && seen != NULL && "Cannot allocate the ranks");
+
+    size_t head = 0, len = 0;
+    uint32_t next = 0;
+    for (uint32_t root = 0; root < n; root++) {
+        if (seen[root]) continue;
+        seen[root] = true;
+        graph->nodes[root].rank = next;
+        queue[len++] = root;
+
+        while (head < len) {
+            Discover_Node *node = &graph->nodes[queue[head++]];
+            if (node->rank + 1 > next) next = node->rank + 1;
+            for (uint32_t i = 0; i < node->targets_cnt; i++) {
+                uint32_t t = node->targets[i];
+                if (seen[t]) continue;
+                seen[t] = true;
+                graph->nodes[t].rank = node->rank + 1;
+                queue[len++] = t;
+            }
+        }
+    }
+
+    free(queue);
+    free(seen);
+}
+
+/*
+ * Printing
+ */
+
+// The name as the .pcs can take it: unquoted, without single quotes and
+// cut at a character boundary
+void discover_print_name(FILE *out, const char *name, size_t len, bool escaped) {
+    char buf[DISCOVER_NAME + 1];
+    size_t n = escaped ? conform_unquote(name, len, buf, DISCOVER_NAME) : (len < DISCOVER_NAME ? len : DISCOVER_NAME);
+    if (!escaped) memcpy(buf, name, n);
+    if (n == DISCOVER_NAME) {
+        while (n > 0 && ((unsigned char) buf[n] & 0xc0) == 0x80) n--;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        fputc(buf[i] == '\'' ? '`' : buf[i] == '\n' ? ' ' : buf[i], out);
+    }
+}
+
+void discover_print_node(const Discover_Graph *graph, const char **lanes, const Discover_Node *node, const char *row, FILE *out) {
+    static const char *KINDS[] = { [NODE_STARTER] = "starter", [NODE_TASK] = "task", [NODE_GATEWAY] = "gateway", [NODE_END] = "end" };
+    static const char *GATEWAYS[] = { [GATEWAY_XOR] = "xor", [GATEWAY_AND] = "and", [GATEWAY_OR] = "or" };
+
+    fprintf(out, "<%s id='%s'", KINDS[node->kind], node->id);
+    if (node->kind == NODE_TASK) {
+        const Discover_Key *key = &graph->log->activities.keys[node->activity - 2];
+        fprintf(out, " name='");
+        discover_print_name(out, key->name, key->len, key->escaped);
+        fprintf(out, "'");
+    }
+    if (node->kind == NODE_GATEWAY) fprintf(out, " type='%s'", GATEWAYS[node->gateway]);
+
+    if (node->targets_cnt > 0) {
+        fprintf(out, " points='");
+        for (uint32_t i = 0; i < node->targets_cnt; i++) {
+            const Discover_Node *target = &graph->nodes[node->targets[i]];
+            if (i > 0) fputc(',', out);
+            if (target->lane != node->lane) fprintf(out, "%s.", lanes[target->lane]);
+            fprintf(out, "%s", target->id);
+        }
+        fprintf(out, "'");
+    }
+
+    if (node->kind == NODE_GATEWAY && node->gateway != GATEWAY_AND && node->targets_cnt > 1) {
+        fprintf(out, " weights='");
+        for (uint32_t i = 0; i < node->targets_cnt; i++) {
+            fprintf(out, "%s%.3g", i > 0 ? "," : "", node->weights[i]);
+        }
+        fprintf(out, "'");
+    }
+
+    if (row != NULL && node->kind != NODE_END) fprintf(out, " row='%s'", row);
+    fprintf(out, "/>\n");
+}
+
+int discover_compare_nodes(const void *a, const void *b) {
+    const Discover_Node *x = *(const Discover_Node **) a, *y = *(const Discover_Node **) b;
+    if (x->lane != y->lane) return x->lane < y->lane ? -1 : 1;
+    if (x->rank != y->rank) return x->rank < y->rank ? -1 : 1;
+    // the end takes the middle row of a column
+    return (x->kind == NODE_END) - (y->kind == NODE_END);
+}
+
+// A subprocess per lane, with a column per rank, as wide as the lane that
+// has the most nodes on it needs, so the columns line up between lanes
+void discover_print(const Discover_Graph *graph, const char *title, FILE *out) {
+    const Discover_Log *log = graph->log;
+    size_t lanes_cnt = log->resources.cnt;
+    size_t n = graph->nodes_cnt;
+
+    uint32_t ranks = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (graph->nodes[i].rank + 1 > ranks) ranks = graph->nodes[i].rank + 1;
+    }
+
+    uint32_t *counts = calloc((size_t) lanes_cnt * ranks, sizeof(uint32_t));
+    uint32_t *widths = calloc(ranks, sizeof(uint32_t));
+    uint32_t *first_rank = malloc(sizeof(uint32_t) * lanes_cnt);
+    const Discover_Node **sorted = malloc(sizeof(Discover_Node *) * n);
+    char (*ids)[DISCOVER_ID] = malloc(DISCOVER_ID * lanes_cnt);
+    const char **lanes = malloc(sizeof(char *) * lanes_cnt);
+    uint32_t *order = malloc(sizeof(uint32_t) * lanes_cnt);
+    assert(counts != NULL && widths != NULL && first_rank != NULL && sorted != NULL && ids != NULL && lanes != NULL
+           && order != NULL && "Cannot allocate the output");
+
+    for (size_t l = 0; l < lanes_cnt; l++) first_rank[l] = UINT32_MAX;
+    for (size_t i = 0; i < n; i++) {
+        const Discover_Node *node = &graph->nodes[i];
+        uint32_t count = ++counts[(size_t) node->lane * ranks + node->rank];
+        // columns take up to 3 nodes
+        if ((count + 2) / 3 > widths[node->rank]) widths[node->rank] = (count + 2) / 3;
+        if (node->rank < first_rank[node->lane]) first_rank[node->lane] = node->rank;
+        sorted[i] = node;
+    }
+    qsort(sorted, n, sizeof(Discover_Node *), discover_compare_nodes);
+
+    // lane ids, unique between themselves
+    Discover_Names taken;
+    discover_names_init(&taken);
+    for (size_t l = 0; l < lanes_cnt; l++) {
+        const Discover_Key *key = &log->resources.keys[l];
+        discover_slug(&taken, ids[l], key->name, key->len, key->len == 0 ? "process" : "");
+        lanes[l] = ids[l];
+    }
+
+    // in the order their first node comes
+    size_t used = 0;
+    for (size_t l = 0; l < lanes_cnt; l++) {
+        if (first_rank[l] != UINT32_MAX) order[used++] = l;
+    }
+    for (size_t i = 1; i < used; i++) {
+        for (size_t j = i; j > 0 && first_rank[order[j]] < first_rank[order[j - 1]]; j--) {
+            uint32_t t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+
+    fprintf(out, "<process name='");
+    discover_print_name(out, title, strlen(title), false);
+    fprintf(out, "'>\n");
+
+    for (size_t u = 0; u < used; u++) {
+        uint32_t lane = order[u];
+        const Discover_Key *key = &log->resources.keys[lane];
+
+        fprintf(out, "\n    <subprocess id='%s' name='", lanes[lane]);
+        if (key->len > 0) discover_print_name(out, key->name, key->len, key->escaped);
+        else discover_print_name(out, used == 1 ? title : "Unassigned", strlen(used == 1 ? title : "Unassigned"), false);
+        fprintf(out, "'>\n        <events>\n");
+
+        // nodes of the lane, by rank
+        size_t at = 0;
+        while (at < n && sorted[at]->lane != lane) at++;
+
+        uint32_t skip = 0;
+        for (uint32_t r = 0; r < ranks; r++) {
+            uint32_t cnt = counts[(size_t) lane * ranks + r];
+            uint32_t width = widths[r];
+            if (cnt == 0) {
+                skip += width;
+                continue;
+            }
+
+            if (skip == 1) fprintf(out, "            <col />\n");
+            else if (skip > 1) fprintf(out, "            <col num='%u' />\n", skip);
+            skip = 0;
+
+            // the end is last in its rank and takes the middle row
+            static const char *ROWS[2][2][3] = {
+                { { "up", "down", NULL }, { "up", "mid", "down" } },
+                { { "up", NULL, NULL }, { "up", "down", NULL } }
+            };
+            for (uint32_t done = 0; done < cnt; done += 3) {
+                uint32_t group = cnt - done < 3 ? cnt - done : 3;
+                if (group == 1) {
+                    fprintf(out, "            ");
+                    discover_print_node(graph, lanes, sorted[at++], NULL, out);
+                    continue;
+                }
+
+                bool has_end = sorted[at + group - 1]->kind == NODE_END;
+                fprintf(out, "            <col>\n");
+                for (uint32_t i = 0; i < group; i++) {
+                    fprintf(out, "                ");
+                    discover_print_node(graph, lanes, sorted[at++], ROWS[has_end][group == 3][i], out);
+                }
+                fprintf(out, "            </col>\n");
+            }
+            skip = width - (cnt + 2) / 3;
+        }
+
+        fprintf(out, "        </events>\n    </subprocess>\n");
+    }
+
+    fprintf(out, "\n</process>\n");
+
+    discover_names_free(&taken);
+    free(counts);
+    free(widths);
+    free(first_rank);
+    free(sorted);
+    free(ids);
+    free(lanes);
+    free(order);
+}
+
+/*
+ * Running
+ */
+
+// Prints the process found in the log at `path` as a .pcs file to `out`,
+// and what it took to stderr
+int discover(const char *path, size_t threads, double filter, FILE *out) {
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? cores : 1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "error: cannot read the log %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return EXIT_FAILURE;
+    }
+
+    const char *data = "";
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "error: cannot map the log %s: %s\n", path, strerror(errno));
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    double start = conform_now();
+    const char *end = data + st.st_size;
+    Conform_Format format = conform_format(data, end);
+
+    // parts end at a line break, quoted fields with one in them may be cut
+    Discover_Part *parts = calloc(threads, sizeof(Discover_Part));
+    assert(parts != NULL && "Cannot allocate the parts");
+    const char *at = format.data;
+    for (size_t i = 0; i < threads; i++) {
+        Discover_Part *part = &parts[i];
+        part->format = &format;
+        part->begin = at;
+        if (i + 1 < threads) {
+            const char *cut = at + (end - at) / (threads - i);
+            const char *eol = cut < end ? memchr(cut, '\n', end - cut) : NULL;
+            at = eol != NULL ? eol + 1 : end;
+        } else {
+            at = end;
+        }
+        part->end = at;
+
+        discover_names_init(&part->activities);
+        discover_names_init(&part->resources);
+        discover_pairs_init(&part->follows, 1024);
+        discover_pairs_init(&part->performed, 1024);
+        discover_cases_init(&part->cases, 1024);
+
+        if (pthread_create(&part->thread, NULL, discover_worker, part) != 0) {
+            fprintf(stderr, "error: cannot create discovery thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    static Discover_Log log = {0};
+    discover_names_init(&log.activities);
+    discover_names_init(&log.resources);
+    discover_pairs_init(&log.follows, 1024);
+    discover_pairs_init(&log.performed, 1024);
+    Discover_Cases cases;
+    discover_cases_init(&cases, 1024);
+
+    // in order, so the cases go on from one part to the next
+    for (size_t i = 0; i < threads; i++) {
+        Discover_Part *part = &parts[i];
+        pthread_join(part->thread, NULL);
+        discover_merge(&log, part, &cases);
+
+        discover_names_free(&part->activities);
+        discover_names_free(&part->resources);
+        free(part->follows.slots);
+        free(part->performed.slots);
+        free(part->cases.slots);
+    }
+    free(parts);
+
+    for (size_t i = 0; i <= cases.mask; i++) {
+        const Discover_Case *c = &cases.slots[i];
+        if (c->id == NULL) continue;
+        discover_count(&log.follows, DISCOVER_START, c->first, 1);
+        discover_count(&log.follows, c->last, DISCOVER_END, 1);
+    }
+    log.cases = cases.cnt;
+    free(cases.slots);
+
+    if (log.activities.cnt == 0) {
+        fprintf(stderr, "error: no events in the log %s\n", path);
+        if (st.st_size > 0) munmap((void *) data, st.st_size);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if (log.resources.cnt == 0) discover_intern(&log.resources, discover_key("", 0, false));
+
+    static Discover_Graph graph = {0};
+    graph.log = &log;
+    graph.activities_cnt = log.activities.cnt + 2;
+    graph.counts = calloc(graph.activities_cnt, sizeof(uint64_t));
+    graph.lanes = calloc(graph.activities_cnt, sizeof(uint32_t));
+    uint64_t *most = calloc(graph.activities_cnt, sizeof(uint64_t));
+    assert(graph.counts != NULL && graph.lanes != NULL && most != NULL && "Cannot allocate the graph");
+
+    graph.counts[DISCOVER_START] = graph.counts[DISCOVER_END] = log.cases;
+    for (size_t i = 0; i <= log.performed.mask; i++) {
+        const Discover_Pair *pair = &log.performed.slots[i];
+        if (pair->key == UINT64_MAX) continue;
+
+        uint32_t activity = pair->key >> 32, resource = pair->key & UINT32_MAX;
+        graph.counts[activity] += pair->count;
+        if (pair->count > most[activity] || (pair->count == most[activity] && resource < graph.lanes[activity])) {
+            most[activity] = pair->count;
+            graph.lanes[activity] = resource;
+        }
+    }
+    free(most);
+
+    discover_filter(&graph, filter);
+
+    // the starter goes with the first activity, the end with the last
+    if (graph.out_offsets[DISCOVER_START + 1] > graph.out_offsets[DISCOVER_START]) {
+        graph.lanes[DISCOVER_START] = graph.lanes[graph.edges[graph.out_offsets[DISCOVER_START]].to];
+    }
+    uint64_t best_end = 0;
+    for (size_t i = 0; i < graph.edges_cnt; i++) {
+        const Discover_Edge *edge = &graph.edges[i];
+        if (edge->to == DISCOVER_END && edge->count > best_end) {
+            best_end = edge->count;
+            graph.lanes[DISCOVER_END] = graph.lanes[edge->from];
+        }
+    }
+
+    discover_build(&graph);
+    discover_rank(&graph);
+
+    // the name of the log, without its directory and extension
+    char title[DISCOVER_NAME];
+    const char *base = strrchr(path, '/');
+    snprintf(title, sizeof(title), "%s", base != NULL ? base + 1 : path);
+    char *dot = strrchr(title, '.');
+    if (dot != NULL && dot != title) *dot = '\0';
+
+    discover_print(&graph, title, out);
+    double elapsed = conform_now() - start;
+
+    fprintf(stderr, "Discovered %zu activities and %zu of %zu pairs from %lu events of %lu cases in %.2fs (%.1fM events/s) on %zu threads\n",
+            log.activities.cnt, graph.edges_cnt, log.follows.cnt, log.events, log.cases, elapsed,
+            elapsed > 0 ? log.events / elapsed / 1e6 : 0, threads);
+
+    discover_names_free(&graph.ids);
+    free(graph.counts);
+    free(graph.lanes);
+    free(graph.edges);
+    free(graph.out_offsets);
+    free(graph.nodes);
+    free(graph.entries);
+    discover_names_free(&log.activities);
+    discover_names_free(&log.resources);
+    free(log.follows.slots);
+    free(log.performed.slots);
+    if (st.st_size > 0) munmap((void *) data, st.st_size);
+    close(fd);
+    return EXIT_SUCCESS;
+}
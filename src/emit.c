@@ -0,0 +1,336 @@
+/*******************************************************************\
+| Section: C Generation                                             |
+| Writes a Process_Model as a standalone C translation unit that    |
+| needs nothing from this repository; defining <MACRO>_HEADER_ONLY  |
+| before including it keeps only the declarations.                  |
+| Every node becomes a label of one function and every edge a goto  |
+| to a constant label, so running an instance interprets nothing.   |
+| Parking works like the Engine: the instance keeps its node and is |
+| resumed through a switch to the label right after the work of     |
+| that node.                                                        |
+\*******************************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+
+FILE *EMIT_OUT;
+
+#define FEMIT(fmt, ...) fprintf(EMIT_OUT, fmt, __VA_ARGS__)
+#define EMIT(line) fprintf(EMIT_OUT, line)
+
+#define EMIT_MAX_IDENT 256
+// the macro, an identifier and the index that tells duplicates apart
+#define EMIT_MAX_NODE_IDENT (2 * EMIT_MAX_IDENT + 16)
+
+typedef enum {
+    IDENT_LOWER = 0,
+    IDENT_UPPER,
+    IDENT_TITLE   // Like_This, as the types of the repository
+} Ident_Case;
+
+// turns `text` into a C identifier, anything that is not alphanumeric
+// becomes an underscore
+void emit_ident(char *dest, const char *text, Ident_Case ident_case) {
+    size_t i = 0;
+    if (isdigit((unsigned char) text[0])) dest[i++] = '_';
+
+    bool word_start = true;
+    for (; *text != '\0' && i < EMIT_MAX_IDENT - 1; text++) {
+        char c = isalnum((unsigned char) *text) ? *text : '_';
+        switch (ident_case) {
+            case IDENT_LOWER: c = tolower((unsigned char) c); break;
+            case IDENT_UPPER: c = toupper((unsigned char) c); break;
+            case IDENT_TITLE: c = word_start ? toupper((unsigned char) c) : tolower((unsigned char) c); break;
+        }
+
+        word_start = c == '_';
+        dest[i++] = c;
+    }
+
+    dest[i] = '\0';
+}
+
+typedef struct {
+    char prefix[EMIT_MAX_IDENT];  // pizza
+    char macro[EMIT_MAX_IDENT];   // PIZZA
+    char type[EMIT_MAX_IDENT];    // Pizza
+    char (*nodes)[EMIT_MAX_NODE_IDENT];
+} Emit_Names;
+
+char (*EMIT_SORT_NAMES)[EMIT_MAX_NODE_IDENT];
+
+int emit_compare_names(const void *a, const void *b) {
+    return strcmp(EMIT_SORT_NAMES[*(const uint32_t *) a], EMIT_SORT_NAMES[*(const uint32_t *) b]);
+}
+
+// Enum names of the nodes. Different events may end up with the same
+// identifier (`a.b_c` and `a_b.c`, or names that only differ past
+// EMIT_MAX_IDENT), those get their node index appended.
+void emit_node_names(const Process_Model *model, Emit_Names *names) {
+    size_t n = model->nodes_cnt;
+    names->nodes = malloc(EMIT_MAX_NODE_IDENT * n);
+    uint32_t *sorted = malloc(sizeof(uint32_t) * n);
+    assert(names->nodes != NULL && sorted != NULL && "Cannot allocate node names");
+
+    char buffer[EMIT_MAX_IDENT];
+    for (size_t i = 0; i < n; i++) {
+        emit_ident(buffer, model->nodes[i].name, IDENT_UPPER);
+        snprintf(names->nodes[i], EMIT_MAX_NODE_IDENT, "%s_%s", names->macro, buffer);
+        sorted[i] = i;
+    }
+
+    EMIT_SORT_NAMES = names->nodes;
+    qsort(sorted, n, sizeof(uint32_t), emit_compare_names);
+    for (size_t i = 1; i < n; i++) {
+        if (strcmp(names->nodes[sorted[i - 1]], names->nodes[sorted[i]]) != 0) continue;
+
+        // the first of a run of duplicates keeps its name
+        size_t len = strlen(names->nodes[sorted[i]]);
+        snprintf(names->nodes[sorted[i]] + len, EMIT_MAX_NODE_IDENT - len, "_%u", sorted[i]);
+    }
+
+    free(sorted);
+}
+
+const char *emit_node_type(size_t nodes_cnt) {
+    if (nodes_cnt <= UINT8_MAX) return "uint8_t";
+    if (nodes_cnt <= UINT16_MAX) return "uint16_t";
+    return "uint32_t";
+}
+
+void emit_string(const char *text) {
+    EMIT("\"");
+    for (; *text != '\0'; text++) {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\') FEMIT("\\%c", c);
+        else if (c < ' ') FEMIT("\\%03o", c);
+        else FEMIT("%c", c);
+    }
+    EMIT("\"");
+}
+
+// rest of a // comment, control characters would end it early
+void emit_comment(const char *text) {
+    for (; *text != '\0'; text++) {
+        FEMIT("%c", (unsigned char) *text < ' ' ? ' ' : *text);
+    }
+    EMIT("\n");
+}
+
+void emit_declarations(const Process_Model *model, const Emit_Names *names) {
+    const char *p = names->prefix, *m = names->macro, *t = names->type;
+
+    FEMIT("#ifndef %s_H\n", m);
+    FEMIT("#define %s_H\n\n", m);
+    EMIT("#include <stdbool.h>\n");
+    EMIT("#include <stdint.h>\n\n");
+
+    FEMIT("#define %s_NODES_CNT %zu\n\n", m, model->nodes_cnt);
+
+    EMIT("typedef enum {\n");
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        FEMIT("    %s = %zu,\n", names->nodes[i], i);
+    }
+    FEMIT("} %s_Node;\n\n", t);
+
+    EMIT("typedef struct {\n");
+    FEMIT("    %s node;\n", emit_node_type(model->nodes_cnt));
+    FEMIT("} %s_Instance;\n\n", t);
+
+    EMIT("typedef enum {\n");
+    FEMIT("    %s_PARKED = 0,  // waiting for %s_complete on a task, wait or mail\n", m, p);
+    FEMIT("    %s_ENDED\n", m);
+    FEMIT("} %s_Status;\n\n", t);
+
+    EMIT("typedef struct {\n");
+    FEMIT("    bool (*on_task)(%s_Instance *instance, %s_Node node, void *user);\n", t, t);
+    FEMIT("    bool (*on_wait)(%s_Instance *instance, %s_Node node, void *user);\n", t, t);
+    FEMIT("    bool (*on_mail)(%s_Instance *instance, %s_Node node, void *user);\n", t, t);
+    FEMIT("    uint32_t (*on_branch)(%s_Instance *instance, %s_Node node, void *user);\n", t, t);
+    FEMIT("    void (*on_end)(%s_Instance *instance, %s_Node node, void *user);\n", t, t);
+    EMIT("    void *user;\n");
+    FEMIT("} %s_Callbacks;\n\n", t);
+
+    FEMIT("extern const char *const %s_node_names[%s_NODES_CNT];\n\n", p, m);
+
+    FEMIT("%s_Status %s_start(%s_Instance *instance, %s_Node starter, const %s_Callbacks *cb);\n", t, p, t, t, t);
+    FEMIT("%s_Status %s_complete(%s_Instance *instance, const %s_Callbacks *cb);\n\n", t, p, t, t);
+
+    FEMIT("#endif // %s_H\n\n", m);
+}
+
+// Ends the instance on `node`, as the Engine does when there is nowhere to go
+void emit_end(const Emit_Names *names, uint32_t node) {
+    FEMIT("    if (cb->on_end) cb->on_end(instance, %s, cb->user);\n", names->nodes[node]);
+    FEMIT("    return %s_ENDED;\n", names->macro);
+}
+
+void emit_execute(const Process_Model *model, const Analysis *a, const Emit_Names *names) {
+    const char *m = names->macro, *t = names->type;
+    size_t n = model->nodes_cnt;
+
+    // nodes reached from a starter, in topological order so that most
+    // edges fall through to the next label
+    uint32_t *order = malloc(sizeof(uint32_t) * n);
+    bool *labeled = calloc(n, sizeof(bool));
+    assert(order != NULL && labeled != NULL && "Cannot allocate code generation");
+
+    size_t order_cnt = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (a->origin[a->order[k]] != ENGINE_INVALID_ID) order[order_cnt++] = a->order[k];
+    }
+
+    for (size_t k = 0; k < order_cnt; k++) {
+        const Model_Node *node = &model->nodes[order[k]];
+        if (node->kind == NODE_STARTER) labeled[order[k]] = true;
+        if (node->kind == NODE_END) continue;
+
+        for (uint32_t i = 0; i < model_successors(node); i++) {
+            bool falls = node->kind != NODE_GATEWAY && k + 1 < order_cnt && order[k + 1] == node->targets[i];
+            if (!falls) labeled[node->targets[i]] = true;
+        }
+    }
+
+    FEMIT("static %s_Status %s_execute(%s_Instance *instance, const %s_Callbacks *cb, bool resume) {\n", t, names->prefix, t, t);
+    EMIT("    if (resume) {\n");
+    EMIT("        switch (instance->node) {\n");
+    for (size_t k = 0; k < order_cnt; k++) {
+        Node_Kind kind = model->nodes[order[k]].kind;
+        if (kind == NODE_TASK || kind == NODE_WAIT || kind == NODE_MAIL) {
+            FEMIT("            case %s: goto leave_%u;\n", names->nodes[order[k]], order[k]);
+        }
+    }
+    FEMIT("            default: return %s_ENDED;\n", m);
+    EMIT("        }\n");
+    EMIT("    }\n\n");
+
+    EMIT("    switch (instance->node) {\n");
+    for (size_t k = 0; k < order_cnt; k++) {
+        if (model->nodes[order[k]].kind == NODE_STARTER) {
+            FEMIT("        case %s: goto node_%u;\n", names->nodes[order[k]], order[k]);
+        }
+    }
+    FEMIT("        default: return %s_ENDED;\n", m);
+    EMIT("    }\n");
+
+    for (size_t k = 0; k < order_cnt; k++) {
+        uint32_t v = order[k];
+        const Model_Node *node = &model->nodes[v];
+        const char *name = names->nodes[v];
+        uint32_t degree = node->kind == NODE_END ? 0 : model_successors(node);
+
+        EMIT("\n");
+        if (labeled[v]) FEMIT("node_%u: ", v);
+        EMIT("// ");
+        emit_comment(node->name);
+
+        switch (node->kind) {
+            case NODE_STARTER: break;
+
+            case NODE_TASK:
+            case NODE_WAIT:
+            case NODE_MAIL: {
+                const char *hook = node->kind == NODE_TASK ? "on_task" : node->kind == NODE_WAIT ? "on_wait" : "on_mail";
+                FEMIT("    instance->node = %s;\n", name);
+                FEMIT("    if (cb->%s && !cb->%s(instance, %s, cb->user)) return %s_PARKED;\n", hook, hook, name, m);
+                FEMIT("leave_%u:\n", v);
+            } break;
+
+            case NODE_GATEWAY: {
+                FEMIT("    instance->node = %s;\n", name);
+                FEMIT("    switch (cb->on_branch ? cb->on_branch(instance, %s, cb->user) : 0) {\n", name);
+                for (uint32_t i = 0; i < degree; i++) {
+                    FEMIT("        case %u: goto node_%u;\n", i, node->targets[i]);
+                }
+                EMIT("    }\n");
+                emit_end(names, v);
+            } continue;
+
+            case NODE_END: {
+                FEMIT("    instance->node = %s;\n", name);
+                emit_end(names, v);
+            } continue;
+        }
+
+        if (degree == 0) {
+            if (node->kind == NODE_STARTER) FEMIT("    instance->node = %s;\n", name);
+            emit_end(names, v);
+        } else if (k + 1 >= order_cnt || order[k + 1] != node->targets[0]) {
+            FEMIT("    goto node_%u;\n", node->targets[0]);
+        }
+    }
+
+    EMIT("}\n\n");
+
+    free(order);
+    free(labeled);
+}
+
+// Returns false for models with AND or OR gateways, the state machine only
+// has one token per instance
+bool emit_c(const Process_Model *model, const char *title, const char *file_path, FILE *out) {
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        const Model_Node *node = &model->nodes[i];
+        if (node->kind == NODE_GATEWAY && node->gateway != GATEWAY_XOR) {
+            fprintf(stderr, "error: `%s` is a parallel gateway, --emit-c only supports xor gateways\n", node->name);
+            return false;
+        }
+    }
+
+    EMIT_OUT = out;
+
+    Emit_Names names = {0};
+    const char *base = strrchr(file_path, '/');
+    base = base ? base + 1 : file_path;
+
+    char stem[EMIT_MAX_IDENT];
+    snprintf(stem, sizeof(stem), "%s", base);
+    char *dot = strrchr(stem, '.');
+    if (dot && dot != stem) *dot = '\0';
+
+    emit_ident(names.prefix, stem, IDENT_LOWER);
+    emit_ident(names.macro, stem, IDENT_UPPER);
+    emit_ident(names.type, stem, IDENT_TITLE);
+    emit_node_names(model, &names);
+
+    static Analysis analysis = {0};
+    analyze(model, &analysis);
+
+    const char *p = names.prefix, *m = names.macro, *t = names.type;
+
+    FEMIT("// Generated by `bpmn --emit-c %s`, do not edit.\n", file_path);
+    EMIT("// Process: ");
+    emit_comment(title);
+    FEMIT("// Define %s_HEADER_ONLY before including this file to get only the declarations.\n\n", m);
+
+    emit_declarations(model, &names);
+
+    FEMIT("#ifndef %s_HEADER_ONLY\n\n", m);
+
+    FEMIT("const char *const %s_node_names[%s_NODES_CNT] = {\n", p, m);
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        EMIT("    ");
+        emit_string(model->nodes[i].name);
+        EMIT(",\n");
+    }
+    EMIT("};\n\n");
+
+    emit_execute(model, &analysis, &names);
+
+    EMIT("// Runs a new instance from `starter` until it parks or ends\n");
+    FEMIT("%s_Status %s_start(%s_Instance *instance, %s_Node starter, const %s_Callbacks *cb) {\n", t, p, t, t, t);
+    EMIT("    instance->node = starter;\n");
+    FEMIT("    return %s_execute(instance, cb, false);\n", p);
+    EMIT("}\n\n");
+
+    EMIT("// Resumes an instance parked on a task, wait or mail\n");
+    FEMIT("%s_Status %s_complete(%s_Instance *instance, const %s_Callbacks *cb) {\n", t, p, t, t);
+    FEMIT("    return %s_execute(instance, cb, true);\n", p);
+    EMIT("}\n\n");
+
+    FEMIT("#endif // %s_HEADER_ONLY\n", m);
+
+    analysis_free(&analysis);
+    free(names.nodes);
+    return true;
+}
@@ -0,0 +1,1737 @@
+/*******************************************************************\
+| Section: Execution Engine                                         |
+| Runs process instances over a resolved model by moving tokens     |
+| through its events. It only depends on libc, POSIX file I/O,      |
+| timer.c, mailbox.c, wal.c and histogram.c, so it can be included  |
+| by other programs that want to execute .pcs models.               |
+\*******************************************************************/
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define MODEL_MAX_TARGETS 3
+#define ENGINE_INVALID_ID UINT32_MAX
+
+typedef enum {
+    NODE_STARTER = 0,
+    NODE_TASK,
+    NODE_GATEWAY,
+    NODE_WAIT,
+    NODE_MAIL,
+    NODE_END
+} Node_Kind;
+
+// Optional timing of a node, in seconds. For tasks, waits and mails it is
+// how long the token stays there; for starters, the time between two
+// arrivals of new instances.
+typedef enum {
+    DIST_NONE = 0,
+    DIST_CONST,      // a
+    DIST_EXP,        // mean a
+    DIST_UNIFORM,    // [a, b)
+    DIST_NORMAL,     // mean a, standard deviation b, truncated at 0
+    DIST_TRIANGULAR  // min a, mode b, max c
+} Distribution_Kind;
+
+typedef struct {
+    Distribution_Kind kind;
+    double a, b, c;
+} Distribution;
+
+double distribution_mean(Distribution dist) {
+    switch (dist.kind) {
+        case DIST_NONE:       return 0;
+        case DIST_CONST:      return dist.a;
+        case DIST_EXP:        return dist.a;
+        case DIST_UNIFORM:    return (dist.a + dist.b) / 2;
+        case DIST_NORMAL:     return dist.a;
+        case DIST_TRIANGULAR: return (dist.a + dist.b + dist.c) / 3;
+    }
+
+    return 0;
+}
+
+// A gateway with more than one incoming edge also joins: XOR gateways let
+// every token through, AND and OR gateways wait for the tokens of the same
+// instance that are still on their way.
+typedef enum {
+    GATEWAY_XOR = 0,  // one target, picked by on_branch
+    GATEWAY_AND,      // every target
+    GATEWAY_OR        // the targets on_select picks, at least one
+} Gateway_Kind;
+
+typedef struct {
+    Node_Kind kind;
+    uint32_t lane;
+    Distribution duration;
+    uint32_t targets[MODEL_MAX_TARGETS];
+    uint32_t targets_cnt;
+    Gateway_Kind gateway;
+    // gateways only: for XOR the probability of each target, for OR the
+    // probability of each target being taken on its own
+    double weights[MODEL_MAX_TARGETS];
+    const char *name;
+} Model_Node;
+
+typedef struct {
+    const char *name;
+    uint32_t capacity;  // people working on the lane, 0 when unlimited
+} Model_Lane;
+
+typedef struct {
+    Model_Node *nodes;
+    size_t nodes_cnt;
+    size_t nodes_cap;
+
+    Model_Lane *lanes;
+    size_t lanes_cnt;
+    size_t lanes_cap;
+} Process_Model;
+
+uint32_t model_push_node(Process_Model *model, Model_Node node) {
+    if (model->nodes_cnt == model->nodes_cap) {
+        model->nodes_cap = model->nodes_cap == 0 ? 64 : model->nodes_cap * 2;
+        model->nodes = realloc(model->nodes, sizeof(Model_Node) * model->nodes_cap);
+        assert(model->nodes != NULL && "Cannot grow model nodes");
+    }
+
+    model->nodes[model->nodes_cnt] = node;
+    return model->nodes_cnt++;
+}
+
+uint32_t model_push_lane(Process_Model *model, Model_Lane lane) {
+    if (model->lanes_cnt == model->lanes_cap) {
+        model->lanes_cap = model->lanes_cap == 0 ? 8 : model->lanes_cap * 2;
+        model->lanes = realloc(model->lanes, sizeof(Model_Lane) * model->lanes_cap);
+        assert(model->lanes != NULL && "Cannot grow model lanes");
+    }
+
+    model->lanes[model->lanes_cnt] = lane;
+    return model->lanes_cnt++;
+}
+
+// Targets a token can actually follow: gateways pick one of them, every
+// other node always leaves through the first one
+uint32_t model_successors(const Model_Node *node) {
+    if (node->kind == NODE_GATEWAY) return node->targets_cnt;
+    return node->targets_cnt > 0 ? 1 : 0;
+}
+
+uint32_t model_find(const Process_Model *model, const char *name) {
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (strcmp(model->nodes[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return ENGINE_INVALID_ID;
+}
+
+void model_free(Process_Model *model) {
+    free(model->nodes);
+    free(model->lanes);
+    memset(model, 0, sizeof(*model));
+}
+
+/*
+ * The model lowered for the engine: one opcode per node and the edges in
+ * CSR form, so moving a token only touches a byte, two offsets and the
+ * target. Edges a token can never follow (all but the first one of a
+ * non-gateway node) are dropped, and starters become plain jumps.
+ *
+ * AND and OR gateways with more than one incoming edge are joins and get
+ * a slot in the join counters of every instance. An OR split is merged by
+ * the closest OR join that all of its targets reach, which learns from it
+ * how many tokens to wait for.
+ */
+
+typedef enum {
+    OP_GOTO = 0,  // follow the only edge
+    OP_BRANCH,    // on_branch picks the edge
+    OP_FORK,      // AND split, a token for every edge
+    OP_SELECT,    // OR split, a token for every edge on_select picks
+    OP_JOIN,      // waits for the other tokens, then goes on as `then`
+    OP_TASK,
+    OP_WAIT,
+    OP_MAIL,
+    OP_END        // end events and starters without edges
+} Opcode;
+
+typedef struct {
+    uint8_t *ops;
+    uint32_t *offsets;  // edges of node i are edges[offsets[i]..offsets[i + 1])
+    uint32_t *edges;
+    size_t nodes_cnt;
+    size_t edges_cnt;
+
+    bool parallel;     // there are AND or OR gateways, instances may have several tokens
+    uint32_t *joins;   // per node, its join slot or ENGINE_INVALID_ID
+    uint32_t *merges;  // per node, the join slot that merges an OR split or ENGINE_INVALID_ID
+    uint32_t *arity;   // per join slot, the incoming edges of an AND join, 0 for OR joins
+    uint8_t *then;     // per join slot, the opcode of the split part of the gateway
+    size_t joins_cnt;
+} Program;
+
+Opcode program_split(const Model_Node *node) {
+    switch (node->gateway) {
+        case GATEWAY_XOR: return OP_BRANCH;
+        case GATEWAY_AND: return OP_FORK;
+        case GATEWAY_OR:  return OP_SELECT;
+    }
+
+    return OP_BRANCH;
+}
+
+Opcode program_opcode(const Model_Node *node, uint32_t degree) {
+    switch (node->kind) {
+        case NODE_STARTER: return degree > 0 ? OP_GOTO : OP_END;
+        case NODE_GATEWAY: return program_split(node);
+        case NODE_TASK:    return OP_TASK;
+        case NODE_WAIT:    return OP_WAIT;
+        case NODE_MAIL:    return OP_MAIL;
+        case NODE_END:     return OP_END;
+    }
+
+    return OP_END;
+}
+
+typedef struct {
+    uint8_t *reached;  // bit i is set when target i of the split reaches the node
+    uint32_t *far;     // longest of the distances from those targets
+    uint32_t *hops;    // distance from the target being searched
+    uint32_t *queue;
+} Program_Scratch;
+
+// Closest OR join reached by every target of the OR split `node`, by the
+// longest of the distances from each target. Breadth-first from each one.
+uint32_t program_merge(const Program *program, uint32_t node, Program_Scratch *scratch) {
+    size_t n = program->nodes_cnt;
+    uint32_t from = program->offsets[node], to = program->offsets[node + 1];
+    memset(scratch->reached, 0, n);
+    memset(scratch->far, 0, sizeof(uint32_t) * n);
+
+    for (uint32_t e = from; e < to; e++) {
+        uint8_t bit = 1 << (e - from);
+        size_t head = 0, len = 0;
+
+        uint32_t start = program->edges[e];
+        scratch->reached[start] |= bit;
+        scratch->hops[start] = 0;
+        scratch->queue[len++] = start;
+
+        while (head < len) {
+            uint32_t v = scratch->queue[head++];
+            if (scratch->hops[v] > scratch->far[v]) scratch->far[v] = scratch->hops[v];
+
+            for (uint32_t k = program->offsets[v]; k < program->offsets[v + 1]; k++) {
+                uint32_t t = program->edges[k];
+                if (scratch->reached[t] & bit) continue;
+
+                scratch->reached[t] |= bit;
+                scratch->hops[t] = scratch->hops[v] + 1;
+                scratch->queue[len++] = t;
+            }
+        }
+    }
+
+    uint8_t all = (1 << (to - from)) - 1;
+    uint32_t best = ENGINE_INVALID_ID, best_far = UINT32_MAX;
+    for (size_t v = 0; v < n; v++) {
+        uint32_t slot = program->joins[v];
+        if (slot == ENGINE_INVALID_ID || program->arity[slot] != 0) continue;
+
+        if (scratch->reached[v] == all && scratch->far[v] < best_far) {
+            best_far = scratch->far[v];
+            best = slot;
+        }
+    }
+
+    return best;
+}
+
+void program_compile_joins(const Process_Model *model, Program *program) {
+    size_t n = model->nodes_cnt;
+    uint32_t *incoming = calloc(n, sizeof(uint32_t));
+    program->joins = malloc(sizeof(uint32_t) * n);
+    program->merges = malloc(sizeof(uint32_t) * n);
+    assert(incoming != NULL && program->joins != NULL && program->merges != NULL && "Cannot allocate program");
+
+    for (size_t e = 0; e < program->edges_cnt; e++) {
+        incoming[program->edges[e]]++;
+    }
+
+    program->joins_cnt = 0;
+    for (size_t i = 0; i < n; i++) {
+        const Model_Node *node = &model->nodes[i];
+        program->joins[i] = ENGINE_INVALID_ID;
+        program->merges[i] = ENGINE_INVALID_ID;
+        if (node->kind == NODE_GATEWAY && node->gateway != GATEWAY_XOR && incoming[i] > 1) {
+            program->joins[i] = program->joins_cnt++;
+        }
+    }
+
+    program->arity = malloc(sizeof(uint32_t) * (program->joins_cnt + 1));
+    program->then = malloc(program->joins_cnt + 1);
+    assert(program->arity != NULL && program->then != NULL && "Cannot allocate program");
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t slot = program->joins[i];
+        if (slot == ENGINE_INVALID_ID) continue;
+
+        program->arity[slot] = model->nodes[i].gateway == GATEWAY_AND ? incoming[i] : 0;
+        program->then[slot] = program->ops[i];
+        program->ops[i] = OP_JOIN;
+    }
+
+    Program_Scratch scratch = {
+        .reached = malloc(n),
+        .far = malloc(sizeof(uint32_t) * n),
+        .hops = malloc(sizeof(uint32_t) * n),
+        .queue = malloc(sizeof(uint32_t) * n)
+    };
+    assert(scratch.reached != NULL && scratch.far != NULL && scratch.hops != NULL && scratch.queue != NULL
+           && "Cannot allocate program");
+
+    for (size_t i = 0; i < n; i++) {
+        const Model_Node *node = &model->nodes[i];
+        if (node->kind != NODE_GATEWAY || node->gateway != GATEWAY_OR) continue;
+        if (program->offsets[i + 1] - program->offsets[i] < 2) continue;
+
+        program->merges[i] = program_merge(program, i, &scratch);
+    }
+
+    free(scratch.reached);
+    free(scratch.far);
+    free(scratch.hops);
+    free(scratch.queue);
+    free(incoming);
+}
+
+void program_compile(const Process_Model *model, Program *program) {
+    size_t n = model->nodes_cnt;
+    memset(program, 0, sizeof(*program));
+    program->nodes_cnt = n;
+
+    for (size_t i = 0; i < n; i++) {
+        if (model->nodes[i].kind != NODE_END) program->edges_cnt += model_successors(&model->nodes[i]);
+    }
+
+    program->ops = malloc(n + 1);
+    program->offsets = malloc(sizeof(uint32_t) * (n + 1));
+    program->edges = malloc(sizeof(uint32_t) * (program->edges_cnt + 1));
+    assert(program->ops != NULL && program->offsets != NULL && program->edges != NULL && "Cannot allocate program");
+
+    uint32_t edge = 0;
+    for (size_t i = 0; i < n; i++) {
+        const Model_Node *node = &model->nodes[i];
+        uint32_t degree = node->kind == NODE_END ? 0 : model_successors(node);
+
+        program->ops[i] = program_opcode(node, degree);
+        program->offsets[i] = edge;
+        for (uint32_t j = 0; j < degree; j++) {
+            program->edges[edge++] = node->targets[j];
+        }
+    }
+
+    program->offsets[n] = edge;
+
+    for (size_t i = 0; i < n; i++) {
+        if (model->nodes[i].kind == NODE_GATEWAY && model->nodes[i].gateway != GATEWAY_XOR) {
+            program->parallel = true;
+        }
+    }
+
+    if (program->parallel) program_compile_joins(model, program);
+}
+
+void program_free(Program *program) {
+    free(program->ops);
+    free(program->offsets);
+    free(program->edges);
+    free(program->joins);
+    free(program->merges);
+    free(program->arity);
+    free(program->then);
+    memset(program, 0, sizeof(*program));
+}
+
+size_t program_size(const Program *program) {
+    size_t size = program->nodes_cnt + sizeof(uint32_t) * (program->nodes_cnt + 1 + program->edges_cnt);
+    if (program->parallel) size += sizeof(uint32_t) * 2 * program->nodes_cnt + 5 * program->joins_cnt;
+    return size;
+}
+
+/*
+ * An instance is a single token: the node it sits on, a state and the tick
+ * it parked there. They are stored column-wise, one array per field
+ * indexed by Instance_Id, plus a bitset of the slots that hold a token, so
+ * an instance costs 17 bytes plus a slot in the ready queue while it has
+ * work to do, and finding the instances on a node only reads the node
+ * column (see engine_find). Ids are reused, the generation tells apart the
+ * instances that had the same one.
+ *
+ * AND and OR gateways fork more tokens, each one in a slot of its own
+ * that points back to the instance it belongs to (its root). The root
+ * counts the live tokens and, for each join, the tokens that got there.
+ * Counters are atomic, so tokens of the same instance can fork, join and
+ * end on different workers without waiting for each other.
+ */
+
+typedef uint32_t Instance_Id;
+
+typedef enum {
+    INSTANCE_READY = 0,  // token can move, instance is in the ready queue
+    INSTANCE_PARKED,     // waiting for engine_complete on a task/wait/mail, or for its timer
+    INSTANCE_DONE,       // slot is free and can be reused by engine_start
+    INSTANCE_HELD        // the token of a root is gone, but other tokens of the instance are not
+} Instance_State;
+
+typedef struct Engine Engine;
+
+// Called when a token reaches a task, wait or mail event. Returns true if
+// the work is already done, or false to park the instance until
+// engine_complete is called for it. Must not call back into the engine.
+typedef bool (*Engine_Work_Fn)(Engine *engine, Instance_Id id, uint32_t node, void *user);
+
+// Called when a token reaches a gateway. Returns the index of the target
+// to follow.
+typedef uint32_t (*Engine_Branch_Fn)(Engine *engine, Instance_Id id, uint32_t node, void *user);
+
+// Called when a token reaches an AND or OR split. Returns the targets an
+// OR gateway follows as a bit mask, where 0 means all of them. AND
+// gateways follow all of them anyway.
+typedef uint32_t (*Engine_Select_Fn)(Engine *engine, Instance_Id id, uint32_t node, void *user);
+
+// Called when a token reaches a wait event, if set instead of on_wait.
+// Returns how many ticks the instance sleeps on the timer wheel of the
+// engine, 0 to move on right away.
+typedef uint32_t (*Engine_Delay_Fn)(Engine *engine, Instance_Id id, uint32_t node, void *user);
+
+// Called when a message is matched with the instance waiting for it on a
+// mail event, right before the token moves on.
+typedef void (*Engine_Message_Fn)(Engine *engine, Instance_Id id, uint32_t node, uint64_t payload, void *user);
+
+// Called when an instance reaches an end event, right before its slot is
+// released. With parallel gateways, when its last token does, and `id` is
+// the root.
+typedef void (*Engine_End_Fn)(Engine *engine, Instance_Id id, uint32_t node, void *user);
+
+// Called when a token reaches any node, before the callback of the node,
+// and with ENGINE_INVALID_ID as the node when it ends or a join absorbs
+// it. Meant for traces, stepping takes a slower copy of the loop when set.
+typedef void (*Engine_Move_Fn)(Engine *engine, Instance_Id id, uint32_t node, void *user);
+
+typedef struct {
+    Engine_Work_Fn on_task;
+    Engine_Work_Fn on_wait;
+    Engine_Work_Fn on_mail;
+    Engine_Delay_Fn on_delay;
+    Engine_Branch_Fn on_branch;
+    Engine_Select_Fn on_select;
+    Engine_Message_Fn on_message;
+    Engine_End_Fn on_end;
+    Engine_Move_Fn on_move;
+    void *user;
+} Engine_Callbacks;
+
+/*
+ * Metrics, only when engine_enable_metrics was called: for each node a
+ * histogram of the ticks tokens spent on it (working on a task, parked on
+ * a wait or mail event, or at a join from the first token that got there
+ * until the last one), and for each lane the tokens that left one of
+ * those events. Each thread stepping instances records into metrics of
+ * its own, which are only merged when read.
+ */
+
+typedef struct {
+    Histogram **nodes;  // allocated on the first sample of the node
+    uint64_t *lanes;    // indexed like the mailboxes, see engine_mailboxes_cnt
+    size_t nodes_cnt;
+    size_t lanes_cnt;
+} Engine_Metrics;
+
+void engine_metrics_init(Engine_Metrics *metrics, size_t nodes, size_t lanes) {
+    metrics->nodes = calloc(nodes, sizeof(Histogram *));
+    metrics->lanes = calloc(lanes, sizeof(uint64_t));
+    assert(metrics->nodes != NULL && metrics->lanes != NULL && "Cannot allocate metrics");
+    metrics->nodes_cnt = nodes;
+    metrics->lanes_cnt = lanes;
+}
+
+void engine_metrics_free(Engine_Metrics *metrics) {
+    for (size_t i = 0; i < metrics->nodes_cnt; i++) {
+        free(metrics->nodes[i]);
+    }
+
+    free(metrics->nodes);
+    free(metrics->lanes);
+    memset(metrics, 0, sizeof(*metrics));
+}
+
+Histogram *engine_metrics_node(Engine_Metrics *metrics, uint32_t node) {
+    if (metrics->nodes[node] == NULL) {
+        metrics->nodes[node] = malloc(sizeof(Histogram));
+        assert(metrics->nodes[node] != NULL && "Cannot allocate metrics");
+        histogram_init(metrics->nodes[node]);
+    }
+
+    return metrics->nodes[node];
+}
+
+// Adds `src` to `dst`, which is initialized if it was not yet
+void engine_metrics_merge(Engine_Metrics *dst, const Engine_Metrics *src) {
+    if (src->nodes == NULL) return;
+    if (dst->nodes == NULL) engine_metrics_init(dst, src->nodes_cnt, src->lanes_cnt);
+
+    for (size_t i = 0; i < src->nodes_cnt; i++) {
+        if (src->nodes[i] != NULL) histogram_merge(engine_metrics_node(dst, i), src->nodes[i]);
+    }
+
+    for (size_t i = 0; i < src->lanes_cnt; i++) {
+        dst->lanes[i] += src->lanes[i];
+    }
+}
+
+struct Engine {
+    const Process_Model *model;
+    Program program;
+    Engine_Callbacks callbacks;
+
+    // instance store, every column is sized instances_cap
+    uint32_t *nodes;        // node the token is on
+    uint8_t *states;        // Instance_State
+    uint32_t *generations;
+    uint64_t *since;        // tick of the timer wheel when it started or parked
+    uint64_t *live;         // bitset, the slot is not INSTANCE_DONE
+    size_t instances_cnt;
+    size_t instances_cap;
+
+    Instance_Id *free_ids;
+    size_t free_cnt;
+    size_t free_cap;
+
+    // tokens, only when the program is parallel, sized as instances
+    Instance_Id *roots;        // instance each slot belongs to
+    _Atomic uint32_t *tokens;  // per root, its live tokens
+    _Atomic uint32_t *arrived; // per root and join slot, tokens waiting there
+    _Atomic uint32_t *expected;// per root and join slot, tokens an OR join waits for
+    uint64_t *opened;          // per root and join slot, tick the first token got there
+
+    // ring buffer, capacity is always a power of two
+    Instance_Id *ready;
+    size_t ready_head;
+    size_t ready_len;
+    size_t ready_cap;
+
+    Timer_Wheel timers;
+
+    // message correlation, only when engine_enable_mail was called
+    Mail_Queue *mailboxes;  // one per lane, see engine_mailboxes_cnt
+    Mail_Table unmatched;
+    uint32_t mail_ttl;
+    uint64_t mail_delivered;
+    uint64_t mail_buffered;
+    uint64_t mail_expired;
+    uint64_t mail_overflow;  // early, with the unmatched table full
+    uint64_t mail_orphaned;  // for an instance that is gone
+
+    // durability, only when engine_enable_wal was called
+    Wal wal;
+    bool durable;
+    bool wal_failed;  // a commit did not make it to disk, engine_commit fails from then on
+    const char *snapshot_path;
+    size_t recovered;  // live instances found by engine_enable_wal
+
+    bool metering;  // see engine_enable_metrics
+    Engine_Metrics metrics;
+
+    size_t active;
+    uint64_t transitions;
+};
+
+void engine_init(Engine *engine, const Process_Model *model, Engine_Callbacks callbacks) {
+    memset(engine, 0, sizeof(*engine));
+    engine->model = model;
+    engine->callbacks = callbacks;
+    program_compile(model, &engine->program);
+    timer_init(&engine->timers, 0);
+}
+
+// events that are not in a subprocess get the last mailbox
+size_t engine_mailboxes_cnt(const Engine *engine) {
+    return engine->model->lanes_cnt + 1;
+}
+
+// Mail events wait for a message posted with engine_post, and only call
+// on_mail when it has not arrived yet. Each lane gets a queue of
+// `queue_cap` messages, and up to `table_cap` messages that arrive before
+// their instance are kept for `ttl` ticks of the timer wheel. Both
+// capacities are powers of two.
+void engine_enable_mail(Engine *engine, size_t queue_cap, size_t table_cap, uint32_t ttl) {
+    size_t lanes = engine_mailboxes_cnt(engine);
+    engine->mailboxes = malloc(sizeof(Mail_Queue) * lanes);
+    assert(engine->mailboxes != NULL && "Cannot allocate mailboxes");
+
+    for (size_t i = 0; i < lanes; i++) {
+        mail_queue_init(&engine->mailboxes[i], queue_cap);
+    }
+    mail_table_init(&engine->unmatched, table_cap);
+    engine->mail_ttl = ttl;
+}
+
+// Records how long tokens stay on each event and how many leave each lane,
+// see Engine_Metrics. Ticks are those of the timer wheel.
+void engine_enable_metrics(Engine *engine) {
+    engine_metrics_init(&engine->metrics, engine->model->nodes_cnt, engine_mailboxes_cnt(engine));
+    engine->metering = true;
+}
+
+void engine_free(Engine *engine) {
+    if (engine->mailboxes) {
+        size_t lanes = engine_mailboxes_cnt(engine);
+        for (size_t i = 0; i < lanes; i++) {
+            mail_queue_free(&engine->mailboxes[i]);
+        }
+        free(engine->mailboxes);
+        mail_table_free(&engine->unmatched);
+    }
+
+    if (engine->durable) wal_close(&engine->wal);
+
+    program_free(&engine->program);
+    timer_free(&engine->timers);
+    free(engine->nodes);
+    free(engine->states);
+    free(engine->generations);
+    free(engine->since);
+    free(engine->live);
+    free(engine->free_ids);
+    free(engine->ready);
+    free(engine->roots);
+    free(engine->tokens);
+    free(engine->arrived);
+    free(engine->expected);
+    free(engine->opened);
+    engine_metrics_free(&engine->metrics);
+    memset(engine, 0, sizeof(*engine));
+}
+
+void engine_push_ready(Engine *engine, Instance_Id id) {
+    if (engine->ready_len == engine->ready_cap) {
+        size_t cap = engine->ready_cap == 0 ? 1024 : engine->ready_cap * 2;
+        Instance_Id *ready = malloc(sizeof(Instance_Id) * cap);
+        assert(ready != NULL && "Cannot grow the ready queue");
+
+        for (size_t i = 0; i < engine->ready_len; i++) {
+            ready[i] = engine->ready[(engine->ready_head + i) & (engine->ready_cap - 1)];
+        }
+
+        free(engine->ready);
+        engine->ready = ready;
+        engine->ready_head = 0;
+        engine->ready_cap = cap;
+    }
+
+    engine->ready[(engine->ready_head + engine->ready_len) & (engine->ready_cap - 1)] = id;
+    engine->ready_len++;
+}
+
+Instance_Id engine_pop_ready(Engine *engine) {
+    Instance_Id id = engine->ready[engine->ready_head];
+    engine->ready_head = (engine->ready_head + 1) & (engine->ready_cap - 1);
+    engine->ready_len--;
+    return id;
+}
+
+// Doubles every column. A column that grew is kept even when a later one
+// fails, as realloc already moved it, and instances_cap only changes once
+// all of them did, so they are never shorter than it.
+bool engine_grow(Engine *engine) {
+    size_t cap = engine->instances_cap == 0 ? 1024 : engine->instances_cap * 2;
+
+    uint32_t *nodes = realloc(engine->nodes, sizeof(uint32_t) * cap);
+    if (nodes == NULL) return false;
+    engine->nodes = nodes;
+
+    uint8_t *states = realloc(engine->states, cap);
+    if (states == NULL) return false;
+    engine->states = states;
+
+    uint32_t *generations = realloc(engine->generations, sizeof(uint32_t) * cap);
+    if (generations == NULL) return false;
+    engine->generations = generations;
+
+    uint64_t *since = realloc(engine->since, sizeof(uint64_t) * cap);
+    if (since == NULL) return false;
+    engine->since = since;
+
+    uint64_t *live = realloc(engine->live, sizeof(uint64_t) * cap / 64);
+    if (live == NULL) return false;
+    memset(live + engine->instances_cap / 64, 0, sizeof(uint64_t) * (cap - engine->instances_cap) / 64);
+    engine->live = live;
+
+    if (engine->program.parallel) {
+        size_t joins = engine->program.joins_cnt;
+
+        Instance_Id *roots = realloc(engine->roots, sizeof(Instance_Id) * cap);
+        if (roots == NULL) return false;
+        engine->roots = roots;
+
+        _Atomic uint32_t *tokens = realloc(engine->tokens, sizeof(uint32_t) * cap);
+        if (tokens == NULL) return false;
+        engine->tokens = tokens;
+
+        _Atomic uint32_t *arrived = realloc(engine->arrived, sizeof(uint32_t) * (cap * joins + 1));
+        if (arrived == NULL) return false;
+        engine->arrived = arrived;
+
+        _Atomic uint32_t *expected = realloc(engine->expected, sizeof(uint32_t) * (cap * joins + 1));
+        if (expected == NULL) return false;
+        engine->expected = expected;
+
+        uint64_t *opened = realloc(engine->opened, sizeof(uint64_t) * (cap * joins + 1));
+        if (opened == NULL) return false;
+        engine->opened = opened;
+    }
+
+    engine->instances_cap = cap;
+    return true;
+}
+
+// Takes a free slot, READY on `node` and in the ready queue
+Instance_Id engine_alloc(Engine *engine, uint32_t node) {
+    Instance_Id id;
+    if (engine->free_cnt > 0) {
+        id = engine->free_ids[--engine->free_cnt];
+    } else {
+        if (engine->instances_cnt == engine->instances_cap && !engine_grow(engine)) {
+            return ENGINE_INVALID_ID;
+        }
+
+        id = engine->instances_cnt++;
+        engine->generations[id] = 0;
+    }
+
+    engine->nodes[id] = node;
+    engine->states[id] = INSTANCE_READY;
+    engine->since[id] = engine->timers.now;
+    engine->live[id / 64] |= 1ULL << (id % 64);
+    engine->active++;
+    engine_push_ready(engine, id);
+    return id;
+}
+
+// Logs the current value of slot `id`, or of join counter `slot` of the
+// root `id` for WAL_JOIN
+void engine_log(Engine *engine, Instance_Id id, Wal_Kind kind, uint32_t slot) {
+    Wal_Record record = { .kind = kind, .id = id };
+    if (kind == WAL_JOIN) {
+        size_t at = (size_t) id * engine->program.joins_cnt + slot;
+        record.node = slot;
+        record.generation = atomic_load_explicit(&engine->arrived[at], memory_order_relaxed);
+        record.root = atomic_load_explicit(&engine->expected[at], memory_order_relaxed);
+    } else {
+        record.state = engine->states[id];
+        record.node = engine->nodes[id];
+        record.generation = engine->generations[id];
+        record.root = engine->program.parallel ? engine->roots[id] : id;
+        record.since = engine->since[id];
+    }
+
+    if (!wal_append(&engine->wal, record)) engine->wal_failed = true;
+}
+
+// The token of a new instance is its root, alone and on no join yet
+void engine_init_root(Engine *engine, Instance_Id id) {
+    size_t joins = engine->program.joins_cnt;
+    engine->roots[id] = id;
+    atomic_init(&engine->tokens[id], 1);
+    for (size_t i = 0; i < joins; i++) {
+        atomic_init(&engine->arrived[id * joins + i], 0);
+        atomic_init(&engine->expected[id * joins + i], 0);
+    }
+}
+
+Instance_Id engine_start(Engine *engine, uint32_t starter) {
+    assert(starter < engine->model->nodes_cnt && "Invalid starter node");
+
+    Instance_Id id = engine_alloc(engine, starter);
+    if (id == ENGINE_INVALID_ID) return id;
+    if (engine->program.parallel) engine_init_root(engine, id);
+
+    if (engine->durable) engine_log(engine, id, WAL_START, 0);
+    return id;
+}
+
+// Slots taken at once for new instances: the top `reused` of the free
+// list, then fresh ones from `fresh`
+typedef struct {
+    size_t reused_at;  // in free_ids
+    size_t reused;
+    Instance_Id fresh;
+    size_t count;
+} Engine_Slots;
+
+// Takes the slots of `count` new instances in O(1), without filling or
+// queueing them, so that workers can do it in parallel with
+// engine_fill_starts. Returns false when the store cannot grow.
+bool engine_take_slots(Engine *engine, size_t count, Engine_Slots *slots) {
+    assert(!engine->durable && "Starts of a durable engine are ordered in the log");
+
+    size_t reused = count < engine->free_cnt ? count : engine->free_cnt;
+    while (engine->instances_cnt + count - reused > engine->instances_cap) {
+        if (!engine_grow(engine)) return false;
+    }
+
+    engine->free_cnt -= reused;
+    slots->reused_at = engine->free_cnt;
+    slots->reused = reused;
+    slots->fresh = (Instance_Id) engine->instances_cnt;
+    slots->count = count;
+
+    engine->instances_cnt += count - reused;
+    engine->active += count;
+    return true;
+}
+
+// Slot of the `i`th instance, in the order engine_alloc would give them.
+// Reused ids stay readable until slots are released again.
+static inline Instance_Id engine_slot_at(const Engine *engine, const Engine_Slots *slots, size_t i) {
+    if (i < slots->reused) return engine->free_ids[slots->reused_at + slots->reused - 1 - i];
+    return slots->fresh + (Instance_Id) (i - slots->reused);
+}
+
+// Fills the slots of instances `from` to `to` as engine_start would, but
+// for the log. Other threads fill other slots at the same time, so the
+// live bits of a word are set at once.
+void engine_fill_starts(Engine *engine, const Engine_Slots *slots, size_t from, size_t to, uint32_t starter) {
+    size_t word = SIZE_MAX;
+    uint64_t bits = 0;
+    for (size_t i = from; i < to; i++) {
+        Instance_Id id = engine_slot_at(engine, slots, i);
+        if (i >= slots->reused) engine->generations[id] = 0;
+        engine->nodes[id] = starter;
+        engine->states[id] = INSTANCE_READY;
+        engine->since[id] = engine->timers.now;
+        if (engine->program.parallel) engine_init_root(engine, id);
+
+        if (id / 64 != word) {
+            if (bits != 0) __atomic_fetch_or(&engine->live[word], bits, __ATOMIC_RELAXED);
+            word = id / 64;
+            bits = 0;
+        }
+        bits |= 1ULL << (id % 64);
+    }
+
+    if (bits != 0) __atomic_fetch_or(&engine->live[word], bits, __ATOMIC_RELAXED);
+}
+
+// A new token of the instance `root`, on `node`
+void engine_spawn(Engine *engine, Instance_Id root, uint32_t node) {
+    Instance_Id id = engine_alloc(engine, node);
+    assert(id != ENGINE_INVALID_ID && "Cannot allocate token");
+    engine->roots[id] = root;
+    if (engine->durable) engine_log(engine, id, WAL_SLOT, 0);
+}
+
+void engine_release(Engine *engine, Instance_Id id) {
+    if (engine->free_cnt == engine->free_cap) {
+        engine->free_cap = engine->instances_cap;
+        engine->free_ids = realloc(engine->free_ids, sizeof(Instance_Id) * engine->free_cap);
+        assert(engine->free_ids != NULL && "Cannot grow the free list");
+    }
+
+    engine->states[id] = INSTANCE_DONE;
+    engine->generations[id]++;
+    engine->live[id / 64] &= ~(1ULL << (id % 64));
+    if (engine->durable) engine_log(engine, id, WAL_SLOT, 0);
+    engine->free_ids[engine->free_cnt++] = id;
+    engine->active--;
+}
+
+// Moves the token through its `target` edge. Returns false when there is
+// nowhere to go, which ends the instance.
+bool engine_leave(Engine *engine, Instance_Id id, uint32_t target) {
+    const Program *program = &engine->program;
+    uint32_t edge = program->offsets[engine->nodes[id]] + target;
+    if (edge >= program->offsets[engine->nodes[id] + 1]) {
+        return false;
+    }
+
+    engine->nodes[id] = program->edges[edge];
+    engine->transitions++;
+    return true;
+}
+
+/*
+ * Effects of stepping an instance on state the engine shares between all
+ * of them: releasing a slot, inserting a timer and looking for a message.
+ * Workers stepping instances in parallel (pool.c) record them instead and
+ * the engine applies them afterwards, in engine_apply.
+ */
+
+typedef enum {
+    DEFER_END = 0,  // release the slot, on_end was already called
+    DEFER_SLEEP,    // insert the timer of a wait
+    DEFER_MAIL,     // look for the message of a mail event
+    DEFER_SPAWN,    // start a token forked from the root `id`, already counted
+    DEFER_LOG       // log the slot `id`, or its join counter arg - 1 when arg > 0
+} Defer_Kind;
+
+typedef struct {
+    Instance_Id id;
+    uint32_t kind;
+    uint32_t arg;  // ticks of a sleep, node of a spawn
+} Deferred;
+
+typedef struct {
+    Deferred *items;
+    size_t len;
+    size_t cap;
+    size_t ends;  // DEFER_END among the items, or released by engine_release_ends
+    uint64_t transitions;
+    Engine_Metrics metrics;  // of the worker, set up on its first sample
+} Engine_Deferred;
+
+void engine_defer(Engine_Deferred *deferred, Instance_Id id, Defer_Kind kind, uint32_t arg) {
+    if (deferred->len == deferred->cap) {
+        deferred->cap = deferred->cap == 0 ? 1024 : deferred->cap * 2;
+        deferred->items = realloc(deferred->items, sizeof(Deferred) * deferred->cap);
+        assert(deferred->items != NULL && "Cannot grow the deferred effects");
+    }
+
+    deferred->items[deferred->len++] = (Deferred) { .id = id, .kind = kind, .arg = arg };
+    if (kind == DEFER_END) deferred->ends++;
+}
+
+// Logs when the engine is durable, see engine_log. `join` is the join slot
+// + 1, or 0 to log the slot itself.
+void engine_log_with(Engine *engine, Instance_Id id, uint32_t join, Engine_Deferred *deferred) {
+    if (!engine->durable) return;
+
+    if (deferred) engine_defer(deferred, id, DEFER_LOG, join);
+    else engine_log(engine, id, join > 0 ? WAL_JOIN : WAL_SLOT, join - 1);
+}
+
+// A token left `node` after `ticks` there
+void engine_measure(Engine *engine, uint32_t node, uint64_t ticks, Engine_Deferred *deferred) {
+    Engine_Metrics *metrics = &engine->metrics;
+    if (deferred) {
+        metrics = &deferred->metrics;
+        if (metrics->nodes == NULL) engine_metrics_init(metrics, engine->metrics.nodes_cnt, engine->metrics.lanes_cnt);
+    }
+
+    histogram_record(engine_metrics_node(metrics, node), ticks);
+    metrics->lanes[engine->model->nodes[node].lane]++;
+}
+
+void engine_free_slot(Engine *engine, Instance_Id id, Engine_Deferred *deferred) {
+    if (deferred) engine_defer(deferred, id, DEFER_END, 0);
+    else engine_release(engine, id);
+}
+
+// A token reached an end, or was absorbed by a join. The instance ends with
+// its last token, and the slot of its root is held until then.
+void engine_end(Engine *engine, Instance_Id id, uint32_t node, Engine_Deferred *deferred) {
+    const Engine_Callbacks *cb = &engine->callbacks;
+    if (cb->on_move) cb->on_move(engine, id, ENGINE_INVALID_ID, cb->user);
+
+    Instance_Id root = id;
+    if (engine->program.parallel) {
+        root = engine->roots[id];
+        if (atomic_fetch_sub_explicit(&engine->tokens[root], 1, memory_order_acq_rel) > 1) {
+            if (id == root) {
+                engine->states[id] = INSTANCE_HELD;
+                engine_log_with(engine, id, 0, deferred);
+            } else {
+                engine_free_slot(engine, id, deferred);
+            }
+            return;
+        }
+
+        if (id != root) engine_free_slot(engine, id, deferred);
+    }
+
+    if (cb->on_end) cb->on_end(engine, root, node, cb->user);
+    engine_free_slot(engine, root, deferred);
+}
+
+// Sends a token down every target in `mask` but the first one, which is
+// left to the token that got to the split
+void engine_fork(Engine *engine, Instance_Id id, uint32_t node, uint32_t mask, Engine_Deferred *deferred) {
+    const Program *program = &engine->program;
+    Instance_Id root = engine->roots[id];
+    uint32_t forks = __builtin_popcount(mask) - 1;
+
+    // set before any of the tokens can get to the join
+    uint32_t merge = program->merges[node];
+    if (merge != ENGINE_INVALID_ID) {
+        atomic_store_explicit(&engine->expected[(size_t) root * program->joins_cnt + merge], forks + 1, memory_order_relaxed);
+        engine_log_with(engine, root, merge + 1, deferred);
+    }
+
+    if (forks == 0) return;
+    atomic_fetch_add_explicit(&engine->tokens[root], forks, memory_order_relaxed);
+    if (deferred) deferred->transitions += forks;
+    else engine->transitions += forks;
+
+    for (mask &= mask - 1; mask != 0; mask &= mask - 1) {
+        uint32_t target = program->edges[program->offsets[node] + __builtin_ctz(mask)];
+        if (deferred) engine_defer(deferred, root, DEFER_SPAWN, target);
+        else engine_spawn(engine, root, target);
+    }
+}
+
+// The split part of a gateway, returns the target the token follows
+uint32_t engine_split(Engine *engine, Instance_Id id, uint32_t node, Opcode op, Engine_Deferred *deferred) {
+    const Engine_Callbacks *cb = &engine->callbacks;
+    if (op == OP_BRANCH) {
+        return cb->on_branch ? cb->on_branch(engine, id, node, cb->user) : 0;
+    }
+
+    const Program *program = &engine->program;
+    uint32_t degree = program->offsets[node + 1] - program->offsets[node];
+    uint32_t mask = (1u << degree) - 1;
+    uint32_t selected = cb->on_select ? cb->on_select(engine, id, node, cb->user) & mask : 0;
+    if (op == OP_SELECT && selected != 0) mask = selected;
+    if (mask == 0) return 0;
+
+    engine_fork(engine, id, node, mask, deferred);
+    return __builtin_ctz(mask);
+}
+
+// Counts a token in at a join. Returns true for the last one expected,
+// which goes on, while the others are absorbed. OR joins that no split
+// told how many tokens to wait for let every token through.
+bool engine_join(Engine *engine, Instance_Id id, uint32_t node, Engine_Deferred *deferred) {
+    const Program *program = &engine->program;
+    uint32_t slot = program->joins[node];
+    Instance_Id root = engine->roots[id];
+    size_t at = (size_t) root * program->joins_cnt + slot;
+
+    uint32_t expected = program->arity[slot];
+    if (expected == 0) expected = atomic_load_explicit(&engine->expected[at], memory_order_relaxed);
+
+    uint32_t arrived = atomic_fetch_add_explicit(&engine->arrived[at], 1, memory_order_acq_rel) + 1;
+    if (engine->metering && arrived == 1) engine->opened[at] = engine->timers.now;
+    if (arrived >= expected) {
+        atomic_store_explicit(&engine->arrived[at], 0, memory_order_relaxed);
+        if (engine->metering) engine_measure(engine, node, engine->timers.now - engine->opened[at], deferred);
+    }
+
+    engine_log_with(engine, root, slot + 1, deferred);
+    return arrived >= expected;
+}
+
+// Takes the message an instance that just reached a mail event waits for,
+// if it already arrived
+bool engine_take_mail(Engine *engine, Instance_Id id, uint32_t node) {
+    Message key = { .instance = id, .generation = engine->generations[id], .node = node };
+    Message message;
+    if (!mail_table_take(&engine->unmatched, &key, &message)) return false;
+
+    const Engine_Callbacks *cb = &engine->callbacks;
+    if (cb->on_message) cb->on_message(engine, id, node, message.payload, cb->user);
+    engine->mail_delivered++;
+    return true;
+}
+
+static inline void engine_park(Engine *engine, Instance_Id id, Engine_Deferred *deferred) {
+    engine->states[id] = INSTANCE_PARKED;
+    engine->since[id] = engine->timers.now;
+    engine_log_with(engine, id, 0, deferred);
+}
+
+// Puts a parked instance to sleep for `ticks` on the timer wheel
+void engine_sleep(Engine *engine, Instance_Id id, uint32_t ticks) {
+    timer_reserve(&engine->timers, engine->instances_cap);
+    timer_insert(&engine->timers, id, ticks);
+}
+
+// Moves a ready instance until it parks or ends. Starters and gateways are
+// followed right away, without going back to the ready queue. The node
+// stays in a register and is only stored before calling back. With
+// `deferred`, the effects on the engine are only recorded there.
+static inline __attribute__((always_inline))
+void engine_step_with(Engine *engine, Instance_Id id, Engine_Deferred *deferred, bool observed) {
+    const Engine_Callbacks *cb = &engine->callbacks;
+    const uint8_t *ops = engine->program.ops;
+    const uint32_t *offsets = engine->program.offsets;
+    const uint32_t *edges = engine->program.edges;
+
+    uint32_t node = engine->nodes[id];
+    uint64_t transitions = 0;
+
+    for (;;) {
+        Engine_Work_Fn work = NULL;
+        Engine_Delay_Fn delay = NULL;
+        bool mail = false;
+        uint32_t target = 0;
+
+        if (observed && cb->on_move) cb->on_move(engine, id, node, cb->user);
+
+        Opcode op = ops[node];
+        switch (op) {
+            case OP_GOTO: {
+                node = edges[offsets[node]];
+                transitions++;
+            } continue;
+
+            case OP_BRANCH: {
+                engine->nodes[id] = node;
+                if (cb->on_branch) target = cb->on_branch(engine, id, node, cb->user);
+            } break;
+
+            case OP_JOIN: {
+                engine->nodes[id] = node;
+                if (!engine_join(engine, id, node, deferred)) {
+                    if (deferred) deferred->transitions += transitions;
+                    else engine->transitions += transitions;
+                    engine_end(engine, id, node, deferred);
+                    return;
+                }
+
+                target = engine_split(engine, id, node, engine->program.then[engine->program.joins[node]], deferred);
+            } break;
+
+            case OP_FORK:
+            case OP_SELECT: {
+                engine->nodes[id] = node;
+                target = engine_split(engine, id, node, op, deferred);
+            } break;
+
+            case OP_TASK: work = cb->on_task; break;
+            case OP_WAIT: {
+                if (cb->on_delay) delay = cb->on_delay;
+                else work = cb->on_wait;
+            } break;
+
+            case OP_MAIL: {
+                mail = engine->mailboxes != NULL;
+                work = cb->on_mail;
+            } break;
+            case OP_END: break;
+        }
+
+        engine->nodes[id] = node;
+        if (deferred) deferred->transitions += transitions;
+        else engine->transitions += transitions;
+        transitions = 0;
+
+        if (op == OP_END) {
+            engine_end(engine, id, node, deferred);
+            return;
+        }
+
+        if (mail && deferred) {
+            engine_park(engine, id, deferred);
+            engine_defer(deferred, id, DEFER_MAIL, 0);
+            return;
+        }
+
+        // with correlation, on_mail is only asked when the message is not there
+        if (mail) {
+            if (engine_take_mail(engine, id, node)) {
+                work = NULL;
+            } else if (work == NULL) {
+                engine_park(engine, id, deferred);
+                return;
+            }
+        }
+
+        if (work && !work(engine, id, node, cb->user)) {
+            engine_park(engine, id, deferred);
+            return;
+        }
+
+        uint32_t ticks = delay ? delay(engine, id, node, cb->user) : 0;
+        if (ticks > 0) {
+            engine_park(engine, id, deferred);
+            if (deferred) {
+                engine_defer(deferred, id, DEFER_SLEEP, ticks);
+            } else {
+                engine_sleep(engine, id, ticks);
+            }
+            return;
+        }
+
+        // the work was done right away
+        if (observed && engine->metering && op >= OP_TASK) engine_measure(engine, node, 0, deferred);
+
+        uint32_t edge = offsets[node] + target;
+        if (edge >= offsets[node + 1]) {
+            engine_end(engine, id, node, deferred);
+            return;
+        }
+
+        node = edges[edge];
+        transitions++;
+    }
+}
+
+// Copies of the loop, so the one without workers, metrics and traces
+// does not test for them on every stop
+void engine_step(Engine *engine, Instance_Id id, Engine_Deferred *deferred) {
+    bool observed = engine->metering || engine->callbacks.on_move != NULL;
+    if (deferred) engine_step_with(engine, id, deferred, observed);
+    else if (observed) engine_step_with(engine, id, NULL, true);
+    else engine_step_with(engine, id, NULL, false);
+}
+
+// Resumes an instance parked on a task, wait or mail event.
+void engine_complete(Engine *engine, Instance_Id id) {
+    assert(engine->states[id] == INSTANCE_PARKED && "Completing an instance that is not parked");
+    if (engine->metering) engine_measure(engine, engine->nodes[id], engine->timers.now - engine->since[id], NULL);
+
+    if (!engine_leave(engine, id, 0)) {
+        engine_end(engine, id, engine->nodes[id], NULL);
+        return;
+    }
+
+    engine->states[id] = INSTANCE_READY;
+    if (engine->durable) engine_log(engine, id, WAL_SLOT, 0);
+    engine_push_ready(engine, id);
+}
+
+// Applies the effects recorded while stepping instances in parallel. Mail
+// events go through the same checks as in engine_step, which may resume
+// them.
+void engine_apply(Engine *engine, Engine_Deferred *deferred) {
+    const Engine_Callbacks *cb = &engine->callbacks;
+    engine->transitions += deferred->transitions;
+
+    for (size_t i = 0; i < deferred->len; i++) {
+        Deferred *d = &deferred->items[i];
+        switch ((Defer_Kind) d->kind) {
+            case DEFER_END: engine_release(engine, d->id); break;
+
+            case DEFER_SLEEP: engine_sleep(engine, d->id, d->arg); break;
+            case DEFER_SPAWN: engine_spawn(engine, d->id, d->arg); break;
+            case DEFER_LOG: engine_log(engine, d->id, d->arg > 0 ? WAL_JOIN : WAL_SLOT, d->arg - 1); break;
+
+            case DEFER_MAIL: {
+                uint32_t node = engine->nodes[d->id];
+                if (engine_take_mail(engine, d->id, node) || (cb->on_mail && cb->on_mail(engine, d->id, node, cb->user))) {
+                    engine_complete(engine, d->id);
+                }
+            } break;
+        }
+    }
+
+    deferred->len = 0;
+    deferred->ends = 0;
+    deferred->transitions = 0;
+}
+
+// Makes room on the free list for every slot, so that workers can release
+// theirs at the same time, see engine_release_ends
+void engine_reserve_free(Engine *engine) {
+    if (engine->free_cap >= engine->instances_cap) return;
+
+    engine->free_cap = engine->instances_cap;
+    engine->free_ids = realloc(engine->free_ids, sizeof(Instance_Id) * engine->free_cap);
+    assert(engine->free_ids != NULL && "Cannot grow the free list");
+}
+
+// The part of engine_apply the workers run in parallel, each on its own
+// effects: releases the slots that ended into the free list from `at`
+// past its end and keeps every other effect for engine_apply. Slots are
+// only counted free by engine_released, once all of them are written.
+// Durable engines log the releases, so they leave them to engine_apply.
+void engine_release_ends(Engine *engine, Engine_Deferred *deferred, size_t at) {
+    assert(!engine->durable && "Releases of a durable engine are ordered in the log");
+
+    Instance_Id *free_ids = engine->free_ids + engine->free_cnt + at;
+    size_t kept = 0;
+
+    // other workers clear bits of the same words, slots started together
+    // mostly end together so the bits of a word are cleared at once
+    size_t word = SIZE_MAX;
+    uint64_t bits = 0;
+    for (size_t i = 0; i < deferred->len; i++) {
+        Deferred d = deferred->items[i];
+        if (d.kind != DEFER_END) {
+            deferred->items[kept++] = d;
+            continue;
+        }
+
+        engine->states[d.id] = INSTANCE_DONE;
+        engine->generations[d.id]++;
+        *free_ids++ = d.id;
+
+        if (d.id / 64 != word) {
+            if (bits != 0) __atomic_fetch_and(&engine->live[word], ~bits, __ATOMIC_RELAXED);
+            word = d.id / 64;
+            bits = 0;
+        }
+        bits |= 1ULL << (d.id % 64);
+    }
+
+    if (bits != 0) __atomic_fetch_and(&engine->live[word], ~bits, __ATOMIC_RELAXED);
+    deferred->len = kept;
+}
+
+// Counts the `released` slots engine_release_ends wrote as free
+void engine_released(Engine *engine, size_t released) {
+    engine->free_cnt += released;
+    engine->active -= released;
+}
+
+// Moves the clock of the timer wheel to `now` and resumes every instance
+// whose wait expired by then. Returns how many were resumed.
+size_t engine_advance(Engine *engine, uint64_t now) {
+    timer_advance(&engine->timers, now);
+
+    size_t resumed = 0;
+    for (uint32_t id = timer_take(&engine->timers); id != TIMER_NONE; id = timer_take(&engine->timers)) {
+        engine_complete(engine, id);
+        resumed++;
+    }
+
+    return resumed;
+}
+
+// Stops the timer of an instance sleeping on a wait, which stays parked
+// until engine_complete. Returns false when it had no pending timer.
+bool engine_cancel_wait(Engine *engine, Instance_Id id) {
+    return timer_cancel(&engine->timers, id);
+}
+
+// Bytes of the instance store per slot, the live bit aside
+size_t engine_slot_size(const Engine *engine) {
+    size_t size = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t);
+    if (engine->program.parallel) {
+        size += sizeof(Instance_Id) + sizeof(uint32_t) + 2 * sizeof(uint32_t) * engine->program.joins_cnt;
+    }
+    return size;
+}
+
+/*
+ * Filter of the node column: compares a block of nodes at once and builds
+ * a 64 bit mask for each word of the live bitset, so free slots and slots
+ * on other nodes are dropped without looking at the other columns.
+ */
+#if defined(__AVX2__)
+
+#define ENGINE_BLOCK 8
+typedef __m256i Engine_Block;
+#define ENGINE_LOAD(p)  _mm256_loadu_si256((const __m256i *) (p))
+#define ENGINE_SET1(x)  _mm256_set1_epi32(x)
+#define ENGINE_EQ(a, b) _mm256_cmpeq_epi32(a, b)
+#define ENGINE_MASK(v)  ((uint64_t) _mm256_movemask_ps(_mm256_castsi256_ps(v)))
+
+#elif defined(__SSE2__)
+
+#define ENGINE_BLOCK 4
+typedef __m128i Engine_Block;
+#define ENGINE_LOAD(p)  _mm_loadu_si128((const __m128i *) (p))
+#define ENGINE_SET1(x)  _mm_set1_epi32(x)
+#define ENGINE_EQ(a, b) _mm_cmpeq_epi32(a, b)
+#define ENGINE_MASK(v)  ((uint64_t) _mm_movemask_ps(_mm_castsi128_ps(v)))
+
+#endif
+
+// Bit i is set when nodes[i] == node, for 64 nodes
+static inline uint64_t engine_match(const uint32_t *nodes, uint32_t node) {
+    uint64_t mask = 0;
+#ifdef ENGINE_BLOCK
+    Engine_Block key = ENGINE_SET1((int) node);
+    for (size_t i = 0; i < 64; i += ENGINE_BLOCK) {
+        mask |= ENGINE_MASK(ENGINE_EQ(ENGINE_LOAD(nodes + i), key)) << i;
+    }
+#else
+    for (size_t i = 0; i < 64; i++) {
+        mask |= (uint64_t) (nodes[i] == node) << i;
+    }
+#endif
+    return mask;
+}
+
+// Collects the instances with a token on `node` since before the tick
+// `before` (UINT64_MAX for all of them), such as the ones stuck at an
+// event. Stores up to `cap` ids in `out` and returns how many there are,
+// which may be more. Roots HELD at a join count as waiting there.
+size_t engine_find(const Engine *engine, uint32_t node, uint64_t before, Instance_Id *out, size_t cap) {
+    size_t found = 0;
+    size_t words = (engine->instances_cnt + 63) / 64;
+    for (size_t w = 0; w < words; w++) {
+        uint64_t live = engine->live[w];
+        if (live == 0) continue;
+
+        // slots past instances_cnt are never live, whatever their node is
+        for (uint64_t mask = live & engine_match(engine->nodes + w * 64, node); mask; mask &= mask - 1) {
+            Instance_Id id = w * 64 + __builtin_ctzll(mask);
+            if (engine->since[id] >= before) continue;
+
+            if (found < cap) out[found] = id;
+            found++;
+        }
+    }
+
+    return found;
+}
+
+// Reference to an instance to address messages to it
+Message engine_address(const Engine *engine, Instance_Id id, uint32_t node) {
+    return (Message) { .instance = id, .generation = engine->generations[id], .node = node };
+}
+
+// Posts a message for the instance and mail event it is addressed to, into
+// the mailbox of the lane of that event. Lock-free, it can be called from
+// any thread and from the callbacks, as long as the model does not change.
+// Returns false when the mailbox is full.
+bool engine_post(Engine *engine, Message message) {
+    assert(engine->mailboxes != NULL && "Message correlation is not enabled");
+    assert(message.node < engine->model->nodes_cnt && "Invalid mail event");
+    return mail_queue_push(&engine->mailboxes[engine->model->nodes[message.node].lane], message);
+}
+
+// Matches a message with its instance: resumes it when it is already parked
+// on the mail event, keeps the message for later when it has not got there
+// yet, and drops it when the instance is gone or there is no room to keep it.
+void engine_deliver(Engine *engine, Message message) {
+    Instance_Id id = message.instance;
+    if (id >= engine->instances_cnt || engine->states[id] == INSTANCE_DONE || engine->generations[id] != message.generation) {
+        engine->mail_orphaned++;
+        return;
+    }
+
+    if (engine->states[id] == INSTANCE_PARKED && engine->nodes[id] == message.node) {
+        const Engine_Callbacks *cb = &engine->callbacks;
+        if (cb->on_message) cb->on_message(engine, message.instance, message.node, message.payload, cb->user);
+        engine->mail_delivered++;
+        engine_complete(engine, message.instance);
+        return;
+    }
+
+    if (mail_table_put(&engine->unmatched, message, engine->timers.now + engine->mail_ttl)) {
+        engine->mail_buffered++;
+    } else {
+        engine->mail_overflow++;
+    }
+}
+
+// Drains the mailbox of every lane, and forgets the unmatched messages
+// whose TTL ran out. Only from the thread that runs the engine. Returns
+// how many messages were taken from the mailboxes.
+size_t engine_poll_mail(Engine *engine) {
+    if (engine->mailboxes == NULL) return 0;
+
+    engine->mail_expired += mail_table_expire(&engine->unmatched, engine->timers.now);
+
+    size_t lanes = engine_mailboxes_cnt(engine);
+    size_t taken = 0;
+    Message message;
+    for (size_t i = 0; i < lanes; i++) {
+        while (mail_queue_pop(&engine->mailboxes[i], &message)) {
+            engine_deliver(engine, message);
+            taken++;
+        }
+    }
+
+    return taken;
+}
+
+// Steps up to `budget` ready instances (0 means until the queue is empty).
+// Returns how many were stepped.
+size_t engine_run(Engine *engine, size_t budget) {
+    size_t stepped = 0;
+    while (engine->ready_len > 0 && (budget == 0 || stepped < budget)) {
+        engine_step(engine, engine_pop_ready(engine), NULL);
+        stepped++;
+    }
+
+    return stepped;
+}
+
+/*
+ * Durability: every change to the instance store is logged (see
+ * engine_log), and engine_commit makes what was logged so far durable with
+ * one fdatasync. A snapshot holds the columns of the store as they are on
+ * disk, so recovering maps it and copies them back, then replays the log
+ * groups written after it. The live bitset, the free list, the token
+ * counts and the ready queue follow from the columns.
+ *
+ * Instances come back at their last logged state: a parked instance is
+ * still parked, but the caller has to give it back its work (the task it
+ * was doing, its timer or its message). Unmatched messages are not kept.
+ */
+
+#define ENGINE_SNAPSHOT_MAGIC 0x50414E53u  // "SNAP"
+#define ENGINE_SNAPSHOT_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seq;  // last log group the snapshot holds
+    uint64_t now;
+    uint64_t instances_cnt;
+    uint64_t nodes_cnt;  // of the model, a snapshot of another one is refused
+    uint64_t joins_cnt;
+} Engine_Snapshot;
+
+typedef struct {
+    void *data;
+    size_t size;  // of one element
+    size_t cnt;   // per instance
+} Engine_Column;
+
+// Columns in the order they are stored, each one padded to 8 bytes
+size_t engine_columns(Engine *engine, Engine_Column *columns) {
+    size_t joins = engine->program.joins_cnt;
+    size_t cnt = 0;
+    columns[cnt++] = (Engine_Column) { engine->nodes, sizeof(uint32_t), 1 };
+    columns[cnt++] = (Engine_Column) { engine->states, sizeof(uint8_t), 1 };
+    columns[cnt++] = (Engine_Column) { engine->generations, sizeof(uint32_t), 1 };
+    columns[cnt++] = (Engine_Column) { engine->since, sizeof(uint64_t), 1 };
+    if (engine->program.parallel) {
+        columns[cnt++] = (Engine_Column) { engine->roots, sizeof(Instance_Id), 1 };
+        columns[cnt++] = (Engine_Column) { (void *) engine->arrived, sizeof(uint32_t), joins };
+        columns[cnt++] = (Engine_Column) { (void *) engine->expected, sizeof(uint32_t), joins };
+    }
+    return cnt;
+}
+
+size_t engine_column_bytes(const Engine_Column *column, size_t instances) {
+    return (column->size * column->cnt * instances + 7) & ~(size_t) 7;
+}
+
+bool engine_write_all(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Makes the entries of the directory of `path` durable, such as a rename
+// into it
+bool engine_sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : slash == path ? strdup("/") : strndup(path, slash - path);
+    assert(dir != NULL && "Cannot allocate the directory path");
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) return false;
+
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool engine_reserve(Engine *engine, size_t cnt) {
+    while (engine->instances_cap < cnt) {
+        if (!engine_grow(engine)) return false;
+    }
+    return true;
+}
+
+void engine_replay(const Wal_Record *record, void *user) {
+    Engine *engine = user;
+    size_t joins = engine->program.joins_cnt;
+
+    if (record->kind == WAL_JOIN) {
+        if (record->id >= engine->instances_cnt || record->node >= joins) return;
+        atomic_store(&engine->arrived[(size_t) record->id * joins + record->node], record->generation);
+        atomic_store(&engine->expected[(size_t) record->id * joins + record->node], record->root);
+        return;
+    }
+
+    Instance_Id id = record->id;
+    if (record->node >= engine->model->nodes_cnt || !engine_reserve(engine, (size_t) id + 1)) return;
+    for (; engine->instances_cnt <= id; engine->instances_cnt++) {
+        engine->states[engine->instances_cnt] = INSTANCE_DONE;
+        engine->generations[engine->instances_cnt] = 0;
+    }
+
+    engine->nodes[id] = record->node;
+    engine->states[id] = record->state;
+    engine->generations[id] = record->generation;
+    engine->since[id] = record->since;
+    if (engine->program.parallel) engine->roots[id] = record->root;
+    if (record->kind == WAL_START) {
+        for (size_t i = 0; i < joins; i++) {
+            atomic_store(&engine->arrived[(size_t) id * joins + i], 0);
+            atomic_store(&engine->expected[(size_t) id * joins + i], 0);
+        }
+    }
+    if (record->since > engine->timers.now) engine->timers.now = record->since;
+}
+
+// Loads the snapshot at `path`, if there is one. Returns false when it
+// cannot be read or is not of this model.
+bool engine_load_snapshot(Engine *engine, const char *path, uint64_t *seq) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return access(path, F_OK) != 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Engine_Snapshot)) {
+        close(fd);
+        return false;
+    }
+
+    uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    bool ok = false;
+    Engine_Snapshot header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != ENGINE_SNAPSHOT_MAGIC || header.version != ENGINE_SNAPSHOT_VERSION
+        || header.nodes_cnt != engine->model->nodes_cnt || header.joins_cnt != engine->program.joins_cnt
+        || !engine_reserve(engine, header.instances_cnt)) {
+        goto CLEAN_UP;
+    }
+
+    Engine_Column columns[8];
+    size_t cnt = engine_columns(engine, columns);
+    size_t offset = sizeof(header);
+    for (size_t i = 0; i < cnt; i++) {
+        size_t bytes = engine_column_bytes(&columns[i], header.instances_cnt);
+        if (offset + bytes > (size_t) st.st_size) goto CLEAN_UP;
+
+        memcpy(columns[i].data, data + offset, columns[i].size * columns[i].cnt * header.instances_cnt);
+        offset += bytes;
+    }
+
+    engine->instances_cnt = header.instances_cnt;
+    engine->timers.now = header.now;
+    *seq = header.seq;
+    ok = true;
+
+CLEAN_UP:
+    munmap(data, st.st_size);
+    return ok;
+}
+
+// Rebuilds what follows from the columns after recovering them
+void engine_rebuild(Engine *engine) {
+    timer_init(&engine->timers, engine->timers.now);
+    memset(engine->live, 0, sizeof(uint64_t) * engine->instances_cap / 64);
+    engine->free_cnt = 0;
+    engine->active = 0;
+    engine->recovered = 0;
+
+    if (engine->program.parallel) {
+        for (size_t id = 0; id < engine->instances_cnt; id++) {
+            if (engine->states[id] != INSTANCE_DONE) atomic_store(&engine->tokens[engine->roots[id]], 0);
+        }
+
+        // joins are not logged with when they opened, they count from now
+        for (size_t i = 0; i < engine->instances_cnt * engine->program.joins_cnt; i++) {
+            engine->opened[i] = engine->timers.now;
+        }
+    }
+
+    for (Instance_Id id = 0; id < engine->instances_cnt; id++) {
+        if (engine->states[id] == INSTANCE_DONE) {
+            if (engine->free_cnt == engine->free_cap) {
+                engine->free_cap = engine->instances_cap;
+                engine->free_ids = realloc(engine->free_ids, sizeof(Instance_Id) * engine->free_cap);
+                assert(engine->free_ids != NULL && "Cannot grow the free list");
+            }
+            engine->free_ids[engine->free_cnt++] = id;
+            continue;
+        }
+
+        engine->live[id / 64] |= 1ULL << (id % 64);
+        engine->active++;
+        if (engine->states[id] == INSTANCE_HELD) continue;
+
+        if (engine->program.parallel) atomic_fetch_add(&engine->tokens[engine->roots[id]], 1);
+        if (!engine->program.parallel || engine->roots[id] == id) engine->recovered++;
+        if (engine->states[id] == INSTANCE_READY) engine_push_ready(engine, id);
+    }
+}
+
+// Makes the instance store durable: recovers it from the snapshot at
+// `snapshot_path` and the log at `wal_path`, then logs every change from
+// here on, committing by itself every `window` records. Call it right
+// after engine_init. Returns false when the files cannot be used.
+bool engine_enable_wal(Engine *engine, const char *wal_path, const char *snapshot_path, size_t window) {
+    assert(engine->instances_cnt == 0 && "The log must be enabled before any instance starts");
+
+    uint64_t seq = 0;
+    if (!engine_load_snapshot(engine, snapshot_path, &seq)) return false;
+    if (!wal_scan(wal_path, seq, engine_replay, engine, NULL, NULL)) return false;
+    engine_rebuild(engine);
+
+    if (!wal_open(&engine->wal, wal_path, window, seq + 1)) return false;
+    engine->snapshot_path = snapshot_path;
+    engine->durable = true;
+    return true;
+}
+
+// Waits until every change logged so far is on disk
+bool engine_commit(Engine *engine) {
+    if (!engine->durable) return true;
+    if (!engine->wal_failed && !wal_commit(&engine->wal)) engine->wal_failed = true;
+    return !engine->wal_failed;
+}
+
+// Writes the instance store to the snapshot file, replacing the old one
+// only once the new one is on disk, and starts the log over once the
+// rename is durable too. Only between runs of the ready queue.
+bool engine_snapshot(Engine *engine) {
+    if (!engine->durable) return true;
+    if (!engine_commit(engine)) return false;
+
+    size_t len = strlen(engine->snapshot_path);
+    char *tmp = malloc(len + 5);
+    assert(tmp != NULL && "Cannot allocate the snapshot path");
+    memcpy(tmp, engine->snapshot_path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    Engine_Snapshot header = {
+        .magic = ENGINE_SNAPSHOT_MAGIC,
+        .version = ENGINE_SNAPSHOT_VERSION,
+        .seq = engine->wal.seq - 1,
+        .now = engine->timers.now,
+        .instances_cnt = engine->instances_cnt,
+        .nodes_cnt = engine->model->nodes_cnt,
+        .joins_cnt = engine->program.joins_cnt
+    };
+
+    bool ok = false;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) goto CLEAN_UP;
+
+    ok = engine_write_all(fd, &header, sizeof(header));
+
+    static const uint8_t padding[8] = {0};
+    Engine_Column columns[8];
+    size_t cnt = engine_columns(engine, columns);
+    for (size_t i = 0; i < cnt && ok; i++) {
+        size_t size = columns[i].size * columns[i].cnt * engine->instances_cnt;
+        ok = engine_write_all(fd, columns[i].data, size)
+            && engine_write_all(fd, padding, engine_column_bytes(&columns[i], engine->instances_cnt) - size);
+    }
+
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    // until the directory is synced a crash can bring back the old snapshot,
+    // which needs the log that is about to be truncated
+    ok = ok && rename(tmp, engine->snapshot_path) == 0 && engine_sync_dir(engine->snapshot_path) && wal_reset(&engine->wal);
+
+CLEAN_UP:
+    free(tmp);
+    if (!ok) engine->wal_failed = true;
+    return ok;
+}
@@ -0,0 +1,194 @@
+/*******************************************************************\
+| Section: Heatmap                                                  |
+| Numbers per event that the viewer paints over the diagram: how    |
+| many tokens went through it, how long they stayed and how many    |
+| were on it on average. They come from a simulation or from the    |
+| Prometheus text that --metrics prom prints. Edges get the tokens  |
+| that went through them, or the value of the event they point to.  |
+\*******************************************************************/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    HEATMAP_NONE = 0,
+    HEATMAP_VISITS,  // tokens that went through the event
+    HEATMAP_MEAN,    // milliseconds a token spent on it
+    HEATMAP_LOAD,    // tokens on it at the same time, on average
+    HEATMAP_METRICS_CNT
+} Heatmap_Metric;
+
+// instances simulated for --heatmap sim when --simulate does not say
+#define HEATMAP_SIM_INSTANCES 10000
+
+static const char *HEATMAP_NAMES[HEATMAP_METRICS_CNT] = { "none", "visits", "mean time", "load" };
+
+typedef struct {
+    const Process_Model *model;
+    double *values;     // HEATMAP_METRICS_CNT per node
+    uint32_t *sources;  // edges coming into each node
+    double max[HEATMAP_METRICS_CNT];
+} Heatmap;
+
+void heatmap_init(Heatmap *heatmap, const Process_Model *model) {
+    memset(heatmap, 0, sizeof(*heatmap));
+    heatmap->model = model;
+    heatmap->values = calloc(model->nodes_cnt * HEATMAP_METRICS_CNT, sizeof(double));
+    heatmap->sources = calloc(model->nodes_cnt, sizeof(uint32_t));
+    assert(heatmap->values != NULL && heatmap->sources != NULL && "Cannot allocate the heatmap");
+
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        for (uint32_t j = 0; j < model->nodes[i].targets_cnt; j++) {
+            heatmap->sources[model->nodes[i].targets[j]]++;
+        }
+    }
+}
+
+void heatmap_free(Heatmap *heatmap) {
+    free(heatmap->values);
+    free(heatmap->sources);
+    memset(heatmap, 0, sizeof(*heatmap));
+}
+
+double heatmap_value(const Heatmap *heatmap, uint32_t node, Heatmap_Metric metric) {
+    return heatmap->values[node * HEATMAP_METRICS_CNT + metric];
+}
+
+void heatmap_set(Heatmap *heatmap, uint32_t node, double visits, double total_ms, double elapsed_ms) {
+    double *values = &heatmap->values[node * HEATMAP_METRICS_CNT];
+    values[HEATMAP_VISITS] = visits;
+    values[HEATMAP_MEAN] = visits > 0 ? total_ms / visits : 0;
+    values[HEATMAP_LOAD] = elapsed_ms > 0 ? total_ms / elapsed_ms : 0;
+
+    for (size_t m = HEATMAP_VISITS; m < HEATMAP_METRICS_CNT; m++) {
+        if (values[m] > heatmap->max[m]) heatmap->max[m] = values[m];
+    }
+}
+
+// Tokens are only counted per event, so the ones on an edge are the ones
+// that left its source when every token leaves by it, the ones that
+// reached its target when nothing else reaches it and at most the fewest
+// of both otherwise. Events a metrics file has nothing about, like
+// starters and gateways that do not join, give way to the other end.
+double heatmap_edge(const Heatmap *heatmap, uint32_t from, uint32_t to, Heatmap_Metric metric) {
+    if (metric != HEATMAP_VISITS) return heatmap_value(heatmap, to, metric);
+
+    const Model_Node *node = &heatmap->model->nodes[from];
+    double left = heatmap_value(heatmap, from, metric);
+    double reached = heatmap_value(heatmap, to, metric);
+    if (left == 0 || reached == 0) return left + reached;
+    if (node->targets_cnt == 1 || (node->kind == NODE_GATEWAY && node->gateway == GATEWAY_AND)) return left;
+    if (heatmap->sources[to] == 1) return reached;
+    return left < reached ? left : reached;
+}
+
+// 0 for nothing, 1 for the highest value of the metric
+double heatmap_scale(const Heatmap *heatmap, double value, Heatmap_Metric metric) {
+    return heatmap->max[metric] > 0 ? value / heatmap->max[metric] : 0;
+}
+
+void heatmap_from_sim(Heatmap *heatmap, const Sim_Result *result) {
+    for (size_t i = 0; i < heatmap->model->nodes_cnt; i++) {
+        const Sim_Node_Stats *stats = &result->nodes[i];
+        heatmap_set(heatmap, i, stats->visits, stats->busy * 1000.0, result->horizon * 1000.0);
+    }
+}
+
+// Reads the label `name` of a Prometheus sample into `out`, undoing the
+// escapes of metrics_print_string
+bool heatmap_label(const char *line, const char *name, char *out, size_t cap) {
+    size_t len = strlen(name);
+    const char *p = strchr(line, '{');
+    while (p != NULL && *p != '}') {
+        p++;
+        if (strncmp(p, name, len) == 0 && p[len] == '=' && p[len + 1] == '"') {
+            p += len + 2;
+            size_t n = 0;
+            for (; *p && *p != '"'; p++) {
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                    if (*p == 'n') {
+                        if (n + 1 < cap) out[n++] = '\n';
+                        continue;
+                    }
+                }
+                if (n + 1 < cap) out[n++] = *p;
+            }
+            out[n] = '\0';
+            return *p == '"';
+        }
+
+        // skip the value of the label
+        p = strchr(p, '"');
+        if (p != NULL) {
+            for (p++; *p && *p != '"'; p++) {
+                if (*p == '\\' && p[1] != '\0') p++;
+            }
+            if (*p == '"') p++;
+        }
+    }
+
+    return false;
+}
+
+static const Process_Model *heatmap_sorted_model;
+
+int heatmap_compare_names(const void *a, const void *b) {
+    const Model_Node *nodes = heatmap_sorted_model->nodes;
+    return strcmp(nodes[*(const uint32_t *) a].name, nodes[*(const uint32_t *) b].name);
+}
+
+int heatmap_compare_name(const void *key, const void *elem) {
+    return strcmp(key, heatmap_sorted_model->nodes[*(const uint32_t *) elem].name);
+}
+
+// Events are looked up by name, the ones the file does not mention stay
+// at zero. Returns false when the file cannot be read.
+bool heatmap_from_metrics(Heatmap *heatmap, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return false;
+
+    const Process_Model *model = heatmap->model;
+    double *counts = calloc(model->nodes_cnt, sizeof(double));
+    double *sums = calloc(model->nodes_cnt, sizeof(double));
+    assert(counts != NULL && sums != NULL && "Cannot allocate the heatmap");
+
+    // sorted by name, so a large file does not scan the nodes on every line
+    uint32_t *order = malloc(sizeof(uint32_t) * model->nodes_cnt);
+    assert(order != NULL && "Cannot allocate the heatmap");
+    for (size_t i = 0; i < model->nodes_cnt; i++) order[i] = i;
+    heatmap_sorted_model = model;
+    qsort(order, model->nodes_cnt, sizeof(uint32_t), heatmap_compare_names);
+
+    const char *count_name = "pcs_event_duration_milliseconds_count{";
+    const char *sum_name = "pcs_event_duration_milliseconds_sum{";
+    double elapsed = 0;
+    char line[4096];
+    char event[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "pcs_elapsed_seconds %lf", &elapsed) == 1) continue;
+
+        double *column = NULL;
+        if (strncmp(line, count_name, strlen(count_name)) == 0) column = counts;
+        else if (strncmp(line, sum_name, strlen(sum_name)) == 0) column = sums;
+        if (column == NULL || !heatmap_label(line, "event", event, sizeof(event))) continue;
+
+        const uint32_t *node = bsearch(event, order, model->nodes_cnt, sizeof(uint32_t), heatmap_compare_name);
+        if (node != NULL) column[*node] = strtod(strrchr(line, '}') + 1, NULL);
+    }
+
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        heatmap_set(heatmap, i, counts[i], sums[i], elapsed * 1000.0);
+    }
+
+    bool ok = !ferror(file);
+    free(order);
+    free(counts);
+    free(sums);
+    fclose(file);
+    return ok;
+}
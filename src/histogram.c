@@ -0,0 +1,108 @@
+/*******************************************************************\
+| Section: Histogram                                                |
+| Log-linear histogram in the spirit of HdrHistogram: every power   |
+| of two is split in 2^HISTOGRAM_SUB_BITS buckets, so any recorded  |
+| value is kept with a relative error below 2^-HISTOGRAM_SUB_BITS   |
+| while the whole uint64 range fits in a fixed array.               |
+\*******************************************************************/
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_COUNT (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min, max;
+    double sum;
+    double sum_sq;
+} Histogram;
+
+void histogram_init(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+size_t histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return value;
+    }
+
+    // position of the highest bit, the next HISTOGRAM_SUB_BITS bits select
+    // the bucket inside that power of two
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - HISTOGRAM_SUB_BITS;
+    return (size_t) (shift + 1) * HISTOGRAM_SUB_COUNT + ((value >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+// smallest value that falls into bucket `index`
+uint64_t histogram_value(size_t index) {
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+
+    unsigned shift = index / HISTOGRAM_SUB_COUNT - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_COUNT;
+    return (HISTOGRAM_SUB_COUNT + sub) << shift;
+}
+
+void histogram_record_n(Histogram *h, uint64_t value, uint64_t n) {
+    h->counts[histogram_index(value)] += n;
+    h->total += n;
+    h->sum += (double) value * n;
+    h->sum_sq += (double) value * value * n;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+void histogram_record(Histogram *h, uint64_t value) { histogram_record_n(h, value, 1); }
+
+void histogram_merge(Histogram *dst, const Histogram *src) {
+    if (src->total == 0) return;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+
+    dst->total += src->total;
+    dst->sum += src->sum;
+    dst->sum_sq += src->sum_sq;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+double histogram_mean(const Histogram *h) {
+    return h->total == 0 ? 0 : h->sum / h->total;
+}
+
+double histogram_stddev(const Histogram *h) {
+    if (h->total < 2) return 0;
+    double mean = histogram_mean(h);
+    double var = h->sum_sq / h->total - mean * mean;
+    return var > 0 ? sqrt(var) : 0;
+}
+
+// value below which `p` percent of the recorded values fall
+uint64_t histogram_percentile(const Histogram *h, double p) {
+    if (h->total == 0) return 0;
+
+    uint64_t rank = (uint64_t) ceil(p / 100.0 * h->total);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_value(i);
+            if (value < h->min) return h->min;
+            if (value > h->max) return h->max;
+            return value;
+        }
+    }
+
+    return h->max;
+}
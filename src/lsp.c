@@ -0,0 +1,1386 @@
+/*******************************************************************\
+| Section: Language Server                                          |
+| --lsp speaks the Language Server Protocol over stdio: errors of   |
+| the parser and unknown or repeated ids as diagnostics, the event  |
+| a `points` target names, every target that names an event, and    |
+| the ids a `points` can take as completions.                       |
+|                                                                   |
+| Documents are cut at their subprocesses, and each one is parsed   |
+| on its own with the parser above, with a jump armed so its first  |
+| error comes back instead of ending the program. A change only     |
+| parses again the subprocesses it touched, the others keep their   |
+| ids and targets, which are then resolved across all of them.      |
+\*******************************************************************/
+
+#include <assert.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define LSP_MAX_DEPTH 64  // of the JSON of a message
+
+/*
+ * JSON: values are parsed into an array, each with its first child and
+ * its next sibling, and strings are decoded in place in the message.
+ */
+
+#define JSON_NONE UINT32_MAX
+
+typedef enum {
+    JSON_NULL = 0,
+    JSON_FALSE,
+    JSON_TRUE,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} Json_Kind;
+
+typedef struct {
+    Json_Kind kind;
+    uint32_t first, next;     // children, and the next one in the parent
+    const char *key;          // in objects
+    size_t key_len;
+    const char *str;          // decoded strings
+    size_t len;
+    double number;
+    const char *raw;          // where the value starts, for ids written back
+    size_t raw_len;
+} Json;
+
+typedef struct {
+    char *p, *end;
+    Json *values;
+    size_t cnt, cap;
+    jmp_buf fail;
+} Json_Parser;
+
+void json_skip_space(Json_Parser *parser) {
+    while (parser->p < parser->end && (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n' || *parser->p == '\r')) {
+        parser->p++;
+    }
+}
+
+void json_expect(Json_Parser *parser, char c) {
+    json_skip_space(parser);
+    if (parser->p >= parser->end || *parser->p != c) longjmp(parser->fail, 1);
+    parser->p++;
+}
+
+void json_utf8(char **w, uint32_t code) {
+    char *out = *w;
+    if (code < 0x80) {
+        *out++ = code;
+    } else if (code < 0x800) {
+        *out++ = 0xc0 | (code >> 6);
+        *out++ = 0x80 | (code & 0x3f);
+    } else if (code < 0x10000) {
+        *out++ = 0xe0 | (code >> 12);
+        *out++ = 0x80 | ((code >> 6) & 0x3f);
+        *out++ = 0x80 | (code & 0x3f);
+    } else {
+        *out++ = 0xf0 | (code >> 18);
+        *out++ = 0x80 | ((code >> 12) & 0x3f);
+        *out++ = 0x80 | ((code >> 6) & 0x3f);
+        *out++ = 0x80 | (code & 0x3f);
+    }
+    *w = out;
+}
+
+uint32_t json_hex(Json_Parser *parser) {
+    if (parser->end - parser->p < 4) longjmp(parser->fail, 1);
+
+    uint32_t code = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *parser->p++;
+        code <<= 4;
+        if (c >= '0' && c <= '9') code |= c - '0';
+        else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+        else longjmp(parser->fail, 1);
+    }
+    return code;
+}
+
+// Decodes the string at the cursor over itself, escapes never get longer
+void json_string(Json_Parser *parser, const char **str, size_t *len) {
+    json_expect(parser, '"');
+    char *start = parser->p, *w = parser->p;
+
+    for (;;) {
+        if (parser->p >= parser->end) longjmp(parser->fail, 1);
+        char c = *parser->p++;
+        if (c == '"') break;
+        if (c != '\\') {
+            *w++ = c;
+            continue;
+        }
+
+        if (parser->p >= parser->end) longjmp(parser->fail, 1);
+        switch (*parser->p++) {
+            case '"':  *w++ = '"';  break;
+            case '\\': *w++ = '\\'; break;
+            case '/':  *w++ = '/';  break;
+            case 'b':  *w++ = '\b'; break;
+            case 'f':  *w++ = '\f'; break;
+            case 'n':  *w++ = '\n'; break;
+            case 'r':  *w++ = '\r'; break;
+            case 't':  *w++ = '\t'; break;
+            case 'u': {
+                uint32_t code = json_hex(parser);
+                if (code >= 0xd800 && code < 0xdc00 && parser->end - parser->p >= 6 && parser->p[0] == '\\' && parser->p[1] == 'u') {
+                    parser->p += 2;
+                    uint32_t low = json_hex(parser);
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                json_utf8(&w, code);
+            } break;
+            default: longjmp(parser->fail, 1);
+        }
+    }
+
+    *str = start;
+    *len = w - start;
+}
+
+uint32_t json_push(Json_Parser *parser, Json_Kind kind) {
+    if (parser->cnt == parser->cap) {
+        parser->cap = parser->cap == 0 ? 64 : parser->cap * 2;
+        parser->values = realloc(parser->values, sizeof(Json) * parser->cap);
+        assert(parser->values != NULL && "Cannot grow the JSON values");
+    }
+
+    parser->values[parser->cnt] = (Json) { .kind = kind, .first = JSON_NONE, .next = JSON_NONE };
+    return parser->cnt++;
+}
+
+bool json_literal(Json_Parser *parser, const char *word) {
+    size_t len = strlen(word);
+    if ((size_t) (parser->end - parser->p) < len || memcmp(parser->p, word, len) != 0) return false;
+    parser->p += len;
+    return true;
+}
+
+uint32_t json_value(Json_Parser *parser, int depth) {
+    if (depth > LSP_MAX_DEPTH) longjmp(parser->fail, 1);
+    json_skip_space(parser);
+    if (parser->p >= parser->end) longjmp(parser->fail, 1);
+
+    const char *raw = parser->p;
+    uint32_t v;
+    char c = *parser->p;
+    if (c == '{' || c == '[') {
+        v = json_push(parser, c == '{' ? JSON_OBJECT : JSON_ARRAY);
+        parser->p++;
+        json_skip_space(parser);
+
+        uint32_t last = JSON_NONE;
+        char close = c == '{' ? '}' : ']';
+        if (parser->p < parser->end && *parser->p == close) {
+            parser->p++;
+        } else {
+            for (;;) {
+                const char *key = NULL;
+                size_t key_len = 0;
+                if (c == '{') {
+                    json_string(parser, &key, &key_len);
+                    json_expect(parser, ':');
+                }
+
+                uint32_t child = json_value(parser, depth + 1);
+                parser->values[child].key = key;
+                parser->values[child].key_len = key_len;
+                if (last == JSON_NONE) parser->values[v].first = child;
+                else parser->values[last].next = child;
+                last = child;
+
+                json_skip_space(parser);
+                if (parser->p < parser->end && *parser->p == ',') {
+                    parser->p++;
+                    continue;
+                }
+                json_expect(parser, close);
+                break;
+            }
+        }
+    } else if (c == '"') {
+        v = json_push(parser, JSON_STRING);
+        const char *str;
+        size_t len;
+        json_string(parser, &str, &len);
+        parser->values[v].str = str;
+        parser->values[v].len = len;
+    } else if (json_literal(parser, "null")) {
+        v = json_push(parser, JSON_NULL);
+    } else if (json_literal(parser, "true")) {
+        v = json_push(parser, JSON_TRUE);
+    } else if (json_literal(parser, "false")) {
+        v = json_push(parser, JSON_FALSE);
+    } else {
+        char *end;
+        double number = strtod(parser->p, &end);
+        if (end == parser->p || end > parser->end) longjmp(parser->fail, 1);
+        v = json_push(parser, JSON_NUMBER);
+        parser->values[v].number = number;
+        parser->p = end;
+    }
+
+    parser->values[v].raw = raw;
+    parser->values[v].raw_len = parser->p - raw;
+    return v;
+}
+
+// The member `key` of the object `v`, JSON_NONE when there is none
+uint32_t json_get(const Json_Parser *parser, uint32_t v, const char *key) {
+    if (v == JSON_NONE || parser->values[v].kind != JSON_OBJECT) return JSON_NONE;
+
+    size_t len = strlen(key);
+    for (uint32_t c = parser->values[v].first; c != JSON_NONE; c = parser->values[c].next) {
+        const Json *child = &parser->values[c];
+        if (child->key_len == len && memcmp(child->key, key, len) == 0) return c;
+    }
+    return JSON_NONE;
+}
+
+// Follows the members in `path`, separated by dots
+uint32_t json_path(const Json_Parser *parser, uint32_t v, const char *path) {
+    char key[64];
+    while (*path != '\0' && v != JSON_NONE) {
+        size_t len = strcspn(path, ".");
+        snprintf(key, sizeof(key), "%.*s", (int) len, path);
+        v = json_get(parser, v, key);
+        path += len + (path[len] == '.');
+    }
+    return v;
+}
+
+double json_number(const Json_Parser *parser, uint32_t v, double otherwise) {
+    return v != JSON_NONE && parser->values[v].kind == JSON_NUMBER ? parser->values[v].number : otherwise;
+}
+
+const char *json_str(const Json_Parser *parser, uint32_t v, size_t *len) {
+    if (v == JSON_NONE || parser->values[v].kind != JSON_STRING) return NULL;
+    *len = parser->values[v].len;
+    return parser->values[v].str;
+}
+
+/*
+ * Output
+ */
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Lsp_Out;
+
+void lsp_reserve(Lsp_Out *out, size_t more) {
+    if (out->len + more <= out->cap) return;
+    while (out->len + more > out->cap) out->cap = out->cap == 0 ? 4096 : out->cap * 2;
+    out->data = realloc(out->data, out->cap);
+    assert(out->data != NULL && "Cannot grow the output");
+}
+
+void lsp_printf(Lsp_Out *out, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    lsp_reserve(out, n + 1);
+    va_start(args, format);
+    vsnprintf(out->data + out->len, n + 1, format, args);
+    va_end(args);
+    out->len += n;
+}
+
+void lsp_string(Lsp_Out *out, const char *s, size_t len) {
+    lsp_reserve(out, len * 6 + 2);
+    out->data[out->len++] = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out->data[out->len++] = '\\';
+            out->data[out->len++] = c;
+        } else if (c < 0x20) {
+            out->len += sprintf(out->data + out->len, "\\u%04x", c);
+        } else if (c < 0x80) {
+            out->data[out->len++] = c;
+        } else {
+            // whole sequences only, messages can quote a byte of one
+            size_t n = c >= 0xc2 && c < 0xe0 ? 2 : c >= 0xe0 && c < 0xf0 ? 3 : c >= 0xf0 && c < 0xf5 ? 4 : 0;
+            size_t k = 1;
+            while (k < n && i + k < len && ((unsigned char) s[i + k] & 0xc0) == 0x80) k++;
+            if (n == 0 || k < n) {
+                memcpy(out->data + out->len, "\xef\xbf\xbd", 3);
+                out->len += 3;
+                continue;
+            }
+            memcpy(out->data + out->len, s + i, n);
+            out->len += n;
+            i += n - 1;
+        }
+    }
+    out->data[out->len++] = '"';
+}
+
+void lsp_send(Lsp_Out *out, FILE *file) {
+    fprintf(file, "Content-Length: %zu\r\n\r\n", out->len);
+    fwrite(out->data, 1, out->len, file);
+    fflush(file);
+    out->len = 0;
+}
+
+/*
+ * Documents
+ */
+
+typedef struct {
+    char *key;        // the full name, as the parser puts it in the symbols
+    uint64_t hash;
+    uint32_t offset;  // of the word in the block
+    uint32_t len;
+    Symb_Kind kind;   // of definitions
+    char type[16];    // of event definitions, like task
+    bool problem;     // a target that is not an event, an id taken before
+} Lsp_Symbol;
+
+typedef struct {
+    size_t start, len;  // in the document
+    bool dirty;         // an edit touched it
+    bool failed;
+    Lex_Error error;    // offset in the block
+    char ns[MAX_TOKEN_LEN];
+
+    Lsp_Symbol *defs, *refs;
+    size_t defs_cnt, defs_cap;
+    size_t refs_cnt, refs_cap;
+    size_t problems;  // to report, with the error
+} Lsp_Block;
+
+typedef struct {
+    char *uri;
+    char *text;
+    size_t len, cap;
+    size_t *lines;  // offsets where they start
+    size_t lines_cnt, lines_cap;
+
+    Lsp_Block *blocks;  // by start
+    size_t blocks_cnt, blocks_cap;
+    Lsp_Block outside;  // the process tag and the end of it
+
+    // definitions of all the blocks, open addressing on their hash
+    struct { uint32_t block, def; } *table;
+    size_t table_mask;
+
+    size_t edit_from, edit_to;  // what the changes since the last update touched
+} Lsp_Document;
+
+typedef struct {
+    Lsp_Document *docs;
+    size_t docs_cnt, docs_cap;
+    bool utf8;      // positions count bytes instead of UTF-16 units
+    bool shutdown;
+    char *buf;      // padded copy of a block, for the lexer
+    size_t buf_cap;
+    Lsp_Out out;
+} Lsp;
+
+static Lexer lsp_lexer;
+static Screen lsp_screen;
+
+void lsp_block_clear(Lsp_Block *block) {
+    for (size_t i = 0; i < block->defs_cnt; i++) free(block->defs[i].key);
+    for (size_t i = 0; i < block->refs_cnt; i++) free(block->refs[i].key);
+    block->defs_cnt = block->refs_cnt = 0;
+    block->failed = false;
+}
+
+void lsp_block_free(Lsp_Block *block) {
+    lsp_block_clear(block);
+    free(block->defs);
+    free(block->refs);
+}
+
+void lsp_push_symbol(Lsp_Symbol **symbols, size_t *cnt, size_t *cap, Lsp_Symbol symbol) {
+    if (*cnt == *cap) {
+        *cap = *cap == 0 ? 16 : *cap * 2;
+        *symbols = realloc(*symbols, sizeof(Lsp_Symbol) * *cap);
+        assert(*symbols != NULL && "Cannot grow the symbols");
+    }
+    (*symbols)[(*cnt)++] = symbol;
+}
+
+void lsp_add(Lsp_Block *block, bool def, const char *key, size_t offset, size_t len, Symb_Kind kind, const char *type) {
+    Lsp_Symbol symbol = {
+        .key = strdup(key),
+        .hash = hash_bytes(key, strlen(key)),
+        .offset = offset,
+        .len = len,
+        .kind = kind
+    };
+    assert(symbol.key != NULL && "Cannot allocate the symbol");
+    snprintf(symbol.type, sizeof(symbol.type), "%s", type);
+
+    if (def) lsp_push_symbol(&block->defs, &block->defs_cnt, &block->defs_cap, symbol);
+    else lsp_push_symbol(&block->refs, &block->refs_cnt, &block->refs_cap, symbol);
+}
+
+void lsp_reset_lexer(Lexer *lexer, char *source, Lex_Error *error) {
+    lexer->source = lexer->content = source;
+    lexer->file_path = "";
+    free(lexer->newlines);
+    lexer->newlines = NULL;
+    lexer->newlines_ready = false;
+    lexer->error = error;
+}
+
+// Picks the ids and the `points` targets of the tags, wherever they are,
+// so a block that does not parse still has them up to where it breaks
+void lsp_walk(Lsp_Block *block, Lexer *lexer) {
+    char key[MAX_TOKEN_LEN * 2];
+    char word[MAX_TOKEN_LEN];
+    char type[MAX_TOKEN_LEN] = "";
+    bool in_tag = false;
+    Token_Kind tag = TOKEN_EOF;
+
+    for (;;) {
+        next_token(lexer);
+        Token_Kind kind = lexer->token.kind;
+        if (kind == TOKEN_EOF) return;
+
+        if (kind == TOKEN_OPTAG) {
+            next_token(lexer);
+            tag = lexer->token.kind;
+            snprintf(type, sizeof(type), "%s", lexer->token.value);
+            in_tag = tag == TOKEN_SUBPROCESS || tag == TOKEN_TYPE;
+            continue;
+        }
+        if (kind == TOKEN_CLTAG) in_tag = false;
+        if (!in_tag || kind != TOKEN_ID) continue;
+
+        char attr[MAX_TOKEN_LEN];
+        snprintf(attr, sizeof(attr), "%s", lexer->token.value);
+        if (next_token(lexer).kind != TOKEN_ATR || next_token(lexer).kind != TOKEN_STR) continue;
+
+        const char *value = lexer->token.value;
+        size_t len = strlen(value);
+        size_t at = lexer->content - 1 - len - lexer->source;
+
+        if (strcmp(attr, "id") == 0 && tag == TOKEN_SUBPROCESS) {
+            snprintf(block->ns, sizeof(block->ns), "%s", value);
+            lsp_add(block, true, value, at, len, SYMB_SUBPROCESS, "subprocess");
+        } else if (strcmp(attr, "id") == 0) {
+            snprintf(word, sizeof(word), "%s", value);
+            symb_name(key, block->ns, word);
+            lsp_add(block, true, key, at, len, SYMB_EVENT, type);
+        } else if (strcmp(attr, "points") == 0) {
+            // split like the parser does, without trimming
+            for (size_t i = 0; i <= len;) {
+                size_t n = strcspn(value + i, ",");
+                if (n > 0) {
+                    snprintf(word, sizeof(word), "%.*s", (int) n, value + i);
+                    symb_name(key, block->ns, word);
+                    lsp_add(block, false, key, at + i, n, SYMB_EVENT, "");
+                }
+                i += n + 1;
+            }
+        }
+    }
+}
+
+// Parses the block on its own, then picks its symbols
+void lsp_analyze(Lsp *lsp, Lsp_Document *doc, Lsp_Block *block) {
+    if (block->len + READ_PADDING > lsp->buf_cap) {
+        lsp->buf_cap = (block->len + READ_PADDING) * 2;
+        lsp->buf = realloc(lsp->buf, lsp->buf_cap);
+        assert(lsp->buf != NULL && "Cannot grow the block buffer");
+    }
+    memcpy(lsp->buf, doc->text + block->start, block->len);
+    memset(lsp->buf + block->len, 0, READ_PADDING);
+
+    lsp_block_clear(block);
+    block->ns[0] = '\0';
+
+    // the symbols are only kept to parse, ids typed one letter at a time
+    // would fill them up
+    Lexer *lexer = &lsp_lexer;
+    if (lexer->symbols.len > HASHMAP_CAPACITY / 2) memset(&lexer->symbols, 0, sizeof(lexer->symbols));
+    lsp_screen.objs_cnt = 0;
+    lsp_screen.rows = 0;
+
+    jmp_buf jump;
+    fail_jump = &jump;
+    lsp_reset_lexer(lexer, lsp->buf, &block->error);
+    if (setjmp(jump) == 0) {
+        assert_next_token(lexer, TOKEN_OPTAG);
+        assert_next_token(lexer, TOKEN_SUBPROCESS);
+        parse_subprocess(lexer, &lsp_screen);
+        assert_next_token(lexer, TOKEN_EOF);
+    } else {
+        block->failed = true;
+    }
+
+    // the walk goes on past the characters the lexer cannot take
+    Lex_Error ignored;
+    lsp_reset_lexer(lexer, lsp->buf, &ignored);
+    const char *end = lsp->buf + block->len;
+    setjmp(jump);
+    if (lexer->content < end) lsp_walk(block, lexer);
+
+    fail_jump = NULL;
+    lexer->error = NULL;
+}
+
+// The process tag before the blocks, whitespace between them and the
+// closing tag after them. Stops at the first error.
+void lsp_check_outside(Lsp *lsp, Lsp_Document *doc) {
+    Lsp_Block *outside = &doc->outside;
+    outside->failed = false;
+
+    size_t head_end = doc->blocks_cnt > 0 ? doc->blocks[0].start : doc->len;
+    // read again after the parse, which can longjmp
+    volatile size_t tail_start = doc->blocks_cnt > 0 ? doc->blocks[doc->blocks_cnt - 1].start + doc->blocks[doc->blocks_cnt - 1].len : doc->len;
+
+    // the closing tag, when there are no blocks, is in the head
+    if (doc->blocks_cnt == 0) {
+        for (size_t i = doc->len; i > 0; i--) {
+            if (doc->text[i - 1] == '<') {
+                head_end = tail_start = i - 1;
+                break;
+            }
+        }
+    }
+
+    if (head_end + READ_PADDING > lsp->buf_cap) {
+        lsp->buf_cap = (head_end + READ_PADDING) * 2;
+        lsp->buf = realloc(lsp->buf, lsp->buf_cap);
+        assert(lsp->buf != NULL && "Cannot grow the block buffer");
+    }
+
+    jmp_buf jump;
+    fail_jump = &jump;
+    Lexer *lexer = &lsp_lexer;
+
+    memcpy(lsp->buf, doc->text, head_end);
+    memset(lsp->buf + head_end, 0, READ_PADDING);
+    lsp_reset_lexer(lexer, lsp->buf, &outside->error);
+    if (setjmp(jump) == 0) {
+        parse_process(lexer, &lsp_screen);
+        next_token(lexer);
+        if (lexer->token.kind != TOKEN_EOF) {
+            PRINT_ERROR(lexer, "Expected new subprocess or end of process");
+            FAIL;
+        }
+    } else {
+        outside->failed = true;
+        fail_jump = NULL;
+        lexer->error = NULL;
+        return;
+    }
+
+    // what is between the blocks
+    for (size_t b = 0; b + 1 < doc->blocks_cnt; b++) {
+        size_t from = doc->blocks[b].start + doc->blocks[b].len;
+        for (size_t i = from; i < doc->blocks[b + 1].start; i++) {
+            if (isspace((unsigned char) doc->text[i])) continue;
+            outside->failed = true;
+            outside->error.offset = i + 1;
+            snprintf(outside->error.message, sizeof(outside->error.message), "Expected new subprocess or end of process");
+            fail_jump = NULL;
+            lexer->error = NULL;
+            return;
+        }
+    }
+
+    size_t tail_len = doc->len - tail_start;
+    if (tail_len + READ_PADDING > lsp->buf_cap) {
+        lsp->buf_cap = (tail_len + READ_PADDING) * 2;
+        lsp->buf = realloc(lsp->buf, lsp->buf_cap);
+        assert(lsp->buf != NULL && "Cannot grow the block buffer");
+    }
+    memcpy(lsp->buf, doc->text + tail_start, tail_len);
+    memset(lsp->buf + tail_len, 0, READ_PADDING);
+    lsp_reset_lexer(lexer, lsp->buf, &outside->error);
+    if (setjmp(jump) == 0) {
+        assert_next_token(lexer, TOKEN_OPTAG);
+        assert_next_token(lexer, TOKEN_SLASH);
+        assert_next_token(lexer, TOKEN_PROCESS);
+        assert_next_token(lexer, TOKEN_CLTAG);
+        assert_next_token(lexer, TOKEN_EOF);
+    } else {
+        outside->error.offset += tail_start;
+        // a last block cut short by the end of the document already says so
+        const Lsp_Block *last = doc->blocks_cnt > 0 ? &doc->blocks[doc->blocks_cnt - 1] : NULL;
+        outside->failed = last == NULL || !last->failed || last->start + last->error.offset != outside->error.offset;
+    }
+
+    fail_jump = NULL;
+    lexer->error = NULL;
+}
+
+// Where a tag named `name` opens (or closes) at or after `from`, `<` then
+// maybe a slash and the name, with spaces between them
+size_t lsp_find_tag(const char *text, size_t from, size_t len, const char *name, bool closing) {
+    size_t name_len = strlen(name);
+    for (size_t i = from; i < len;) {
+        const char *lt = memchr(text + i, '<', len - i);
+        if (lt == NULL) return len;
+
+        size_t at = lt - text, p = at + 1;
+        while (p < len && isspace((unsigned char) text[p])) p++;
+        if (closing) {
+            if (p >= len || text[p] != '/') {
+                i = at + 1;
+                continue;
+            }
+            p++;
+            while (p < len && isspace((unsigned char) text[p])) p++;
+        }
+
+        if (p + name_len <= len && memcmp(text + p, name, name_len) == 0
+            && (p + name_len == len || !isalnum((unsigned char) text[p + name_len]))) {
+            return at;
+        }
+        i = at + 1;
+    }
+    return len;
+}
+
+void lsp_index_lines(Lsp_Document *doc) {
+    size_t cnt = lex_find_newlines(doc->text, doc->len, NULL) + 1;
+    if (cnt > doc->lines_cap) {
+        doc->lines_cap = cnt * 2;
+        doc->lines = realloc(doc->lines, sizeof(size_t) * doc->lines_cap);
+        assert(doc->lines != NULL && "Cannot grow the lines");
+    }
+
+    doc->lines[0] = 0;
+    lex_find_newlines(doc->text, doc->len, doc->lines + 1);
+    for (size_t i = 1; i < cnt; i++) doc->lines[i]++;
+    doc->lines_cnt = cnt;
+}
+
+// The first line that starts after `offset`
+size_t lsp_line_after(const Lsp_Document *doc, size_t offset) {
+    size_t lo = 0, hi = doc->lines_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (doc->lines[mid] <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Moves the lines after an edit that replaced `from..to` by `text`, instead
+// of finding all of them again
+void lsp_splice_lines(Lsp_Document *doc, size_t from, size_t to, const char *text, size_t len) {
+    size_t a = lsp_line_after(doc, from), b = lsp_line_after(doc, to);
+    size_t added = lex_find_newlines(text, len, NULL);
+    size_t cnt = doc->lines_cnt - (b - a) + added;
+    if (cnt > doc->lines_cap) {
+        doc->lines_cap = cnt * 2;
+        doc->lines = realloc(doc->lines, sizeof(size_t) * doc->lines_cap);
+        assert(doc->lines != NULL && "Cannot grow the lines");
+    }
+
+    memmove(doc->lines + a + added, doc->lines + b, sizeof(size_t) * (doc->lines_cnt - b));
+    for (size_t i = a + added; i < cnt; i++) doc->lines[i] = doc->lines[i] - (to - from) + len;
+    for (size_t i = 0, k = a; i < len; i++) {
+        if (text[i] == '\n') doc->lines[k++] = from + i + 1;
+    }
+    doc->lines_cnt = cnt;
+}
+
+Lsp_Block *lsp_block_at(Lsp_Document *doc, size_t offset) {
+    size_t lo = 0, hi = doc->blocks_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (doc->blocks[mid].start + doc->blocks[mid].len <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < doc->blocks_cnt && doc->blocks[lo].start <= offset) return &doc->blocks[lo];
+    return NULL;
+}
+
+bool lsp_same_defs(const Lsp_Block *a, const Lsp_Block *b) {
+    if (a->defs_cnt != b->defs_cnt) return false;
+    for (size_t i = 0; i < a->defs_cnt; i++) {
+        if (a->defs[i].hash != b->defs[i].hash || strcmp(a->defs[i].key, b->defs[i].key) != 0) return false;
+    }
+    return true;
+}
+
+// The definition named `key`, NULL when there is none
+const Lsp_Symbol *lsp_lookup(const Lsp_Document *doc, const char *key, uint64_t hash, size_t *block) {
+    for (size_t i = hash & doc->table_mask; doc->table[i].block != UINT32_MAX; i = (i + 1) & doc->table_mask) {
+        const Lsp_Symbol *def = &doc->blocks[doc->table[i].block].defs[doc->table[i].def];
+        if (def->hash == hash && strcmp(def->key, key) == 0) {
+            if (block != NULL) *block = doc->table[i].block;
+            return def;
+        }
+    }
+    return NULL;
+}
+
+// Puts the definitions of all the blocks in the table, the first one of
+// a name keeps it
+void lsp_index_defs(Lsp_Document *doc) {
+    size_t defs = 0;
+    for (size_t b = 0; b < doc->blocks_cnt; b++) defs += doc->blocks[b].defs_cnt;
+    size_t table_cap = 64;
+    while (table_cap < 2 * defs) table_cap *= 2;
+    if (doc->table == NULL || doc->table_mask + 1 != table_cap) {
+        free(doc->table);
+        doc->table = malloc(sizeof(*doc->table) * table_cap);
+        assert(doc->table != NULL && "Cannot allocate the definitions");
+        doc->table_mask = table_cap - 1;
+    }
+    memset(doc->table, 0xff, sizeof(*doc->table) * table_cap);
+
+    for (uint32_t b = 0; b < doc->blocks_cnt; b++) {
+        const Lsp_Block *block = &doc->blocks[b];
+        for (uint32_t d = 0; d < block->defs_cnt; d++) {
+            const Lsp_Symbol *def = &block->defs[d];
+            for (size_t i = def->hash & doc->table_mask;; i = (i + 1) & doc->table_mask) {
+                if (doc->table[i].block == UINT32_MAX) {
+                    doc->table[i].block = b;
+                    doc->table[i].def = d;
+                    break;
+                }
+                const Lsp_Symbol *other = &doc->blocks[doc->table[i].block].defs[doc->table[i].def];
+                if (other->hash == def->hash && strcmp(other->key, def->key) == 0) break;
+            }
+        }
+    }
+}
+
+// Marks what the block has to report against the table
+void lsp_resolve(Lsp_Document *doc, Lsp_Block *block) {
+    block->problems = block->failed;
+    for (size_t d = 0; d < block->defs_cnt; d++) {
+        Lsp_Symbol *def = &block->defs[d];
+        def->problem = lsp_lookup(doc, def->key, def->hash, NULL) != def;
+        block->problems += def->problem;
+    }
+    for (size_t r = 0; r < block->refs_cnt; r++) {
+        Lsp_Symbol *ref = &block->refs[r];
+        const Lsp_Symbol *def = lsp_lookup(doc, ref->key, ref->hash, NULL);
+        ref->problem = def == NULL || def->kind != SYMB_EVENT;
+        block->problems += ref->problem;
+    }
+}
+
+// Cuts the text in blocks again from the last block before the edits,
+// until a block after them starts and ends where it did. The blocks no
+// edit touched are kept, the others are parsed again. The definitions
+// are only indexed again when the names or the places of them changed,
+// otherwise just the targets of the new blocks are resolved.
+void lsp_update(Lsp *lsp, Lsp_Document *doc) {
+    Lsp_Block *old = doc->blocks;
+    size_t old_cnt = doc->blocks_cnt;
+    const char *text = doc->text;
+
+    // the last block before the edits is cut again too, without its closing
+    // tag it ends at the next one, which the edits may have changed
+    size_t keep = 0;
+    while (keep < old_cnt && !old[keep].dirty && old[keep].start + old[keep].len < doc->edit_from) keep++;
+    if (keep > 0) keep--;
+
+    size_t cap = old_cnt + 16;
+    Lsp_Block *blocks = malloc(sizeof(Lsp_Block) * cap);
+    assert(blocks != NULL && "Cannot allocate the blocks");
+    if (keep > 0) memcpy(blocks, old, sizeof(Lsp_Block) * keep);
+    size_t cnt = keep, o = keep;
+    bool reindex = false;
+    size_t from = keep > 0 ? old[keep - 1].start + old[keep - 1].len : 0;
+
+    for (size_t at = lsp_find_tag(text, from, doc->len, "subprocess", false); at < doc->len;) {
+        size_t next = lsp_find_tag(text, at + 1, doc->len, "subprocess", false);
+        size_t close = lsp_find_tag(text, at + 1, next, "subprocess", true);
+        size_t end = next;
+        if (close < next) {
+            const char *gt = memchr(text + close, '>', next - close);
+            if (gt != NULL) end = gt - text + 1;
+        } else {
+            // without its closing tag, it goes up to the end of the process
+            size_t process = lsp_find_tag(text, at + 1, next, "process", true);
+            if (process < end) end = process;
+        }
+
+        if (cnt == cap) {
+            cap *= 2;
+            blocks = realloc(blocks, sizeof(Lsp_Block) * cap);
+            assert(blocks != NULL && "Cannot grow the blocks");
+        }
+
+        while (o < old_cnt && old[o].start < at) {
+            lsp_block_free(&old[o++]);
+            reindex = true;
+        }
+
+        if (o < old_cnt && old[o].start == at && old[o].len == end - at && !old[o].dirty) {
+            reindex |= cnt != o;
+            blocks[cnt++] = old[o++];
+            if (at < doc->edit_to) {
+                at = next;
+                continue;
+            }
+
+            // past the edits, the rest is as it was
+            if (old_cnt - o > cap - cnt) {
+                cap = cnt + old_cnt - o;
+                blocks = realloc(blocks, sizeof(Lsp_Block) * cap);
+                assert(blocks != NULL && "Cannot grow the blocks");
+            }
+            reindex |= cnt != o;
+            memcpy(blocks + cnt, old + o, sizeof(Lsp_Block) * (old_cnt - o));
+            cnt += old_cnt - o;
+            o = old_cnt;
+            break;
+        }
+
+        Lsp_Block *block = &blocks[cnt];
+        *block = (Lsp_Block) { .start = at, .len = end - at, .dirty = true };
+        lsp_analyze(lsp, doc, block);
+        if (o < old_cnt && old[o].start == at) {
+            reindex |= cnt != o || !lsp_same_defs(block, &old[o]);
+            lsp_block_free(&old[o++]);
+        } else {
+            reindex = true;
+        }
+        cnt++;
+        at = next;
+    }
+    while (o < old_cnt) {
+        lsp_block_free(&old[o++]);
+        reindex = true;
+    }
+    free(old);
+
+    doc->blocks = blocks;
+    doc->blocks_cnt = cnt;
+    doc->blocks_cap = cap;
+    doc->edit_from = SIZE_MAX;
+    doc->edit_to = 0;
+    lsp_check_outside(lsp, doc);
+
+    if (reindex || doc->table == NULL) lsp_index_defs(doc);
+    for (size_t b = 0; b < cnt; b++) {
+        if (reindex || blocks[b].dirty) lsp_resolve(doc, &blocks[b]);
+        blocks[b].dirty = false;
+    }
+}
+
+Lsp_Document *lsp_document(Lsp *lsp, const char *uri, size_t len) {
+    for (size_t i = 0; i < lsp->docs_cnt; i++) {
+        if (strlen(lsp->docs[i].uri) == len && memcmp(lsp->docs[i].uri, uri, len) == 0) return &lsp->docs[i];
+    }
+    return NULL;
+}
+
+void lsp_set_text(Lsp_Document *doc, const char *text, size_t len) {
+    if (len + 1 > doc->cap) {
+        doc->cap = (len + 1) * 2;
+        doc->text = realloc(doc->text, doc->cap);
+        assert(doc->text != NULL && "Cannot grow the document");
+    }
+    memcpy(doc->text, text, len);
+    doc->text[len] = '\0';
+    doc->len = len;
+    doc->edit_from = 0;
+    doc->edit_to = len;
+    for (size_t b = 0; b < doc->blocks_cnt; b++) doc->blocks[b].dirty = true;
+    lsp_index_lines(doc);
+}
+
+/*
+ * Positions: lines and characters, in UTF-16 units unless the client
+ * takes UTF-8
+ */
+
+size_t lsp_offset(const Lsp *lsp, const Lsp_Document *doc, size_t line, size_t character) {
+    if (line >= doc->lines_cnt) return doc->len;
+
+    size_t at = doc->lines[line];
+    size_t end = line + 1 < doc->lines_cnt ? doc->lines[line + 1] - 1 : doc->len;
+    for (size_t units = 0; units < character && at < end;) {
+        unsigned char c = doc->text[at];
+        size_t bytes = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+        units += lsp->utf8 ? bytes : bytes == 4 ? 2 : 1;
+        at += bytes;
+    }
+    return at < end ? at : end;
+}
+
+void lsp_position(Lsp *lsp, const Lsp_Document *doc, size_t offset, Lsp_Out *out) {
+    size_t lo = 0, hi = doc->lines_cnt;
+    while (lo + 1 < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (doc->lines[mid] <= offset) lo = mid;
+        else hi = mid;
+    }
+
+    size_t units = 0;
+    for (size_t at = doc->lines[lo]; at < offset && at < doc->len;) {
+        unsigned char c = doc->text[at];
+        size_t bytes = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+        units += lsp->utf8 ? bytes : bytes == 4 ? 2 : 1;
+        at += bytes;
+    }
+    lsp_printf(out, "{\"line\":%zu,\"character\":%zu}", lo, units);
+}
+
+void lsp_range(Lsp *lsp, const Lsp_Document *doc, size_t offset, size_t len, Lsp_Out *out) {
+    lsp_printf(out, "{\"start\":");
+    lsp_position(lsp, doc, offset, out);
+    lsp_printf(out, ",\"end\":");
+    lsp_position(lsp, doc, offset + len, out);
+    lsp_printf(out, "}");
+}
+
+void lsp_location(Lsp *lsp, const Lsp_Document *doc, size_t offset, size_t len, Lsp_Out *out) {
+    lsp_printf(out, "{\"uri\":");
+    lsp_string(out, doc->uri, strlen(doc->uri));
+    lsp_printf(out, ",\"range\":");
+    lsp_range(lsp, doc, offset, len, out);
+    lsp_printf(out, "}");
+}
+
+/*
+ * Diagnostics
+ */
+
+void lsp_diagnostic(Lsp *lsp, const Lsp_Document *doc, bool *first, size_t offset, size_t len, int severity, const char *format, ...) {
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    Lsp_Out *out = &lsp->out;
+    lsp_printf(out, "%s{\"range\":", *first ? "" : ",");
+    lsp_range(lsp, doc, offset, len, out);
+    lsp_printf(out, ",\"severity\":%d,\"source\":\"pcs\",\"message\":", severity);
+    lsp_string(out, message, strlen(message));
+    lsp_printf(out, "}");
+    *first = false;
+}
+
+// The parser stops right after the token it complains about, which is
+// found back from `offset` without going before `from`
+size_t lsp_token_before(const Lsp_Document *doc, size_t from, size_t offset, size_t *start) {
+    const char *text = doc->text;
+    if (offset > doc->len) offset = doc->len;
+
+    size_t at = offset;
+    if (at > from && text[at - 1] == '\'') {
+        at--;
+        while (at > from && text[at - 1] != '\'') at--;
+        if (at > from) at--;
+    } else {
+        while (at > from && (isalnum((unsigned char) text[at - 1]) || text[at - 1] == '_')) at--;
+        if (at == offset && at > from && !isspace((unsigned char) text[at - 1])) at--;
+    }
+
+    *start = at;
+    return offset - at;
+}
+
+#define LSP_ERROR 1
+#define LSP_WARNING 2
+
+void lsp_publish(Lsp *lsp, const Lsp_Document *doc, FILE *file) {
+    Lsp_Out *out = &lsp->out;
+    lsp_printf(out, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":");
+    lsp_string(out, doc->uri, strlen(doc->uri));
+    lsp_printf(out, ",\"diagnostics\":[");
+
+    bool first = true;
+    if (doc->outside.failed) {
+        size_t start, len = lsp_token_before(doc, 0, doc->outside.error.offset, &start);
+        lsp_diagnostic(lsp, doc, &first, start, len, LSP_ERROR, "%s", doc->outside.error.message);
+    }
+
+    for (size_t b = 0; b < doc->blocks_cnt; b++) {
+        const Lsp_Block *block = &doc->blocks[b];
+        if (block->problems == 0) continue;
+        if (block->failed) {
+            size_t start, len = lsp_token_before(doc, block->start, block->start + block->error.offset, &start);
+            lsp_diagnostic(lsp, doc, &first, start, len, LSP_ERROR, "%s", block->error.message);
+        }
+
+        for (size_t d = 0; d < block->defs_cnt; d++) {
+            const Lsp_Symbol *def = &block->defs[d];
+            if (def->problem) {
+                size_t at;
+                const Lsp_Symbol *other = lsp_lookup(doc, def->key, def->hash, &at);
+                size_t line = lsp_line_after(doc, doc->blocks[at].start + other->offset);
+                lsp_diagnostic(lsp, doc, &first, block->start + def->offset, def->len, LSP_WARNING,
+                               "`%s` is already defined on line %zu", def->key, line);
+            }
+        }
+
+        for (size_t r = 0; r < block->refs_cnt; r++) {
+            const Lsp_Symbol *ref = &block->refs[r];
+            if (ref->problem) {
+                lsp_diagnostic(lsp, doc, &first, block->start + ref->offset, ref->len, LSP_WARNING, "points to unknown event `%s`", ref->key);
+            }
+        }
+    }
+
+    lsp_printf(out, "]}}");
+    lsp_send(out, file);
+}
+
+/*
+ * Requests
+ */
+
+// The symbol under the offset, with its block
+const Lsp_Symbol *lsp_symbol_at(Lsp_Document *doc, size_t offset, bool *def) {
+    Lsp_Block *block = lsp_block_at(doc, offset);
+    if (block == NULL) return NULL;
+
+    size_t at = offset - block->start;
+    for (size_t i = 0; i < block->refs_cnt; i++) {
+        const Lsp_Symbol *s = &block->refs[i];
+        if (s->offset <= at && at <= s->offset + s->len) {
+            *def = false;
+            return s;
+        }
+    }
+    for (size_t i = 0; i < block->defs_cnt; i++) {
+        const Lsp_Symbol *s = &block->defs[i];
+        if (s->offset <= at && at <= s->offset + s->len) {
+            *def = true;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void lsp_definition(Lsp *lsp, Lsp_Document *doc, size_t offset) {
+    Lsp_Out *out = &lsp->out;
+    bool def;
+    const Lsp_Symbol *symbol = lsp_symbol_at(doc, offset, &def);
+    size_t block;
+    const Lsp_Symbol *target = symbol != NULL ? lsp_lookup(doc, symbol->key, symbol->hash, &block) : NULL;
+
+    if (target == NULL) {
+        lsp_printf(out, "null");
+        return;
+    }
+    lsp_location(lsp, doc, doc->blocks[block].start + target->offset, target->len, out);
+}
+
+void lsp_references(Lsp *lsp, Lsp_Document *doc, size_t offset, bool declaration) {
+    Lsp_Out *out = &lsp->out;
+    bool def;
+    const Lsp_Symbol *symbol = lsp_symbol_at(doc, offset, &def);
+    if (symbol == NULL) {
+        lsp_printf(out, "null");
+        return;
+    }
+
+    // copied, the symbol is in the blocks that are walked
+    char key[MAX_TOKEN_LEN * 2];
+    snprintf(key, sizeof(key), "%s", symbol->key);
+    uint64_t hash = symbol->hash;
+
+    bool first = true;
+    lsp_printf(out, "[");
+    size_t block;
+    const Lsp_Symbol *target = lsp_lookup(doc, key, hash, &block);
+    if (declaration && target != NULL) {
+        lsp_location(lsp, doc, doc->blocks[block].start + target->offset, target->len, out);
+        first = false;
+    }
+
+    for (size_t b = 0; b < doc->blocks_cnt; b++) {
+        const Lsp_Block *blk = &doc->blocks[b];
+        for (size_t r = 0; r < blk->refs_cnt; r++) {
+            const Lsp_Symbol *ref = &blk->refs[r];
+            if (ref->hash != hash || strcmp(ref->key, key) != 0) continue;
+            if (!first) lsp_printf(out, ",");
+            lsp_location(lsp, doc, blk->start + ref->offset, ref->len, out);
+            first = false;
+        }
+    }
+    lsp_printf(out, "]");
+}
+
+// Ids of the events when the offset is in a `points`, the ones of the
+// same subprocess without it
+void lsp_completion(Lsp *lsp, Lsp_Document *doc, size_t offset) {
+    Lsp_Out *out = &lsp->out;
+    const char *text = doc->text;
+
+    // back to the quote, which must come after points=
+    size_t word = offset;
+    while (word > 0 && text[word - 1] != '\'' && text[word - 1] != ',' && text[word - 1] != '\n') word--;
+    size_t quote = word;
+    while (quote > 0 && text[quote - 1] != '\'' && text[quote - 1] != '\n') quote--;
+    size_t p = quote > 0 ? quote - 1 : 0;
+    while (p > 0 && isspace((unsigned char) text[p - 1])) p--;
+    bool in_points = quote > 0 && text[quote - 1] == '\'' && p > 0 && text[p - 1] == '=';
+    if (in_points) {
+        p--;
+        while (p > 0 && isspace((unsigned char) text[p - 1])) p--;
+        in_points = p >= 6 && memcmp(text + p - 6, "points", 6) == 0;
+    }
+
+    Lsp_Block *here = lsp_block_at(doc, offset);
+    if (!in_points || here == NULL) {
+        lsp_printf(out, "[]");
+        return;
+    }
+
+    size_t ns_len = strlen(here->ns);
+    lsp_printf(out, "{\"isIncomplete\":false,\"items\":[");
+    bool first = true;
+    for (size_t b = 0; b < doc->blocks_cnt; b++) {
+        const Lsp_Block *block = &doc->blocks[b];
+        for (size_t d = 0; d < block->defs_cnt; d++) {
+            const Lsp_Symbol *def = &block->defs[d];
+            if (def->kind != SYMB_EVENT) continue;
+
+            const char *label = def->key;
+            if (ns_len > 0 && strncmp(def->key, here->ns, ns_len) == 0 && def->key[ns_len] == '.') label += ns_len + 1;
+
+            lsp_printf(out, "%s{\"label\":", first ? "" : ",");
+            lsp_string(out, label, strlen(label));
+            lsp_printf(out, ",\"kind\":23,\"detail\":");
+            lsp_string(out, def->type, strlen(def->type));
+            lsp_printf(out, ",\"textEdit\":{\"range\":");
+            lsp_range(lsp, doc, word, offset - word, out);
+            lsp_printf(out, ",\"newText\":");
+            lsp_string(out, label, strlen(label));
+            lsp_printf(out, "}}");
+            first = false;
+        }
+    }
+    lsp_printf(out, "]}");
+}
+
+// Applies the edits of a didChange, marking the blocks they touch
+void lsp_change(Lsp *lsp, Lsp_Document *doc, const Json_Parser *json, uint32_t changes) {
+    for (uint32_t c = json->values[changes].first; c != JSON_NONE; c = json->values[c].next) {
+        size_t len;
+        const char *text = json_str(json, json_get(json, c, "text"), &len);
+        if (text == NULL) continue;
+
+        uint32_t range = json_get(json, c, "range");
+        if (range == JSON_NONE) {
+            lsp_set_text(doc, text, len);
+            continue;
+        }
+
+        size_t from = lsp_offset(lsp, doc, json_number(json, json_path(json, range, "start.line"), 0),
+                                 json_number(json, json_path(json, range, "start.character"), 0));
+        size_t to = lsp_offset(lsp, doc, json_number(json, json_path(json, range, "end.line"), 0),
+                               json_number(json, json_path(json, range, "end.character"), 0));
+        if (to < from) to = from;
+
+        size_t new_len = doc->len - (to - from) + len;
+        if (new_len + 1 > doc->cap) {
+            doc->cap = (new_len + 1) * 2;
+            doc->text = realloc(doc->text, doc->cap);
+            assert(doc->text != NULL && "Cannot grow the document");
+        }
+        memmove(doc->text + from + len, doc->text + to, doc->len - to + 1);
+        memcpy(doc->text + from, text, len);
+        doc->len = new_len;
+        lsp_splice_lines(doc, from, to, text, len);
+
+        size_t edit_to = doc->edit_to >= to ? doc->edit_to - (to - from) + len : doc->edit_to;
+        if (from < doc->edit_from) doc->edit_from = from;
+        doc->edit_to = edit_to > from + len ? edit_to : from + len;
+
+        // blocks after the edit move, the ones it touches are parsed again
+        for (size_t b = 0; b < doc->blocks_cnt; b++) {
+            Lsp_Block *block = &doc->blocks[b];
+            if (block->start + block->len <= from) continue;
+            if (block->start >= to) block->start = block->start + len - (to - from);
+            else block->dirty = true;
+        }
+    }
+}
+
+void lsp_reply_start(Lsp_Out *out, const Json_Parser *json, uint32_t id) {
+    lsp_printf(out, "{\"jsonrpc\":\"2.0\",\"id\":");
+    if (id == JSON_NONE) lsp_printf(out, "null");
+    else lsp_printf(out, "%.*s", (int) json->values[id].raw_len, json->values[id].raw);
+}
+
+void lsp_error(Lsp_Out *out, const Json_Parser *json, uint32_t id, int code, const char *message, FILE *file) {
+    lsp_reply_start(out, json, id);
+    lsp_printf(out, ",\"error\":{\"code\":%d,\"message\":", code);
+    lsp_string(out, message, strlen(message));
+    lsp_printf(out, "}}");
+    lsp_send(out, file);
+}
+
+// Handles one message. Returns false on exit.
+bool lsp_handle(Lsp *lsp, Json_Parser *json, char *body, size_t len, FILE *file, int *status) {
+    json->p = body;
+    json->end = body + len;
+    json->cnt = 0;
+
+    uint32_t root = JSON_NONE;
+    if (setjmp(json->fail) == 0) {
+        root = json_value(json, 0);
+    } else {
+        lsp_error(&lsp->out, json, JSON_NONE, -32700, "Parse error", file);
+        return true;
+    }
+
+    uint32_t id = json_get(json, root, "id");
+    uint32_t params = json_get(json, root, "params");
+    size_t method_len;
+    const char *method = json_str(json, json_get(json, root, "method"), &method_len);
+    if (method == NULL) return true;  // a response to us
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", (int) method_len, method);
+
+    size_t uri_len = 0;
+    const char *uri = json_str(json, json_path(json, params, "textDocument.uri"), &uri_len);
+    Lsp_Document *doc = uri != NULL ? lsp_document(lsp, uri, uri_len) : NULL;
+    Lsp_Out *out = &lsp->out;
+
+    if (strcmp(name, "initialize") == 0) {
+        uint32_t encodings = json_path(json, params, "capabilities.general.positionEncodings");
+        if (encodings != JSON_NONE && json->values[encodings].kind == JSON_ARRAY) {
+            for (uint32_t e = json->values[encodings].first; e != JSON_NONE; e = json->values[e].next) {
+                size_t n;
+                const char *encoding = json_str(json, e, &n);
+                if (encoding != NULL && n == 5 && memcmp(encoding, "utf-8", 5) == 0) lsp->utf8 = true;
+            }
+        }
+
+        lsp_reply_start(out, json, id);
+        lsp_printf(out, ",\"result\":{\"capabilities\":{\"positionEncoding\":\"%s\","
+                   "\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+                   "\"definitionProvider\":true,\"referencesProvider\":true,"
+                   "\"completionProvider\":{\"triggerCharacters\":[\"'\",\",\",\".\"]}},"
+                   "\"serverInfo\":{\"name\":\"pcs\"}}}", lsp->utf8 ? "utf-8" : "utf-16");
+        lsp_send(out, file);
+    } else if (strcmp(name, "shutdown") == 0) {
+        lsp->shutdown = true;
+        lsp_reply_start(out, json, id);
+        lsp_printf(out, ",\"result\":null}");
+        lsp_send(out, file);
+    } else if (strcmp(name, "exit") == 0) {
+        *status = lsp->shutdown ? EXIT_SUCCESS : EXIT_FAILURE;
+        return false;
+    } else if (strcmp(name, "textDocument/didOpen") == 0) {
+        size_t text_len;
+        const char *text = json_str(json, json_path(json, params, "textDocument.text"), &text_len);
+        if (uri == NULL || text == NULL) return true;
+
+        if (doc == NULL) {
+            if (lsp->docs_cnt == lsp->docs_cap) {
+                lsp->docs_cap = lsp->docs_cap == 0 ? 4 : lsp->docs_cap * 2;
+                lsp->docs = realloc(lsp->docs, sizeof(Lsp_Document) * lsp->docs_cap);
+                assert(lsp->docs != NULL && "Cannot grow the documents");
+            }
+            doc = &lsp->docs[lsp->docs_cnt++];
+            memset(doc, 0, sizeof(*doc));
+            doc->uri = strndup(uri, uri_len);
+            assert(doc->uri != NULL && "Cannot allocate the document");
+        }
+        lsp_set_text(doc, text, text_len);
+        lsp_update(lsp, doc);
+        lsp_publish(lsp, doc, file);
+    } else if (strcmp(name, "textDocument/didChange") == 0) {
+        uint32_t changes = json_get(json, params, "contentChanges");
+        if (doc == NULL || changes == JSON_NONE || json->values[changes].kind != JSON_ARRAY) return true;
+
+        lsp_change(lsp, doc, json, changes);
+        lsp_update(lsp, doc);
+        lsp_publish(lsp, doc, file);
+    } else if (strcmp(name, "textDocument/didClose") == 0) {
+        if (doc == NULL) return true;
+
+        for (size_t b = 0; b < doc->blocks_cnt; b++) lsp_block_free(&doc->blocks[b]);
+        lsp_block_free(&doc->outside);
+        free(doc->blocks);
+        free(doc->table);
+        free(doc->text);
+        free(doc->lines);
+        free(doc->uri);
+        *doc = lsp->docs[--lsp->docs_cnt];
+    } else if (strcmp(name, "textDocument/definition") == 0 || strcmp(name, "textDocument/references") == 0
+               || strcmp(name, "textDocument/completion") == 0) {
+        uint32_t line = json_path(json, params, "position.line");
+        uint32_t character = json_path(json, params, "position.character");
+        if (doc == NULL || line == JSON_NONE || character == JSON_NONE) {
+            lsp_error(out, json, id, -32602, "Expected an open textDocument and a position", file);
+            return true;
+        }
+
+        size_t offset = lsp_offset(lsp, doc, json_number(json, line, 0), json_number(json, character, 0));
+        lsp_reply_start(out, json, id);
+        lsp_printf(out, ",\"result\":");
+        if (name[13] == 'd') {
+            lsp_definition(lsp, doc, offset);
+        } else if (name[13] == 'r') {
+            uint32_t declaration = json_path(json, params, "context.includeDeclaration");
+            lsp_references(lsp, doc, offset, declaration != JSON_NONE && json->values[declaration].kind == JSON_TRUE);
+        } else {
+            lsp_completion(lsp, doc, offset);
+        }
+        lsp_printf(out, "}");
+        lsp_send(out, file);
+    } else if (id != JSON_NONE) {
+        lsp_error(out, json, id, -32601, "Method not found", file);
+    }
+
+    return true;
+}
+
+// Serves the messages of `in` until exit. Returns the exit status.
+int lsp(FILE *in, FILE *out) {
+    static Lsp server = {0};
+    Json_Parser json = {0};
+    init_screen(&lsp_screen);
+
+    char *body = NULL;
+    size_t body_cap = 0;
+    char header[256];
+    int status = EXIT_FAILURE;
+
+    for (;;) {
+        size_t len = 0;
+        bool has_len = false;
+        for (;;) {
+            if (fgets(header, sizeof(header), in) == NULL) goto done;
+            if (strcmp(header, "\r\n") == 0 || strcmp(header, "\n") == 0) break;
+            if (strncasecmp(header, "Content-Length:", 15) == 0) {
+                len = strtoull(header + 15, NULL, 10);
+                has_len = true;
+            }
+        }
+        if (!has_len) continue;
+
+        if (len + 1 > body_cap) {
+            body_cap = (len + 1) * 2;
+            body = realloc(body, body_cap);
+            assert(body != NULL && "Cannot grow the message");
+        }
+        if (fread(body, 1, len, in) != len) break;
+        body[len] = '\0';
+
+        if (!lsp_handle(&server, &json, body, len, out, &status)) break;
+    }
+
+done:
+    free(body);
+    free(json.values);
+    return status;
+}
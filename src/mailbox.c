@@ -0,0 +1,273 @@
+/*******************************************************************\
+| Section: Mailboxes                                                |
+| Messages for mail events, addressed to an instance (and the       |
+| generation of its slot, as ids are reused) and to the mail event  |
+| that waits for them. Any thread posts into the queue of the lane  |
+| of that event, a bounded lock-free MPSC ring, and the thread that |
+| runs the lane drains it. Messages that arrive before their        |
+| instance reaches the event are kept in a bounded table until      |
+| their TTL runs out.                                               |
+\*******************************************************************/
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint32_t instance;
+    uint32_t generation;
+    uint32_t node;  // mail event the message is for
+    uint64_t payload;
+} Message;
+
+/*
+ * Bounded MPSC ring (Vyukov): every cell carries a sequence number that
+ * tells producers whether it is free for their position and the consumer
+ * whether it was written. Producers only race on a CAS of the tail.
+ */
+
+typedef struct {
+    _Atomic size_t seq;
+    Message message;
+} Mail_Cell;
+
+typedef struct {
+    Mail_Cell *cells;
+    size_t mask;
+
+    _Alignas(64) _Atomic size_t tail;  // producers
+    _Alignas(64) size_t head;          // consumer only
+} Mail_Queue;
+
+void mail_queue_init(Mail_Queue *queue, size_t cap) {
+    assert(cap > 0 && (cap & (cap - 1)) == 0 && "Mail queue capacity must be a power of two");
+
+    memset(queue, 0, sizeof(*queue));
+    queue->cells = malloc(sizeof(Mail_Cell) * cap);
+    assert(queue->cells != NULL && "Cannot allocate mail queue");
+    queue->mask = cap - 1;
+
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&queue->cells[i].seq, i);
+    }
+    atomic_init(&queue->tail, 0);
+}
+
+void mail_queue_free(Mail_Queue *queue) {
+    free(queue->cells);
+    memset(queue, 0, sizeof(*queue));
+}
+
+// Safe from any thread. Returns false when the queue is full.
+bool mail_queue_push(Mail_Queue *queue, Message message) {
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    for (;;) {
+        Mail_Cell *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->message = message;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Only from the thread that owns the queue
+bool mail_queue_pop(Mail_Queue *queue, Message *message) {
+    Mail_Cell *cell = &queue->cells[queue->head & queue->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq != queue->head + 1) return false;
+
+    *message = cell->message;
+    atomic_store_explicit(&cell->seq, queue->head + queue->mask + 1, memory_order_release);
+    queue->head++;
+    return true;
+}
+
+/*
+ * Unmatched messages: open addressing on (instance, generation, node) with
+ * backward shift deletion, plus a FIFO of arrivals. The TTL is the same for
+ * every message, so the FIFO is also in expiry order and expiring is a
+ * walk from its front.
+ *
+ * Every entry has exactly one arrival, tied to it by `seq`. A message that
+ * replaces another keeps the arrival of the old one, which is queued again
+ * with the new expiry when it comes due. Taken messages leave their arrival
+ * behind, and the dead arrivals are compacted away when the FIFO fills up.
+ */
+
+typedef struct {
+    Message message;
+    uint64_t expires;
+    uint64_t seq;
+    bool used;
+} Mail_Entry;
+
+typedef struct {
+    Message message;  // only the key is used
+    uint64_t expires;
+    uint64_t seq;
+} Mail_Arrival;
+
+typedef struct {
+    Mail_Entry *entries;
+    size_t mask;
+    size_t len;
+    uint64_t seq;
+
+    Mail_Arrival *fifo;
+    size_t fifo_head;
+    size_t fifo_len;
+} Mail_Table;
+
+void mail_table_init(Mail_Table *table, size_t cap) {
+    assert(cap > 0 && (cap & (cap - 1)) == 0 && "Mail table capacity must be a power of two");
+
+    memset(table, 0, sizeof(*table));
+    table->entries = calloc(cap * 2, sizeof(Mail_Entry));
+    table->fifo = malloc(sizeof(Mail_Arrival) * cap);
+    assert(table->entries != NULL && table->fifo != NULL && "Cannot allocate mail table");
+    table->mask = cap * 2 - 1;
+}
+
+void mail_table_free(Mail_Table *table) {
+    free(table->entries);
+    free(table->fifo);
+    memset(table, 0, sizeof(*table));
+}
+
+size_t mail_table_cap(const Mail_Table *table) {
+    return (table->mask + 1) / 2;
+}
+
+bool mail_same_key(const Message *a, const Message *b) {
+    return a->instance == b->instance && a->generation == b->generation && a->node == b->node;
+}
+
+size_t mail_hash(const Message *key) {
+    uint64_t h = ((uint64_t) key->instance << 32 | key->node) ^ ((uint64_t) key->generation * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+Mail_Entry *mail_table_find(Mail_Table *table, const Message *key) {
+    for (size_t i = mail_hash(key) & table->mask;; i = (i + 1) & table->mask) {
+        Mail_Entry *entry = &table->entries[i];
+        if (!entry->used || mail_same_key(&entry->message, key)) return entry;
+    }
+}
+
+void mail_table_remove(Mail_Table *table, Mail_Entry *entry) {
+    size_t hole = entry - table->entries;
+    table->entries[hole].used = false;
+    table->len--;
+
+    // pull back the entries of the cluster that would not be found anymore
+    for (size_t i = (hole + 1) & table->mask; table->entries[i].used; i = (i + 1) & table->mask) {
+        size_t home = mail_hash(&table->entries[i].message) & table->mask;
+        if (((i - home) & table->mask) >= ((i - hole) & table->mask)) {
+            table->entries[hole] = table->entries[i];
+            table->entries[i].used = false;
+            hole = i;
+        }
+    }
+}
+
+// The entry of a live arrival, NULL when its message was taken
+Mail_Entry *mail_table_arrival(Mail_Table *table, const Mail_Arrival *arrival) {
+    Mail_Entry *entry = mail_table_find(table, &arrival->message);
+    return entry->used && entry->seq == arrival->seq ? entry : NULL;
+}
+
+void mail_table_append(Mail_Table *table, Mail_Arrival arrival) {
+    size_t cap = mail_table_cap(table);
+    assert(table->fifo_len < cap && "Mail table FIFO overflow");
+    table->fifo[(table->fifo_head + table->fifo_len++) & (cap - 1)] = arrival;
+}
+
+// Drops the arrivals of taken messages, keeping the order of the others
+void mail_table_compact(Mail_Table *table) {
+    size_t cap = mail_table_cap(table);
+    size_t kept = 0;
+
+    for (size_t i = 0; i < table->fifo_len; i++) {
+        Mail_Arrival arrival = table->fifo[(table->fifo_head + i) & (cap - 1)];
+        if (mail_table_arrival(table, &arrival) != NULL) {
+            table->fifo[(table->fifo_head + kept++) & (cap - 1)] = arrival;
+        }
+    }
+
+    table->fifo_len = kept;
+}
+
+// Drops the messages whose TTL ran out by `now`, returns how many
+size_t mail_table_expire(Mail_Table *table, uint64_t now) {
+    size_t expired = 0;
+    size_t cap = mail_table_cap(table);
+
+    while (table->fifo_len > 0 && table->fifo[table->fifo_head].expires <= now) {
+        Mail_Arrival arrival = table->fifo[table->fifo_head];
+        table->fifo_head = (table->fifo_head + 1) & (cap - 1);
+        table->fifo_len--;
+
+        Mail_Entry *entry = mail_table_arrival(table, &arrival);
+        if (entry == NULL) continue;
+
+        if (entry->expires <= now) {
+            mail_table_remove(table, entry);
+            expired++;
+        } else {
+            // replaced by a newer message, which expires later than anything queued
+            arrival.expires = entry->expires;
+            mail_table_append(table, arrival);
+        }
+    }
+
+    return expired;
+}
+
+// Keeps the message until `expires`. A newer message for the same
+// instance and event replaces the older one. Returns false when full.
+bool mail_table_put(Mail_Table *table, Message message, uint64_t expires) {
+    Mail_Entry *entry = mail_table_find(table, &message);
+    if (entry->used) {
+        entry->message = message;
+        entry->expires = expires;
+        return true;
+    }
+
+    if (table->len == mail_table_cap(table)) return false;
+    if (table->fifo_len == mail_table_cap(table)) mail_table_compact(table);
+
+    // compacting leaves the entries where they are
+    uint64_t seq = table->seq++;
+    *entry = (Mail_Entry) { .message = message, .expires = expires, .seq = seq, .used = true };
+    table->len++;
+
+    mail_table_append(table, (Mail_Arrival) { .message = message, .expires = expires, .seq = seq });
+    return true;
+}
+
+bool mail_table_take(Mail_Table *table, const Message *key, Message *message) {
+    if (table->len == 0) return false;
+
+    Mail_Entry *entry = mail_table_find(table, key);
+    if (!entry->used) return false;
+
+    *message = entry->message;
+    mail_table_remove(table, entry);
+    return true;
+}
@@ -1,17 +1,59 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// FNV-1a, for the hash tables of the modules below and the keys of caches
+uint64_t hash_bytes(const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
 
 #include "bundle.c"
+#include "timer.c"
+#include "mailbox.c"
+#include "wal.c"
+#include "histogram.c"
+#include "engine.c"
+#include "pool.c"
+#include "metrics.c"
+#include "trace.c"
+#include "sim.c"
+#include "heatmap.c"
+#include "conform.c"
+#include "discover.c"
+#include "analysis.c"
+#include "emit.c"
 #include "raylib.h"
 #include "raymath.h"
+#include "rlgl.h"
 
 #define ASSERT assert
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
-#define FAIL exit(EXIT_FAILURE)
+
+// The language server parses with a jump armed, so errors go back to it
+// instead of ending the program
+static jmp_buf *fail_jump = NULL;
+#define FAIL do { if (fail_jump != NULL) longjmp(*fail_jump, 1); exit(EXIT_FAILURE); } while (0)
 
 char *shift_args(int *argc, char ***argv) {
     ASSERT(*argc > 0 && "Shifting empty command line arguments!");
@@ -19,7 +61,35 @@ char *shift_args(int *argc, char ***argv) {
     return *(*argv)++;
 }
 
-void usage(char *program_name) { printf("Usage: %s <FILE>\n", program_name); }
+void usage(char *program_name) {
+    printf("Usage: %s [OPTIONS] <FILE>\n", program_name);
+    printf("Options:\n");
+    printf("    --run <N>             run N instances of the process per starter and exit\n");
+    printf("    --simulate <N>        simulate N instances using the `duration` of the events\n");
+    printf("    --replications <N>    independent replications of the simulation (default: threads)\n");
+    printf("    --threads <N>         threads used by the simulation, --conform and --discover (default: cores)\n");
+    printf("    --seed <N>            seed of the simulation\n");
+    printf("    --bench <N>           measure the engine on N instances per starter and exit\n");
+    printf("    --bench-store <N>     compare the instance store with an array of structs on N instances per starter\n");
+    printf("    --wal <DIR>           log the instances of --run to DIR and recover them from there\n");
+    printf("    --metrics <FORMAT>    print the metrics of --run or --simulate as json or prom instead\n");
+    printf("    --trace <FILE>        write the moves of the tokens of --simulate to FILE, in one replication\n");
+    printf("    --play <FILE>         play back a trace of --trace in the viewer\n");
+    printf("    --heatmap <FILE|sim>  color the diagram by a file of --metrics prom or by a --simulate run, H toggles it\n");
+    printf("    --conform <LOG>       replay the cases of a CSV event log on the process and print their fitness\n");
+    printf("    --discover <LOG>      print a process found in a CSV event log as a .pcs file and exit, without FILE\n");
+    printf("    --filter <R>          drop the pairs of --discover rarer than R times the busiest of their events (default: %g)\n", DISCOVER_FILTER);
+    printf("    --lsp                 serve the Language Server Protocol over stdio, without FILE\n");
+    printf("    --export <FILE>       draw the diagram to FILE as a PNG in a hidden window and exit\n");
+    printf("    --scale <S>           size of --export against the window, the text stays sharp (default: 1)\n");
+    printf("    --workers <N>         threads stepping instances in --run and --bench (default: 1)\n");
+    printf("    --analyze             print the critical path and expected cycle time and exit\n");
+    printf("    --emit-c              print the process as a C state machine and exit\n");
+}
+
+// The lexer scans the content in blocks of up to 32 bytes, so the buffer is
+// padded with zeros to keep the last loads inside the allocation
+#define READ_PADDING 32
 
 char *read_file(const char *file_path) {
     char *content = NULL;
@@ -32,7 +102,7 @@ char *read_file(const char *file_path) {
     if (fseek(file, 0L, SEEK_END) != 0) goto CLEAN_UP;
 
     long file_size = ftell(file);
-    content = malloc(sizeof(char) * file_size);
+    content = malloc(sizeof(char) * (file_size + READ_PADDING));
     rewind(file);
 
     long bytes_readed = fread(content, sizeof(char), file_size, file);
@@ -43,6 +113,7 @@ char *read_file(const char *file_path) {
         goto CLEAN_UP;
     }
 
+    memset(content + file_size, 0, READ_PADDING);
     fclose(file);
     return content;
 
@@ -90,16 +161,21 @@ typedef struct {
             Event_Kind kind;
             char title[MAX_TOKEN_LEN];
             char points_to[3][MAX_TOKEN_LEN];
+            double weights[3];
+            Gateway_Kind gateway;
+            Distribution duration;
         } event;
 
         struct Subprocess_Symb {
             char name[MAX_TOKEN_LEN];
+            int capacity;
         } subprocess;
 
     } as;
 
     Symb_Kind kind;
     int obj_id;
+    uint32_t node_id;
 } Symbol;
 
 typedef struct {
@@ -113,7 +189,7 @@ typedef struct {
     size_t len;
 } Hash_Map;
 
-bool str_contains(char *haystack, char needle, size_t limit) {
+bool str_contains(const char *haystack, char needle, size_t limit) {
     for (size_t i = 0; i < limit && haystack[i] != '\0'; i++) {
         if (haystack[i] == needle) {
             return true;
@@ -124,7 +200,7 @@ bool str_contains(char *haystack, char needle, size_t limit) {
 }
 
 // appends namespace to symbol if not already contains it
-void symb_name(char *dest, char *namespace, char *name) {
+void symb_name(char *dest, char *namespace, const char *name) {
     size_t i = 0;
 
     if (!str_contains(name, '.', MAX_TOKEN_LEN))  {
@@ -161,7 +237,7 @@ Key_Value *get_symbol(Hash_Map *map, char *key) {
     size_t h = hash(key, &key_len);
 
     Key_Value *entry = &map->entries[HASHMAP_INDEX(h)];
-    while (entry->occupied && memcmp(entry->key, key, key_len) != 0) {
+    while (entry->occupied && memcmp(entry->key, key, key_len + 1) != 0) {
         h++;
         entry = &map->entries[HASHMAP_INDEX(h)];
     }
@@ -176,7 +252,7 @@ Key_Value* put_symbol(Hash_Map *map, char *key, Symbol symbol) {
 
     ASSERT(map->len < HASHMAP_CAPACITY && "Symbols Table is full!");
 
-    while (entry->occupied && memcmp(entry->key, key, key_len) != 0) {
+    while (entry->occupied && memcmp(entry->key, key, key_len + 1) != 0) {
         h++;
         entry = &map->entries[HASHMAP_INDEX(h)];
     }
@@ -281,56 +357,227 @@ Token_Kind get_kind(char *key, size_t key_len) {
 | Section: Lexer                                                    |
 \*******************************************************************/
 
-#define PRINT_ERROR(lexer, msg)                                         \
-    fprintf(stderr, "%s:%ld:%ld: error: " msg "\n", (lexer)->file_path, \
-            (lexer)->row, (lexer)->col);
+#define PRINT_ERROR(lexer, msg) lex_error((lexer), "%s", msg)
+#define PRINT_ERROR_FMT(lexer, format, ...) lex_error((lexer), format, __VA_ARGS__)
+
+typedef struct {
+    size_t row, col;
+} Location;
 
-#define PRINT_ERROR_FMT(lexer, format, ...)                                \
-    fprintf(stderr, "%s:%ld:%ld: error: " format "\n", (lexer)->file_path, \
-            (lexer)->row, (lexer)->col, __VA_ARGS__);
+typedef struct {
+    size_t offset;  // in the source
+    char message[512];
+} Lex_Error;
 
 typedef struct {
+    char *source;
     char *content;
-    size_t col, row;
     const char *file_path;
     Hash_Map symbols;
     Token token;
+
+    // offsets of every '\n' in source, only built when a location is needed
+    size_t *newlines;
+    size_t newlines_cnt;
+    bool newlines_ready;
+
+    Lex_Error *error;  // takes the errors instead of stderr when set
 } Lexer;
 
 void init_lexer(Lexer *lexer, const char *file_path) {
-    lexer->col = 1;
-    lexer->row = 1;
     lexer->file_path = file_path;
-    lexer->content = read_file(file_path);
+    lexer->source = read_file(file_path);
+    lexer->content = lexer->source;
     lexer->symbols.len = 0;
+    lexer->newlines = NULL;
+    lexer->newlines_cnt = 0;
+    lexer->newlines_ready = false;
+    lexer->error = NULL;
 }
 
 char lex_getc(Lexer *lexer) {
     char c = *lexer->content;
-    if (c == '\0') {
-        return '\0';
+    if (c != '\0') {
+        lexer->content++;
     }
 
-    if (c == '\n') {
-        lexer->col = 1;
-        lexer->row += 1;
-    } else {
-        lexer->col += 1;
-    }
-
-    lexer->content++;
     return c;
 }
 
 char lex_peekc(Lexer *lexer) { return *lexer->content; }
 
-char lex_trim_left(Lexer *lexer) {
-    char c = lex_getc(lexer);
-    while (c != '\0' && isspace(c)) {
-        c = lex_getc(lexer);
+// Moves the cursor `n` bytes forward. The skipped bytes must not contain '\0'
+void lex_advance(Lexer *lexer, size_t n) { lexer->content += n; }
+
+/*
+ * Scanning kernels:
+ *   - lex_span_space:    length of the whitespace run at `s` (same set as
+ *                        isspace in the C locale)
+ *   - lex_span_string:   length of a string literal body, up to `'`, '\n'
+ *                        or '\0'
+ *   - lex_find_newlines: collects the offsets of every '\n' in `s[0..len)`,
+ *                        returns how many there are (`out` may be NULL)
+ * The '\0' terminator always stops the span scans and read_file guarantees
+ * that the blocks loaded after it are still inside the buffer.
+ */
+#if defined(__AVX2__)
+
+#define LEX_BLOCK 32
+typedef __m256i Lex_Block;
+#define LEX_LOAD(p)      _mm256_loadu_si256((const __m256i *) (p))
+#define LEX_SET1(c)      _mm256_set1_epi8(c)
+#define LEX_EQ(a, b)     _mm256_cmpeq_epi8(a, b)
+#define LEX_OR(a, b)     _mm256_or_si256(a, b)
+#define LEX_SUB(a, b)    _mm256_sub_epi8(a, b)
+#define LEX_SUBS_U(a, b) _mm256_subs_epu8(a, b)
+#define LEX_ZERO()       _mm256_setzero_si256()
+#define LEX_MASK(v)      ((uint32_t) _mm256_movemask_epi8(v))
+
+#elif defined(__SSE2__)
+
+#define LEX_BLOCK 16
+typedef __m128i Lex_Block;
+#define LEX_LOAD(p)      _mm_loadu_si128((const __m128i *) (p))
+#define LEX_SET1(c)      _mm_set1_epi8(c)
+#define LEX_EQ(a, b)     _mm_cmpeq_epi8(a, b)
+#define LEX_OR(a, b)     _mm_or_si128(a, b)
+#define LEX_SUB(a, b)    _mm_sub_epi8(a, b)
+#define LEX_SUBS_U(a, b) _mm_subs_epu8(a, b)
+#define LEX_ZERO()       _mm_setzero_si128()
+#define LEX_MASK(v)      ((uint32_t) _mm_movemask_epi8(v))
+
+#endif
+
+#ifdef LEX_BLOCK
+
+size_t lex_span_space(const char *s) {
+    size_t n = 0;
+    for (;;) {
+        Lex_Block v = LEX_LOAD(s + n);
+        // '\t', '\n', '\v', '\f' and '\r' are the range 9..13
+        Lex_Block ctl = LEX_EQ(LEX_SUBS_U(LEX_SUB(v, LEX_SET1('\t')), LEX_SET1('\r' - '\t')), LEX_ZERO());
+        uint32_t space = LEX_MASK(LEX_OR(LEX_EQ(v, LEX_SET1(' ')), ctl));
+        uint32_t stop = ~space & (uint32_t) ((1ULL << LEX_BLOCK) - 1);
+        if (stop) return n + __builtin_ctz(stop);
+        n += LEX_BLOCK;
     }
+}
 
-    return c;
+size_t lex_span_string(const char *s) {
+    size_t n = 0;
+    for (;;) {
+        Lex_Block v = LEX_LOAD(s + n);
+        Lex_Block stop = LEX_OR(LEX_OR(LEX_EQ(v, LEX_SET1('\'')), LEX_EQ(v, LEX_SET1('\n'))), LEX_EQ(v, LEX_ZERO()));
+        uint32_t mask = LEX_MASK(stop);
+        if (mask) return n + __builtin_ctz(mask);
+        n += LEX_BLOCK;
+    }
+}
+
+size_t lex_find_newlines(const char *s, size_t len, size_t *out) {
+    size_t cnt = 0;
+    size_t i = 0;
+    for (; i + LEX_BLOCK <= len; i += LEX_BLOCK) {
+        uint32_t mask = LEX_MASK(LEX_EQ(LEX_LOAD(s + i), LEX_SET1('\n')));
+        if (out == NULL) {
+            cnt += __builtin_popcount(mask);
+            continue;
+        }
+
+        for (; mask; mask &= mask - 1) {
+            out[cnt++] = i + __builtin_ctz(mask);
+        }
+    }
+
+    for (; i < len; i++) {
+        if (s[i] == '\n') {
+            if (out) out[cnt] = i;
+            cnt++;
+        }
+    }
+
+    return cnt;
+}
+
+#else
+
+size_t lex_span_space(const char *s) {
+    size_t n = 0;
+    while (s[n] != '\0' && isspace((unsigned char) s[n])) n++;
+    return n;
+}
+
+size_t lex_span_string(const char *s) {
+    size_t n = 0;
+    while (s[n] != '\0' && s[n] != '\'' && s[n] != '\n') n++;
+    return n;
+}
+
+size_t lex_find_newlines(const char *s, size_t len, size_t *out) {
+    size_t cnt = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\n') {
+            if (out) out[cnt] = i;
+            cnt++;
+        }
+    }
+
+    return cnt;
+}
+
+#endif // LEX_BLOCK
+
+void lex_build_newlines(Lexer *lexer) {
+    size_t len = strlen(lexer->source);
+    lexer->newlines_cnt = lex_find_newlines(lexer->source, len, NULL);
+    lexer->newlines = malloc(sizeof(size_t) * (lexer->newlines_cnt + 1));
+    ASSERT(lexer->newlines != NULL && "Cannot allocate the newline index");
+    lex_find_newlines(lexer->source, len, lexer->newlines);
+    lexer->newlines_ready = true;
+}
+
+Location lex_offset_location(Lexer *lexer, size_t offset) {
+    if (!lexer->newlines_ready) {
+        lex_build_newlines(lexer);
+    }
+
+    // number of newlines before offset
+    size_t lo = 0, hi = lexer->newlines_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (lexer->newlines[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t line_start = lo == 0 ? 0 : lexer->newlines[lo - 1] + 1;
+    return (Location) { .row = lo + 1, .col = offset - line_start + 1 };
+}
+
+Location lex_location(Lexer *lexer) {
+    return lex_offset_location(lexer, lexer->content - lexer->source);
+}
+
+void lex_error(Lexer *lexer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (lexer->error != NULL) {
+        lexer->error->offset = lexer->content - lexer->source;
+        vsnprintf(lexer->error->message, sizeof(lexer->error->message), format, args);
+    } else {
+        Location loc = lex_location(lexer);
+        fprintf(stderr, "%s:%ld:%ld: error: ", lexer->file_path, loc.row, loc.col);
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+    }
+    va_end(args);
+}
+
+char lex_trim_left(Lexer *lexer) {
+    lex_advance(lexer, lex_span_space(lexer->content));
+    return lex_getc(lexer);
 }
 
 Token next_token(Lexer *lexer) {
@@ -350,14 +597,16 @@ Token next_token(Lexer *lexer) {
         case '/': lexer->token.kind = TOKEN_SLASH; break;
 
         case '\'': {
-            len = 0;
-            c = lex_getc(lexer);
-            while (len < (MAX_TOKEN_LEN - 1) && c != '\0' && c != '\'' && c != '\n') {
-                lexer->token.value[len++] = c;
-                c = lex_getc(lexer);
+            len = lex_span_string(lexer->content);
+            if (len > MAX_TOKEN_LEN - 1) {
+                lex_advance(lexer, MAX_TOKEN_LEN);
+                PRINT_ERROR(lexer, "Unexpected end of string literal");
+                FAIL;
             }
 
-            if (c != '\'') {
+            memcpy(lexer->token.value, lexer->content, len);
+            lex_advance(lexer, len);
+            if (lex_getc(lexer) != '\'') {
                 PRINT_ERROR(lexer, "Unexpected end of string literal");
                 FAIL;
             }
@@ -418,22 +667,54 @@ void assert_next_token(Lexer *lexer, Token_Kind expected) {
 typedef struct {
     Rectangle rect;
     Symbol *value;
+    Color fills[HEATMAP_METRICS_CNT];  // of tasks, for each overlay
 } Screen_Object;
 
-#define MAX_SCREEN_OBJECTS 512
+// Arrows are laid out once, so drawing a frame only picks the thickness
+// of the overlay
+typedef struct {
+    Vector2 corner;      // where the line leaves `from` when it turns, else start
+    Vector2 start, end;  // end is where the head begins
+    Vector2 left, right, tip;
+    Color color;
+    float thickness[HEATMAP_METRICS_CNT];
+    uint32_t from, to;  // nodes
+} Screen_Arrow;
+
+#define TEXT_RESOLVED_CNT 4
+#define TEXT_RESOLVED_MAX_SIZE 4096
+
+typedef struct {
+    float scale;  // texels per pixel of the atlas
+    Texture2D texture;
+} Text_Resolved;
+
+// Every label comes from one signed distance field atlas, see resource_text
+typedef struct {
+    Font font;  // metrics at font.baseSize, distances in the alpha
+    const unsigned char *distances;
+    Shader shader;
+    bool shaded;
+    float zoom;  // screen pixels per unit of what is drawn now
+    Text_Resolved resolved[TEXT_RESOLVED_CNT];
+    size_t next_resolved;
+} Text;
+
+#define MAX_SCREEN_OBJECTS HASHMAP_CAPACITY
 typedef struct {
     Screen_Object screen_objects[MAX_SCREEN_OBJECTS];
     size_t objs_cnt;
+    Screen_Arrow *arrows;
+    size_t arrows_cnt;
+    Heatmap_Metric overlay;
     char title[MAX_TOKEN_LEN];
     int cols, rows;
 
-    Texture2D wait_texture;
-    Texture2D mail_texture;
-    Texture2D rectangle;
-    Texture2D rect_rexture;
 
-    Font font;
-    Font font_header;
+    Text *text;
+    int *codepoints;  // sorted, those the text of the model is made of
+    size_t codepoints_cnt;
+    size_t codepoints_cap;
 
     struct {
         int font_size;
@@ -467,6 +748,408 @@ void setup_screen(Screen *screen) {
     screen->settings.font_size_header = screen->settings.font_size*1.5;
 }
 
+// The bytes of a resource, inflated the first time they are asked for and
+// checked against the CRC-32 the bundler took
+const unsigned char *resource_data(size_t id) {
+    static const unsigned char *loaded[RESOURCES_CNT];
+    if (loaded[id] != NULL) return loaded[id];
+
+    const Resource *resource = &resources[id];
+    unsigned char *data = (unsigned char *) resource->data;
+    int size = resource->size;
+    if (resource->packed) data = DecompressData(resource->data, resource->size, &size);
+
+    if (data == NULL || (size_t) size != resource->raw_size || ComputeCRC32(data, size) != resource->crc) {
+        fprintf(stderr, "error: the bundled resource %s is corrupted\n", resource->name);
+        exit(EXIT_FAILURE);
+    }
+
+    loaded[id] = data;
+    return data;
+}
+
+// The texture of an image resource, decoded and uploaded the first time an
+// event that shows it is drawn, so diagrams without them never pay for it
+Texture2D resource_texture(size_t id) {
+    static Texture2D textures[RESOURCES_CNT];
+    if (textures[id].id == 0) {
+        Image image = LoadImageFromMemory(".png", resource_data(id), resources[id].raw_size);
+        textures[id] = LoadTextureFromImage(image);
+        UnloadImage(image);
+    }
+    return textures[id];
+}
+
+// The font of an atlas in the layout of the bundler, see Baked_Atlas
+Font baked_font(const Baked_Atlas *baked_atlas) {
+    const Baked_Glyph *baked = (const Baked_Glyph *) (baked_atlas + 1);
+    Font font = {
+        .baseSize = baked_atlas->font_size,
+        .glyphCount = baked_atlas->glyph_count,
+        .glyphPadding = baked_atlas->padding,
+        .glyphs = MemAlloc(baked_atlas->glyph_count*sizeof(GlyphInfo)),
+        .recs = MemAlloc(baked_atlas->glyph_count*sizeof(Rectangle)),
+    };
+
+    // The glyph images stay empty, only ImageDrawText reads them
+    for (int g = 0; g < font.glyphCount; g++) {
+        font.glyphs[g].value = baked[g].value;
+        font.glyphs[g].offsetX = baked[g].offset_x;
+        font.glyphs[g].offsetY = baked[g].offset_y;
+        font.glyphs[g].advanceX = baked[g].advance_x;
+        font.recs[g] = (Rectangle) { baked[g].x, baked[g].y, baked[g].width, baked[g].height };
+    }
+
+    // Baked as coverage only, text is drawn with it as the alpha of white
+    const unsigned char *gray = (const unsigned char *) (baked + baked_atlas->glyph_count);
+    Image image = {
+        .data = MemAlloc(2*baked_atlas->width*baked_atlas->height),
+        .width = baked_atlas->width,
+        .height = baked_atlas->height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA,
+    };
+    unsigned char *pixels = image.data;
+    for (int p = 0; p < baked_atlas->width*baked_atlas->height; p++) {
+        pixels[2*p] = 255;
+        pixels[2*p + 1] = gray[p];
+    }
+    font.texture = LoadTextureFromImage(image);
+    UnloadImage(image);
+    return font;
+}
+
+/*
+ * Text
+ */
+
+// The outline is where the distance crosses SDF_ON_EDGE. The shader puts
+// it there within one screen pixel, from how fast the distance changes
+// between neighbouring fragments, so the text keeps sharp at any scale.
+#define TEXT_SHADER_LEGACY \
+    "varying vec2 fragTexCoord;\n" \
+    "varying vec4 fragColor;\n" \
+    "uniform sampler2D texture0;\n" \
+    "uniform vec4 colDiffuse;\n" \
+    "void main() {\n" \
+    "    float distance = texture2D(texture0, fragTexCoord).a - 0.5;\n" \
+    "    float width = max(length(vec2(dFdx(distance), dFdy(distance))), 0.0001);\n" \
+    "    gl_FragColor = vec4(fragColor.rgb, fragColor.a*clamp(distance/width + 0.5, 0.0, 1.0))*colDiffuse;\n" \
+    "}\n"
+
+const char *TEXT_SHADER_330 =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "uniform sampler2D texture0;\n"
+    "uniform vec4 colDiffuse;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    float distance = texture(texture0, fragTexCoord).a - 0.5;\n"
+    "    float width = max(length(vec2(dFdx(distance), dFdy(distance))), 0.0001);\n"
+    "    finalColor = vec4(fragColor.rgb, fragColor.a*clamp(distance/width + 0.5, 0.0, 1.0))*colDiffuse;\n"
+    "}\n";
+const char *TEXT_SHADER_120 = "#version 120\n" TEXT_SHADER_LEGACY;
+const char *TEXT_SHADER_100 = "#version 100\n#extension GL_OES_standard_derivatives : enable\nprecision mediump float;\n" TEXT_SHADER_LEGACY;
+
+#define TEXT_CACHE_VERSION 1
+
+// The atlases go to $XDG_CACHE_HOME/bpmn, or ~/.cache/bpmn, named by the
+// hash of what they are made from. False when there is no such directory
+// and it cannot be made, the atlas is then built every time.
+bool text_cache_path(char *path, size_t size, uint64_t key) {
+    char dir[4096];
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache != NULL && cache[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", cache);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return false;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+    size_t len = strlen(dir);
+    snprintf(dir + len, sizeof(dir) - len, "/bpmn");
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+
+    return snprintf(path, size, "%s/atlas-%016llx.bin", dir, (unsigned long long) key) < (int) size;
+}
+
+// A cached atlas, followed in the file by the CRC-32 of its bytes. NULL when
+// it is not there or does not hold together.
+unsigned char *text_cache_read(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    unsigned char *bytes = NULL;
+    long size = 0;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > (long) (sizeof(Baked_Atlas) + sizeof(uint32_t))) {
+        rewind(file);
+        bytes = malloc(size);
+        if (bytes != NULL && fread(bytes, 1, size, file) != (size_t) size) {
+            free(bytes);
+            bytes = NULL;
+        }
+    }
+    fclose(file);
+    if (bytes == NULL) return NULL;
+
+    size -= sizeof(uint32_t);
+    uint32_t crc;
+    memcpy(&crc, bytes + size, sizeof(crc));
+    const Baked_Atlas *atlas = (const Baked_Atlas *) bytes;
+    bool valid = ComputeCRC32(bytes, size) == crc && atlas->glyph_count > 0 && atlas->width > 0 && atlas->height > 0
+        && (size_t) size == sizeof(Baked_Atlas) + atlas->glyph_count*sizeof(Baked_Glyph) + (size_t) atlas->width*atlas->height;
+    if (!valid) {
+        free(bytes);
+        return NULL;
+    }
+    return bytes;
+}
+
+// Written aside and renamed over, as jobs running together may share it.
+// The cache only saves time, so a failure is not reported.
+void text_cache_write(const char *path, const unsigned char *bytes, size_t size) {
+    char tmp[4096 + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) return;
+
+    uint32_t crc = ComputeCRC32((unsigned char *) bytes, size);
+    bool ok = fwrite(bytes, 1, size, file) == size && fwrite(&crc, sizeof(crc), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) remove(tmp);
+}
+
+// Packs the glyphs of `codepoints` into a new atlas. Those in the bundled
+// field are copied out of it, the others rasterized from the TTF with the
+// same settings. The codepoints the font has no glyph for are left out, so
+// raylib draws them as '?'.
+unsigned char *text_build_atlas(const Baked_Atlas *bundled, size_t font, const int *codepoints, size_t codepoints_cnt, size_t *size) {
+    const Baked_Glyph *bundled_glyphs = (const Baked_Glyph *) (bundled + 1);
+    const unsigned char *bundled_pixels = (const unsigned char *) (bundled_glyphs + bundled->glyph_count);
+
+    GlyphInfo *glyphs = MemAlloc(codepoints_cnt*sizeof(GlyphInfo));
+    int *missing = MemAlloc(codepoints_cnt*sizeof(int));
+    int glyphs_cnt = 0, missing_cnt = 0;
+    for (size_t i = 0; i < codepoints_cnt; i++) {
+        const Baked_Glyph *baked = NULL;
+        for (int g = 0; g < bundled->glyph_count && baked == NULL; g++) {
+            if (bundled_glyphs[g].value == codepoints[i]) baked = &bundled_glyphs[g];
+        }
+
+        if (baked == NULL) {
+            missing[missing_cnt++] = codepoints[i];
+            continue;
+        }
+
+        GlyphInfo *glyph = &glyphs[glyphs_cnt++];
+        *glyph = (GlyphInfo) {
+            .value = baked->value,
+            .offsetX = baked->offset_x,
+            .offsetY = baked->offset_y,
+            .advanceX = baked->advance_x,
+            .image = {
+                .data = MemAlloc(baked->width*baked->height),
+                .width = baked->width,
+                .height = baked->height,
+                .mipmaps = 1,
+                .format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
+            },
+        };
+        for (int y = 0; y < baked->height; y++) {
+            memcpy((unsigned char *) glyph->image.data + y*baked->width, bundled_pixels + (baked->y + y)*bundled->width + baked->x, baked->width);
+        }
+    }
+
+    if (missing_cnt > 0) {
+        const unsigned char *ttf = resource_data(font);
+        GlyphInfo *rasterized = LoadFontData(ttf, resources[font].raw_size, bundled->font_size, missing, missing_cnt, FONT_SDF);
+        for (int i = 0; rasterized != NULL && i < missing_cnt; i++) {
+            if (rasterized[i].image.data != NULL) glyphs[glyphs_cnt++] = rasterized[i];
+        }
+        MemFree(rasterized);
+    }
+    MemFree(missing);
+
+    // Rows as tall as the tallest glyph, the field makes them taller than the font
+    int tallest = 0;
+    for (int i = 0; i < glyphs_cnt; i++) {
+        if (glyphs[i].image.height > tallest) tallest = glyphs[i].image.height;
+    }
+
+    Rectangle *recs = NULL;
+    Image image = GenImageFontAtlas(glyphs, &recs, glyphs_cnt, tallest, bundled->padding, 0);
+
+    *size = sizeof(Baked_Atlas) + glyphs_cnt*sizeof(Baked_Glyph) + (size_t) image.width*image.height;
+    unsigned char *bytes = malloc(*size);
+    ASSERT(bytes != NULL && "Cannot allocate the atlas");
+
+    Baked_Atlas *atlas = (Baked_Atlas *) bytes;
+    *atlas = (Baked_Atlas) {
+        .font_size = bundled->font_size,
+        .padding = bundled->padding,
+        .glyph_count = glyphs_cnt,
+        .width = image.width,
+        .height = image.height,
+    };
+
+    Baked_Glyph *baked = (Baked_Glyph *) (atlas + 1);
+    for (int i = 0; i < glyphs_cnt; i++) {
+        baked[i] = (Baked_Glyph) {
+            glyphs[i].value, glyphs[i].offsetX, glyphs[i].offsetY, glyphs[i].advanceX,
+            recs[i].x, recs[i].y, recs[i].width, recs[i].height,
+        };
+    }
+
+    // The atlas comes in gray-alpha, with the field in the alpha
+    unsigned char *pixels = (unsigned char *) (baked + glyphs_cnt);
+    for (int p = 0; p < image.width*image.height; p++) pixels[p] = ((unsigned char *) image.data)[2*p + 1];
+
+    UnloadImage(image);
+    MemFree(recs);
+    UnloadFontData(glyphs, glyphs_cnt);
+    return bytes;
+}
+
+// Loads the distance field of exactly `codepoints`, plus the '?' raylib
+// draws for any other, with the shader that draws it when the context has
+// one. OpenGL 1.1, or a driver that refuses the shader, gets the coverage
+// worked out on the CPU by text_resolve instead.
+void resource_text(Text *text, size_t font, const int *codepoints, size_t codepoints_cnt) {
+    size_t atlas = FONT_ATLASES_CNT;
+    for (size_t i = 0; i < FONT_ATLASES_CNT; i++) {
+        if (font_atlases[i].font == font && font_atlases[i].sdf) atlas = i;
+    }
+    ASSERT(atlas < FONT_ATLASES_CNT && "the bundle has no distance field of the font");
+
+    // The key is what the glyphs come from, then the codepoints
+    enum { KEY_HEADER = 3 };
+    int *key = malloc(sizeof(int) * (KEY_HEADER + codepoints_cnt + 1));
+    ASSERT(key != NULL && "Cannot allocate the atlas key");
+    key[0] = TEXT_CACHE_VERSION;
+    key[1] = resources[font].crc;
+    key[2] = resources[font_atlases[atlas].resource].crc;
+
+    int *set = key + KEY_HEADER;
+    size_t set_cnt = 0;
+    bool question = false;
+    for (size_t i = 0; i < codepoints_cnt; i++) {
+        if (!question && codepoints[i] >= '?') {
+            if (codepoints[i] != '?') set[set_cnt++] = '?';
+            question = true;
+        }
+        set[set_cnt++] = codepoints[i];
+    }
+    if (!question) set[set_cnt++] = '?';
+
+    char path[4096];
+    bool cached = text_cache_path(path, sizeof(path), hash_bytes(key, sizeof(int) * (KEY_HEADER + set_cnt)));
+    unsigned char *bytes = cached ? text_cache_read(path) : NULL;
+    if (bytes == NULL) {
+        size_t size = 0;
+        const Baked_Atlas *bundled = (const Baked_Atlas *) resource_data(font_atlases[atlas].resource);
+        bytes = text_build_atlas(bundled, font, set, set_cnt, &size);
+        if (cached) text_cache_write(path, bytes, size);
+    }
+    free(key);
+
+    const Baked_Atlas *baked = (const Baked_Atlas *) bytes;
+    text->font = baked_font(baked);
+    text->distances = (const unsigned char *) ((const Baked_Glyph *) (baked + 1) + baked->glyph_count);
+    text->zoom = 1;
+    SetTextureFilter(text->font.texture, TEXTURE_FILTER_BILINEAR);
+
+    const char *source = NULL;
+    switch (rlGetVersion()) {
+        case RL_OPENGL_21: source = TEXT_SHADER_120; break;
+        case RL_OPENGL_33:
+        case RL_OPENGL_43: source = TEXT_SHADER_330; break;
+        case RL_OPENGL_ES_20:
+        case RL_OPENGL_ES_30: source = TEXT_SHADER_100; break;
+        default: break;
+    }
+
+    if (source != NULL) text->shader = LoadShaderFromMemory(NULL, source);
+    text->shaded = text->shader.id != 0 && text->shader.id != rlGetShaderIdDefault();
+}
+
+// What the shader does, once for the whole atlas: the distances sampled at
+// `scale` texels per pixel of the atlas and turned into coverage over one
+// texel around the outline. The scales go in quarter octaves, so a zoom
+// reuses the last few textures. raylib is told the size of the atlas, not
+// of the texture, as that is what it divides the glyph rectangles by.
+Texture2D text_resolve(Text *text, float scale) {
+    const Font *font = &text->font;
+    float limit = (float) TEXT_RESOLVED_MAX_SIZE / fmaxf(font->texture.width, font->texture.height);
+    scale = fminf(exp2f(roundf(log2f(scale)*4)/4), limit);
+
+    for (size_t i = 0; i < TEXT_RESOLVED_CNT; i++) {
+        if (text->resolved[i].texture.id != 0 && text->resolved[i].scale == scale) return text->resolved[i].texture;
+    }
+
+    int atlas_width = font->texture.width, atlas_height = font->texture.height;
+    Image image = {
+        .width = ceilf(atlas_width*scale),
+        .height = ceilf(atlas_height*scale),
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA,
+    };
+    unsigned char *pixels = image.data = MemAlloc(2*image.width*image.height);
+
+    for (int y = 0; y < image.height; y++) {
+        float v = fminf(fmaxf((y + 0.5f)/scale - 0.5f, 0), atlas_height - 1);
+        int y0 = v, y1 = y0 + 1 < atlas_height ? y0 + 1 : y0;
+        float fy = v - y0;
+        for (int x = 0; x < image.width; x++) {
+            float u = fminf(fmaxf((x + 0.5f)/scale - 0.5f, 0), atlas_width - 1);
+            int x0 = u, x1 = x0 + 1 < atlas_width ? x0 + 1 : x0;
+            float fx = u - x0;
+
+            const unsigned char *row0 = text->distances + y0*atlas_width, *row1 = text->distances + y1*atlas_width;
+            float d = Lerp(Lerp(row0[x0], row0[x1], fx), Lerp(row1[x0], row1[x1], fx), fy);
+            float coverage = Clamp(0.5f + (d - SDF_ON_EDGE)/SDF_PIXEL_DIST_SCALE*scale, 0, 1);
+
+            pixels[2*(y*image.width + x)] = 255;
+            pixels[2*(y*image.width + x) + 1] = coverage*255 + 0.5f;
+        }
+    }
+
+    Text_Resolved *resolved = &text->resolved[text->next_resolved];
+    text->next_resolved = (text->next_resolved + 1) % TEXT_RESOLVED_CNT;
+    if (resolved->texture.id != 0) UnloadTexture(resolved->texture);
+
+    resolved->scale = scale;
+    resolved->texture = LoadTextureFromImage(image);
+    UnloadImage(image);
+    SetTextureFilter(resolved->texture, TEXTURE_FILTER_BILINEAR);
+    resolved->texture.width = atlas_width;
+    resolved->texture.height = atlas_height;
+    return resolved->texture;
+}
+
+Vector2 text_measure(const Text *text, const char *string, float font_size, float spacing) {
+    return MeasureTextEx(text->font, string, font_size, spacing);
+}
+
+// Draws `string` at `font_size` units, rotated by `rotation` degrees around
+// `position`, with `text->zoom` screen pixels per unit
+void text_draw(Text *text, const char *string, Vector2 position, float rotation, float font_size, float spacing, Color color) {
+    if (text->shaded) {
+        BeginShaderMode(text->shader);
+        DrawTextPro(text->font, string, position, (Vector2) {0}, rotation, font_size, spacing, color);
+        EndShaderMode();
+        return;
+    }
+
+    Font font = text->font;
+    font.texture = text_resolve(text, font_size/font.baseSize*text->zoom);
+    DrawTextPro(font, string, position, (Vector2) {0}, rotation, font_size, spacing, color);
+}
+
 size_t push_obj(Screen *screen, Screen_Object obj) {
     ASSERT(screen->objs_cnt < MAX_SCREEN_OBJECTS && "out of space");
     screen->screen_objects[screen->objs_cnt] = obj;
@@ -474,15 +1157,15 @@ size_t push_obj(Screen *screen, Screen_Object obj) {
 }
 
 
-Vector2 grid2world(Screen screen, Vector2 grid_pos, int obj_width, int obj_height, bool center, int padding) {
+Vector2 grid2world(const Screen *screen, Vector2 grid_pos, int obj_width, int obj_height, bool center, int padding) {
     Vector2 units = {
-        screen.settings.width / screen.cols,
-        screen.settings.height / screen.rows
+        screen->settings.width / screen->cols,
+        screen->settings.height / screen->rows
     };
 
     Vector2 pos = (Vector2) {
-        .x = grid_pos.x*units.x + padding + screen.settings.sub_header_width,
-        .y = grid_pos.y*units.y + screen.settings.header_height
+        .x = grid_pos.x*units.x + padding + screen->settings.sub_header_width,
+        .y = grid_pos.y*units.y + screen->settings.header_height
     };
 
     if (center) {
@@ -493,37 +1176,14 @@ Vector2 grid2world(Screen screen, Vector2 grid_pos, int obj_width, int obj_heigh
     return pos;
 }
 
-void draw_arrow_head(Screen screen, Vector2 start, Vector2 end) {
-    const int head_size = 6;
-    Vector2 direction = Vector2Subtract(end, start);
-    float total_length = Vector2Length(direction);
-
-    if (total_length > 0) {
-        direction = Vector2Scale(direction, 1.0f / total_length);
-
-        Vector2 adjusted_end = Vector2Add(start, Vector2Scale(direction, total_length - head_size * 2));
-
-        Vector2 perpendicular = (Vector2){ -direction.y, direction.x };
-        Vector2 right_point = Vector2Add(adjusted_end, Vector2Scale(perpendicular, -head_size));
-        Vector2 left_point = Vector2Add(adjusted_end, Vector2Scale(perpendicular, head_size));
-        Vector2 arrow_head_base = Vector2Add(adjusted_end, Vector2Scale(direction, head_size * 2));
-
-        DrawLineEx(start, adjusted_end, screen.settings.line_thickness, BLACK);
-        DrawLineEx(adjusted_end, left_point, screen.settings.line_thickness, BLACK);
-        DrawLineEx(adjusted_end, right_point, screen.settings.line_thickness, BLACK);
-        DrawLineEx(left_point, arrow_head_base, screen.settings.line_thickness, BLACK);
-        DrawLineEx(right_point, arrow_head_base, screen.settings.line_thickness, BLACK);
-    }
-}
-
-void draw_arrow(Screen screen, Screen_Object from, Screen_Object to) {
+Screen_Arrow layout_arrow(const Screen *screen, Screen_Object from, Screen_Object to) {
     Vector2 world_from = grid2world(
         screen,
         RECT_POS(from.rect),
         from.rect.width,
         from.rect.height,
         true,
-        screen.settings.events_padding
+        screen->settings.events_padding
     );
 
     Vector2 world_to = grid2world(
@@ -532,12 +1192,13 @@ void draw_arrow(Screen screen, Screen_Object from, Screen_Object to) {
         to.rect.width,
         to.rect.height,
         true,
-        screen.settings.events_padding
+        screen->settings.events_padding
     );
 
     Vector2 start = {0};
     Vector2 line = {0};
     Vector2 end = {0};
+    bool turns = false;
 
     int diff_iy = from.rect.y - to.rect.y;
     int diff_ix = from.rect.x - to.rect.x;
@@ -563,7 +1224,7 @@ void draw_arrow(Screen screen, Screen_Object from, Screen_Object to) {
             end.y = world_to.y + to.rect.height/2.0;
             start.x = line.x;
             start.y = end.y;
-            DrawLineEx(line, start, screen.settings.line_thickness, BLACK);
+            turns = true;
         } else if (diff_ix > 0) { // from na frente
             line = (Vector2) {
                 .y = world_from.y + from.rect.height,
@@ -573,7 +1234,7 @@ void draw_arrow(Screen screen, Screen_Object from, Screen_Object to) {
             end.y = world_to.y + to.rect.height/2.0;
             start.x = line.x;
             start.y = end.y;
-            DrawLineEx(line, start, screen.settings.line_thickness, BLACK);
+            turns = true;
         } else {
             start.x = end.x = world_from.x + from.rect.width/2.0;
             start.y = world_from.y + from.rect.height;
@@ -589,7 +1250,7 @@ void draw_arrow(Screen screen, Screen_Object from, Screen_Object to) {
             end.y = world_to.y + to.rect.height/2.0;
             start.x = line.x;
             start.y = end.y;
-            DrawLineEx(line, start, screen.settings.line_thickness, BLACK);
+            turns = true;
         } else if (diff_ix > 0) { // from na frente
             line = (Vector2) {
                 .y = world_from.y,
@@ -599,7 +1260,7 @@ void draw_arrow(Screen screen, Screen_Object from, Screen_Object to) {
             end.y = world_to.y + to.rect.height/2.0;
             start.x = line.x;
             start.y = end.y;
-            DrawLineEx(line, start, screen.settings.line_thickness, BLACK);
+            turns = true;
         } else {
             start.x = end.x = world_from.x + from.rect.width/2.0;
             start.y = world_from.y;
@@ -607,12 +1268,50 @@ void draw_arrow(Screen screen, Screen_Object from, Screen_Object to) {
         }
     }
 
-    draw_arrow_head(screen, start, end);
+    Screen_Arrow arrow = {
+        .corner = turns ? line : start,
+        .start = start,
+        .end = start,
+        .left = start,
+        .right = start,
+        .tip = start
+    };
+
+    const int head_size = 6;
+    Vector2 direction = Vector2Subtract(end, start);
+    float total_length = Vector2Length(direction);
+
+    if (total_length > 0) {
+        direction = Vector2Scale(direction, 1.0f / total_length);
+
+        Vector2 adjusted_end = Vector2Add(start, Vector2Scale(direction, total_length - head_size * 2));
+        Vector2 perpendicular = (Vector2){ -direction.y, direction.x };
+
+        arrow.end = adjusted_end;
+        arrow.right = Vector2Add(adjusted_end, Vector2Scale(perpendicular, -head_size));
+        arrow.left = Vector2Add(adjusted_end, Vector2Scale(perpendicular, head_size));
+        arrow.tip = Vector2Add(adjusted_end, Vector2Scale(direction, head_size * 2));
+    }
+
+    return arrow;
+}
+
+// The head keeps the thickness of the lines, so it still fits the shaft
+// of a heavy edge
+void draw_arrow(const Screen *screen, const Screen_Arrow *arrow) {
+    float thickness = arrow->thickness[screen->overlay];
+
+    DrawLineEx(arrow->corner, arrow->start, thickness, arrow->color);
+    DrawLineEx(arrow->start, arrow->end, thickness, arrow->color);
+    DrawLineEx(arrow->end, arrow->left, screen->settings.line_thickness, arrow->color);
+    DrawLineEx(arrow->end, arrow->right, screen->settings.line_thickness, arrow->color);
+    DrawLineEx(arrow->left, arrow->tip, screen->settings.line_thickness, arrow->color);
+    DrawLineEx(arrow->right, arrow->tip, screen->settings.line_thickness, arrow->color);
 }
 
-void draw_fitting_text(Rectangle rect, Font font, char *text, int font_size, int margin) {
+void draw_fitting_text(Text *text, Rectangle rect, char *title, int font_size, int margin) {
     int word_count = 0;
-    const char **words = TextSplit(text, ' ', &word_count);
+    const char **words = TextSplit(title, ' ', &word_count);
 
     rect.x += margin;
     rect.y += margin;
@@ -623,7 +1322,7 @@ void draw_fitting_text(Rectangle rect, Font font, char *text, int font_size, int
     const float spacing = font_size / 10.0;
     int space_left = rect.width;
     for (int i = 0; i < word_count; i++) {
-        int word_len = MeasureTextEx(font, words[i], font_size, spacing).x + font_size;
+        int word_len = text_measure(text, words[i], font_size, spacing).x + font_size;
 
         if (word_len > space_left) {
             space_left = rect.width - word_len;
@@ -633,25 +1332,51 @@ void draw_fitting_text(Rectangle rect, Font font, char *text, int font_size, int
             space_left -= word_len;
         }
 
-        DrawTextEx(font, words[i], pos, font_size, spacing, BLACK);
+        text_draw(text, words[i], pos, 0, font_size, spacing, BLACK);
         pos.x += word_len;
     }
 }
 
-void draw_header(Screen screen) {
-    const float spacing = screen.settings.font_size_header / 10.0;
-    Vector2 text_measure = MeasureTextEx(screen.font_header, screen.title, screen.settings.font_size_header, spacing);
+// What the viewer writes over the model. The font atlas only has the
+// glyphs that were collected, so every label and format is defined here
+// and collect_overlay_codepoints takes them all, the conversions of the
+// formats with a few glyphs that are never drawn.
+#define OVERLAY_HEATMAP "heatmap: %s"
+#define OVERLAY_STATUS "%s  %zu tokens  %s/s%s"
+#define OVERLAY_PAUSED "  paused"
+#define OVERLAY_DIGITS "0123456789"
+
+void collect_codepoints(Screen *screen, const char *text);
+
+void collect_overlay_codepoints(Screen *screen) {
+    collect_codepoints(screen, OVERLAY_HEATMAP);
+    collect_codepoints(screen, OVERLAY_STATUS);
+    collect_codepoints(screen, OVERLAY_PAUSED);
+    collect_codepoints(screen, OVERLAY_DIGITS);
+    collect_codepoints(screen, FORMAT_DURATION_GLYPHS);
+    for (size_t m = 0; m < HEATMAP_METRICS_CNT; m++) collect_codepoints(screen, HEATMAP_NAMES[m]);
+}
+
+void draw_header(const Screen *screen) {
+    const float spacing = screen->settings.font_size_header / 10.0;
+    Vector2 title_measure = text_measure(screen->text, screen->title, screen->settings.font_size_header, spacing);
 
     Vector2 pos = {
-        .x = screen.settings.width / 2 - text_measure.x / 2,
-        .y = screen.settings.header_height / 2 - text_measure.y / 2
+        .x = screen->settings.width / 2 - title_measure.x / 2,
+        .y = screen->settings.header_height / 2 - title_measure.y / 2
     };
 
-    // DrawLineEx(VECTOR(0, screen.settings.header_height), VECTOR(screen.settings.width, screen.settings.header_height), screen.settings.line_thickness, BLACK);
-    DrawTextEx(screen.font_header, screen.title, pos, screen.settings.font_size_header, spacing, BLACK);
+    // DrawLineEx(VECTOR(0, screen->settings.header_height), VECTOR(screen->settings.width, screen->settings.header_height), screen->settings.line_thickness, BLACK);
+    text_draw(screen->text, screen->title, pos, 0, screen->settings.font_size_header, spacing, BLACK);
+
+    if (screen->overlay != HEATMAP_NONE) {
+        const char *overlay = TextFormat(OVERLAY_HEATMAP, HEATMAP_NAMES[screen->overlay]);
+        Vector2 overlay_pos = { screen->settings.sub_header_width, pos.y };
+        text_draw(screen->text, overlay, overlay_pos, 0, screen->settings.font_size, screen->settings.font_size / 10.0, BLACK);
+    }
 }
 
-void draw_subprocess_header(Screen screen, Screen_Object subprocess_obj) {
+void draw_subprocess_header(const Screen *screen, Screen_Object subprocess_obj) {
     Vector2 world_obj_pos = grid2world(
         screen,
         RECT_POS(subprocess_obj.rect),
@@ -662,33 +1387,33 @@ void draw_subprocess_header(Screen screen, Screen_Object subprocess_obj) {
     );
 
     Rectangle entire_row = {
-        .x = world_obj_pos.x - screen.settings.sub_header_width,
+        .x = world_obj_pos.x - screen->settings.sub_header_width,
         .y = world_obj_pos.y,
         .width = subprocess_obj.rect.width - 1,
         .height = subprocess_obj.rect.height + 1
     };
 
     Rectangle sub_header = {
-        .x = world_obj_pos.x - screen.settings.sub_header_width,
+        .x = world_obj_pos.x - screen->settings.sub_header_width,
         .y = world_obj_pos.y,
-        .width = screen.settings.sub_header_width,
+        .width = screen->settings.sub_header_width,
         .height = subprocess_obj.rect.height + 1
     };
 
-    const float spacing = screen.settings.font_size_header / 10.0;
+    const float spacing = screen->settings.font_size_header / 10.0;
     const float rotation = -90;
 
-    Vector2 text_measure = MeasureTextEx(screen.font_header, subprocess_obj.value->as.subprocess.name, screen.settings.font_size_header, spacing);
+    Vector2 name_measure = text_measure(screen->text, subprocess_obj.value->as.subprocess.name, screen->settings.font_size_header, spacing);
     Vector2 text_position = RECT_POS(sub_header);
-    text_position.y += sub_header.height/2.0 + text_measure.x/2.0;
-    text_position.x += sub_header.width/2.0 - text_measure.y/2.0;
+    text_position.y += sub_header.height/2.0 + name_measure.x/2.0;
+    text_position.x += sub_header.width/2.0 - name_measure.y/2.0;
 
-    DrawRectangleLinesEx(entire_row, screen.settings.line_thickness/2.0, BLACK);
-    DrawRectangleLinesEx(sub_header, screen.settings.line_thickness/2.0, BLACK);
-    DrawTextPro(screen.font_header, subprocess_obj.value->as.subprocess.name, text_position, (Vector2) {0}, rotation, screen.settings.font_size_header, spacing, BLACK);
+    DrawRectangleLinesEx(entire_row, screen->settings.line_thickness/2.0, BLACK);
+    DrawRectangleLinesEx(sub_header, screen->settings.line_thickness/2.0, BLACK);
+    text_draw(screen->text, subprocess_obj.value->as.subprocess.name, text_position, rotation, screen->settings.font_size_header, spacing, BLACK);
 }
 
-void draw_obj(Screen screen, Screen_Object obj) {
+void draw_obj(const Screen *screen, Screen_Object obj) {
     if (obj.value->kind == SYMB_EVENT) {
         Vector2 world_obj_pos = grid2world(
             screen,
@@ -696,7 +1421,7 @@ void draw_obj(Screen screen, Screen_Object obj) {
             obj.rect.width,
             obj.rect.height,
             true,
-            screen.settings.events_padding
+            screen->settings.events_padding
         );
 
         Rectangle world_obj_rect = {
@@ -716,13 +1441,22 @@ void draw_obj(Screen screen, Screen_Object obj) {
             } break;
 
             case EVENT_TASK: {
-                DrawRectangleRounded(world_obj_rect, 0.3f, 0, WHITE);
-                DrawRectangleRoundedLinesEx(world_obj_rect, 0.3f, 0, screen.settings.line_thickness, BLACK);
-                draw_fitting_text(world_obj_rect, screen.font, obj.value->as.event.title, screen.settings.font_size, 5);
+                DrawRectangleRounded(world_obj_rect, 0.3f, 0, obj.fills[screen->overlay]);
+                DrawRectangleRoundedLinesEx(world_obj_rect, 0.3f, 0, screen->settings.line_thickness, BLACK);
+                draw_fitting_text(screen->text, world_obj_rect, obj.value->as.event.title, screen->settings.font_size, 5);
             } break;
 
             case EVENT_GATEWAY: {
-                DrawTexture(screen.rect_rexture, world_obj_pos.x, world_obj_pos.y, WHITE);
+                DrawTexture(resource_texture(RESOURCE_RECTANGLE), world_obj_pos.x, world_obj_pos.y, WHITE);
+
+                Vector2 center = {world_obj_rect.x + world_obj_rect.width / 2, world_obj_rect.y + world_obj_rect.height / 2};
+                float arm = world_obj_rect.width / 5;
+                if (obj.value->as.event.gateway == GATEWAY_AND) {
+                    DrawLineEx((Vector2){center.x - arm, center.y}, (Vector2){center.x + arm, center.y}, screen->settings.line_thickness * 2, BLACK);
+                    DrawLineEx((Vector2){center.x, center.y - arm}, (Vector2){center.x, center.y + arm}, screen->settings.line_thickness * 2, BLACK);
+                } else if (obj.value->as.event.gateway == GATEWAY_OR) {
+                    DrawRing(center, arm - screen->settings.line_thickness, arm + screen->settings.line_thickness, 0, 360, 32, BLACK);
+                }
             } break;
 
             case EVENT_END: {
@@ -733,11 +1467,11 @@ void draw_obj(Screen screen, Screen_Object obj) {
             } break;
 
             case EVENT_WAIT: {
-                DrawTextureEx(screen.wait_texture, world_obj_pos, 0, 1.0f, WHITE);
+                DrawTextureEx(resource_texture(RESOURCE_RELOGIO), world_obj_pos, 0, 1.0f, WHITE);
             } break;
 
             case EVENT_MAIL: {
-                DrawTextureEx(screen.mail_texture, world_obj_pos, 0, 1.0f, WHITE);
+                DrawTextureEx(resource_texture(RESOURCE_EMAIL), world_obj_pos, 0, 1.0f, WHITE);
             } break;
 
             default: ASSERT(0 && "Unreachable statement");
@@ -748,6 +1482,275 @@ void draw_obj(Screen screen, Screen_Object obj) {
     }
 }
 
+// white for nothing, through yellow, to red for the highest value
+Color heat_color(float t) {
+    if (t < 0.5f) return ColorLerp(WHITE, YELLOW, t * 2);
+    return ColorLerp(YELLOW, RED, t * 2 - 1);
+}
+
+// Lays out the arrows and maps the heatmap, if any, to the fill of the
+// tasks and the thickness of the arrows, for every overlay at once
+void layout_screen(Screen *screen, Lexer *lexer, const Analysis *analysis, const Heatmap *heatmap) {
+    screen->arrows_cnt = 0;
+    screen->arrows = realloc(screen->arrows, sizeof(Screen_Arrow) * screen->objs_cnt * 3);
+    ASSERT(screen->arrows != NULL && "Cannot allocate the arrows");
+
+    for (size_t i = 0; i < screen->objs_cnt; i++) {
+        Screen_Object *obj = &screen->screen_objects[i];
+        uint32_t from = obj->value->node_id;
+
+        for (size_t m = 0; m < HEATMAP_METRICS_CNT; m++) {
+            obj->fills[m] = WHITE;
+            if (heatmap != NULL && m != HEATMAP_NONE && obj->value->kind == SYMB_EVENT) {
+                obj->fills[m] = heat_color(heatmap_scale(heatmap, heatmap_value(heatmap, from, m), m));
+            }
+        }
+
+        if (obj->value->kind != SYMB_EVENT) continue;
+
+        for (size_t j = 0; j < 3; j++) {
+            Key_Value *to = get_symbol(&lexer->symbols, obj->value->as.event.points_to[j]);
+            if (to == NULL) continue;
+
+            Screen_Arrow arrow = layout_arrow(screen, *obj, screen->screen_objects[to->value.obj_id]);
+            arrow.color = analysis_critical_edge(analysis, from, to->value.node_id) ? RED : BLACK;
+            arrow.from = from;
+            arrow.to = to->value.node_id;
+            for (size_t m = 0; m < HEATMAP_METRICS_CNT; m++) {
+                float t = 0;
+                if (heatmap != NULL && m != HEATMAP_NONE && to->value.kind == SYMB_EVENT) {
+                    t = heatmap_scale(heatmap, heatmap_edge(heatmap, from, to->value.node_id, m), m);
+                }
+                arrow.thickness[m] = screen->settings.line_thickness * (1 + 4 * t);
+            }
+
+            screen->arrows[screen->arrows_cnt++] = arrow;
+        }
+    }
+}
+
+/*******************************************************************\
+| Section: Playback                                                 |
+| Tokens of a trace (see trace.c) move along the laid out arrows.   |
+| The trace is read a chunk at a time as the clock goes, and every  |
+| token is a quad of the same texture, so they all go to the GPU in |
+| one batch.                                                        |
+\*******************************************************************/
+
+#define PLAY_TRAVEL 0.4     // seconds a token takes to cross an arrow on screen
+#define PLAY_DURATION 60.0  // seconds the whole trace lasts at the starting speed
+#define PLAY_TOKEN_SIZE 8
+#define PLAY_NO_ARROW UINT32_MAX
+
+typedef struct {
+    uint32_t node;   // where it is, or where it goes
+    uint32_t arrow;  // it takes to get there, PLAY_NO_ARROW when it just appears
+    uint32_t slot;   // in the list of visible tokens
+    uint64_t moved;  // trace time it left for `node`
+    bool visible;
+    bool gone;       // ended or absorbed, hidden once it gets to `node`
+} Play_Token;
+
+typedef struct {
+    Trace_Reader reader;
+    Play_Token *tokens;  // indexed by token
+    size_t tokens_cap;
+    uint32_t *visible;
+    size_t visible_cnt;
+
+    Vector2 *centers;     // of each node
+    uint32_t *arrows_of;  // first arrow of each node, the others follow it
+    size_t nodes_cnt;
+
+    double now;    // trace time, in milliseconds
+    double speed;  // trace milliseconds per second
+    bool paused;
+    Texture2D texture;
+} Playback;
+
+bool play_open(Playback *play, const Screen *screen, const Process_Model *model, const char *path) {
+    memset(play, 0, sizeof(*play));
+    if (!trace_open(&play->reader, path, model->nodes_cnt)) return false;
+
+    play->nodes_cnt = model->nodes_cnt;
+    play->centers = calloc(model->nodes_cnt, sizeof(Vector2));
+    play->arrows_of = malloc(sizeof(uint32_t) * model->nodes_cnt);
+    ASSERT(play->centers != NULL && play->arrows_of != NULL && "Cannot allocate the playback");
+
+    for (size_t i = 0; i < screen->objs_cnt; i++) {
+        const Screen_Object *obj = &screen->screen_objects[i];
+        if (obj->value->kind != SYMB_EVENT) continue;
+
+        Vector2 pos = grid2world(screen, RECT_POS(obj->rect), obj->rect.width, obj->rect.height, true, screen->settings.events_padding);
+        play->centers[obj->value->node_id] = VECTOR(pos.x + obj->rect.width / 2, pos.y + obj->rect.height / 2);
+    }
+
+    memset(play->arrows_of, 0xff, sizeof(uint32_t) * model->nodes_cnt);
+    for (size_t i = screen->arrows_cnt; i-- > 0;) {
+        play->arrows_of[screen->arrows[i].from] = i;
+    }
+
+    play->now = play->reader.first;
+    play->speed = fmax((play->reader.last - play->reader.first) / PLAY_DURATION, 1);
+    trace_seek(&play->reader, play->reader.first);
+    return true;
+}
+
+// The circle every token is drawn with, once there is a window
+void play_load_texture(Playback *play) {
+    Image image = GenImageColor(2 * PLAY_TOKEN_SIZE, 2 * PLAY_TOKEN_SIZE, BLANK);
+    ImageDrawCircle(&image, PLAY_TOKEN_SIZE, PLAY_TOKEN_SIZE, PLAY_TOKEN_SIZE - 1, WHITE);
+    play->texture = LoadTextureFromImage(image);
+    UnloadImage(image);
+}
+
+uint32_t play_arrow(const Playback *play, const Screen *screen, uint32_t from, uint32_t to) {
+    for (size_t i = play->arrows_of[from]; i < screen->arrows_cnt && screen->arrows[i].from == from; i++) {
+        if (screen->arrows[i].to == to) return i;
+    }
+    return PLAY_NO_ARROW;
+}
+
+void play_hide(Playback *play, uint32_t token) {
+    Play_Token *t = &play->tokens[token];
+    uint32_t last = play->visible[--play->visible_cnt];
+    play->visible[t->slot] = last;
+    play->tokens[last].slot = t->slot;
+    t->visible = false;
+}
+
+void play_move(Playback *play, const Screen *screen, Trace_Record record) {
+    if (record.token >= play->tokens_cap) {
+        size_t cap = play->tokens_cap == 0 ? 1024 : play->tokens_cap;
+        while (cap <= record.token) cap *= 2;
+        play->tokens = realloc(play->tokens, sizeof(Play_Token) * cap);
+        play->visible = realloc(play->visible, sizeof(uint32_t) * cap);
+        ASSERT(play->tokens != NULL && play->visible != NULL && "Cannot grow the tokens");
+        memset(&play->tokens[play->tokens_cap], 0, sizeof(Play_Token) * (cap - play->tokens_cap));
+        play->tokens_cap = cap;
+    }
+
+    Play_Token *t = &play->tokens[record.token];
+    if (record.node == ENGINE_INVALID_ID || record.node >= play->nodes_cnt) {
+        t->gone = true;
+        return;
+    }
+
+    // slots are reused, a token that was gone comes back somewhere else
+    bool moving = t->visible && !t->gone;
+    t->arrow = moving ? play_arrow(play, screen, t->node, record.node) : PLAY_NO_ARROW;
+    t->node = record.node;
+    t->moved = record.time;
+    t->gone = false;
+
+    if (!t->visible) {
+        t->visible = true;
+        t->slot = play->visible_cnt;
+        play->visible[play->visible_cnt++] = record.token;
+    }
+}
+
+// Drops the tokens and puts back the ones live at `time`: those of the
+// last keyframe before it, moved by the records from there up to `time`
+void play_seek(Playback *play, const Screen *screen, double time) {
+    if (time < play->reader.first) time = play->reader.first;
+    if (time > play->reader.last) time = play->reader.last;
+
+    for (size_t i = 0; i < play->visible_cnt; i++) {
+        play->tokens[play->visible[i]].visible = false;
+    }
+    play->visible_cnt = 0;
+    play->now = time;
+    trace_seek(&play->reader, (uint64_t) time);
+
+    for (size_t i = 0; i < play->reader.keyframe_len; i++) {
+        play_move(play, screen, play->reader.keyframe[i]);
+    }
+
+    Trace_Record record;
+    while (trace_next(&play->reader, (uint64_t) time, &record)) {
+        play_move(play, screen, record);
+    }
+}
+
+void play_update(Playback *play, const Screen *screen, float dt) {
+    double span = play->reader.last - play->reader.first;
+    if (IsKeyPressed(KEY_SPACE)) play->paused = !play->paused;
+    if (IsKeyPressed(KEY_UP)) play->speed *= 2;
+    if (IsKeyPressed(KEY_DOWN)) play->speed = fmax(play->speed / 2, 1);
+    if (IsKeyPressed(KEY_RIGHT)) play_seek(play, screen, play->now + span / 20);
+    if (IsKeyPressed(KEY_LEFT)) play_seek(play, screen, play->now - span / 20);
+    if (IsKeyPressed(KEY_R)) play_seek(play, screen, play->reader.first);
+
+    if (!play->paused) play->now = fmin(play->now + dt * play->speed, play->reader.last + PLAY_TRAVEL * play->speed);
+
+    Trace_Record record;
+    while (trace_next(&play->reader, (uint64_t) play->now, &record)) {
+        play_move(play, screen, record);
+    }
+
+    double travel = PLAY_TRAVEL * play->speed;
+    for (size_t i = 0; i < play->visible_cnt;) {
+        const Play_Token *t = &play->tokens[play->visible[i]];
+        if (t->gone && play->now - t->moved >= travel) play_hide(play, play->visible[i]);
+        else i++;
+    }
+}
+
+// Along the arrow while it moves, then around the center of its node,
+// spread so the tokens waiting there do not hide each other
+Vector2 play_position(const Playback *play, const Screen *screen, uint32_t token) {
+    const Play_Token *t = &play->tokens[token];
+    double f = (play->now - t->moved) / (PLAY_TRAVEL * play->speed);
+
+    if (t->arrow == PLAY_NO_ARROW || f >= 1) {
+        Vector2 spread = VECTOR((int) (token % 5) - 2, (int) (token / 5 % 5) - 2);
+        return Vector2Add(play->centers[t->node], Vector2Scale(spread, PLAY_TOKEN_SIZE / 2));
+    }
+
+    const Screen_Arrow *arrow = &screen->arrows[t->arrow];
+    float bend = Vector2Distance(arrow->corner, arrow->start);
+    float along = f * (bend + Vector2Distance(arrow->start, arrow->tip));
+    if (along < bend) return Vector2MoveTowards(arrow->corner, arrow->start, along);
+    return Vector2MoveTowards(arrow->start, arrow->tip, along - bend);
+}
+
+void draw_tokens(const Playback *play, const Screen *screen) {
+    const float half = PLAY_TOKEN_SIZE / 2.0f;
+
+    rlSetTexture(play->texture.id);
+    rlBegin(RL_QUADS);
+    rlColor4ub(BLUE.r, BLUE.g, BLUE.b, BLUE.a);
+    rlNormal3f(0, 0, 1);
+    for (size_t i = 0; i < play->visible_cnt; i++) {
+        Vector2 p = play_position(play, screen, play->visible[i]);
+        rlTexCoord2f(0, 0); rlVertex2f(p.x - half, p.y - half);
+        rlTexCoord2f(0, 1); rlVertex2f(p.x - half, p.y + half);
+        rlTexCoord2f(1, 1); rlVertex2f(p.x + half, p.y + half);
+        rlTexCoord2f(1, 0); rlVertex2f(p.x + half, p.y - half);
+    }
+    rlEnd();
+    rlSetTexture(0);
+}
+
+void draw_playback_status(const Playback *play, const Screen *screen) {
+    const char *status = TextFormat(OVERLAY_STATUS,
+                                    FMT_DURATION((play->now - play->reader.first) / 1000.0), play->visible_cnt,
+                                    FMT_DURATION(play->speed / 1000.0), play->paused ? OVERLAY_PAUSED : "");
+    const float spacing = screen->settings.font_size / 10.0;
+    Vector2 measure = text_measure(screen->text, status, screen->settings.font_size, spacing);
+    Vector2 pos = { screen->settings.width - measure.x - screen->settings.events_padding, (screen->settings.header_height - measure.y) / 2 };
+    text_draw(screen->text, status, pos, 0, screen->settings.font_size, spacing, BLACK);
+}
+
+void play_close(Playback *play) {
+    trace_close(&play->reader);
+    free(play->tokens);
+    free(play->visible);
+    free(play->centers);
+    free(play->arrows_of);
+}
+
 /*******************************************************************\
 | Section: Parser                                                   |
 \*******************************************************************/
@@ -765,12 +1768,12 @@ typedef struct {
     size_t len;
 } Attr_List;
 
-Attr *get_attr(Attr_List attrs, char *id) {
+Attr *get_attr(Attr_List *attrs, char *id) {
     size_t len_id = strlen(id);
     ASSERT(len_id < MAX_TOKEN_LEN && "Length of id cannot be greater than MAX_TOKEN_LEN");
 
-    for (size_t i = 0; i < attrs.len; i++) {
-        Attr *attr = &attrs.items[i];
+    for (size_t i = 0; i < attrs->len; i++) {
+        Attr *attr = &attrs->items[i];
         if (strncmp(attr->id, id, len_id) == 0) {
             return attr;
         }
@@ -788,16 +1791,44 @@ void parse_columns(Lexer *lexer, Screen *screen, int *cur_col, char *namespace);
 void parse_event(Lexer *lexer, Screen *screen, int col, char *namespace);
 void parse_attrs(Lexer *lexer, Attr_List *attrs);
 
-Screen_Object parse_event_task(Lexer *lexer, Attr_List attrs, Key_Value *symbol,  Screen *screen, int col, char *namespace);
-Screen_Object parse_event_starter(Lexer *lexer, Attr_List attrs, Key_Value *symbol, Screen *screen, int col, char *namespace);
-Screen_Object parse_event_with_sprite(Lexer *lexer, Attr_List attrs, Key_Value *symbol, Screen *screen, int col, char *namespace);
-Screen_Object parse_event_gateway(Attr_List attrs, Key_Value *symbol, Screen *screen, int col, char *namespace);
+Screen_Object parse_event_task(Lexer *lexer, Attr_List *attrs, Key_Value *symbol,  Screen *screen, int col, char *namespace);
+Screen_Object parse_event_starter(Lexer *lexer, Attr_List *attrs, Key_Value *symbol, Screen *screen, int col, char *namespace);
+Screen_Object parse_event_with_sprite(Lexer *lexer, Attr_List *attrs, Key_Value *symbol, Screen *screen, int col, char *namespace);
+Screen_Object parse_event_gateway(Lexer *lexer, Attr_List *attrs, Key_Value *symbol, Screen *screen, int col, char *namespace);
 Screen_Object parse_event_end(Screen *screen, int col);
 
 Event_Kind translate_event(const char *event);
+Distribution translate_distribution(Lexer *lexer, const char *text);
 int translate_row(Lexer *lexer, const char *column);
 
-void parse(Lexer *lexer, Screen *screen) {
+// Adds the codepoints of the UTF-8 `text` to those of the screen, its font
+// atlas is made of exactly them
+void collect_codepoints(Screen *screen, const char *text) {
+    while (*text != '\0') {
+        int size = 0;
+        int codepoint = GetCodepointNext(text, &size);
+        text += size;
+
+        size_t lo = 0, hi = screen->codepoints_cnt;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (screen->codepoints[mid] < codepoint) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < screen->codepoints_cnt && screen->codepoints[lo] == codepoint) continue;
+
+        if (screen->codepoints_cnt == screen->codepoints_cap) {
+            screen->codepoints_cap = screen->codepoints_cap == 0 ? 128 : screen->codepoints_cap * 2;
+            screen->codepoints = realloc(screen->codepoints, sizeof(int) * screen->codepoints_cap);
+            ASSERT(screen->codepoints != NULL && "Cannot allocate the codepoints");
+        }
+        memmove(&screen->codepoints[lo + 1], &screen->codepoints[lo], sizeof(int) * (screen->codepoints_cnt - lo));
+        screen->codepoints[lo] = codepoint;
+        screen->codepoints_cnt++;
+    }
+}
+
+void parse(Lexer *lexer, Screen *screen) {
     parse_process(lexer, screen);
 
     for (;;) {
@@ -841,6 +1872,7 @@ void parse_process(Lexer *lexer, Screen *screen) {
     assert_next_token(lexer, TOKEN_ATR);
     assert_next_token(lexer, TOKEN_STR);
     memcpy(screen->title, lexer->token.value, MAX_TOKEN_LEN);
+    collect_codepoints(screen, screen->title);
 
     assert_next_token(lexer, TOKEN_CLTAG);
 }
@@ -860,7 +1892,7 @@ void parse_subprocess(Lexer *lexer, Screen *screen) {
     char subprocess_namespace[MAX_TOKEN_LEN] = {0};
 
     parse_attrs(lexer, &attrs);
-    Attr *id_attr = get_attr(attrs, "id");
+    Attr *id_attr = get_attr(&attrs, "id");
     if (id_attr == NULL) {
         PRINT_ERROR(lexer, "Subprocess must have  an `id`");
         FAIL;
@@ -870,9 +1902,19 @@ void parse_subprocess(Lexer *lexer, Screen *screen) {
 
     Key_Value *entry = put_symbol(&lexer->symbols, subprocess_namespace, symbol);
 
-    Attr *name = get_attr(attrs, "name");
+    Attr *name = get_attr(&attrs, "name");
     if (name) {
         memcpy(entry->value.as.subprocess.name, name->value, MAX_TOKEN_LEN);
+        collect_codepoints(screen, entry->value.as.subprocess.name);
+    }
+
+    Attr *capacity = get_attr(&attrs, "capacity");
+    if (capacity) {
+        entry->value.as.subprocess.capacity = atoi(capacity->value);
+        if (entry->value.as.subprocess.capacity <= 0) {
+            PRINT_ERROR_FMT(lexer, "Invalid capacity `%s`, expected a positive number", capacity->value);
+            FAIL;
+        }
     }
 
     parse_events(lexer, screen, subprocess_namespace);
@@ -996,7 +2038,7 @@ void parse_event(Lexer *lexer, Screen *screen, int col, char *namespace) {
     Attr_List attrs = {0};
     parse_attrs(lexer, &attrs);
 
-    Attr *id_attr = get_attr(attrs, "id");
+    Attr *id_attr = get_attr(&attrs, "id");
     if (id_attr == NULL) {
         PRINT_ERROR(lexer, "Event need to have an `id`");
         FAIL;
@@ -1012,12 +2054,12 @@ void parse_event(Lexer *lexer, Screen *screen, int col, char *namespace) {
 
     Screen_Object obj;
     switch (event_kind) {
-        case EVENT_TASK:    obj = parse_event_task(lexer, attrs, kv, screen, col, namespace);    break;
-        case EVENT_STARTER: obj = parse_event_starter(lexer, attrs, kv, screen, col, namespace); break;
+        case EVENT_TASK:    obj = parse_event_task(lexer, &attrs, kv, screen, col, namespace);    break;
+        case EVENT_STARTER: obj = parse_event_starter(lexer, &attrs, kv, screen, col, namespace); break;
         case EVENT_WAIT:
         case EVENT_MAIL:
-            obj = parse_event_with_sprite(lexer, attrs, kv, screen, col, namespace);             break;
-        case EVENT_GATEWAY: obj = parse_event_gateway(attrs, kv, screen, col, namespace);        break;
+            obj = parse_event_with_sprite(lexer, &attrs, kv, screen, col, namespace);             break;
+        case EVENT_GATEWAY: obj = parse_event_gateway(lexer, &attrs, kv, screen, col, namespace); break;
         case EVENT_END:     obj = parse_event_end(screen, col);                                  break;
         default: ASSERT(0 && "Unreachable statement");
     }
@@ -1054,13 +2096,19 @@ void parse_attrs(Lexer *lexer, Attr_List *attrs) {
     }
 }
 
-Screen_Object parse_event_task(Lexer *lexer, Attr_List attrs, Key_Value *symbol, Screen *screen, int col, char *namespace) {
+Screen_Object parse_event_task(Lexer *lexer, Attr_List *attrs, Key_Value *symbol, Screen *screen, int col, char *namespace) {
     char buffer[MAX_TOKEN_LEN];
     int row_number = 1;
 
     Attr *name = get_attr(attrs, "name");
     if (name) {
         memcpy(symbol->value.as.event.title, name->value, MAX_TOKEN_LEN);
+        collect_codepoints(screen, symbol->value.as.event.title);
+    }
+
+    Attr *duration = get_attr(attrs, "duration");
+    if (duration) {
+        symbol->value.as.event.duration = translate_distribution(lexer, duration->value);
     }
 
     Attr *points = get_attr(attrs, "points");
@@ -1084,7 +2132,7 @@ Screen_Object parse_event_task(Lexer *lexer, Attr_List attrs, Key_Value *symbol,
     };
 }
 
-Screen_Object parse_event_starter(Lexer *lexer, Attr_List attrs, Key_Value *symbol, Screen *screen, int col, char *namespace) {
+Screen_Object parse_event_starter(Lexer *lexer, Attr_List *attrs, Key_Value *symbol, Screen *screen, int col, char *namespace) {
     char buffer[MAX_TOKEN_LEN];
     int row_number = 1;
 
@@ -1094,6 +2142,11 @@ Screen_Object parse_event_starter(Lexer *lexer, Attr_List attrs, Key_Value *symb
         memcpy(symbol->value.as.event.points_to, buffer, MAX_TOKEN_LEN);
     }
 
+    Attr *arrivals = get_attr(attrs, "arrivals");
+    if (arrivals) {
+        symbol->value.as.event.duration = translate_distribution(lexer, arrivals->value);
+    }
+
     Attr *row = get_attr(attrs, "row");
     if (row) {
         row_number = translate_row(lexer, row->value);
@@ -1109,7 +2162,7 @@ Screen_Object parse_event_starter(Lexer *lexer, Attr_List attrs, Key_Value *symb
     };
 }
 
-Screen_Object parse_event_with_sprite(Lexer *lexer, Attr_List attrs, Key_Value *symbol, Screen *screen, int col, char *namespace) {
+Screen_Object parse_event_with_sprite(Lexer *lexer, Attr_List *attrs, Key_Value *symbol, Screen *screen, int col, char *namespace) {
     char buffer[MAX_TOKEN_LEN];
     int row_number = 1;
 
@@ -1119,6 +2172,11 @@ Screen_Object parse_event_with_sprite(Lexer *lexer, Attr_List attrs, Key_Value *
         memcpy(symbol->value.as.event.points_to, buffer, MAX_TOKEN_LEN);
     }
 
+    Attr *duration = get_attr(attrs, "duration");
+    if (duration) {
+        symbol->value.as.event.duration = translate_distribution(lexer, duration->value);
+    }
+
     Attr *row = get_attr(attrs, "row");
     if (row) {
         row_number = translate_row(lexer, row->value);
@@ -1134,7 +2192,7 @@ Screen_Object parse_event_with_sprite(Lexer *lexer, Attr_List attrs, Key_Value *
     };
 }
 
-Screen_Object parse_event_gateway(Attr_List attrs, Key_Value *symbol, Screen *screen, int col, char *namespace) {
+Screen_Object parse_event_gateway(Lexer *lexer, Attr_List *attrs, Key_Value *symbol, Screen *screen, int col, char *namespace) {
     char buffer[MAX_TOKEN_LEN];
     int row_number = 1;
 
@@ -1148,6 +2206,47 @@ Screen_Object parse_event_gateway(Attr_List attrs, Key_Value *symbol, Screen *sc
         }
     }
 
+    // probability of following each of the points, in the same order
+    Attr *weights = get_attr(attrs, "weights");
+    if (weights) {
+        int len = 0;
+        const char **words = TextSplit(weights->value, ',', &len);
+        for (int i = 0; i < len; i++) {
+            char *end = NULL;
+            double weight = strtod(words[i], &end);
+            if (i >= 3 || end == words[i] || *end != '\0' || weight < 0) {
+                PRINT_ERROR_FMT(lexer, "Invalid weights `%s`, expected up to 3 non negative numbers", weights->value);
+                FAIL;
+            }
+
+            symbol->value.as.event.weights[i] = weight;
+        }
+    }
+
+    Attr *type = get_attr(attrs, "type");
+    if (type) {
+        if (strcmp(type->value, "xor") == 0) {
+            symbol->value.as.event.gateway = GATEWAY_XOR;
+        } else if (strcmp(type->value, "and") == 0) {
+            symbol->value.as.event.gateway = GATEWAY_AND;
+        } else if (strcmp(type->value, "or") == 0) {
+            symbol->value.as.event.gateway = GATEWAY_OR;
+        } else {
+            PRINT_ERROR_FMT(lexer, "Invalid gateway type `%s`, expected xor, and or or", type->value);
+            FAIL;
+        }
+    }
+
+    // OR gateways take each point on its own, so weights are probabilities
+    if (symbol->value.as.event.gateway == GATEWAY_OR) {
+        for (int i = 0; i < 3; i++) {
+            if (symbol->value.as.event.weights[i] > 1) {
+                PRINT_ERROR_FMT(lexer, "Invalid weights `%s`, OR gateways take probabilities between 0 and 1", weights->value);
+                FAIL;
+            }
+        }
+    }
+
     return (Screen_Object) {
         .rect = {
             .height = 32,
@@ -1215,29 +2314,816 @@ int translate_row(Lexer *lexer, const char *row) {
     FAIL;
 }
 
+// time := number [ms|s|m|h|d], seconds when the unit is omitted
+bool translate_time(const char **text, double *seconds) {
+    char *end = NULL;
+    double value = strtod(*text, &end);
+    if (end == *text || value < 0) {
+        return false;
+    }
+
+    double unit = 1;
+    if (strncmp(end, "ms", 2) == 0)   { unit = 0.001; end += 2; }
+    else if (*end == 's')             { unit = 1;     end += 1; }
+    else if (*end == 'm')             { unit = 60;    end += 1; }
+    else if (*end == 'h')             { unit = 3600;  end += 1; }
+    else if (*end == 'd')             { unit = 86400; end += 1; }
+
+    *seconds = value * unit;
+    *text = end;
+    return true;
+}
+
+// duration := time | fn '(' time [',' time]* ')'
+// fn       := const | exp | uniform | normal | tri
+Distribution translate_distribution(Lexer *lexer, const char *text) {
+    static const struct {
+        const char *name;
+        Distribution_Kind kind;
+        size_t args;
+    } functions[] = {
+        { "const",   DIST_CONST,      1 },
+        { "exp",     DIST_EXP,        1 },
+        { "uniform", DIST_UNIFORM,    2 },
+        { "normal",  DIST_NORMAL,     2 },
+        { "tri",     DIST_TRIANGULAR, 3 },
+    };
+
+    Distribution dist = { .kind = DIST_CONST };
+    double args[3] = {0};
+    size_t expected = 1;
+
+    const char *cur = text;
+    while (isspace((unsigned char) *cur)) cur++;
+
+    bool call = false;
+    for (size_t i = 0; i < ARRAY_SIZE(functions); i++) {
+        size_t len = strlen(functions[i].name);
+        if (strncmp(cur, functions[i].name, len) == 0 && cur[len] == '(') {
+            dist.kind = functions[i].kind;
+            expected = functions[i].args;
+            cur += len + 1;
+            call = true;
+            break;
+        }
+    }
+
+    size_t count = 0;
+    for (;;) {
+        while (isspace((unsigned char) *cur)) cur++;
+        if (count >= expected || !translate_time(&cur, &args[count])) {
+            PRINT_ERROR_FMT(lexer, "Invalid duration `%s`", text);
+            FAIL;
+        }
+
+        count++;
+        while (isspace((unsigned char) *cur)) cur++;
+        if (*cur != ',') break;
+        cur++;
+    }
+
+    if (call && *cur++ != ')') {
+        PRINT_ERROR_FMT(lexer, "Missing `)` in duration `%s`", text);
+        FAIL;
+    }
+
+    while (isspace((unsigned char) *cur)) cur++;
+    if (*cur != '\0' || count != expected) {
+        PRINT_ERROR_FMT(lexer, "Invalid duration `%s`", text);
+        FAIL;
+    }
+
+    if (dist.kind == DIST_TRIANGULAR && !(args[0] <= args[1] && args[1] <= args[2] && args[0] < args[2])) {
+        PRINT_ERROR_FMT(lexer, "Triangular duration `%s` must be tri(min, mode, max)", text);
+        FAIL;
+    }
+
+    dist.a = args[0];
+    dist.b = args[1];
+    dist.c = args[2];
+    return dist;
+}
+
+// Analyzes the subprocesses of a document with the parser above
+#include "lsp.c"
+
+/*******************************************************************\
+| Section: Model                                                    |
+| Lowers the symbols table into the model used by the execution     |
+| engine: events become nodes identified by their screen object     |
+| order and `points` are resolved to node indexes.                  |
+\*******************************************************************/
+
+Key_Value *symbol_entry(Symbol *symbol) {
+    return (Key_Value *) ((char *) symbol - offsetof(Key_Value, value));
+}
+
+Node_Kind translate_node(Event_Kind kind) {
+    switch (kind) {
+        case EVENT_STARTER: return NODE_STARTER;
+        case EVENT_TASK:    return NODE_TASK;
+        case EVENT_GATEWAY: return NODE_GATEWAY;
+        case EVENT_WAIT:    return NODE_WAIT;
+        case EVENT_MAIL:    return NODE_MAIL;
+        case EVENT_END:     return NODE_END;
+        default: ASSERT(0 && "Unreachable statement");
+    }
+
+    return NODE_END;
+}
+
+void build_model(Lexer *lexer, Screen *screen, Process_Model *model) {
+    // events are pushed before the subprocess that contains them, so the
+    // lane of an event is the next one to be pushed
+    for (size_t i = 0; i < screen->objs_cnt; i++) {
+        Symbol *symbol = screen->screen_objects[i].value;
+        symbol->node_id = ENGINE_INVALID_ID;
+
+        if (symbol->kind == SYMB_SUBPROCESS) {
+            const char *name = symbol->as.subprocess.name;
+            Model_Lane lane = {
+                .name = name[0] != '\0' ? name : symbol_entry(symbol)->key,
+                .capacity = symbol->as.subprocess.capacity
+            };
+
+            model_push_lane(model, lane);
+            continue;
+        }
+
+        Model_Node node = {
+            .kind = translate_node(symbol->as.event.kind),
+            .lane = model->lanes_cnt,
+            .duration = symbol->as.event.duration,
+            .gateway = symbol->as.event.gateway,
+            .name = symbol_entry(symbol)->key
+        };
+
+        symbol->node_id = model_push_node(model, node);
+    }
+
+    for (size_t i = 0; i < screen->objs_cnt; i++) {
+        Symbol *symbol = screen->screen_objects[i].value;
+        if (symbol->node_id == ENGINE_INVALID_ID) continue;
+
+        Model_Node *node = &model->nodes[symbol->node_id];
+        double weights = 0;
+        for (size_t j = 0; j < MODEL_MAX_TARGETS; j++) {
+            char *target = symbol->as.event.points_to[j];
+            if (target[0] == '\0') continue;
+
+            Key_Value *to = get_symbol(&lexer->symbols, target);
+            if (to == NULL || to->value.kind != SYMB_EVENT) {
+                fprintf(stderr, "%s: warning: `%s` points to unknown event `%s`\n", lexer->file_path, node->name, target);
+                continue;
+            }
+
+            node->weights[node->targets_cnt] = symbol->as.event.weights[j];
+            node->targets[node->targets_cnt++] = to->value.node_id;
+            weights += symbol->as.event.weights[j];
+        }
+
+        // gateways without weights pick any target with the same chance, OR
+        // gateways without weights take all of them
+        for (size_t j = 0; j < node->targets_cnt; j++) {
+            if (node->gateway == GATEWAY_OR) {
+                if (weights == 0) node->weights[j] = 1;
+            } else {
+                node->weights[j] = weights > 0 ? node->weights[j] / weights : 1.0 / node->targets_cnt;
+            }
+        }
+    }
+}
+
+/*******************************************************************\
+| Section: Run                                                      |
+| Headless execution of the model: N instances per starter are      |
+| started at once, every task is parked, every wait sleeps on the   |
+| timer wheel of the engine for the mean of its duration and every  |
+| mail waits for its message, so all of them are alive at the same  |
+| time. Each round then completes the parked tasks, posts the       |
+| messages and lets every pending wait expire, until every instance |
+| reaches an end. A task followed by a mail event sends the message |
+| itself, so it gets there before the token.                        |
+\*******************************************************************/
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    Instance_Id *items;
+    size_t len;
+    size_t cap;
+} Parked;
+
+bool run_park(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) engine;
+    (void) node;
+
+    Parked *parked = user;
+    if (parked->len == parked->cap) {
+        parked->cap = parked->cap == 0 ? 1024 : parked->cap * 2;
+        parked->items = realloc(parked->items, sizeof(Instance_Id) * parked->cap);
+        ASSERT(parked->items != NULL && "Cannot grow the parked list");
+    }
+
+    parked->items[parked->len++] = id;
+    return false;
+}
+
+// one per worker of the pool
+typedef struct {
+    Parked tasks;
+    Parked mails;  // waiting for a message
+} Run_Parked;
+
+bool run_park_task(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    return run_park(engine, id, node, &((Run_Parked *) user)[POOL_WORKER].tasks);
+}
+
+bool run_park_mail(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    return run_park(engine, id, node, &((Run_Parked *) user)[POOL_WORKER].mails);
+}
+
+size_t run_ready(Engine *engine, Pool *pool) {
+    return pool ? pool_run(pool) : engine_run(engine, 0);
+}
+
+void run_send(Engine *engine, Instance_Id id, uint32_t node) {
+    Message message = engine_address(engine, id, node);
+    while (!engine_post(engine, message)) {
+        engine_poll_mail(engine);
+    }
+}
+
+// in milliseconds, waits without a duration still sleep for one tick
+uint32_t run_wait_ticks(const Model_Node *node) {
+    double ms = distribution_mean(node->duration) * 1000;
+    if (ms < 1) return 1;
+    return ms < UINT32_MAX ? (uint32_t) ms : UINT32_MAX;
+}
+
+uint32_t run_delay(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) id;
+    (void) user;
+    return run_wait_ticks(&engine->model->nodes[node]);
+}
+
+// With --wal, rounds are the commit window and every RUN_SNAPSHOT_ROUNDS
+// of them the instances are written to a snapshot
+#define RUN_WAL_WINDOW (1 << 16)
+#define RUN_SNAPSHOT_ROUNDS 64
+
+// Gives the instances that were parked when the run stopped back their
+// work: tasks are done again, waits sleep for what was left and mail
+// events are sent their message again
+void run_resume(Engine *engine, Run_Parked *parked) {
+    for (Instance_Id id = 0; id < engine->instances_cnt; id++) {
+        if (engine->states[id] != INSTANCE_PARKED) continue;
+
+        uint32_t node = engine->nodes[id];
+        switch (engine->model->nodes[node].kind) {
+            case NODE_WAIT: {
+                uint64_t wakes = engine->since[id] + run_wait_ticks(&engine->model->nodes[node]);
+                engine_sleep(engine, id, wakes > engine->timers.now ? wakes - engine->timers.now : 1);
+            } break;
+
+            case NODE_MAIL: run_park(engine, id, node, &parked->mails); break;
+            default:        run_park(engine, id, node, &parked->tasks); break;
+        }
+    }
+}
+
+int run_model(Process_Model *model, size_t instances, size_t workers, const char *wal_dir, Metrics_Format metrics) {
+    static Engine engine = {0};
+    static Pool pool = {0};
+    Run_Parked *parked = calloc(workers, sizeof(Run_Parked));
+    ASSERT(parked != NULL && "Cannot allocate the parked lists");
+
+    Engine_Callbacks callbacks = {
+        .on_task = run_park_task,
+        .on_mail = run_park_mail,
+        .on_delay = run_delay,
+        .user = parked
+    };
+
+    uint32_t longest = 1;
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind != NODE_WAIT) continue;
+
+        uint32_t ticks = run_wait_ticks(&model->nodes[i]);
+        if (ticks > longest) longest = ticks;
+    }
+
+    double start = now_seconds();
+    engine_init(&engine, model, callbacks);
+    engine_enable_mail(&engine, 1 << 16, 1 << 20, 2 * longest);
+    if (metrics != METRICS_NONE) engine_enable_metrics(&engine);
+
+    static char wal_path[4096], snapshot_path[4096];
+    if (wal_dir) {
+        snprintf(wal_path, sizeof(wal_path), "%s/instances.wal", wal_dir);
+        snprintf(snapshot_path, sizeof(snapshot_path), "%s/instances.snap", wal_dir);
+        if (!engine_enable_wal(&engine, wal_path, snapshot_path, RUN_WAL_WINDOW)) {
+            fprintf(stderr, "error: cannot recover the instances from %s: %s\n", wal_dir, strerror(errno));
+            free(parked);
+            engine_free(&engine);
+            return EXIT_FAILURE;
+        }
+        run_resume(&engine, parked);
+    }
+
+    if (workers > 1) pool_init(&pool, &engine, workers);
+
+    size_t starters = 0;
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind != NODE_STARTER) continue;
+
+        starters++;
+        for (size_t j = 0; j < instances && engine.recovered == 0; j++) {
+            if (engine_start(&engine, i) == ENGINE_INVALID_ID) {
+                fprintf(stderr, "error: cannot allocate instance %zu\n", j);
+                if (workers > 1) pool_free(&pool);
+                free(parked);
+                engine_free(&engine);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    Pool *runner = workers > 1 ? &pool : NULL;
+    run_ready(&engine, runner);
+    engine_commit(&engine);
+
+    size_t peak = engine.active;
+    size_t peak_timers = 0;
+    size_t rounds = 0;
+    for (;;) {
+        if (engine.timers.pending > peak_timers) peak_timers = engine.timers.pending;
+
+        size_t waiting = engine.timers.pending;
+        for (size_t w = 0; w < workers; w++) {
+            waiting += parked[w].tasks.len + parked[w].mails.len;
+        }
+        if (waiting == 0) break;
+
+        for (size_t w = 0; w < workers; w++) {
+            Parked *tasks = &parked[w].tasks;
+            for (size_t i = 0; i < tasks->len; i++) {
+                Instance_Id id = tasks->items[i];
+                engine_complete(&engine, id);
+                if (engine.states[id] == INSTANCE_READY && model->nodes[engine.nodes[id]].kind == NODE_MAIL) {
+                    run_send(&engine, id, engine.nodes[id]);
+                }
+            }
+            tasks->len = 0;
+
+            Parked *mails = &parked[w].mails;
+            for (size_t i = 0; i < mails->len; i++) {
+                run_send(&engine, mails->items[i], engine.nodes[mails->items[i]]);
+            }
+            mails->len = 0;
+        }
+
+        engine_poll_mail(&engine);
+        engine_advance(&engine, engine.timers.now + longest);
+        run_ready(&engine, runner);
+        rounds++;
+
+        bool durable = rounds % RUN_SNAPSHOT_ROUNDS == 0 ? engine_snapshot(&engine) : engine_commit(&engine);
+        if (!durable) {
+            fprintf(stderr, "error: cannot write the log to %s: %s\n", wal_dir, strerror(errno));
+            break;
+        }
+    }
+
+    if (engine.durable && !engine.wal_failed && !engine_snapshot(&engine)) {
+        fprintf(stderr, "error: cannot write the snapshot to %s: %s\n", wal_dir, strerror(errno));
+    }
+
+    double elapsed = now_seconds() - start;
+
+    if (metrics != METRICS_NONE) {
+        if (runner) pool_metrics(&pool, &engine.metrics);
+        metrics_print(model, &engine.metrics, elapsed, metrics, stdout);
+    } else {
+        printf("starters:    %zu\n", starters);
+        printf("workers:     %zu\n", workers);
+        printf("instances:   %zu\n", starters * instances);
+        printf("peak alive:  %zu\n", peak);
+        printf("rounds:      %zu\n", rounds);
+        printf("transitions: %lu\n", engine.transitions);
+        printf("memory:      %zu bytes per instance\n", engine_slot_size(&engine) + 2*sizeof(Instance_Id));
+        printf("timers:      %zu at peak, %zu bytes each\n", peak_timers, 3*sizeof(uint32_t));
+        printf("messages:    %lu delivered, %lu early, %lu expired, %lu overflowed, %lu orphaned\n",
+               engine.mail_delivered, engine.mail_buffered, engine.mail_expired, engine.mail_overflow, engine.mail_orphaned);
+        if (engine.durable) {
+            printf("log:         %zu recovered, %lu records in %lu commits\n",
+                   engine.recovered, engine.wal.logged, engine.wal.groups);
+        }
+        printf("elapsed:     %.3fs\n", elapsed);
+    }
+
+    for (size_t w = 0; w < workers; w++) {
+        free(parked[w].tasks.items);
+        free(parked[w].mails.items);
+    }
+    free(parked);
+    if (runner) pool_free(&pool);
+    engine_free(&engine);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Benchmark of the engine alone: every task, wait and mail completes
+ * right away, so each instance runs from its starter to an end in a single
+ * engine_step and the time is spent in the interpreter loop. With several
+ * workers, instances are started in bigger batches so the threads have
+ * something to share, and the workers set them up themselves.
+ */
+
+#define BENCH_BATCH 1024
+#define BENCH_POOL_BATCH (1 << 20)
+
+// one per worker, on its own cache line
+typedef struct {
+    _Alignas(64) uint64_t x;
+} Bench_Rng;
+
+bool bench_work(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) engine;
+    (void) id;
+    (void) node;
+    (void) user;
+    return true;
+}
+
+uint32_t bench_branch(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) id;
+    uint64_t *x = &((Bench_Rng *) user)[POOL_WORKER].x;
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+
+    uint32_t degree = engine->program.offsets[node + 1] - engine->program.offsets[node];
+    return degree > 0 ? *x % degree : 0;
+}
+
+int bench_model(Process_Model *model, size_t instances, size_t workers) {
+    static Engine engine = {0};
+    static Pool pool = {0};
+    Bench_Rng *rngs = malloc(sizeof(Bench_Rng) * workers);
+    ASSERT(rngs != NULL && "Cannot allocate the benchmark state");
+    for (size_t i = 0; i < workers; i++) {
+        rngs[i].x = 0x9E3779B97F4A7C15ULL + i;
+    }
+
+    Engine_Callbacks callbacks = {
+        .on_task = bench_work,
+        .on_wait = bench_work,
+        .on_mail = bench_work,
+        .on_branch = bench_branch,
+        .user = rngs
+    };
+
+    double compile_start = now_seconds();
+    engine_init(&engine, model, callbacks);
+    double compile_time = now_seconds() - compile_start;
+
+    Pool *runner = workers > 1 ? &pool : NULL;
+    if (runner) pool_init(&pool, &engine, workers);
+    size_t batch_size = runner ? BENCH_POOL_BATCH : BENCH_BATCH;
+
+    double start = now_seconds();
+    size_t started = 0;
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind != NODE_STARTER) continue;
+
+        for (size_t j = 0; j < instances; j += batch_size) {
+            size_t batch = instances - j < batch_size ? instances - j : batch_size;
+            size_t k = runner && pool_start(runner, i, batch) ? batch : 0;
+            for (; k < batch; k++) {
+                if (engine_start(&engine, i) == ENGINE_INVALID_ID) {
+                    fprintf(stderr, "error: cannot allocate instance %zu\n", j + k);
+                    if (runner) pool_free(&pool);
+                    free(rngs);
+                    engine_free(&engine);
+                    return EXIT_FAILURE;
+                }
+            }
+
+            run_ready(&engine, runner);
+            started += batch;
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+    const Program *program = &engine.program;
+
+    printf("program:     %zu nodes, %zu edges, %zu bytes\n", program->nodes_cnt, program->edges_cnt, program_size(program));
+    printf("compile:     %.3fms\n", compile_time * 1000);
+    printf("workers:     %zu\n", workers);
+    printf("instances:   %zu\n", started);
+    printf("transitions: %lu\n", engine.transitions);
+    printf("elapsed:     %.3fs\n", elapsed);
+    if (elapsed > 0 && engine.transitions > 0) {
+        printf("throughput:  %.1fM transitions/s, %.2fns per transition\n",
+               engine.transitions / elapsed / 1e6, elapsed * 1e9 / engine.transitions);
+    }
+
+    if (runner) {
+        uint64_t stolen = 0;
+        for (size_t i = 0; i < workers; i++) stolen += pool.workers[i].stolen;
+        printf("stolen:      %lu of %zu instances\n", stolen, started);
+        pool_free(&pool);
+    }
+
+    free(rngs);
+    engine_free(&engine);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Benchmark of the instance store: parks instances all over the model,
+ * then looks for the ones on each node with engine_find, and with a plain
+ * loop over a copy of the same instances as an array of structs, the
+ * layout the engine would have with every field of an instance together.
+ */
+
+#define STORE_SCANS 16
+
+typedef struct {
+    uint32_t node;
+    uint8_t state;
+    bool live;
+    uint32_t generation;
+    uint64_t since;
+    Instance_Id root;
+    uint32_t tokens;
+} Store_Instance;
+
+// half of the tasks and every wait and mail event park
+bool store_park(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) id;
+    if (engine->model->nodes[node].kind != NODE_TASK) return false;
+
+    uint64_t *x = &((Bench_Rng *) user)->x;
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x & 1;
+}
+
+size_t store_find(const Store_Instance *instances, size_t cnt, uint32_t node, uint64_t before, Instance_Id *out, size_t cap) {
+    size_t found = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        if (!instances[i].live || instances[i].node != node || instances[i].since >= before) continue;
+
+        if (found < cap) out[found] = i;
+        found++;
+    }
+
+    return found;
+}
+
+int bench_store(Process_Model *model, size_t instances) {
+    static Engine engine = {0};
+    Bench_Rng rng = { .x = 0x9E3779B97F4A7C15ULL };
+
+    Engine_Callbacks callbacks = {
+        .on_task = store_park,
+        .on_wait = store_park,
+        .on_mail = store_park,
+        .on_branch = bench_branch,
+        .user = &rng
+    };
+
+    engine_init(&engine, model, callbacks);
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind != NODE_STARTER) continue;
+
+        for (size_t j = 0; j < instances; j++) {
+            if (engine_start(&engine, i) == ENGINE_INVALID_ID) {
+                fprintf(stderr, "error: cannot allocate instance %zu\n", j);
+                engine_free(&engine);
+                return EXIT_FAILURE;
+            }
+
+            if (engine.ready_len >= BENCH_BATCH) engine_run(&engine, 0);
+        }
+    }
+    engine_run(&engine, 0);
+
+    size_t cnt = engine.instances_cnt;
+    Store_Instance *fat = malloc(sizeof(Store_Instance) * cnt);
+    Instance_Id *out = malloc(sizeof(Instance_Id) * (cnt + 1));
+    ASSERT(fat != NULL && out != NULL && "Cannot allocate the benchmark state");
+
+    for (size_t i = 0; i < cnt; i++) {
+        fat[i] = (Store_Instance) {
+            .node = engine.nodes[i],
+            .state = engine.states[i],
+            .live = engine.states[i] != INSTANCE_DONE,
+            .generation = engine.generations[i],
+            .since = engine.since[i],
+            .root = engine.program.parallel ? engine.roots[i] : i,
+            .tokens = engine.program.parallel ? atomic_load(&engine.tokens[i]) : 1
+        };
+    }
+
+    size_t found = 0, found_fat = 0;
+    double start = now_seconds();
+    for (size_t k = 0; k < STORE_SCANS; k++) {
+        for (size_t i = 0; i < model->nodes_cnt; i++) {
+            found += engine_find(&engine, i, UINT64_MAX, out, cnt);
+        }
+    }
+    double soa = now_seconds() - start;
+
+    start = now_seconds();
+    for (size_t k = 0; k < STORE_SCANS; k++) {
+        for (size_t i = 0; i < model->nodes_cnt; i++) {
+            found_fat += store_find(fat, cnt, i, UINT64_MAX, out, cnt);
+        }
+    }
+    double aos = now_seconds() - start;
+
+    ASSERT(found == found_fat && "The layouts disagree on the instances found");
+
+    double scanned = (double) STORE_SCANS * model->nodes_cnt * cnt;
+    printf("instances:   %zu slots, %zu parked\n", cnt, engine.active);
+    printf("scans:       %d per node, %zu found each\n", STORE_SCANS, found / STORE_SCANS);
+    printf("columns:     %zu bytes per instance, %.3fns per instance scanned\n",
+           engine_slot_size(&engine), soa * 1e9 / scanned);
+    printf("structs:     %zu bytes per instance, %.3fns per instance scanned\n",
+           sizeof(Store_Instance), aos * 1e9 / scanned);
+    if (soa > 0) printf("speedup:     %.2fx\n", aos / soa);
+
+    free(fat);
+    free(out);
+    engine_free(&engine);
+    return EXIT_SUCCESS;
+}
+
 void load_resources(Screen *screen) {
-    screen->font = LoadFontFromMemory(".ttf", resources[RESOURCE_FONT_RUBIK].data, resources[RESOURCE_FONT_RUBIK].size, screen->settings.font_size, NULL, 0);
-    screen->font_header = LoadFontFromMemory(".ttf", resources[RESOURCE_FONT_RUBIK].data, resources[RESOURCE_FONT].size, screen->settings.font_size_header, NULL, 0);
+    collect_overlay_codepoints(screen);
+
+    static Text text = {0};
+    screen->text = &text;
+    resource_text(screen->text, RESOURCE_FONT_RUBIK, screen->codepoints, screen->codepoints_cnt);
+}
+
+void draw_diagram(const Screen *screen) {
+    for (size_t i = 0; i < screen->arrows_cnt; i++) {
+        draw_arrow(screen, &screen->arrows[i]);
+    }
 
-    Image mail = LoadImageFromMemory(".png", resources[RESOURCE_EMAIL].data, resources[RESOURCE_EMAIL].size);
-    screen->mail_texture = LoadTextureFromImage(mail);
+    for (size_t i = 0; i < screen->objs_cnt; i++) {
+        draw_obj(screen, screen->screen_objects[i]);
+    }
+}
 
-    Image relogio = LoadImageFromMemory(".png", resources[RESOURCE_RELOGIO].data, resources[RESOURCE_RELOGIO].size);
-    screen->wait_texture = LoadTextureFromImage(relogio);
+#define VIEW_MIN_ZOOM 0.25f
+#define VIEW_MAX_ZOOM 16.0f
 
-    Image rect = LoadImageFromMemory(".png", resources[RESOURCE_RECTANGLE].data, resources[RESOURCE_RECTANGLE].size);
-    screen->rect_rexture = LoadTextureFromImage(rect);
+// The wheel zooms around the cursor, dragging pans and 0 shows the whole
+// diagram again
+void update_view(Camera2D *camera) {
+    if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+        camera->target = Vector2Subtract(camera->target, Vector2Scale(GetMouseDelta(), 1/camera->zoom));
+    }
 
+    float wheel = GetMouseWheelMove();
+    if (wheel != 0) {
+        Vector2 mouse = GetMousePosition();
+        camera->target = GetScreenToWorld2D(mouse, *camera);
+        camera->offset = mouse;
+        camera->zoom = Clamp(camera->zoom*expf(wheel/8), VIEW_MIN_ZOOM, VIEW_MAX_ZOOM);
+    }
+
+    if (IsKeyPressed(KEY_ZERO)) *camera = (Camera2D) { .zoom = 1 };
+}
+
+// Draws the diagram offscreen at `scale` times the size of the window, the
+// text from the same distance field, and writes it to `path` as a PNG
+bool export_png(const Screen *screen, const char *path, float scale) {
+    RenderTexture2D target = LoadRenderTexture(screen->settings.width*scale, (screen->settings.height + screen->settings.header_height)*scale);
+    if (!IsRenderTextureValid(target)) return false;
+
+    screen->text->zoom = scale;
+    BeginTextureMode(target);
+    ClearBackground(WHITE);
+    BeginMode2D((Camera2D) { .zoom = scale });
+    draw_diagram(screen);
+    draw_header(screen);
+    EndMode2D();
+    EndTextureMode();
+
+    Image image = LoadImageFromTexture(target.texture);
+    ImageFlipVertical(&image);
+    bool exported = ExportImage(image, path);
+    UnloadImage(image);
+    UnloadRenderTexture(target);
+    return exported;
 }
 
 int main(int argc, char **argv) {
     char *program_name = shift_args(&argc, &argv);
-    if (argc == 0) {
+    char *file_path = NULL;
+    long run_instances = 0;
+    long bench_instances = 0;
+    long store_instances = 0;
+    bool analyze_only = false;
+    bool emit_only = false;
+    bool lsp_only = false;
+    size_t workers = 1;
+    const char *wal_dir = NULL;
+    Metrics_Format metrics = METRICS_NONE;
+    const char *heatmap_source = NULL;
+    const char *play_path = NULL;
+    const char *log_path = NULL;
+    const char *discover_path = NULL;
+    const char *export_path = NULL;
+    float export_scale = 1;
+    double filter = DISCOVER_FILTER;
+    Sim_Config sim = { .seed = 42 };
+
+    while (argc > 0) {
+        char *arg = shift_args(&argc, &argv);
+        bool takes_value = strcmp(arg, "--run") == 0 || strcmp(arg, "--bench") == 0 || strcmp(arg, "--simulate") == 0
+            || strcmp(arg, "--replications") == 0 || strcmp(arg, "--threads") == 0
+            || strcmp(arg, "--seed") == 0 || strcmp(arg, "--workers") == 0 || strcmp(arg, "--bench-store") == 0
+            || strcmp(arg, "--wal") == 0 || strcmp(arg, "--metrics") == 0
+            || strcmp(arg, "--heatmap") == 0 || strcmp(arg, "--trace") == 0 || strcmp(arg, "--play") == 0
+            || strcmp(arg, "--conform") == 0 || strcmp(arg, "--discover") == 0 || strcmp(arg, "--filter") == 0
+            || strcmp(arg, "--export") == 0 || strcmp(arg, "--scale") == 0;
+
+        if (takes_value && argc == 0) {
+            usage(program_name);
+            return EXIT_FAILURE;
+        }
+
+        if (strcmp(arg, "--run") == 0) {
+            run_instances = atol(shift_args(&argc, &argv));
+        } else if (strcmp(arg, "--bench") == 0) {
+            bench_instances = atol(shift_args(&argc, &argv));
+        } else if (strcmp(arg, "--bench-store") == 0) {
+            store_instances = atol(shift_args(&argc, &argv));
+        } else if (strcmp(arg, "--simulate") == 0) {
+            sim.instances = strtoull(shift_args(&argc, &argv), NULL, 10);
+        } else if (strcmp(arg, "--replications") == 0) {
+            sim.replications = strtoull(shift_args(&argc, &argv), NULL, 10);
+        } else if (strcmp(arg, "--threads") == 0) {
+            sim.threads = strtoull(shift_args(&argc, &argv), NULL, 10);
+        } else if (strcmp(arg, "--seed") == 0) {
+            sim.seed = strtoull(shift_args(&argc, &argv), NULL, 10);
+        } else if (strcmp(arg, "--metrics") == 0) {
+            const char *format = shift_args(&argc, &argv);
+            if (!metrics_parse_format(format, &metrics)) {
+                fprintf(stderr, "error: unknown metrics format %s, expected json or prom\n", format);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(arg, "--trace") == 0) {
+            sim.trace = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--play") == 0) {
+            play_path = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--conform") == 0) {
+            log_path = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--discover") == 0) {
+            discover_path = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--export") == 0) {
+            export_path = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--scale") == 0) {
+            export_scale = strtof(shift_args(&argc, &argv), NULL);
+        } else if (strcmp(arg, "--filter") == 0) {
+            filter = strtod(shift_args(&argc, &argv), NULL);
+        } else if (strcmp(arg, "--heatmap") == 0) {
+            heatmap_source = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--wal") == 0) {
+            wal_dir = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--workers") == 0) {
+            workers = strtoull(shift_args(&argc, &argv), NULL, 10);
+        } else if (strcmp(arg, "--analyze") == 0) {
+            analyze_only = true;
+        } else if (strcmp(arg, "--emit-c") == 0) {
+            emit_only = true;
+        } else if (strcmp(arg, "--lsp") == 0) {
+            lsp_only = true;
+        } else {
+            file_path = arg;
+        }
+    }
+
+    if (lsp_only) return lsp(stdin, stdout);
+    if (discover_path != NULL) return discover(discover_path, sim.threads, filter, stdout);
+
+    if (file_path == NULL) {
         usage(program_name);
         return EXIT_FAILURE;
     }
 
-    char *file_path = shift_args(&argc, &argv);
     static Lexer lexer = {0};
     static Screen screen = {0};
 
@@ -1245,37 +3131,123 @@ int main(int argc, char **argv) {
     init_screen(&screen);
 
     parse(&lexer, &screen);
+
+    static Process_Model model = {0};
+    build_model(&lexer, &screen, &model);
+
+    if (workers == 0) workers = 1;
+    if (run_instances > 0) return run_model(&model, run_instances, workers, wal_dir, metrics);
+    if (bench_instances > 0) return bench_model(&model, bench_instances, workers);
+    if (store_instances > 0) return bench_store(&model, store_instances);
+    if (log_path != NULL) {
+        // the log may name the events by their titles
+        const char **titles = calloc(model.nodes_cnt, sizeof(char *));
+        assert(titles != NULL && "Cannot allocate the titles");
+        for (size_t i = 0; i < screen.objs_cnt; i++) {
+            Symbol *symbol = screen.screen_objects[i].value;
+            if (symbol->node_id != ENGINE_INVALID_ID && symbol->as.event.title[0] != '\0') {
+                titles[symbol->node_id] = symbol->as.event.title;
+            }
+        }
+
+        int status = conform(&model, titles, log_path, sim.threads);
+        free(titles);
+        return status;
+    }
+    if (sim.instances > 0 && heatmap_source == NULL) {
+        sim.metrics = metrics;
+        return simulate(&model, sim);
+    }
+
+    if (emit_only) {
+        return emit_c(&model, screen.title, file_path, stdout) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    static Analysis analysis = {0};
+    analyze(&model, &analysis);
+
+    if (analyze_only) {
+        analysis_print(&model, &analysis);
+        return EXIT_SUCCESS;
+    }
+
+    static Heatmap heatmap = {0};
+    if (heatmap_source != NULL) {
+        heatmap_init(&heatmap, &model);
+        if (strcmp(heatmap_source, "sim") == 0) {
+            static Sim_Result result = {0};
+            if (sim.instances == 0) sim.instances = HEATMAP_SIM_INSTANCES;
+            if (!sim_run(&model, &sim, &result)) {
+                fprintf(stderr, "error: cannot write the trace %s: %s\n", sim.trace, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            heatmap_from_sim(&heatmap, &result);
+            sim_result_free(&result);
+        } else if (!heatmap_from_metrics(&heatmap, heatmap_source)) {
+            fprintf(stderr, "error: cannot read the metrics in %s: %s\n", heatmap_source, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
     setup_screen(&screen);
+    layout_screen(&screen, &lexer, &analysis, heatmap_source != NULL ? &heatmap : NULL);
+
+    static Playback play = {0};
+    if (play_path != NULL && !play_open(&play, &screen, &model, play_path)) {
+        fprintf(stderr, "error: cannot read %s as a trace of %s\n", play_path, file_path);
+        return EXIT_FAILURE;
+    }
+
+    if (export_path != NULL) {
+        if (!(export_scale > 0)) {
+            fprintf(stderr, "error: the scale of --export must be above 0\n");
+            return EXIT_FAILURE;
+        }
+        SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    }
 
     InitWindow(screen.settings.width, screen.settings.height + screen.settings.header_height, screen.title);
 
     load_resources(&screen);
+    if (export_path != NULL) {
+        bool exported = export_png(&screen, export_path, export_scale);
+        CloseWindow();
+        if (!exported) {
+            fprintf(stderr, "error: cannot export the diagram to %s\n", export_path);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (play_path != NULL) play_load_texture(&play);
 
-
+    Camera2D camera = { .zoom = 1 };
     while (!WindowShouldClose()) {
+        if (heatmap_source != NULL && IsKeyPressed(KEY_H)) {
+            screen.overlay = (screen.overlay + 1) % HEATMAP_METRICS_CNT;
+        }
+
+        if (play_path != NULL) play_update(&play, &screen, GetFrameTime());
+        update_view(&camera);
+
         BeginDrawing();
         ClearBackground(WHITE);
 
-        draw_header(screen);
-        for (size_t i = 0; i < screen.objs_cnt; i++) {
-            Screen_Object obj = screen.screen_objects[i];
-            if (obj.value->kind == SYMB_EVENT) {
-                for (size_t j = 0; j < 3; j++) {
-                    Key_Value *to = get_symbol(&lexer.symbols, obj.value->as.event.points_to[j]);
-                    if (to != NULL) {
-                        draw_arrow(screen, obj, screen.screen_objects[to->value.obj_id]);
-                    }
-                }
-            }
-        }
+        screen.text->zoom = camera.zoom;
+        BeginMode2D(camera);
+        draw_diagram(&screen);
+        if (play_path != NULL) draw_tokens(&play, &screen);
+        EndMode2D();
 
-        for (size_t i = 0; i < screen.objs_cnt; i++) {
-            draw_obj(screen, screen.screen_objects[i]);
-        }
+        // the header stays put over the diagram
+        screen.text->zoom = 1;
+        DrawRectangle(0, 0, screen.settings.width, screen.settings.header_height, WHITE);
+        draw_header(&screen);
+        if (play_path != NULL) draw_playback_status(&play, &screen);
 
         EndDrawing();
     }
 
+    if (play_path != NULL) play_close(&play);
     CloseWindow();
 
     return EXIT_SUCCESS;
@@ -0,0 +1,142 @@
+/*******************************************************************\
+| Section: Metrics Export                                           |
+| Dumps the metrics of an engine (see Engine_Metrics) as JSON or as |
+| Prometheus text. Latencies are in milliseconds, the ticks of both |
+| --run and --simulate, and lanes report how many tokens left their |
+| events and at what rate over `elapsed` seconds.                   |
+\*******************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef enum {
+    METRICS_NONE = 0,
+    METRICS_JSON,
+    METRICS_PROM
+} Metrics_Format;
+
+bool metrics_parse_format(const char *name, Metrics_Format *format) {
+    if (strcmp(name, "json") == 0) *format = METRICS_JSON;
+    else if (strcmp(name, "prom") == 0) *format = METRICS_PROM;
+    else return false;
+    return true;
+}
+
+const char *metrics_kind(Node_Kind kind) {
+    switch (kind) {
+        case NODE_STARTER: return "starter";
+        case NODE_TASK:    return "task";
+        case NODE_GATEWAY: return "gateway";
+        case NODE_WAIT:    return "wait";
+        case NODE_MAIL:    return "mail";
+        case NODE_END:     return "end";
+    }
+
+    return "";
+}
+
+// events outside of a subprocess are counted in a lane with no name
+const char *metrics_lane(const Process_Model *model, size_t lane) {
+    return lane < model->lanes_cnt ? model->lanes[lane].name : "";
+}
+
+// Same escapes for JSON strings and Prometheus label values
+void metrics_print_string(const char *s, FILE *out) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', out);
+        if (*s == '\n') fputs("\\n", out);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static const double METRICS_QUANTILES[] = { 50, 90, 99 };
+#define METRICS_QUANTILES_CNT (sizeof(METRICS_QUANTILES) / sizeof(METRICS_QUANTILES[0]))
+
+void metrics_print_json(const Process_Model *model, const Engine_Metrics *metrics, double elapsed, FILE *out) {
+    fprintf(out, "{\n  \"elapsed\": %.6f,\n  \"events\": [", elapsed);
+
+    bool first = true;
+    for (size_t i = 0; i < metrics->nodes_cnt; i++) {
+        const Histogram *h = metrics->nodes[i];
+        if (h == NULL) continue;
+
+        const Model_Node *node = &model->nodes[i];
+        fprintf(out, "%s\n    {\"id\": ", first ? "" : ",");
+        metrics_print_string(node->name, out);
+        fprintf(out, ", \"kind\": \"%s\", \"lane\": ", metrics_kind(node->kind));
+        metrics_print_string(metrics_lane(model, node->lane), out);
+        fprintf(out, ", \"count\": %lu, \"mean\": %.3f, \"min\": %lu", h->total, histogram_mean(h), h->min);
+        for (size_t q = 0; q < METRICS_QUANTILES_CNT; q++) {
+            fprintf(out, ", \"p%g\": %lu", METRICS_QUANTILES[q], histogram_percentile(h, METRICS_QUANTILES[q]));
+        }
+        fprintf(out, ", \"max\": %lu}", h->max);
+        first = false;
+    }
+
+    fprintf(out, "\n  ],\n  \"lanes\": [");
+
+    first = true;
+    for (size_t i = 0; i < metrics->lanes_cnt; i++) {
+        if (i == model->lanes_cnt && metrics->lanes[i] == 0) continue;
+
+        fprintf(out, "%s\n    {\"name\": ", first ? "" : ",");
+        metrics_print_string(metrics_lane(model, i), out);
+        fprintf(out, ", \"tokens\": %lu, \"throughput\": %.3f}",
+                metrics->lanes[i], elapsed > 0 ? metrics->lanes[i] / elapsed : 0);
+        first = false;
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void metrics_print_labels(const Process_Model *model, size_t node, FILE *out) {
+    fputs("{event=", out);
+    metrics_print_string(model->nodes[node].name, out);
+    fprintf(out, ",kind=\"%s\",lane=", metrics_kind(model->nodes[node].kind));
+    metrics_print_string(metrics_lane(model, model->nodes[node].lane), out);
+}
+
+void metrics_print_prom(const Process_Model *model, const Engine_Metrics *metrics, double elapsed, FILE *out) {
+    fprintf(out, "# HELP pcs_event_duration_milliseconds Time tokens spent on an event.\n");
+    fprintf(out, "# TYPE pcs_event_duration_milliseconds summary\n");
+    for (size_t i = 0; i < metrics->nodes_cnt; i++) {
+        const Histogram *h = metrics->nodes[i];
+        if (h == NULL) continue;
+
+        for (size_t q = 0; q < METRICS_QUANTILES_CNT; q++) {
+            fputs("pcs_event_duration_milliseconds", out);
+            metrics_print_labels(model, i, out);
+            fprintf(out, ",quantile=\"%g\"} %lu\n", METRICS_QUANTILES[q] / 100, histogram_percentile(h, METRICS_QUANTILES[q]));
+        }
+
+        fputs("pcs_event_duration_milliseconds_sum", out);
+        metrics_print_labels(model, i, out);
+        fprintf(out, "} %.0f\n", h->sum);
+        fputs("pcs_event_duration_milliseconds_count", out);
+        metrics_print_labels(model, i, out);
+        fprintf(out, "} %lu\n", h->total);
+    }
+
+    fprintf(out, "# HELP pcs_lane_tokens_total Tokens that left an event of the lane.\n");
+    fprintf(out, "# TYPE pcs_lane_tokens_total counter\n");
+    for (size_t i = 0; i < metrics->lanes_cnt; i++) {
+        if (i == model->lanes_cnt && metrics->lanes[i] == 0) continue;
+
+        fputs("pcs_lane_tokens_total{lane=", out);
+        metrics_print_string(metrics_lane(model, i), out);
+        fprintf(out, "} %lu\n", metrics->lanes[i]);
+    }
+
+    fprintf(out, "# HELP pcs_elapsed_seconds Time the metrics were collected over.\n");
+    fprintf(out, "# TYPE pcs_elapsed_seconds gauge\n");
+    fprintf(out, "pcs_elapsed_seconds %.6f\n", elapsed);
+}
+
+void metrics_print(const Process_Model *model, const Engine_Metrics *metrics, double elapsed, Metrics_Format format, FILE *out) {
+    if (format == METRICS_JSON) metrics_print_json(model, metrics, elapsed, out);
+    else if (format == METRICS_PROM) metrics_print_prom(model, metrics, elapsed, out);
+}
@@ -0,0 +1,407 @@
+/*******************************************************************\
+| Section: Worker Pool                                              |
+| Steps the ready instances of an engine on several threads. The    |
+| threads are started once and park between rounds. In a round,    |
+| workers claim the ready queue a few runs of POOL_RUN instances at |
+| a time into their own Chase-Lev deque: the owner pushes and takes |
+| at the bottom without contention, and idle workers steal from the |
+| top of the others, so a worker stuck in a long callback holds     |
+| back at most the rest of its run. Everything the engine shares is |
+| deferred (see engine_apply). Each worker releases the slots that  |
+| ended on its own, and the calling thread applies the rest once    |
+| every worker is done, so callbacks are the only code that has to  |
+| be thread-safe.                                                   |
+\*******************************************************************/
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define POOL_EMPTY UINT32_MAX
+#define POOL_ABORT (UINT32_MAX - 1)
+#define POOL_RUN 8    // instances of the batch per deque item
+#define POOL_CLAIM 8  // runs a worker takes from the batch at once
+
+// index of the worker running the current thread, for callbacks that keep
+// per worker state; 0 outside of a pool
+_Thread_local size_t POOL_WORKER = 0;
+
+typedef struct Pool_Ring {
+    struct Pool_Ring *prev;  // rings are only freed with the deque, thieves may still read them
+    size_t mask;
+    _Atomic uint32_t items[];  // runs of the batch
+} Pool_Ring;
+
+typedef struct {
+    _Alignas(64) _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(Pool_Ring *) ring;
+} Pool_Deque;
+
+Pool_Ring *pool_ring_new(size_t cap, Pool_Ring *prev) {
+    Pool_Ring *ring = malloc(sizeof(Pool_Ring) + sizeof(uint32_t) * cap);
+    assert(ring != NULL && "Cannot allocate worker deque");
+    ring->prev = prev;
+    ring->mask = cap - 1;
+    return ring;
+}
+
+void pool_deque_init(Pool_Deque *deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->ring, pool_ring_new(1024, NULL));
+}
+
+void pool_deque_free(Pool_Deque *deque) {
+    Pool_Ring *ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    while (ring != NULL) {
+        Pool_Ring *prev = ring->prev;
+        free(ring);
+        ring = prev;
+    }
+}
+
+// Owner only
+void pool_deque_push(Pool_Deque *deque, uint32_t run) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    Pool_Ring *ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+
+    if (b - t > (int64_t) ring->mask) {
+        Pool_Ring *bigger = pool_ring_new((ring->mask + 1) * 2, ring);
+        for (int64_t i = t; i < b; i++) {
+            uint32_t item = atomic_load_explicit(&ring->items[i & ring->mask], memory_order_relaxed);
+            atomic_store_explicit(&bigger->items[i & bigger->mask], item, memory_order_relaxed);
+        }
+
+        atomic_store_explicit(&deque->ring, bigger, memory_order_release);
+        ring = bigger;
+    }
+
+    atomic_store_explicit(&ring->items[b & ring->mask], run, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
+
+// Owner only, POOL_EMPTY when there is nothing left
+uint32_t pool_deque_take(Pool_Deque *deque) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    Pool_Ring *ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return POOL_EMPTY;
+    }
+
+    uint32_t run = atomic_load_explicit(&ring->items[b & ring->mask], memory_order_relaxed);
+    if (t == b) {
+        // last one, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            run = POOL_EMPTY;
+        }
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+
+    return run;
+}
+
+// Any thread, POOL_ABORT when it lost a race and may try again
+uint32_t pool_deque_steal(Pool_Deque *deque) {
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b) return POOL_EMPTY;
+
+    Pool_Ring *ring = atomic_load_explicit(&deque->ring, memory_order_acquire);
+    uint32_t run = atomic_load_explicit(&ring->items[t & ring->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return POOL_ABORT;
+    }
+
+    return run;
+}
+
+typedef struct Pool Pool;
+
+typedef struct {
+    Pool *pool;
+    size_t index;
+    Pool_Deque deque;
+    Engine_Deferred deferred;
+    uint64_t stepped;
+    uint64_t stolen;  // instances of the runs stolen from the others
+} Pool_Worker;
+
+struct Pool {
+    Engine *engine;
+    Pool_Worker *workers;
+    size_t workers_cnt;
+    pthread_t *threads;
+    size_t threads_cnt;  // started, run workers 1 to threads_cnt
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint64_t round;  // under lock, bumped to start a round
+    bool stopping;
+
+    // the round steps the first `queued` instances of the ready queue,
+    // then the instances started by pool_start, `batch` in all
+    size_t batch;
+    size_t queued;
+    Engine_Slots starts;
+    uint32_t starter;
+    bool release;  // workers release the slots that ended themselves
+
+    _Alignas(64) _Atomic size_t claimed;    // runs of the batch taken into a deque
+    _Alignas(64) _Atomic size_t remaining;  // instances of the batch not yet stepped
+    _Alignas(64) _Atomic size_t done;       // threads through the round
+};
+
+void *pool_thread(void *arg);
+
+void pool_init(Pool *pool, Engine *engine, size_t workers) {
+    assert(workers > 0 && "A pool needs at least one worker");
+
+    memset(pool, 0, sizeof(*pool));
+    pool->engine = engine;
+    pool->workers_cnt = workers;
+    pool->workers = calloc(workers, sizeof(Pool_Worker));
+    pool->threads = malloc(sizeof(pthread_t) * workers);
+    assert(pool->workers != NULL && pool->threads != NULL && "Cannot allocate the worker pool");
+
+    for (size_t i = 0; i < workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pool_deque_init(&pool->workers[i].deque);
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    // workers without a thread never claim anything, the others do their share
+    while (pool->threads_cnt + 1 < workers) {
+        Pool_Worker *worker = &pool->workers[pool->threads_cnt + 1];
+        if (pthread_create(&pool->threads[pool->threads_cnt], NULL, pool_thread, worker) != 0) break;
+        pool->threads_cnt++;
+    }
+}
+
+void pool_free(Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->threads_cnt; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+
+    for (size_t i = 0; i < pool->workers_cnt; i++) {
+        pool_deque_free(&pool->workers[i].deque);
+        free(pool->workers[i].deferred.items);
+        engine_metrics_free(&pool->workers[i].deferred.metrics);
+    }
+
+    free(pool->workers);
+    free(pool->threads);
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Merges the metrics of every worker into `metrics`, see Engine_Metrics
+void pool_metrics(const Pool *pool, Engine_Metrics *metrics) {
+    for (size_t i = 0; i < pool->workers_cnt; i++) {
+        engine_metrics_merge(metrics, &pool->workers[i].deferred.metrics);
+    }
+}
+
+// Instance `i` of the batch
+static inline Instance_Id pool_instance(const Pool *pool, size_t i) {
+    const Engine *engine = pool->engine;
+    if (i < pool->queued) return engine->ready[(engine->ready_head + i) & (engine->ready_cap - 1)];
+    return engine_slot_at(engine, &pool->starts, i - pool->queued);
+}
+
+// Takes the next runs of the batch into the deque of the worker. Returns
+// false when the whole batch was claimed.
+bool pool_claim(Pool_Worker *worker) {
+    Pool *pool = worker->pool;
+    size_t runs = (pool->batch + POOL_RUN - 1) / POOL_RUN;
+
+    size_t from = atomic_fetch_add_explicit(&pool->claimed, POOL_CLAIM, memory_order_relaxed);
+    if (from >= runs) return false;
+
+    size_t to = from + POOL_CLAIM < runs ? from + POOL_CLAIM : runs;
+    for (size_t run = from; run < to; run++) {
+        pool_deque_push(&worker->deque, (uint32_t) run);
+    }
+
+    return true;
+}
+
+// Steals from the other workers, starting after this one so thieves
+// spread over the victims
+uint32_t pool_steal(Pool_Worker *worker) {
+    Pool *pool = worker->pool;
+    for (size_t k = 1; k < pool->workers_cnt; k++) {
+        Pool_Worker *victim = &pool->workers[(worker->index + k) % pool->workers_cnt];
+
+        uint32_t run;
+        do {
+            run = pool_deque_steal(&victim->deque);
+        } while (run == POOL_ABORT);
+
+        if (run != POOL_EMPTY) {
+            size_t from = (size_t) run * POOL_RUN;
+            worker->stolen += from + POOL_RUN < pool->batch ? POOL_RUN : pool->batch - from;
+            return run;
+        }
+    }
+
+    return POOL_EMPTY;
+}
+
+// The share of a worker in a round: steps instances until the whole batch
+// is, then releases the slots that ended on it
+void pool_work(Pool_Worker *worker) {
+    Pool *pool = worker->pool;
+    Engine *engine = pool->engine;
+
+    // stepped and not yet taken off remaining, which is only done before
+    // looking for more work, to keep the counter off the hot loop
+    size_t stepped = 0;
+    while (atomic_load_explicit(&pool->remaining, memory_order_acquire) > 0) {
+        uint32_t run = pool_deque_take(&worker->deque);
+        if (run == POOL_EMPTY) {
+            if (stepped > 0) atomic_fetch_sub_explicit(&pool->remaining, stepped, memory_order_release);
+            stepped = 0;
+
+            if (pool_claim(worker)) continue;
+            run = pool_steal(worker);
+        }
+        if (run == POOL_EMPTY) {
+            sched_yield();
+            continue;
+        }
+
+        size_t from = (size_t) run * POOL_RUN;
+        size_t to = from + POOL_RUN < pool->batch ? from + POOL_RUN : pool->batch;
+        if (to > pool->queued) {
+            size_t start = from > pool->queued ? from : pool->queued;
+            engine_fill_starts(engine, &pool->starts, start - pool->queued, to - pool->queued, pool->starter);
+        }
+
+        for (size_t i = from; i < to; i++) {
+            engine_step(engine, pool_instance(pool, i), &worker->deferred);
+        }
+
+        worker->stepped += to - from;
+        stepped += to - from;
+    }
+
+    // every worker is done stepping, so the counts of the others are final
+    if (pool->release) {
+        size_t at = 0;
+        for (size_t i = 0; i < worker->index; i++) {
+            at += pool->workers[i].deferred.ends;
+        }
+        engine_release_ends(engine, &worker->deferred, at);
+    }
+}
+
+void *pool_thread(void *arg) {
+    Pool_Worker *worker = arg;
+    Pool *pool = worker->pool;
+    POOL_WORKER = worker->index;
+
+    uint64_t seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->round == seen && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        bool stopping = pool->stopping;
+        seen = pool->round;
+        pthread_mutex_unlock(&pool->lock);
+        if (stopping) break;
+
+        pool_work(worker);
+        atomic_fetch_add_explicit(&pool->done, 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+// Starts `count` instances of `starter`, which the workers set up and
+// step in the next pool_run. Only the slots are taken here, so nothing
+// else may touch them before. Returns false when the engine is durable or
+// cannot grow, start them with engine_start then.
+bool pool_start(Pool *pool, uint32_t starter, size_t count) {
+    assert(pool->starts.count == 0 && "Instances started by pool_start were not run");
+
+    Engine *engine = pool->engine;
+    if (engine->durable || !engine_take_slots(engine, count, &pool->starts)) return false;
+
+    pool->starter = starter;
+    return true;
+}
+
+// Steps every ready instance of the engine, and those of pool_start, on
+// the workers until none is left. The calling thread is worker 0. Returns
+// how many were stepped.
+size_t pool_run(Pool *pool) {
+    Engine *engine = pool->engine;
+    size_t stepped = 0;
+
+    while (engine->ready_len > 0 || pool->starts.count > 0) {
+        size_t queued = engine->ready_len;
+        size_t batch = queued + pool->starts.count;
+        pool->release = !engine->durable;
+        if (pool->release) engine_reserve_free(engine);
+
+        // the lock publishes the batch to the workers it wakes
+        pthread_mutex_lock(&pool->lock);
+        pool->batch = batch;
+        pool->queued = queued;
+        atomic_store_explicit(&pool->claimed, 0, memory_order_relaxed);
+        atomic_store_explicit(&pool->remaining, batch, memory_order_relaxed);
+        atomic_store_explicit(&pool->done, 0, memory_order_relaxed);
+        pool->round++;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(&pool->workers[0]);
+        while (atomic_load_explicit(&pool->done, memory_order_acquire) < pool->threads_cnt) {
+            sched_yield();
+        }
+
+        engine->ready_head = (engine->ready_head + queued) & (engine->ready_cap - 1);
+        engine->ready_len -= queued;
+        pool->starts.count = 0;
+
+        if (pool->release) {
+            size_t released = 0;
+            for (size_t i = 0; i < pool->workers_cnt; i++) {
+                released += pool->workers[i].deferred.ends;
+            }
+            engine_released(engine, released);
+        }
+
+        for (size_t i = 0; i < pool->workers_cnt; i++) {
+            engine_apply(engine, &pool->workers[i].deferred);
+        }
+
+        stepped += batch;
+    }
+
+    return stepped;
+}
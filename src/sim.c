@@ -0,0 +1,727 @@
+/*******************************************************************\
+| Section: Simulation                                               |
+| Monte Carlo discrete-event simulation of a Process_Model. The     |
+| instances are split into independent replications, each one an    |
+| Engine driven by its own event calendar and its own RNG stream,   |
+| so results only depend on the seed and the number of             |
+| replications, never on how many threads ran them.                 |
+\*******************************************************************/
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * RNG: xoshiro256**, seeded through splitmix64. Every replication gets the
+ * stream `seed` mixed with its own index.
+ */
+
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(Rng *rng, uint64_t seed, uint64_t stream) {
+    uint64_t x = seed;
+    x ^= splitmix64(&stream);
+    for (size_t i = 0; i < 4; i++) {
+        rng->s[i] = splitmix64(&x);
+    }
+}
+
+uint64_t rng_next(Rng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = ((s[1] * 5) << 7 | (s[1] * 5) >> 57) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = s[3] << 45 | s[3] >> 19;
+
+    return result;
+}
+
+// uniform in [0, 1)
+double rng_uniform(Rng *rng) { return (rng_next(rng) >> 11) * 0x1.0p-53; }
+
+double rng_sample(Rng *rng, Distribution dist) {
+    switch (dist.kind) {
+        case DIST_NONE:    return 0;
+        case DIST_CONST:   return dist.a;
+        case DIST_EXP:     return -dist.a * log(1.0 - rng_uniform(rng));
+        case DIST_UNIFORM: return dist.a + (dist.b - dist.a) * rng_uniform(rng);
+
+        case DIST_NORMAL: {
+            double u = 1.0 - rng_uniform(rng);
+            double v = rng_uniform(rng);
+            double x = dist.a + dist.b * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+            return x > 0 ? x : 0;
+        }
+
+        case DIST_TRIANGULAR: {
+            double u = rng_uniform(rng);
+            double f = (dist.b - dist.a) / (dist.c - dist.a);
+            if (u < f) return dist.a + sqrt(u * (dist.c - dist.a) * (dist.b - dist.a));
+            return dist.c - sqrt((1 - u) * (dist.c - dist.a) * (dist.c - dist.b));
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Event calendar: a binary min-heap of pending events ordered by time and
+ * then by the order they were scheduled, so events at the same time, which
+ * any constant duration produces in long runs, come out FIFO. Both
+ * operations are O(log n) whatever the spacing of the events.
+ */
+
+typedef enum {
+    SIM_ARRIVAL = 0,  // `id` is the starter node
+    SIM_COMPLETE      // `id` is the instance parked on a task or wait
+} Sim_Event_Kind;
+
+typedef struct {
+    double time;
+    uint64_t seq;
+    uint32_t id;
+    uint32_t kind;
+} Sim_Event;
+
+typedef struct {
+    Sim_Event *heap;
+    size_t size;
+    size_t cap;
+    uint64_t seq;
+} Calendar;
+
+void calendar_init(Calendar *cal) {
+    memset(cal, 0, sizeof(*cal));
+}
+
+void calendar_free(Calendar *cal) {
+    free(cal->heap);
+    memset(cal, 0, sizeof(*cal));
+}
+
+static inline bool calendar_before(const Sim_Event *a, const Sim_Event *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+void calendar_push(Calendar *cal, double time, Sim_Event_Kind kind, uint32_t id) {
+    if (cal->size == cal->cap) {
+        cal->cap = cal->cap == 0 ? 1024 : cal->cap * 2;
+        cal->heap = realloc(cal->heap, sizeof(Sim_Event) * cal->cap);
+        assert(cal->heap != NULL && "Cannot grow the calendar");
+    }
+
+    Sim_Event ev = { .time = time, .seq = cal->seq++, .id = id, .kind = kind };
+    size_t i = cal->size++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!calendar_before(&ev, &cal->heap[parent])) break;
+        cal->heap[i] = cal->heap[parent];
+        i = parent;
+    }
+
+    cal->heap[i] = ev;
+}
+
+bool calendar_pop(Calendar *cal, Sim_Event *out) {
+    if (cal->size == 0) return false;
+
+    *out = cal->heap[0];
+    Sim_Event last = cal->heap[--cal->size];
+    size_t n = cal->size;
+    if (n == 0) return true;
+
+    // the last event was scheduled late and belongs near the leaves: move
+    // the hole all the way down first, then sift `last` up from there
+    size_t i = 0;
+    for (size_t child = 1; child < n; child = 2 * i + 1) {
+        if (child + 1 < n && calendar_before(&cal->heap[child + 1], &cal->heap[child])) child++;
+        cal->heap[i] = cal->heap[child];
+        i = child;
+    }
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!calendar_before(&last, &cal->heap[parent])) break;
+        cal->heap[i] = cal->heap[parent];
+        i = parent;
+    }
+
+    cal->heap[i] = last;
+    return true;
+}
+
+/*
+ * Replications
+ */
+
+typedef struct {
+    size_t instances;
+    size_t replications;
+    size_t threads;
+    uint64_t seed;
+    Metrics_Format metrics;  // print the metrics of the engine instead of the report
+    const char *trace;       // file for the moves of the tokens, takes a single replication
+} Sim_Config;
+
+typedef struct {
+    uint64_t visits;
+    double busy;
+} Sim_Node_Stats;
+
+typedef struct {
+    Histogram wait;     // milliseconds spent in the queue before each task
+    double queue_area;  // queue length integrated over time
+    size_t queue_max;
+} Sim_Lane_Stats;
+
+typedef struct {
+    Histogram cycle;  // milliseconds
+    Sim_Node_Stats *nodes;
+    Sim_Lane_Stats *lanes;
+    double horizon;
+    Engine_Metrics metrics;
+} Sim_Result;
+
+// Tasks of a lane with a capacity compete for its servers; the ones that
+// find every server busy wait in a FIFO ring of instance ids
+typedef struct {
+    uint32_t capacity;
+    uint32_t busy;
+
+    Instance_Id *queue;
+    size_t queue_head;
+    size_t queue_len;
+    size_t queue_cap;
+
+    double last_change;
+} Sim_Lane;
+
+typedef struct {
+    const Process_Model *model;
+    Engine engine;
+    Calendar calendar;
+    Rng rng;
+    double now;
+
+    Sim_Lane *lanes;
+
+    // flat per-instance state, indexed by Instance_Id
+    double *started;  // arrival of the instance
+    double *queued;   // when it joined the queue of a lane
+    double *service;  // duration of the task it is queued for
+    size_t instances_cap;
+
+    Sim_Result *result;
+    Trace_Writer *trace;
+} Sim_Replication;
+
+// Accumulates the queue length since the last change of the lane
+void sim_lane_track(Sim_Replication *rep, uint32_t lane_id) {
+    Sim_Lane *lane = &rep->lanes[lane_id];
+    Sim_Lane_Stats *stats = &rep->result->lanes[lane_id];
+
+    stats->queue_area += lane->queue_len * (rep->now - lane->last_change);
+    lane->last_change = rep->now;
+}
+
+void sim_lane_serve(Sim_Replication *rep, uint32_t lane_id, Instance_Id id, double duration, double waited) {
+    rep->lanes[lane_id].busy++;
+    histogram_record(&rep->result->lanes[lane_id].wait, (uint64_t) llround(waited * 1000.0));
+    calendar_push(&rep->calendar, rep->now + duration, SIM_COMPLETE, id);
+}
+
+void sim_lane_enqueue(Sim_Replication *rep, uint32_t lane_id, Instance_Id id, double duration) {
+    Sim_Lane *lane = &rep->lanes[lane_id];
+    sim_lane_track(rep, lane_id);
+
+    if (lane->queue_len == lane->queue_cap) {
+        size_t cap = lane->queue_cap == 0 ? 256 : lane->queue_cap * 2;
+        Instance_Id *queue = malloc(sizeof(Instance_Id) * cap);
+        assert(queue != NULL && "Cannot grow lane queue");
+
+        for (size_t i = 0; i < lane->queue_len; i++) {
+            queue[i] = lane->queue[(lane->queue_head + i) & (lane->queue_cap - 1)];
+        }
+
+        free(lane->queue);
+        lane->queue = queue;
+        lane->queue_head = 0;
+        lane->queue_cap = cap;
+    }
+
+    lane->queue[(lane->queue_head + lane->queue_len++) & (lane->queue_cap - 1)] = id;
+    rep->queued[id] = rep->now;
+    rep->service[id] = duration;
+
+    Sim_Lane_Stats *stats = &rep->result->lanes[lane_id];
+    if (lane->queue_len > stats->queue_max) stats->queue_max = lane->queue_len;
+}
+
+// A task of the lane finished: its server takes the next one in the queue
+void sim_lane_release(Sim_Replication *rep, uint32_t lane_id) {
+    Sim_Lane *lane = &rep->lanes[lane_id];
+    lane->busy--;
+
+    if (lane->queue_len > 0) {
+        sim_lane_track(rep, lane_id);
+
+        Instance_Id id = lane->queue[lane->queue_head];
+        lane->queue_head = (lane->queue_head + 1) & (lane->queue_cap - 1);
+        lane->queue_len--;
+
+        sim_lane_serve(rep, lane_id, id, rep->service[id], rep->now - rep->queued[id]);
+    }
+}
+
+// Tokens forked by AND and OR gateways take slots of their own, so the
+// per-instance state follows the engine as it grows
+void sim_reserve(Sim_Replication *rep) {
+    if (rep->engine.instances_cap <= rep->instances_cap) return;
+
+    rep->instances_cap = rep->engine.instances_cap;
+    rep->started = realloc(rep->started, sizeof(double) * rep->instances_cap);
+    rep->queued = realloc(rep->queued, sizeof(double) * rep->instances_cap);
+    rep->service = realloc(rep->service, sizeof(double) * rep->instances_cap);
+    assert(rep->started != NULL && rep->queued != NULL && rep->service != NULL && "Cannot grow instance state");
+}
+
+bool sim_work(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) engine;
+    Sim_Replication *rep = user;
+    const Model_Node *n = &rep->model->nodes[node];
+    sim_reserve(rep);
+
+    double duration = rng_sample(&rep->rng, n->duration);
+    rep->result->nodes[node].visits++;
+    rep->result->nodes[node].busy += duration;
+
+    if (n->kind == NODE_TASK && rep->lanes[n->lane].capacity > 0) {
+        Sim_Lane *lane = &rep->lanes[n->lane];
+        if (lane->busy < lane->capacity) {
+            sim_lane_serve(rep, n->lane, id, duration, 0);
+        } else {
+            sim_lane_enqueue(rep, n->lane, id, duration);
+        }
+
+        return false;
+    }
+
+    if (duration <= 0) return true;
+    calendar_push(&rep->calendar, rep->now + duration, SIM_COMPLETE, id);
+    return false;
+}
+
+uint32_t sim_branch(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) engine;
+    (void) id;
+    Sim_Replication *rep = user;
+
+    rep->result->nodes[node].visits++;
+
+    const Model_Node *n = &rep->model->nodes[node];
+    double u = rng_uniform(&rep->rng);
+    for (uint32_t i = 0; i + 1 < n->targets_cnt; i++) {
+        u -= n->weights[i];
+        if (u < 0) return i;
+    }
+
+    return n->targets_cnt > 0 ? n->targets_cnt - 1 : 0;
+}
+
+// OR gateways take each target with its own probability, and the most
+// likely one when none comes up
+uint32_t sim_select(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) engine;
+    (void) id;
+    Sim_Replication *rep = user;
+
+    rep->result->nodes[node].visits++;
+
+    const Model_Node *n = &rep->model->nodes[node];
+    if (n->gateway != GATEWAY_OR) return 0;
+
+    uint32_t mask = 0, likely = 0;
+    for (uint32_t i = 0; i < n->targets_cnt; i++) {
+        if (rng_uniform(&rep->rng) < n->weights[i]) mask |= 1u << i;
+        if (n->weights[i] > n->weights[likely]) likely = i;
+    }
+
+    return mask != 0 ? mask : 1u << likely;
+}
+
+void sim_end(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) engine;
+    Sim_Replication *rep = user;
+
+    // instances also end on events that point nowhere, already counted
+    if (rep->model->nodes[node].kind == NODE_END) rep->result->nodes[node].visits++;
+    double cycle = rep->now - rep->started[id];
+    histogram_record(&rep->result->cycle, (uint64_t) llround(cycle * 1000.0));
+}
+
+void sim_trace(Engine *engine, Instance_Id id, uint32_t node, void *user) {
+    (void) engine;
+    Sim_Replication *rep = user;
+    trace_append(rep->trace, (uint64_t) llround(rep->now * 1000.0), id, node);
+}
+
+void sim_start(Sim_Replication *rep, uint32_t starter) {
+    Instance_Id id = engine_start(&rep->engine, starter);
+    assert(id != ENGINE_INVALID_ID && "Cannot allocate instance");
+    sim_reserve(rep);
+
+    rep->started[id] = rep->now;
+    rep->result->nodes[starter].visits++;
+}
+
+void sim_replication(const Process_Model *model, size_t instances, uint64_t seed, size_t index, bool metrics,
+                     Trace_Writer *trace, Sim_Result *result) {
+    Sim_Replication rep = {
+        .model = model,
+        .result = result,
+        .trace = trace
+    };
+
+    Engine_Callbacks callbacks = {
+        .on_task = sim_work,
+        .on_wait = sim_work,
+        .on_mail = sim_work,
+        .on_branch = sim_branch,
+        .on_select = sim_select,
+        .on_end = sim_end,
+        .on_move = trace ? sim_trace : NULL,
+        .user = &rep
+    };
+
+    engine_init(&rep.engine, model, callbacks);
+    if (metrics) engine_enable_metrics(&rep.engine);
+    calendar_init(&rep.calendar);
+    rng_seed(&rep.rng, seed, index);
+
+    rep.lanes = calloc(model->lanes_cnt, sizeof(Sim_Lane));
+    assert(rep.lanes != NULL && "Cannot allocate lanes");
+    for (size_t i = 0; i < model->lanes_cnt; i++) {
+        rep.lanes[i].capacity = model->lanes[i].capacity;
+    }
+
+    size_t starters = 0;
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind == NODE_STARTER) starters++;
+    }
+
+    // instances are split between starters, each one with its own arrivals
+    size_t *remaining = calloc(model->nodes_cnt, sizeof(size_t));
+    assert(remaining != NULL && "Cannot allocate arrivals");
+
+    size_t k = 0;
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        if (model->nodes[i].kind != NODE_STARTER) continue;
+
+        remaining[i] = instances / starters + (k++ < instances % starters ? 1 : 0);
+        if (remaining[i] > 0) calendar_push(&rep.calendar, 0, SIM_ARRIVAL, i);
+    }
+
+    Sim_Event ev;
+    while (calendar_pop(&rep.calendar, &ev)) {
+        rep.now = ev.time;
+        // the engine only measures, its clock is in milliseconds
+        if (metrics) engine_advance(&rep.engine, (uint64_t) llround(rep.now * 1000.0));
+
+        if (ev.kind == SIM_ARRIVAL) {
+            sim_start(&rep, ev.id);
+            if (--remaining[ev.id] > 0) {
+                double gap = rng_sample(&rep.rng, model->nodes[ev.id].duration);
+                calendar_push(&rep.calendar, rep.now + gap, SIM_ARRIVAL, ev.id);
+            }
+        } else {
+            const Model_Node *node = &model->nodes[rep.engine.nodes[ev.id]];
+            if (node->kind == NODE_TASK && rep.lanes[node->lane].capacity > 0) {
+                sim_lane_release(&rep, node->lane);
+            }
+
+            engine_complete(&rep.engine, ev.id);
+        }
+
+        engine_run(&rep.engine, 0);
+    }
+
+    result->horizon = rep.now;
+
+    for (size_t i = 0; i < model->lanes_cnt; i++) {
+        sim_lane_track(&rep, i);
+        free(rep.lanes[i].queue);
+    }
+
+    free(rep.lanes);
+    free(remaining);
+    free(rep.started);
+    free(rep.queued);
+    free(rep.service);
+    calendar_free(&rep.calendar);
+    engine_metrics_merge(&result->metrics, &rep.engine.metrics);
+    engine_free(&rep.engine);
+}
+
+typedef struct {
+    const Process_Model *model;
+    Sim_Config config;
+    Sim_Result *results;
+    Trace_Writer *trace;
+    atomic_size_t next;
+} Sim_Shared;
+
+void *sim_worker(void *arg) {
+    Sim_Shared *shared = arg;
+    const Sim_Config *config = &shared->config;
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&shared->next, 1);
+        if (i >= config->replications) break;
+
+        size_t instances = config->instances / config->replications + (i < config->instances % config->replications ? 1 : 0);
+        sim_replication(shared->model, instances, config->seed, i, config->metrics != METRICS_NONE,
+                        shared->trace, &shared->results[i]);
+    }
+
+    return NULL;
+}
+
+/*
+ * Report
+ */
+
+// every character format_duration writes
+#define FORMAT_DURATION_GLYPHS "0123456789.-msdh "
+
+char *format_duration(double seconds, char *buf, size_t len) {
+    long s = lround(seconds);
+    if (seconds < 1) {
+        snprintf(buf, len, "%.0fms", seconds * 1000);
+    } else if (seconds < 60) {
+        snprintf(buf, len, "%.1fs", seconds);
+    } else if (seconds < 3600) {
+        snprintf(buf, len, "%ldm %02lds", s / 60, s % 60);
+    } else if (seconds < 86400) {
+        snprintf(buf, len, "%ldh %02ldm", s / 3600, (s / 60) % 60);
+    } else {
+        snprintf(buf, len, "%ldd %02ldh", s / 86400, (s / 3600) % 24);
+    }
+
+    return buf;
+}
+
+#define FMT_DURATION(seconds) format_duration((seconds), (char[32]) {0}, 32)
+
+void sim_print_distribution(const Histogram *h) {
+    enum { BINS = 20, BAR = 40 };
+    uint64_t counts[BINS] = {0};
+
+    double lo = h->min;
+    double hi = histogram_percentile(h, 99.9);
+    double step = hi > lo ? (hi - lo) / BINS : 1;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (h->counts[i] == 0) continue;
+
+        double value = histogram_value(i);
+        size_t bin = value <= lo ? 0 : (size_t) ((value - lo) / step);
+        counts[bin < BINS ? bin : BINS - 1] += h->counts[i];
+    }
+
+    uint64_t peak = 1;
+    for (size_t i = 0; i < BINS; i++) {
+        if (counts[i] > peak) peak = counts[i];
+    }
+
+    for (size_t i = 0; i < BINS; i++) {
+        char bar[BAR + 1] = {0};
+        memset(bar, '#', counts[i] * BAR / peak);
+        printf("    %10s %-*s %lu\n", FMT_DURATION((lo + i * step) / 1000.0), BAR, bar, counts[i]);
+    }
+}
+
+void sim_print(const Process_Model *model, const Sim_Config *config, const Sim_Result *total) {
+    const Histogram *h = &total->cycle;
+
+    printf("Simulated %zu instances in %zu replications on %zu threads (seed %lu)\n\n",
+           config->instances, config->replications, config->threads, config->seed);
+
+    if (h->total == 0) {
+        printf("No instance reached an end event\n");
+        return;
+    }
+
+    printf("Cycle time\n");
+    printf("    mean %s, stddev %s\n", FMT_DURATION(histogram_mean(h) / 1000.0), FMT_DURATION(histogram_stddev(h) / 1000.0));
+    printf("    min  %s\n", FMT_DURATION(h->min / 1000.0));
+    printf("    p50  %s\n", FMT_DURATION(histogram_percentile(h, 50) / 1000.0));
+    printf("    p90  %s\n", FMT_DURATION(histogram_percentile(h, 90) / 1000.0));
+    printf("    p95  %s\n", FMT_DURATION(histogram_percentile(h, 95) / 1000.0));
+    printf("    p99  %s\n", FMT_DURATION(histogram_percentile(h, 99) / 1000.0));
+    printf("    max  %s\n\n", FMT_DURATION(h->max / 1000.0));
+
+    printf("Distribution\n");
+    sim_print_distribution(h);
+
+    // load: average number of instances inside the event at the same time,
+    // i.e. how many people it keeps busy
+    printf("\n%-40s %10s %12s %8s\n", "Event", "Visits", "Mean time", "Load");
+    for (size_t i = 0; i < model->nodes_cnt; i++) {
+        const Sim_Node_Stats *stats = &total->nodes[i];
+        double mean = stats->visits > 0 ? stats->busy / stats->visits : 0;
+        double load = total->horizon > 0 ? stats->busy / total->horizon : 0;
+        printf("%-40s %10lu %12s %8.2f\n", model->nodes[i].name, stats->visits, FMT_DURATION(mean), load);
+    }
+
+    // lanes without a capacity never queue, their load is how many people
+    // they would need to keep the same pace
+    printf("\n%-24s %8s %8s %11s %9s %9s %10s %10s %10s\n",
+           "Lane", "Capacity", "Load", "Utilization", "Avg queue", "Max queue", "Wait p50", "Wait p90", "Wait p99");
+    for (size_t i = 0; i < model->lanes_cnt; i++) {
+        const Model_Lane *lane = &model->lanes[i];
+        const Sim_Lane_Stats *stats = &total->lanes[i];
+
+        double busy = 0;
+        for (size_t j = 0; j < model->nodes_cnt; j++) {
+            if (model->nodes[j].lane == i && model->nodes[j].kind == NODE_TASK) busy += total->nodes[j].busy;
+        }
+
+        double load = total->horizon > 0 ? busy / total->horizon : 0;
+        if (lane->capacity == 0) {
+            printf("%-24s %8s %8.2f\n", lane->name, "-", load);
+            continue;
+        }
+
+        printf("%-24s %8u %8.2f %10.1f%% %9.2f %9zu %10s %10s %10s\n",
+               lane->name, lane->capacity, load, 100.0 * load / lane->capacity,
+               total->horizon > 0 ? stats->queue_area / total->horizon : 0, stats->queue_max,
+               FMT_DURATION(histogram_percentile(&stats->wait, 50) / 1000.0),
+               FMT_DURATION(histogram_percentile(&stats->wait, 90) / 1000.0),
+               FMT_DURATION(histogram_percentile(&stats->wait, 99) / 1000.0));
+    }
+}
+
+// Runs the replications of `config` and merges them into `total`, filling
+// in the threads and replications left to their defaults. Returns false
+// when the trace cannot be written.
+bool sim_run(const Process_Model *model, Sim_Config *config, Sim_Result *total) {
+    if (config->threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        config->threads = cores > 0 ? cores : 1;
+    }
+
+    if (config->replications == 0) config->replications = config->threads;
+    if (config->replications > config->instances) config->replications = config->instances;
+    // replications have a clock each, and their tokens would mix in a trace
+    if (config->trace != NULL) config->replications = 1;
+    if (config->threads > config->replications) config->threads = config->replications;
+
+    Trace_Writer trace;
+    if (config->trace != NULL && !trace_create(&trace, config->trace, model->nodes_cnt)) return false;
+
+    Sim_Shared shared = {
+        .model = model,
+        .config = *config,
+        .trace = config->trace != NULL ? &trace : NULL,
+        .results = calloc(config->replications, sizeof(Sim_Result))
+    };
+    assert(shared.results != NULL && "Cannot allocate replication results");
+
+    for (size_t i = 0; i < config->replications; i++) {
+        Sim_Result *result = &shared.results[i];
+        histogram_init(&result->cycle);
+        result->nodes = calloc(model->nodes_cnt, sizeof(Sim_Node_Stats));
+        result->lanes = calloc(model->lanes_cnt, sizeof(Sim_Lane_Stats));
+        assert(result->nodes != NULL && result->lanes != NULL && "Cannot allocate replication results");
+        for (size_t j = 0; j < model->lanes_cnt; j++) {
+            histogram_init(&result->lanes[j].wait);
+        }
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * config->threads);
+    assert(threads != NULL && "Cannot allocate threads");
+    for (size_t i = 0; i < config->threads; i++) {
+        if (pthread_create(&threads[i], NULL, sim_worker, &shared) != 0) {
+            fprintf(stderr, "error: cannot create simulation thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < config->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // merged in replication order, so the report is the same on any thread count
+    histogram_init(&total->cycle);
+    total->nodes = calloc(model->nodes_cnt, sizeof(Sim_Node_Stats));
+    total->lanes = calloc(model->lanes_cnt, sizeof(Sim_Lane_Stats));
+    assert(total->nodes != NULL && total->lanes != NULL && "Cannot allocate simulation results");
+    for (size_t j = 0; j < model->lanes_cnt; j++) {
+        histogram_init(&total->lanes[j].wait);
+    }
+
+    for (size_t i = 0; i < config->replications; i++) {
+        Sim_Result *result = &shared.results[i];
+        histogram_merge(&total->cycle, &result->cycle);
+        engine_metrics_merge(&total->metrics, &result->metrics);
+        engine_metrics_free(&result->metrics);
+        total->horizon += result->horizon;
+        for (size_t j = 0; j < model->nodes_cnt; j++) {
+            total->nodes[j].visits += result->nodes[j].visits;
+            total->nodes[j].busy += result->nodes[j].busy;
+        }
+
+        for (size_t j = 0; j < model->lanes_cnt; j++) {
+            histogram_merge(&total->lanes[j].wait, &result->lanes[j].wait);
+            total->lanes[j].queue_area += result->lanes[j].queue_area;
+            if (result->lanes[j].queue_max > total->lanes[j].queue_max) {
+                total->lanes[j].queue_max = result->lanes[j].queue_max;
+            }
+        }
+
+        free(result->nodes);
+        free(result->lanes);
+    }
+
+    free(shared.results);
+    free(threads);
+    return config->trace == NULL || trace_finish(&trace);
+}
+
+void sim_result_free(Sim_Result *result) {
+    engine_metrics_free(&result->metrics);
+    free(result->nodes);
+    free(result->lanes);
+}
+
+int simulate(const Process_Model *model, Sim_Config config) {
+    static Sim_Result total = {0};
+    if (!sim_run(model, &config, &total)) {
+        fprintf(stderr, "error: cannot write the trace %s: %s\n", config.trace, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (config.metrics != METRICS_NONE) metrics_print(model, &total.metrics, total.horizon, config.metrics, stdout);
+    else sim_print(model, &config, &total);
+
+    sim_result_free(&total);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,242 @@
+/*******************************************************************\
+| Section: Timer Wheel                                              |
+| Hierarchical timing wheel for instances parked on wait events: 4  |
+| levels of 256 slots, each one 256 times coarser than the one      |
+| below, so any delay below 2^32 ticks is inserted and cancelled in |
+| O(1). Timers move down a level when the slot they sit on comes    |
+| around, and a whole level 0 slot expires at once.                 |
+|                                                                   |
+| Timers are identified by a dense id (the Instance_Id) and live in |
+| three flat arrays: the links of an intrusive circular list and   |
+| the low 32 bits of the expiry tick, 12 bytes per timer. Slots are |
+| the sentinels of those lists, so unlinking never needs to know    |
+| where a timer is.                                                 |
+\*******************************************************************/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 8
+#define TIMER_SLOTS (1u << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_EXPIRED (TIMER_LEVELS * TIMER_SLOTS)  // sentinel of the expired list
+#define TIMER_BASE (TIMER_EXPIRED + 1)              // timer `id` is node TIMER_BASE + id
+#define TIMER_NONE UINT32_MAX
+
+typedef struct {
+    uint64_t now;
+    size_t pending;  // inserted and not yet taken or cancelled
+
+    uint32_t *next;     // TIMER_NONE when the timer is not linked
+    uint32_t *prev;
+    uint32_t *expires;  // low 32 bits of the tick the timer expires at
+    size_t cap;         // ids below cap can be inserted
+
+    uint64_t occupied[TIMER_LEVELS][TIMER_SLOTS / 64];
+} Timer_Wheel;
+
+void timer_link(Timer_Wheel *wheel, uint32_t list, uint32_t node) {
+    uint32_t last = wheel->prev[list];
+    wheel->next[last] = node;
+    wheel->prev[node] = last;
+    wheel->next[node] = list;
+    wheel->prev[list] = node;
+}
+
+void timer_unlink(Timer_Wheel *wheel, uint32_t node) {
+    uint32_t prev = wheel->prev[node], next = wheel->next[node];
+    wheel->next[prev] = next;
+    wheel->prev[next] = prev;
+    wheel->next[node] = TIMER_NONE;
+
+    // the list became empty, both neighbours are its sentinel
+    if (prev == next && prev < TIMER_EXPIRED) {
+        wheel->occupied[prev / TIMER_SLOTS][(prev % TIMER_SLOTS) / 64] &= ~(1ull << (prev % 64));
+    }
+}
+
+bool timer_list_empty(const Timer_Wheel *wheel, uint32_t list) {
+    return wheel->next[list] == list;
+}
+
+void timer_init(Timer_Wheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+void timer_free(Timer_Wheel *wheel) {
+    free(wheel->next);
+    free(wheel->prev);
+    free(wheel->expires);
+    memset(wheel, 0, sizeof(*wheel));
+}
+
+// Makes room for ids below `cap`
+void timer_reserve(Timer_Wheel *wheel, size_t cap) {
+    if (cap <= wheel->cap) return;
+
+    bool first = wheel->next == NULL;
+    size_t nodes = TIMER_BASE + cap;
+    wheel->next = realloc(wheel->next, sizeof(uint32_t) * nodes);
+    wheel->prev = realloc(wheel->prev, sizeof(uint32_t) * nodes);
+    wheel->expires = realloc(wheel->expires, sizeof(uint32_t) * nodes);
+    assert(wheel->next != NULL && wheel->prev != NULL && wheel->expires != NULL && "Cannot grow the timer wheel");
+
+    if (first) {
+        for (uint32_t i = 0; i < TIMER_BASE; i++) {
+            wheel->next[i] = wheel->prev[i] = i;
+        }
+    }
+
+    for (size_t i = TIMER_BASE + wheel->cap; i < nodes; i++) {
+        wheel->next[i] = TIMER_NONE;
+    }
+
+    wheel->cap = cap;
+}
+
+// Links the node on the slot of its expiry, on the finest level whose
+// rotation still covers it
+void timer_place(Timer_Wheel *wheel, uint32_t node) {
+    uint32_t expires = wheel->expires[node];
+    uint32_t delta = expires - (uint32_t) wheel->now;
+
+    uint32_t level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= 1u << ((level + 1) * TIMER_SLOT_BITS)) {
+        level++;
+    }
+
+    uint32_t slot = (expires >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+    uint32_t list = level * TIMER_SLOTS + slot;
+    timer_link(wheel, list, node);
+    wheel->occupied[level][slot / 64] |= 1ull << (slot % 64);
+}
+
+void timer_insert(Timer_Wheel *wheel, uint32_t id, uint32_t delay) {
+    assert(id < wheel->cap && "Timer id out of the reserved range");
+    assert(delay > 0 && "Timers expire in the future");
+
+    uint32_t node = TIMER_BASE + id;
+    assert(wheel->next[node] == TIMER_NONE && "Timer already pending");
+
+    wheel->expires[node] = (uint32_t) (wheel->now + delay);
+    timer_place(wheel, node);
+    wheel->pending++;
+}
+
+// Returns false when the timer was not pending
+bool timer_cancel(Timer_Wheel *wheel, uint32_t id) {
+    if (id >= wheel->cap) return false;
+
+    uint32_t node = TIMER_BASE + id;
+    if (wheel->next[node] == TIMER_NONE) return false;
+
+    timer_unlink(wheel, node);
+    wheel->pending--;
+    return true;
+}
+
+// Moves the whole list of a slot to the end of another one
+void timer_splice(Timer_Wheel *wheel, uint32_t from, uint32_t to) {
+    if (timer_list_empty(wheel, from)) return;
+
+    uint32_t first = wheel->next[from], last = wheel->prev[from];
+    uint32_t tail = wheel->prev[to];
+
+    wheel->next[tail] = first;
+    wheel->prev[first] = tail;
+    wheel->next[last] = to;
+    wheel->prev[to] = last;
+
+    wheel->next[from] = wheel->prev[from] = from;
+    wheel->occupied[from / TIMER_SLOTS][(from % TIMER_SLOTS) / 64] &= ~(1ull << (from % 64));
+}
+
+// Spreads the slot of `level` that just came around over the lower levels
+void timer_cascade(Timer_Wheel *wheel, uint32_t level) {
+    uint32_t slot = (wheel->now >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+    uint32_t list = level * TIMER_SLOTS + slot;
+    if (timer_list_empty(wheel, list)) return;
+
+    // detach the list first, the last timer still points to the sentinel
+    uint32_t node = wheel->next[list];
+    wheel->next[list] = wheel->prev[list] = list;
+    wheel->occupied[level][slot / 64] &= ~(1ull << (slot % 64));
+
+    while (node != list) {
+        uint32_t next = wheel->next[node];
+        timer_place(wheel, node);
+        node = next;
+    }
+}
+
+// First occupied slot of `level` in [from, TIMER_SLOTS), or TIMER_SLOTS
+uint32_t timer_find_slot(const Timer_Wheel *wheel, uint32_t level, uint32_t from) {
+    for (uint32_t word = from / 64; word < TIMER_SLOTS / 64; word++) {
+        uint64_t bits = wheel->occupied[level][word];
+        if (word == from / 64) bits &= ~0ull << (from % 64);
+        if (bits) return word * 64 + __builtin_ctzll(bits);
+    }
+
+    return TIMER_SLOTS;
+}
+
+// Next tick where something happens: a level 0 slot expires or an upper
+// slot cascades. UINT64_MAX when there are no timers. Slots at or behind
+// the current position of their level belong to its next rotation.
+uint64_t timer_next_tick(const Timer_Wheel *wheel) {
+    uint64_t next = UINT64_MAX;
+    for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+        uint32_t shift = level * TIMER_SLOT_BITS;
+        uint64_t span = (uint64_t) 1 << (shift + TIMER_SLOT_BITS);
+        uint64_t base = wheel->now & ~(span - 1);
+        uint32_t current = (wheel->now >> shift) & TIMER_SLOT_MASK;
+
+        uint32_t slot = timer_find_slot(wheel, level, current + 1);
+        if (slot == TIMER_SLOTS) {
+            slot = timer_find_slot(wheel, level, 0);
+            if (slot == TIMER_SLOTS) continue;
+            base += span;
+        }
+
+        uint64_t tick = base + ((uint64_t) slot << shift);
+        if (tick < next) next = tick;
+    }
+
+    return next;
+}
+
+// Advances the clock to `now`, jumping straight between the ticks where
+// something happens. Every timer expiring up to it moves to the expired
+// list, in expiry order, to be drained with timer_take.
+void timer_advance(Timer_Wheel *wheel, uint64_t now) {
+    for (;;) {
+        uint64_t tick = timer_next_tick(wheel);
+        if (tick > now) break;
+
+        wheel->now = tick;
+        for (uint32_t level = TIMER_LEVELS - 1; level > 0; level--) {
+            if ((tick & (((uint64_t) 1 << (level * TIMER_SLOT_BITS)) - 1)) == 0) {
+                timer_cascade(wheel, level);
+            }
+        }
+
+        timer_splice(wheel, tick & TIMER_SLOT_MASK, TIMER_EXPIRED);
+    }
+
+    if (wheel->now < now) wheel->now = now;
+}
+
+// Pops the next expired timer, TIMER_NONE when there are no more
+uint32_t timer_take(Timer_Wheel *wheel) {
+    if (wheel->next == NULL || timer_list_empty(wheel, TIMER_EXPIRED)) return TIMER_NONE;
+
+    uint32_t node = wheel->next[TIMER_EXPIRED];
+    timer_unlink(wheel, node);
+    wheel->pending--;
+    return node - TIMER_BASE;
+}
@@ -0,0 +1,343 @@
+/*******************************************************************\
+| Section: Traces                                                   |
+| Binary file of the moves of the tokens of a simulation, in time   |
+| order, for the viewer to play back. Records are written in chunks |
+| of TRACE_CHUNK, and an index of the chunks with the time each one |
+| starts goes at the end of the file, so a reader only keeps the    |
+| index and the chunk it is playing in memory, and can jump to any  |
+| time of a trace larger than memory. Some chunks start with a      |
+| keyframe, the last record of each token that is live there, so a  |
+| jump also finds the tokens parked since long before it: it starts |
+| from the keyframe before the time and plays the records on. A     |
+| keyframe is only written once as many records as it would hold   |
+| were written since the last one, so keyframes never take more     |
+| room than the records, and a jump plays about as many records as  |
+| there are live tokens.                                            |
+|                                                                   |
+|   header | keyframe 0 | chunk 0 | chunk 1 | keyframe 2 | chunk 2  |
+|          | ... | index | footer                                   |
+\*******************************************************************/
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC 0x43525450u  // "PTRC"
+#define TRACE_VERSION 3
+#define TRACE_CHUNK (1 << 16)
+
+typedef struct {
+    uint64_t time;  // milliseconds
+    uint32_t token;
+    uint32_t node;  // ENGINE_INVALID_ID when the token is gone
+} Trace_Record;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nodes_cnt;  // of the model that was traced
+    uint32_t unused;
+} Trace_Header;
+
+typedef struct {
+    uint64_t offset;       // of its keyframe, the records follow it
+    uint64_t first, last;  // times of its first and last records
+    uint32_t count;
+    uint32_t live;         // records in the keyframe, 0 when it has none
+    uint32_t keyframe;     // chunk of the last keyframe up to this one
+    uint32_t unused;
+} Trace_Chunk;
+
+typedef struct {
+    uint64_t index;  // offset of the index
+    uint64_t chunks_cnt;
+    uint32_t magic;
+    uint32_t unused;
+} Trace_Footer;
+
+typedef struct {
+    int fd;
+    Trace_Record *records;
+    size_t len;
+    uint64_t offset;  // where the next chunk goes
+
+    Trace_Chunk *chunks;
+    size_t chunks_cnt;
+    size_t chunks_cap;
+    bool failed;
+
+    // tokens as of the end of the last chunk written, for the keyframes
+    Trace_Record *last;  // per token
+    uint32_t *slots;     // per token, in `live`, TRACE_NOT_LIVE when it is not
+    uint32_t *live;
+    size_t live_cnt;
+    size_t tokens_cap;
+    uint32_t keyframe;  // chunk of the last keyframe
+    size_t since;       // records written since it
+} Trace_Writer;
+
+#define TRACE_NOT_LIVE UINT32_MAX
+
+bool trace_write_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool trace_create(Trace_Writer *writer, const char *path, uint32_t nodes_cnt) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) return false;
+
+    writer->records = malloc(sizeof(Trace_Record) * TRACE_CHUNK);
+    assert(writer->records != NULL && "Cannot allocate the trace buffer");
+
+    Trace_Header header = { .magic = TRACE_MAGIC, .version = TRACE_VERSION, .nodes_cnt = nodes_cnt };
+    writer->failed = !trace_write_all(writer->fd, &header, sizeof(header));
+    writer->offset = sizeof(header);
+    return !writer->failed;
+}
+
+// Follows the token of `record` for the keyframes
+void trace_track(Trace_Writer *writer, Trace_Record record) {
+    if (record.token >= writer->tokens_cap) {
+        size_t cap = writer->tokens_cap == 0 ? 1024 : writer->tokens_cap;
+        while (cap <= record.token) cap *= 2;
+        writer->last = realloc(writer->last, sizeof(Trace_Record) * cap);
+        writer->slots = realloc(writer->slots, sizeof(uint32_t) * cap);
+        writer->live = realloc(writer->live, sizeof(uint32_t) * cap);
+        assert(writer->last != NULL && writer->slots != NULL && writer->live != NULL && "Cannot grow the trace tokens");
+        memset(&writer->slots[writer->tokens_cap], 0xff, sizeof(uint32_t) * (cap - writer->tokens_cap));
+        writer->tokens_cap = cap;
+    }
+
+    uint32_t slot = writer->slots[record.token];
+    if (record.node == ENGINE_INVALID_ID) {
+        if (slot == TRACE_NOT_LIVE) return;
+        uint32_t moved = writer->live[--writer->live_cnt];
+        writer->live[slot] = moved;
+        writer->slots[moved] = slot;
+        writer->slots[record.token] = TRACE_NOT_LIVE;
+        return;
+    }
+
+    writer->last[record.token] = record;
+    if (slot == TRACE_NOT_LIVE) {
+        writer->slots[record.token] = writer->live_cnt;
+        writer->live[writer->live_cnt++] = record.token;
+    }
+}
+
+// Writes the buffered records, after a keyframe when they are due one
+void trace_flush(Trace_Writer *writer) {
+    if (writer->len == 0) return;
+
+    if (writer->chunks_cnt == writer->chunks_cap) {
+        writer->chunks_cap = writer->chunks_cap == 0 ? 64 : writer->chunks_cap * 2;
+        writer->chunks = realloc(writer->chunks, sizeof(Trace_Chunk) * writer->chunks_cap);
+        assert(writer->chunks != NULL && "Cannot grow the trace index");
+    }
+
+    bool keyframe = writer->chunks_cnt == 0 || writer->since >= writer->live_cnt;
+    if (keyframe) {
+        writer->keyframe = writer->chunks_cnt;
+        writer->since = 0;
+    }
+
+    size_t size = sizeof(Trace_Record) * writer->len;
+    writer->chunks[writer->chunks_cnt++] = (Trace_Chunk) {
+        .offset = writer->offset,
+        .first = writer->records[0].time,
+        .last = writer->records[writer->len - 1].time,
+        .count = writer->len,
+        .live = keyframe ? writer->live_cnt : 0,
+        .keyframe = writer->keyframe
+    };
+
+    // the tokens live before the first record, a chunk's worth at a time
+    if (keyframe && writer->live_cnt > 0) {
+        Trace_Record *records = malloc(sizeof(Trace_Record) * TRACE_CHUNK);
+        assert(records != NULL && "Cannot allocate the trace keyframe");
+        for (size_t i = 0; i < writer->live_cnt; i += TRACE_CHUNK) {
+            size_t n = writer->live_cnt - i < TRACE_CHUNK ? writer->live_cnt - i : TRACE_CHUNK;
+            for (size_t j = 0; j < n; j++) {
+                records[j] = writer->last[writer->live[i + j]];
+            }
+            if (!trace_write_all(writer->fd, records, sizeof(Trace_Record) * n)) writer->failed = true;
+        }
+        free(records);
+        writer->offset += sizeof(Trace_Record) * writer->live_cnt;
+    }
+
+    for (size_t i = 0; i < writer->len; i++) {
+        trace_track(writer, writer->records[i]);
+    }
+
+    if (!trace_write_all(writer->fd, writer->records, size)) writer->failed = true;
+    writer->offset += size;
+    writer->since += writer->len;
+    writer->len = 0;
+}
+
+// Records must come in time order
+void trace_append(Trace_Writer *writer, uint64_t time, uint32_t token, uint32_t node) {
+    if (writer->len == TRACE_CHUNK) trace_flush(writer);
+    writer->records[writer->len++] = (Trace_Record) { .time = time, .token = token, .node = node };
+}
+
+// Writes what is left and the index. Returns false when any write failed.
+bool trace_finish(Trace_Writer *writer) {
+    trace_flush(writer);
+
+    Trace_Footer footer = { .index = writer->offset, .chunks_cnt = writer->chunks_cnt, .magic = TRACE_MAGIC };
+    if (!trace_write_all(writer->fd, writer->chunks, sizeof(Trace_Chunk) * writer->chunks_cnt)) writer->failed = true;
+    if (!trace_write_all(writer->fd, &footer, sizeof(footer))) writer->failed = true;
+    if (close(writer->fd) != 0) writer->failed = true;
+
+    bool ok = !writer->failed;
+    free(writer->records);
+    free(writer->chunks);
+    free(writer->last);
+    free(writer->slots);
+    free(writer->live);
+    memset(writer, 0, sizeof(*writer));
+    return ok;
+}
+
+typedef struct {
+    int fd;
+    Trace_Chunk *chunks;
+    size_t chunks_cnt;
+    uint64_t first, last;  // times of the whole trace
+
+    Trace_Record *records;  // of the chunk being read
+    size_t len;
+    size_t at;
+    size_t next;  // chunk to load after this one
+
+    Trace_Record *keyframe;  // the one trace_seek started from
+    size_t keyframe_len;
+    size_t keyframe_cap;
+} Trace_Reader;
+
+// Reads the index of the trace at `path`, which must come from a model
+// with `nodes_cnt` nodes. Returns false when it cannot be read or does
+// not fit.
+bool trace_open(Trace_Reader *reader, const char *path, uint32_t nodes_cnt) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0) return false;
+
+    Trace_Header header;
+    Trace_Footer footer;
+    off_t end = lseek(reader->fd, 0, SEEK_END);
+    if (pread(reader->fd, &header, sizeof(header), 0) != sizeof(header)
+        || end < (off_t) (sizeof(header) + sizeof(footer))
+        || pread(reader->fd, &footer, sizeof(footer), end - sizeof(footer)) != sizeof(footer)
+        || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION || footer.magic != TRACE_MAGIC
+        || header.nodes_cnt != nodes_cnt
+        || footer.index + footer.chunks_cnt * sizeof(Trace_Chunk) + sizeof(footer) != (uint64_t) end) {
+        close(reader->fd);
+        return false;
+    }
+
+    size_t size = sizeof(Trace_Chunk) * footer.chunks_cnt;
+    reader->chunks = malloc(size > 0 ? size : 1);
+    reader->records = malloc(sizeof(Trace_Record) * TRACE_CHUNK);
+    assert(reader->chunks != NULL && reader->records != NULL && "Cannot allocate the trace");
+
+    if (pread(reader->fd, reader->chunks, size, footer.index) != (ssize_t) size) {
+        close(reader->fd);
+        free(reader->chunks);
+        free(reader->records);
+        return false;
+    }
+
+    reader->chunks_cnt = footer.chunks_cnt;
+    if (reader->chunks_cnt > 0) {
+        reader->first = reader->chunks[0].first;
+        reader->last = reader->chunks[reader->chunks_cnt - 1].last;
+    }
+    return true;
+}
+
+bool trace_load_chunk(Trace_Reader *reader, size_t chunk) {
+    const Trace_Chunk *c = &reader->chunks[chunk];
+    size_t size = sizeof(Trace_Record) * c->count;
+    off_t offset = c->offset + sizeof(Trace_Record) * c->live;
+    if (c->count > TRACE_CHUNK || pread(reader->fd, reader->records, size, offset) != (ssize_t) size) {
+        reader->len = reader->at = 0;
+        return false;
+    }
+
+    reader->len = c->count;
+    reader->at = 0;
+    reader->next = chunk + 1;
+    return true;
+}
+
+bool trace_load_keyframe(Trace_Reader *reader, size_t chunk) {
+    const Trace_Chunk *c = &reader->chunks[chunk];
+    if (c->live > reader->keyframe_cap) {
+        reader->keyframe_cap = c->live;
+        reader->keyframe = realloc(reader->keyframe, sizeof(Trace_Record) * reader->keyframe_cap);
+        assert(reader->keyframe != NULL && "Cannot grow the trace keyframe");
+    }
+
+    size_t size = sizeof(Trace_Record) * c->live;
+    reader->keyframe_len = 0;
+    if (pread(reader->fd, reader->keyframe, size, c->offset) != (ssize_t) size) return false;
+    reader->keyframe_len = c->live;
+    return true;
+}
+
+// Goes to the last keyframe before the chunk that holds `time`, with the
+// tokens that were live there in `keyframe`. Records up to `time` are then
+// taken with trace_next to get where every token is at `time`.
+void trace_seek(Trace_Reader *reader, uint64_t time) {
+    size_t lo = 0, hi = reader->chunks_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (reader->chunks[mid].last < time) lo = mid + 1;
+        else hi = mid;
+    }
+
+    reader->len = reader->at = 0;
+    reader->keyframe_len = 0;
+    reader->next = lo;
+    if (lo == reader->chunks_cnt) return;
+
+    size_t keyframe = reader->chunks[lo].keyframe;
+    if (keyframe > lo || !trace_load_keyframe(reader, keyframe)) return;
+    trace_load_chunk(reader, keyframe);
+}
+
+// Takes the next record up to `until`, reading the next chunk from disk
+// when this one is done
+bool trace_next(Trace_Reader *reader, uint64_t until, Trace_Record *record) {
+    while (reader->at == reader->len) {
+        if (reader->next >= reader->chunks_cnt || reader->chunks[reader->next].first > until) return false;
+        if (!trace_load_chunk(reader, reader->next)) return false;
+    }
+
+    if (reader->records[reader->at].time > until) return false;
+    *record = reader->records[reader->at++];
+    return true;
+}
+
+void trace_close(Trace_Reader *reader) {
+    if (reader->fd > 0) close(reader->fd);
+    free(reader->chunks);
+    free(reader->records);
+    free(reader->keyframe);
+    memset(reader, 0, sizeof(*reader));
+}
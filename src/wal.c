@@ -0,0 +1,186 @@
+/*******************************************************************\
+| Section: Write-Ahead Log                                          |
+| Append-only log of the changes to the instance store. Records are |
+| buffered in memory and written in groups, each one with a header  |
+| that carries a sequence number and a checksum of its records, and |
+| a group is durable after a single fdatasync. A group cut short by |
+| a crash fails its checksum, so reading stops at the last one that |
+| was complete. Records hold the new value of what changed, so      |
+| replaying a record twice does no harm.                            |
+\*******************************************************************/
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WAL_MAGIC 0x4C415750u  // "PWAL"
+
+typedef enum {
+    WAL_SLOT = 0,  // a slot of the store changed
+    WAL_START,     // a slot became the root of an instance, its join counters are reset
+    WAL_JOIN       // a join counter of the root `id` changed
+} Wal_Kind;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t state;
+    uint16_t unused;
+    uint32_t id;
+    uint32_t node;        // WAL_JOIN: join slot
+    uint32_t generation;  // WAL_JOIN: tokens arrived
+    uint32_t root;        // WAL_JOIN: tokens expected
+    uint32_t unused2;
+    uint64_t since;
+} Wal_Record;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t seq;
+    uint32_t checksum;  // of the records that follow
+    uint32_t unused;
+} Wal_Group;
+
+typedef struct {
+    int fd;
+    Wal_Record *records;
+    size_t len;
+    size_t cap;
+
+    uint64_t seq;  // of the next group
+    uint64_t groups;
+    uint64_t logged;
+} Wal;
+
+// FNV-1a
+uint32_t wal_checksum(const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+typedef void (*Wal_Replay_Fn)(const Wal_Record *record, void *user);
+
+// Calls `replay` for the records of every complete group of the log at
+// `path` with a sequence number above `after`. Stores the offset right
+// after the last complete group in `end` and its sequence number in
+// `last`, if not NULL. Returns false when the log cannot be read, a
+// missing log is an empty one.
+bool wal_scan(const char *path, uint64_t after, Wal_Replay_Fn replay, void *user, off_t *end, uint64_t *last) {
+    if (end) *end = 0;
+    if (last) *last = after;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return access(path, F_OK) != 0;
+
+    Wal_Record *records = NULL;
+    size_t cap = 0;
+    off_t offset = 0;
+    Wal_Group group;
+
+    while (pread(fd, &group, sizeof(group), offset) == sizeof(group) && group.magic == WAL_MAGIC) {
+        if (group.count > cap) {
+            cap = group.count;
+            records = realloc(records, sizeof(Wal_Record) * cap);
+            assert(records != NULL && "Cannot allocate the log records");
+        }
+
+        size_t size = sizeof(Wal_Record) * group.count;
+        if (pread(fd, records, size, offset + sizeof(group)) != (ssize_t) size) break;
+        if (wal_checksum(records, size) != group.checksum) break;
+
+        if (group.seq > after) {
+            for (uint32_t i = 0; i < group.count; i++) {
+                replay(&records[i], user);
+            }
+        }
+
+        offset += sizeof(group) + size;
+        if (end) *end = offset;
+        if (last && group.seq > *last) *last = group.seq;
+    }
+
+    free(records);
+    close(fd);
+    return true;
+}
+
+// Opens the log at `path` for appending, after its last complete group,
+// buffering up to `cap` records. The first group gets sequence number
+// `seq`, unless the log already goes further.
+bool wal_open(Wal *wal, const char *path, size_t cap, uint64_t seq) {
+    assert(cap > 0 && "The log needs room for a record");
+
+    memset(wal, 0, sizeof(*wal));
+    off_t end;
+    uint64_t last;
+    if (!wal_scan(path, UINT64_MAX, NULL, NULL, &end, &last)) return false;
+
+    wal->fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (wal->fd < 0) return false;
+
+    // a torn group at the tail would hide every group written after it
+    if (ftruncate(wal->fd, end) != 0 || lseek(wal->fd, end, SEEK_SET) != end) {
+        close(wal->fd);
+        return false;
+    }
+
+    wal->records = malloc(sizeof(Wal_Record) * cap);
+    assert(wal->records != NULL && "Cannot allocate the log buffer");
+    wal->cap = cap;
+    wal->seq = (end > 0 && last >= seq) ? last + 1 : seq;
+    return true;
+}
+
+// Writes the buffered records as a group and waits until they are on
+// disk, one fdatasync for all of them
+bool wal_commit(Wal *wal) {
+    if (wal->len == 0) return true;
+
+    size_t size = sizeof(Wal_Record) * wal->len;
+    Wal_Group group = {
+        .magic = WAL_MAGIC,
+        .count = wal->len,
+        .seq = wal->seq,
+        .checksum = wal_checksum(wal->records, size)
+    };
+
+    if (write(wal->fd, &group, sizeof(group)) != sizeof(group)) return false;
+    if (write(wal->fd, wal->records, size) != (ssize_t) size) return false;
+    if (fdatasync(wal->fd) != 0) return false;
+
+    wal->seq++;
+    wal->groups++;
+    wal->len = 0;
+    return true;
+}
+
+// Commits by itself when the buffer is full
+bool wal_append(Wal *wal, Wal_Record record) {
+    if (wal->len == wal->cap && !wal_commit(wal)) return false;
+
+    wal->records[wal->len++] = record;
+    wal->logged++;
+    return true;
+}
+
+// Drops every group, once a snapshot holds what they did. Sequence
+// numbers go on from where they were.
+bool wal_reset(Wal *wal) {
+    assert(wal->len == 0 && "Resetting a log with records not committed");
+    return ftruncate(wal->fd, 0) == 0 && lseek(wal->fd, 0, SEEK_SET) == 0 && fdatasync(wal->fd) == 0;
+}
+
+void wal_close(Wal *wal) {
+    if (wal->fd > 0) close(wal->fd);
+    free(wal->records);
+    memset(wal, 0, sizeof(*wal));
+}